@@ -0,0 +1,710 @@
+/*
+ * Copyright (c) 2020 Yubico AB. All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+/*
+ * Microbenchmarks: fido_dev_make_cred() and fido_dev_get_assert(),
+ * signature verification for each COSE algorithm, CTAPHID framing over an
+ * in-memory device, and device enumeration.
+ *
+ * Credentials and assertions are made by a virtual authenticator at
+ * setup, and its replies recorded. The benchmarks then run the library's
+ * own request encoding, framing and reply parsing, with the recorded
+ * replies served from memory, so that the authenticator's work is not
+ * measured.
+ *
+ * Every benchmark runs a fixed number of iterations, a fixed number of
+ * times, after a warm-up; the median run is reported. Results are written
+ * to stdout, one JSON object per line:
+ *
+ *	{"name":"...","iterations":N,"runs":R,"ns_per_op":X,
+ *	    "ops_per_sec":Y,"allocs_per_op":Z}
+ *
+ * Allocations are counted by interposing malloc(3) where the C library
+ * allows it, and no sanitizer is in use; elsewhere, allocs_per_op is -1.
+ *
+ * With -b, only the benchmarks listed in a baseline file, in the format
+ * above, are run, and the program fails if any of them is slower than
+ * its baseline by more than a tolerance (-t, in percent), or allocates
+ * more. With -a, only allocations are compared. With -u, the baseline is
+ * rewritten with new results instead.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fido.h"
+#include "fido/es256.h"
+#include "fido/rs256.h"
+#include "fido/eddsa.h"
+#include "../virtual/vdev.h"
+
+#define MAX_RUNS	100
+#define MAX_BASELINE	64
+#define MAX_LINE	512
+#define MAX_REPLY	129	/* frames in a maximum-sized message */
+#define LOOP_FRAMES	130	/* a maximum-sized message, and then some */
+
+static const unsigned char cdh[32] = {
+	0xec, 0x8d, 0x8f, 0x78, 0x42, 0x4a, 0x2b, 0xb7,
+	0x82, 0x34, 0xaa, 0xca, 0x07, 0xa1, 0xf6, 0x56,
+	0x42, 0x1c, 0xb6, 0xf6, 0xb3, 0x00, 0x86, 0x52,
+	0x35, 0x2d, 0xa2, 0x62, 0x4a, 0xbe, 0x89, 0x76,
+};
+
+static const unsigned char user_id[] = {
+	0x78, 0x1c, 0x78, 0x60, 0xad, 0x88, 0xd2, 0x63,
+	0x32, 0x62, 0x2a, 0xf1, 0x74, 0x5d, 0xed, 0xb2,
+	0xe7, 0xa4, 0x2b, 0x44, 0x89, 0x29, 0x39, 0xc5,
+	0x56, 0x64, 0x01, 0x27, 0x0d, 0xbb, 0xc4, 0x49,
+};
+
+/* the frames of a reply, as read from the virtual authenticator */
+struct reply {
+	unsigned char	frame[MAX_REPLY][CTAP_RPT_SIZE];
+	size_t		n;
+};
+
+struct alg {
+	const char	*name;
+	int		 type;
+	fido_cred_t	*cred;
+	fido_assert_t	*assert;
+	void		*pk;
+	struct reply	 cred_reply;
+	struct reply	 assert_reply;
+};
+
+static struct alg algs[] = {
+	{ .name = "es256", .type = COSE_ES256 },
+	{ .name = "rs256", .type = COSE_RS256 },
+	{ .name = "eddsa", .type = COSE_EDDSA },
+};
+
+/*
+ * The virtual authenticator, with its replies recorded into record, or,
+ * if replay is set, requests discarded and replay read back instead.
+ */
+static struct {
+	fido_dev_t		*dev;
+	struct reply		*record;
+	const struct reply	*replay;
+	size_t			 pos;
+} canned;
+
+/* frames written to the in-memory device are read back */
+static struct {
+	unsigned char	frame[LOOP_FRAMES][CTAP_RPT_SIZE];
+	size_t		head;
+	size_t		tail;
+} loop;
+
+struct baseline {
+	char	name[64];
+	double	ns;
+	double	allocs;
+};
+
+struct ping {
+	fido_dev_t	*dev;
+	unsigned char	*buf;
+	unsigned char	*reply;
+	size_t		 len;
+};
+
+static fido_dev_io_t	 vdev_frame_io;
+static const char	*filter;
+static size_t		 n_iter;
+static size_t		 n_runs = 5;
+static struct baseline	 baseline[MAX_BASELINE];
+static size_t		 n_baseline;
+static double		 tolerance = 100;
+static bool		 allocs_only;
+static bool		 update;
+static bool		 regressed;
+
+/* sanitizers bring their own allocator, which cannot be interposed */
+#if defined(__has_feature)
+#if __has_feature(address_sanitizer) || __has_feature(memory_sanitizer)
+#define NO_COUNT_ALLOCS
+#endif
+#endif
+#if defined(__SANITIZE_ADDRESS__)
+#define NO_COUNT_ALLOCS
+#endif
+
+#if defined(__GLIBC__) && !defined(NO_COUNT_ALLOCS)
+#define COUNT_ALLOCS
+
+void *__libc_malloc(size_t);
+void *__libc_calloc(size_t, size_t);
+void *__libc_realloc(void *, size_t);
+void __libc_free(void *);
+
+static uint64_t n_alloc;
+
+void *
+malloc(size_t n)
+{
+	__atomic_add_fetch(&n_alloc, 1, __ATOMIC_RELAXED);
+
+	return (__libc_malloc(n));
+}
+
+void *
+calloc(size_t nmemb, size_t n)
+{
+	__atomic_add_fetch(&n_alloc, 1, __ATOMIC_RELAXED);
+
+	return (__libc_calloc(nmemb, n));
+}
+
+void *
+realloc(void *ptr, size_t n)
+{
+	__atomic_add_fetch(&n_alloc, 1, __ATOMIC_RELAXED);
+
+	return (__libc_realloc(ptr, n));
+}
+
+void
+free(void *ptr)
+{
+	__libc_free(ptr);
+}
+
+static uint64_t
+alloc_count(void)
+{
+	return (__atomic_load_n(&n_alloc, __ATOMIC_RELAXED));
+}
+#endif /* COUNT_ALLOCS */
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+		err(1, "clock_gettime");
+
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec);
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return ((x > y) - (x < y));
+}
+
+static void
+load_baseline(const char *path)
+{
+	FILE		*fp;
+	struct baseline	*b;
+	char		 line[MAX_LINE];
+
+	if ((fp = fopen(path, "r")) == NULL)
+		err(1, "%s", path);
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (n_baseline == nitems(baseline))
+			errx(1, "%s: too many entries", path);
+		b = &baseline[n_baseline++];
+		if (sscanf(line, "{\"name\":\"%63[^\"]\",\"iterations\":%*u,"
+		    "\"runs\":%*u,\"ns_per_op\":%lf,\"ops_per_sec\":%*f,"
+		    "\"allocs_per_op\":%lf}", b->name, &b->ns, &b->allocs) != 3)
+			errx(1, "%s: invalid entry: %s", path, line);
+	}
+
+	if (ferror(fp) || n_baseline == 0)
+		errx(1, "%s: no entries", path);
+
+	fclose(fp);
+}
+
+static const struct baseline *
+find_baseline(const char *name)
+{
+	for (size_t i = 0; i < n_baseline; i++)
+		if (strcmp(baseline[i].name, name) == 0)
+			return (&baseline[i]);
+
+	return (NULL);
+}
+
+static void
+check_baseline(const struct baseline *b, double ns, double allocs)
+{
+	if (update)
+		return;
+
+	if (!allocs_only && ns > b->ns * (1 + tolerance / 100)) {
+		warnx("%s: %.1f ns/op, baseline %.1f", b->name, ns, b->ns);
+		regressed = true;
+	}
+
+	/*
+	 * Allocations are not noisy, but may depend on the keys of the
+	 * virtual authenticator (rs256 verification allocates slightly less
+	 * for some); results are rounded to 1/100.
+	 */
+	if (allocs >= 0 && b->allocs >= 0 && allocs > b->allocs + 0.005) {
+		warnx("%s: %.2f allocs/op, baseline %.2f", b->name, allocs,
+		    b->allocs);
+		regressed = true;
+	}
+}
+
+static void
+run(const char *name, size_t iterations, void (*fn)(void *), void *arg)
+{
+	const struct baseline *b = NULL;
+	uint64_t	t[MAX_RUNS];
+	uint64_t	t0;
+	double		ns;
+	double		allocs = -1;
+#ifdef COUNT_ALLOCS
+	uint64_t	a0;
+#endif
+
+	if (filter != NULL && strstr(name, filter) == NULL)
+		return;
+	if (n_baseline > 0 && (b = find_baseline(name)) == NULL)
+		return;
+	if (n_iter > 0)
+		iterations = n_iter;
+
+	for (size_t i = 0; i < iterations / 10 + 1; i++)
+		fn(arg);
+
+#ifdef COUNT_ALLOCS
+	a0 = alloc_count();
+#endif
+	for (size_t r = 0; r < n_runs; r++) {
+		t0 = now_ns();
+		for (size_t i = 0; i < iterations; i++)
+			fn(arg);
+		t[r] = now_ns() - t0;
+	}
+#ifdef COUNT_ALLOCS
+	allocs = (double)(alloc_count() - a0) / (double)(n_runs * iterations);
+#endif
+
+	qsort(t, n_runs, sizeof(*t), cmp_u64);
+	ns = (double)t[n_runs / 2] / (double)iterations;
+
+	printf("{\"name\":\"%s\",\"iterations\":%zu,\"runs\":%zu,"
+	    "\"ns_per_op\":%.1f,\"ops_per_sec\":%.1f,\"allocs_per_op\":%.2f}\n",
+	    name, iterations, n_runs, ns, ns > 0 ? 1e9 / ns : 0, allocs);
+	fflush(stdout);
+
+	if (b != NULL)
+		check_baseline(b, ns, allocs);
+}
+
+static int
+canned_read(void *handle, unsigned char *buf, size_t len, int ms)
+{
+	struct reply	*r = canned.record;
+	int		 n;
+
+	if (canned.replay != NULL) {
+		if (len != CTAP_RPT_SIZE || canned.pos == canned.replay->n)
+			return (-1);
+		memcpy(buf, canned.replay->frame[canned.pos++], len);
+		return ((int)len);
+	}
+
+	if ((n = vdev_frame_io.read(handle, buf, len, ms)) == CTAP_RPT_SIZE &&
+	    r != NULL) {
+		if (r->n == nitems(r->frame))
+			errx(1, "%s: reply too long", __func__);
+		memcpy(r->frame[r->n++], buf, len);
+	}
+
+	return (n);
+}
+
+static int
+canned_write(void *handle, const unsigned char *buf, size_t len)
+{
+	if (canned.replay == NULL)
+		return (vdev_frame_io.write(handle, buf, len));
+
+	/* a new request is answered from the start of the reply */
+	if (len > 5 && (buf[5] & CTAP_FRAME_INIT))
+		canned.pos = 0;
+
+	return ((int)len);
+}
+
+static void *
+pk_from_cred(int type, const fido_cred_t *cred)
+{
+	const unsigned char	*ptr = fido_cred_pubkey_ptr(cred);
+	size_t			 len = fido_cred_pubkey_len(cred);
+	es256_pk_t		*es256;
+	rs256_pk_t		*rs256;
+	eddsa_pk_t		*eddsa;
+
+	switch (type) {
+	case COSE_ES256:
+		if ((es256 = es256_pk_new()) == NULL ||
+		    es256_pk_from_ptr(es256, ptr, len) != FIDO_OK)
+			errx(1, "es256_pk_from_ptr");
+		return (es256);
+	case COSE_RS256:
+		if ((rs256 = rs256_pk_new()) == NULL ||
+		    rs256_pk_from_ptr(rs256, ptr, len) != FIDO_OK)
+			errx(1, "rs256_pk_from_ptr");
+		return (rs256);
+	default:
+		if ((eddsa = eddsa_pk_new()) == NULL ||
+		    eddsa_pk_from_ptr(eddsa, ptr, len) != FIDO_OK)
+			errx(1, "eddsa_pk_from_ptr");
+		return (eddsa);
+	}
+}
+
+static void
+pk_free(int type, void *pk)
+{
+	es256_pk_t	*es256 = pk;
+	rs256_pk_t	*rs256 = pk;
+	eddsa_pk_t	*eddsa = pk;
+
+	switch (type) {
+	case COSE_ES256:
+		es256_pk_free(&es256);
+		break;
+	case COSE_RS256:
+		rs256_pk_free(&rs256);
+		break;
+	default:
+		eddsa_pk_free(&eddsa);
+		break;
+	}
+}
+
+/* a credential and an assertion of each type, with the recorded replies */
+static void
+setup_algs(const vdev_t *v)
+{
+	fido_dev_io_t	 io;
+	fido_dev_t	*dev;
+	struct alg	*a;
+	int		 r;
+
+	vdev_io(&vdev_frame_io);
+	io = vdev_frame_io;
+	io.read = canned_read;
+	io.write = canned_write;
+
+	if ((dev = fido_dev_new()) == NULL ||
+	    fido_dev_set_io_functions(dev, &io) != FIDO_OK ||
+	    fido_dev_open(dev, vdev_path(v)) != FIDO_OK)
+		errx(1, "fido_dev_open");
+
+	for (size_t i = 0; i < sizeof(algs) / sizeof(*algs); i++) {
+		a = &algs[i];
+		if ((a->cred = fido_cred_new()) == NULL ||
+		    fido_cred_set_type(a->cred, a->type) != FIDO_OK ||
+		    fido_cred_set_clientdata_hash(a->cred, cdh,
+		    sizeof(cdh)) != FIDO_OK ||
+		    fido_cred_set_rp(a->cred, "example.org",
+		    "Example") != FIDO_OK ||
+		    fido_cred_set_user(a->cred, user_id, sizeof(user_id),
+		    "jsmith@example.org", "John Smith", NULL) != FIDO_OK)
+			errx(1, "fido_cred_set");
+		canned.record = &a->cred_reply;
+		if ((r = fido_dev_make_cred(dev, a->cred, NULL)) != FIDO_OK)
+			errx(1, "fido_dev_make_cred: %s", fido_strerr(r));
+
+		if ((a->assert = fido_assert_new()) == NULL ||
+		    fido_assert_set_rp(a->assert, "example.org") != FIDO_OK ||
+		    fido_assert_set_clientdata_hash(a->assert, cdh,
+		    sizeof(cdh)) != FIDO_OK ||
+		    fido_assert_allow_cred(a->assert, fido_cred_id_ptr(a->cred),
+		    fido_cred_id_len(a->cred)) != FIDO_OK)
+			errx(1, "fido_assert_set");
+		canned.record = &a->assert_reply;
+		if ((r = fido_dev_get_assert(dev, a->assert, NULL)) != FIDO_OK)
+			errx(1, "fido_dev_get_assert: %s", fido_strerr(r));
+		canned.record = NULL;
+
+		a->pk = pk_from_cred(a->type, a->cred);
+	}
+
+	canned.dev = dev;
+}
+
+static void
+teardown_algs(void)
+{
+	struct alg *a;
+
+	for (size_t i = 0; i < sizeof(algs) / sizeof(*algs); i++) {
+		a = &algs[i];
+		pk_free(a->type, a->pk);
+		fido_assert_free(&a->assert);
+		fido_cred_free(&a->cred);
+	}
+
+	canned.replay = NULL;
+	fido_dev_close(canned.dev);
+	fido_dev_free(&canned.dev);
+}
+
+static void
+make_cred(void *arg)
+{
+	struct alg *a = arg;
+
+	canned.replay = &a->cred_reply;
+	if (fido_dev_make_cred(canned.dev, a->cred, NULL) != FIDO_OK)
+		errx(1, "%s", __func__);
+	canned.replay = NULL;
+}
+
+static void
+get_assert(void *arg)
+{
+	struct alg *a = arg;
+
+	canned.replay = &a->assert_reply;
+	if (fido_dev_get_assert(canned.dev, a->assert, NULL) != FIDO_OK)
+		errx(1, "%s", __func__);
+	canned.replay = NULL;
+}
+
+static void
+cred_verify(void *arg)
+{
+	const struct alg *a = arg;
+
+	if (fido_cred_verify(a->cred) != FIDO_OK)
+		errx(1, "%s", __func__);
+}
+
+static void
+assert_verify(void *arg)
+{
+	const struct alg *a = arg;
+
+	if (fido_assert_verify(a->assert, 0, a->type, a->pk) != FIDO_OK)
+		errx(1, "%s", __func__);
+}
+
+static void *
+loop_open(const char *path)
+{
+	(void)path;
+
+	return (&loop);
+}
+
+static void
+loop_close(void *handle)
+{
+	(void)handle;
+}
+
+static int
+loop_read(void *handle, unsigned char *buf, size_t len, int ms)
+{
+	(void)handle;
+	(void)ms;
+
+	if (len != CTAP_RPT_SIZE || loop.head == loop.tail)
+		return (-1);
+
+	memcpy(buf, loop.frame[loop.head++ % LOOP_FRAMES], len);
+
+	return ((int)len);
+}
+
+static int
+loop_write(void *handle, const unsigned char *buf, size_t len)
+{
+	(void)handle;
+
+	if (len != CTAP_RPT_SIZE + 1 || loop.tail - loop.head == LOOP_FRAMES)
+		return (-1);
+
+	/* skip report id */
+	memcpy(loop.frame[loop.tail++ % LOOP_FRAMES], buf + 1, len - 1);
+
+	return ((int)len);
+}
+
+static void
+ping(void *arg)
+{
+	const struct ping	*p = arg;
+	const uint8_t		 cmd = CTAP_FRAME_INIT | CTAP_CMD_PING;
+
+	if (fido_tx(p->dev, cmd, p->buf, p->len) < 0 ||
+	    fido_rx(p->dev, cmd, p->reply, p->len, -1) != (int)p->len ||
+	    memcmp(p->buf, p->reply, p->len) != 0)
+		errx(1, "%s", __func__);
+}
+
+static void
+bench_framing(void)
+{
+	const size_t	 sizes[] = { 64, 1024, 7609 };
+	fido_dev_io_t	 io;
+	struct ping	 p;
+	char		 name[64];
+
+	io.open = loop_open;
+	io.close = loop_close;
+	io.read = loop_read;
+	io.write = loop_write;
+
+	memset(&p, 0, sizeof(p));
+	if ((p.dev = fido_dev_new()) == NULL ||
+	    fido_dev_set_io_functions(p.dev, &io) != FIDO_OK)
+		errx(1, "fido_dev_set_io_functions");
+
+	/* an open device, without CTAPHID_INIT */
+	p.dev->io_handle = loop_open(NULL);
+	p.dev->cid = 0x01020304;
+
+	for (size_t i = 0; i < nitems(sizes); i++) {
+		p.len = sizes[i];
+		if ((p.buf = malloc(p.len)) == NULL ||
+		    (p.reply = malloc(p.len)) == NULL)
+			err(1, "malloc");
+		for (size_t j = 0; j < p.len; j++)
+			p.buf[j] = (unsigned char)j;
+		snprintf(name, sizeof(name), "fido_tx_rx/%zu", p.len);
+		run(name, 10000, ping, &p);
+		free(p.buf);
+		free(p.reply);
+	}
+
+	p.dev->io_handle = NULL;
+	fido_dev_free(&p.dev);
+}
+
+static void
+manifest(void *arg)
+{
+	fido_dev_info_t	*devlist;
+	size_t		 ndevs = 0;
+
+	(void)arg;
+
+	if ((devlist = fido_dev_info_new(64)) == NULL)
+		errx(1, "fido_dev_info_new");
+
+	/* no devices, or no backend, is fine */
+	(void)fido_dev_info_manifest(devlist, 64, &ndevs);
+	fido_dev_info_free(&devlist, ndevs);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: fido2_bench [-au] [-b baseline] [-f filter] "
+	    "[-n iterations]\n\t[-r runs] [-t tolerance]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	vdev_t		*v;
+	struct alg	*a;
+	char		 name[64];
+	const char	*baseline_path = NULL;
+	char		*ep;
+	int		 ch;
+
+	while ((ch = getopt(argc, argv, "ab:f:n:r:t:u")) != -1) {
+		switch (ch) {
+		case 'a':
+			allocs_only = true;
+			break;
+		case 'b':
+			baseline_path = optarg;
+			break;
+		case 'f':
+			filter = optarg;
+			break;
+		case 'n':
+			n_iter = strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			n_runs = strtoul(optarg, NULL, 10);
+			if (n_runs < 1 || n_runs > MAX_RUNS)
+				usage();
+			break;
+		case 't':
+			tolerance = strtod(optarg, &ep);
+			if (*ep != '\0' || !(tolerance >= 0))
+				usage();
+			break;
+		case 'u':
+			update = true;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	/* every entry is rewritten */
+	if (update && (baseline_path == NULL || filter != NULL ||
+	    allocs_only))
+		usage();
+
+	if (baseline_path != NULL) {
+		load_baseline(baseline_path);
+		if (update && freopen(baseline_path, "w", stdout) == NULL)
+			err(1, "%s", baseline_path);
+	}
+
+	fido_init(0);
+
+	if ((v = vdev_new()) == NULL)
+		errx(1, "vdev_new");
+
+	setup_algs(v);
+
+	for (size_t i = 0; i < nitems(algs); i++) {
+		a = &algs[i];
+		snprintf(name, sizeof(name), "fido_dev_make_cred/%s",
+		    a->name);
+		run(name, 10000, make_cred, a);
+		snprintf(name, sizeof(name), "fido_dev_get_assert/%s",
+		    a->name);
+		run(name, 10000, get_assert, a);
+	}
+
+	for (size_t i = 0; i < nitems(algs); i++) {
+		a = &algs[i];
+		snprintf(name, sizeof(name), "fido_cred_verify/%s", a->name);
+		run(name, 1000, cred_verify, a);
+		snprintf(name, sizeof(name), "fido_assert_verify/%s", a->name);
+		run(name, 1000, assert_verify, a);
+	}
+
+	bench_framing();
+
+	run("fido_dev_info_manifest", 100, manifest, NULL);
+
+	teardown_algs();
+	vdev_free(&v);
+
+	exit(regressed ? 1 : 0);
+}
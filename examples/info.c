@@ -130,6 +130,26 @@ print_maxmsgsiz(uint64_t maxmsgsiz)
 	printf("maxmsgsiz: %d\n", (int)maxmsgsiz);
 }
 
+/*
+ * Auxiliary function to print the maximum number of credentials in a
+ * credential list on stdout.
+ */
+static void
+print_maxcredcntlst(uint64_t maxcredcntlst)
+{
+	printf("maxcredcntlst: %d\n", (int)maxcredcntlst);
+}
+
+/*
+ * Auxiliary function to print an authenticator's maximum credential id
+ * length on stdout.
+ */
+static void
+print_maxcredidlen(uint64_t maxcredidlen)
+{
+	printf("maxcredidlen: %d\n", (int)maxcredidlen);
+}
+
 /*
  * Auxiliary function to print an array of bytes on stdout.
  */
@@ -190,6 +210,12 @@ getinfo(const char *path)
 	/* print maximum message size */
 	print_maxmsgsiz(fido_cbor_info_maxmsgsiz(ci));
 
+	/* print maximum number of credentials in a list */
+	print_maxcredcntlst(fido_cbor_info_maxcredcntlst(ci));
+
+	/* print maximum credential id length */
+	print_maxcredidlen(fido_cbor_info_maxcredidlen(ci));
+
 	/* print supported pin protocols */
 	print_byte_array("pin protocols", fido_cbor_info_protocols_ptr(ci),
 	    fido_cbor_info_protocols_len(ci));
@@ -0,0 +1,359 @@
+/*
+ * Copyright (c) 2020 Yubico AB. All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+/*
+ * Corpus replay benchmark. Linked with one of the fuzz_* harnesses, this
+ * runs every input of a corpus through LLVMFuzzerTestOneInput(), i.e.
+ * through the harness's set_wire_data(), dev_read() and dev_write(), and
+ * reports throughput and per-input latency as a JSON object:
+ *
+ *	{"name":"...","inputs":N,"bytes":B,"passes":P,"inputs_per_sec":X,
+ *	    "mb_per_sec":Y,"p50_us":..,"p90_us":..,"p99_us":..,"max_us":..,
+ *	    "slow":S}
+ *
+ * Arguments are files or directories of files; inputs are read into
+ * memory before the clock starts.
+ *
+ * With -b or -i, inputs costing more than a budget of nanoseconds (-b) or
+ * instructions (-i) per byte are reported, copied to the directory given
+ * by -o, if any, and the program fails. The cost of an input is its
+ * cheapest pass, and it is charged for at least BUDGET_MIN_LEN bytes.
+ * Instructions are counted with perf_event_open(2) where available.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#define HAVE_PERF_EVENT
+#endif
+
+#include <dirent.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mutator_aux.h"
+
+#include "../openbsd-compat/openbsd-compat.h"
+
+#define BUDGET_MIN_LEN	1024
+
+struct input {
+	char	*path;
+	uint8_t	*ptr;
+	size_t	 len;
+	uint64_t ns;	/* cheapest pass */
+	int64_t	 insns;	/* -1 if not counted */
+};
+
+static struct input	*inputs;
+static size_t		 n_inputs;
+static size_t		 n_bytes;
+static int		 insn_fd = -1;
+
+int LLVMFuzzerTestOneInput(const uint8_t *, size_t);
+size_t LLVMFuzzerMutate(uint8_t *, size_t, size_t);
+
+/* referenced by the harnesses' mutators, which are not used here */
+size_t
+LLVMFuzzerMutate(uint8_t *ptr, size_t size, size_t maxsize)
+{
+	(void)ptr;
+	(void)maxsize;
+
+	return (size);
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+		err(1, "clock_gettime");
+
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec);
+}
+
+static void
+insn_open(void)
+{
+#ifdef HAVE_PERF_EVENT
+	struct perf_event_attr pe;
+
+	memset(&pe, 0, sizeof(pe));
+	pe.type = PERF_TYPE_HARDWARE;
+	pe.size = sizeof(pe);
+	pe.config = PERF_COUNT_HW_INSTRUCTIONS;
+	pe.exclude_kernel = 1;
+	pe.exclude_hv = 1;
+
+	/* not an error; e.g. virtual machines may not expose the counter */
+	if ((insn_fd = (int)syscall(SYS_perf_event_open, &pe, 0, -1, -1,
+	    0)) < 0)
+		warn("perf_event_open");
+#endif
+}
+
+static int64_t
+insn_count(void)
+{
+	uint64_t n;
+
+	if (insn_fd < 0 || read(insn_fd, &n, sizeof(n)) != sizeof(n))
+		return (-1);
+
+	return ((int64_t)n);
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return ((x > y) - (x < y));
+}
+
+static void
+load_file(const char *path)
+{
+	FILE		*fp;
+	struct input	*in;
+	struct stat	 st;
+
+	if ((fp = fopen(path, "rb")) == NULL || fstat(fileno(fp), &st) < 0)
+		err(1, "%s", path);
+
+	if (!S_ISREG(st.st_mode)) {
+		fclose(fp);
+		return;
+	}
+
+	if (n_inputs + 1 > SIZE_MAX / sizeof(*inputs) ||
+	    (in = realloc(inputs, (n_inputs + 1) * sizeof(*in))) == NULL)
+		err(1, "realloc");
+
+	inputs = in;
+	in = &inputs[n_inputs];
+	memset(in, 0, sizeof(*in));
+	in->len = (size_t)st.st_size;
+	in->ns = UINT64_MAX;
+	in->insns = -1;
+
+	if ((in->path = strdup(path)) == NULL)
+		err(1, "strdup");
+
+	/* the harnesses take a non-const pointer into the input */
+	if ((in->ptr = malloc(in->len ? in->len : 1)) == NULL)
+		err(1, "malloc");
+	if (in->len && fread(in->ptr, 1, in->len, fp) != in->len)
+		errx(1, "%s: short read", path);
+
+	fclose(fp);
+	n_inputs++;
+	n_bytes += in->len;
+}
+
+static void
+load(const char *path)
+{
+	DIR		*dir;
+	struct dirent	*de;
+	struct stat	 st;
+	char		 name[PATH_MAX];
+
+	if (stat(path, &st) < 0)
+		err(1, "%s", path);
+
+	if (!S_ISDIR(st.st_mode)) {
+		load_file(path);
+		return;
+	}
+
+	if ((dir = opendir(path)) == NULL)
+		err(1, "%s", path);
+
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+		if ((size_t)snprintf(name, sizeof(name), "%s/%s", path,
+		    de->d_name) >= sizeof(name))
+			errx(1, "%s/%s: name too long", path, de->d_name);
+		load_file(name);
+	}
+
+	closedir(dir);
+}
+
+static void
+save(const struct input *in, const char *dir)
+{
+	FILE		*fp;
+	const char	*base;
+	char		 name[PATH_MAX];
+
+	if ((base = strrchr(in->path, '/')) != NULL)
+		base++;
+	else
+		base = in->path;
+
+	if ((size_t)snprintf(name, sizeof(name), "%s/%s", dir,
+	    base) >= sizeof(name))
+		errx(1, "%s/%s: name too long", dir, base);
+
+	if ((fp = fopen(name, "wb")) == NULL ||
+	    fwrite(in->ptr, 1, in->len, fp) != in->len || fclose(fp) != 0)
+		err(1, "%s", name);
+}
+
+/* report inputs over budget; returns their number */
+static size_t
+check_budget(double ns_per_byte, double insns_per_byte, const char *dir)
+{
+	const struct input	*in;
+	double			 len;
+	size_t			 n = 0;
+
+	for (size_t i = 0; i < n_inputs; i++) {
+		in = &inputs[i];
+		len = (double)(in->len > BUDGET_MIN_LEN ? in->len :
+		    BUDGET_MIN_LEN);
+		if ((ns_per_byte <= 0 || in->ns <= ns_per_byte * len) &&
+		    (insns_per_byte <= 0 || in->insns < 0 ||
+		    in->insns <= insns_per_byte * len))
+			continue;
+		fprintf(stderr, "%s: %zu bytes, %.1f us, %lld insns\n",
+		    in->path, in->len, (double)in->ns / 1e3,
+		    (long long)in->insns);
+		if (dir != NULL)
+			save(in, dir);
+		n++;
+	}
+
+	return (n);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: corpus_harness [-b ns] [-i insns] [-n passes] "
+	    "[-N name] [-o dir]\n\tcorpus ...\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char	*name = "corpus";
+	const char	*dir = NULL;
+	struct input	*in;
+	uint64_t	*t;
+	uint64_t	 t0;
+	uint64_t	 total = 0;
+	int64_t		 i0;
+	int64_t		 i1;
+	size_t		 n_passes = 1;
+	size_t		 n;
+	size_t		 n_slow = 0;
+	double		 ns_per_byte = 0;
+	double		 insns_per_byte = 0;
+	double		 s;
+	int		 ch;
+
+	while ((ch = getopt(argc, argv, "b:i:N:n:o:")) != -1) {
+		switch (ch) {
+		case 'b':
+			ns_per_byte = strtod(optarg, NULL);
+			break;
+		case 'i':
+			insns_per_byte = strtod(optarg, NULL);
+			break;
+		case 'o':
+			dir = optarg;
+			break;
+		case 'N':
+			name = optarg;
+			break;
+		case 'n':
+			n_passes = strtoul(optarg, NULL, 10);
+			if (n_passes < 1)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 1)
+		usage();
+
+	for (int i = 0; i < argc; i++)
+		load(argv[i]);
+
+	if (n_inputs == 0)
+		errx(1, "empty corpus");
+
+	n = n_inputs * n_passes;
+	if ((t = calloc(n, sizeof(*t))) == NULL)
+		err(1, "calloc");
+
+	if (insns_per_byte > 0)
+		insn_open();
+
+	for (size_t p = 0; p < n_passes; p++)
+		for (size_t i = 0; i < n_inputs; i++) {
+			in = &inputs[i];
+			i0 = insn_count();
+			t0 = now_ns();
+			LLVMFuzzerTestOneInput(in->ptr, in->len);
+			t[p * n_inputs + i] = now_ns() - t0;
+			i1 = insn_count();
+			total += t[p * n_inputs + i];
+			if (t[p * n_inputs + i] < in->ns)
+				in->ns = t[p * n_inputs + i];
+			if (i0 >= 0 && i1 >= i0 &&
+			    (in->insns < 0 || i1 - i0 < in->insns))
+				in->insns = i1 - i0;
+		}
+
+	if (ns_per_byte > 0 || insns_per_byte > 0)
+		n_slow = check_budget(ns_per_byte, insns_per_byte, dir);
+
+	qsort(t, n, sizeof(*t), cmp_u64);
+	s = (double)total / 1e9;
+
+	printf("{\"name\":\"%s\",\"inputs\":%zu,\"bytes\":%zu,\"passes\":%zu,"
+	    "\"inputs_per_sec\":%.1f,\"mb_per_sec\":%.2f,\"p50_us\":%.1f,"
+	    "\"p90_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f,\"slow\":%zu}\n",
+	    name, n_inputs, n_bytes, n_passes, s > 0 ? (double)n / s : 0,
+	    s > 0 ? (double)(n_bytes * n_passes) / s / 1e6 : 0,
+	    (double)t[n / 2] / 1e3, (double)t[(n * 90) / 100] / 1e3,
+	    (double)t[(n * 99) / 100] / 1e3, (double)t[n - 1] / 1e3, n_slow);
+
+	for (size_t i = 0; i < n_inputs; i++) {
+		free(inputs[i].path);
+		free(inputs[i].ptr);
+	}
+	free(inputs);
+	free(t);
+
+	if (insn_fd >= 0)
+		close(insn_fd);
+
+	exit(n_slow ? 1 : 0);
+}
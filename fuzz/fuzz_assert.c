@@ -346,25 +346,44 @@ pack(uint8_t *ptr, size_t len, const struct param *p)
 	return (max - len);
 }
 
-static void
-get_assert(fido_assert_t *assert, uint8_t u2f, const struct blob *cdh,
-    const char *rp_id, int ext, uint8_t up, uint8_t uv, const char *pin,
-    uint8_t cred_count, struct blob *cred)
+/*
+ * The device is allocated once and reused across inputs. It is opened for
+ * every input, so that CTAPHID_INIT is still read from the wire data; this
+ * also undoes fido_dev_force_u2f().
+ */
+static fido_dev_t *
+prepare_dev(void)
 {
-	fido_dev_t	*dev;
-	fido_dev_io_t	 io;
+	static fido_dev_t	*dev;
+	fido_dev_io_t		 io;
 
 	io.open = dev_open;
 	io.close = dev_close;
 	io.read = dev_read;
 	io.write = dev_write;
 
-	if ((dev = fido_dev_new()) == NULL || fido_dev_set_io_functions(dev,
-	    &io) != FIDO_OK || fido_dev_open(dev, "nodev") != FIDO_OK) {
+	if (dev == NULL && ((dev = fido_dev_new()) == NULL ||
+	    fido_dev_set_io_functions(dev, &io) != FIDO_OK)) {
 		fido_dev_free(&dev);
-		return;
+		return (NULL);
 	}
 
+	if (fido_dev_open(dev, "nodev") != FIDO_OK)
+		return (NULL);
+
+	return (dev);
+}
+
+static void
+get_assert(fido_assert_t *assert, uint8_t u2f, const struct blob *cdh,
+    const char *rp_id, int ext, uint8_t up, uint8_t uv, const char *pin,
+    uint8_t cred_count, struct blob *cred)
+{
+	fido_dev_t	*dev;
+
+	if ((dev = prepare_dev()) == NULL)
+		return;
+
 	if (u2f & 1)
 		fido_dev_force_u2f(dev);
 
@@ -386,7 +405,6 @@ get_assert(fido_assert_t *assert, uint8_t u2f, const struct blob *cdh,
 
 	fido_dev_cancel(dev);
 	fido_dev_close(dev);
-	fido_dev_free(&dev);
 }
 
 static void
@@ -395,9 +413,10 @@ verify_assert(int type, const unsigned char *cdh_ptr, size_t cdh_len,
     const unsigned char *sig_ptr, size_t sig_len, uint8_t up, uint8_t uv,
     int ext, void *pk)
 {
-	fido_assert_t	*assert = NULL;
+	static fido_assert_t *assert;
 
-	if ((assert = fido_assert_new()) == NULL)
+	/* reused; fido_assert_reset() leaves it as if newly allocated */
+	if (assert == NULL && (assert = fido_assert_new()) == NULL)
 		return;
 
 	fido_assert_set_clientdata_hash(assert, cdh_ptr, cdh_len);
@@ -414,7 +433,7 @@ verify_assert(int type, const unsigned char *cdh_ptr, size_t cdh_len,
 	fido_assert_set_sig(assert, 0, sig_ptr, sig_len);
 	fido_assert_verify(assert, 0, type, pk);
 
-	fido_assert_free(&assert);
+	fido_assert_reset(assert);
 }
 
 /*
@@ -467,7 +486,7 @@ int
 LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
 {
 	struct param	 p;
-	fido_assert_t	*assert = NULL;
+	static fido_assert_t *assert;
 	es256_pk_t	*es256_pk = NULL;
 	rs256_pk_t	*rs256_pk = NULL;
 	eddsa_pk_t	*eddsa_pk = NULL;
@@ -522,7 +541,7 @@ LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
 		break;
 	}
 
-	if ((assert = fido_assert_new()) == NULL)
+	if (assert == NULL && (assert = fido_assert_new()) == NULL)
 		goto out;
 
 	set_wire_data(p.wire_data.body, p.wire_data.len);
@@ -563,7 +582,8 @@ out:
 	rs256_pk_free(&rs256_pk);
 	eddsa_pk_free(&eddsa_pk);
 
-	fido_assert_free(&assert);
+	if (assert != NULL)
+		fido_assert_reset(assert);
 
 	return (0);
 }
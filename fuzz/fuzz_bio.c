@@ -471,23 +471,30 @@ pack(uint8_t *ptr, size_t len, const struct param *p)
 	return (max - len);
 }
 
+/*
+ * The device is allocated once and reused across inputs. It is opened for
+ * every operation, so that CTAPHID_INIT is still read from the wire data.
+ */
 static fido_dev_t *
-prepare_dev()
+prepare_dev(void)
 {
-	fido_dev_t	*dev;
-	fido_dev_io_t	 io;
+	static fido_dev_t	*dev;
+	fido_dev_io_t		 io;
 
 	io.open = dev_open;
 	io.close = dev_close;
 	io.read = dev_read;
 	io.write = dev_write;
 
-	if ((dev = fido_dev_new()) == NULL || fido_dev_set_io_functions(dev,
-	    &io) != FIDO_OK || fido_dev_open(dev, "nodev") != FIDO_OK) {
+	if (dev == NULL && ((dev = fido_dev_new()) == NULL ||
+	    fido_dev_set_io_functions(dev, &io) != FIDO_OK)) {
 		fido_dev_free(&dev);
 		return (NULL);
 	}
 
+	if (fido_dev_open(dev, "nodev") != FIDO_OK)
+		return (NULL);
+
 	return (dev);
 }
 
@@ -515,7 +522,6 @@ done:
 	if (dev)
 		fido_dev_close(dev);
 
-	fido_dev_free(&dev);
 	fido_bio_info_free(&i);
 }
 
@@ -568,7 +574,6 @@ done:
 	if (dev)
 		fido_dev_close(dev);
 
-	fido_dev_free(&dev);
 	fido_bio_template_free(&t);
 	fido_bio_enroll_free(&e);
 }
@@ -597,7 +602,6 @@ done:
 	if (dev)
 		fido_dev_close(dev);
 
-	fido_dev_free(&dev);
 	fido_bio_template_array_free(&ta);
 }
 
@@ -623,7 +627,6 @@ done:
 	if (dev)
 		fido_dev_close(dev);
 
-	fido_dev_free(&dev);
 	fido_bio_template_free(&t);
 }
 
@@ -648,7 +651,6 @@ done:
 	if (dev)
 		fido_dev_close(dev);
 
-	fido_dev_free(&dev);
 	fido_bio_template_free(&t);
 }
 
@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2020 Yubico AB. All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+/*
+ * Fuzz the CBOR decoders of authenticator data and attestation statements
+ * directly, without emulating a device. The first byte of an input picks
+ * the COSE algorithm of the credential; the rest is a CBOR item, typically
+ * the byte string holding authenticator data, or an attestation statement
+ * map. Built against the static library, where these functions are
+ * reachable.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mutator_aux.h"
+#include "fido.h"
+
+#include "../openbsd-compat/openbsd-compat.h"
+
+static const int cose_alg[] = { COSE_ES256, COSE_RS256, COSE_EDDSA };
+
+int LLVMFuzzerTestOneInput(const uint8_t *, size_t);
+
+static void
+decode_cred_authdata(const cbor_item_t *item, int type)
+{
+	fido_blob_t	authdata_cbor;
+	fido_authdata_t	authdata;
+	fido_attcred_t	attcred;
+	int		authdata_ext = 0;
+
+	memset(&authdata_cbor, 0, sizeof(authdata_cbor));
+	memset(&authdata, 0, sizeof(authdata));
+	memset(&attcred, 0, sizeof(attcred));
+
+	if (cbor_decode_cred_authdata(item, type, &authdata_cbor, &authdata,
+	    &attcred, &authdata_ext) == 0) {
+		consume(&authdata, sizeof(authdata));
+		consume(attcred.id.ptr, attcred.id.len);
+		consume(&attcred.pubkey, sizeof(attcred.pubkey));
+		consume(&authdata_ext, sizeof(authdata_ext));
+	}
+
+	free(authdata_cbor.ptr);
+	free(attcred.id.ptr);
+}
+
+static void
+decode_assert_authdata(const cbor_item_t *item)
+{
+	fido_blob_t	authdata_cbor;
+	fido_authdata_t	authdata;
+	fido_blob_t	hmac_secret_enc;
+	int		authdata_ext = 0;
+
+	memset(&authdata_cbor, 0, sizeof(authdata_cbor));
+	memset(&authdata, 0, sizeof(authdata));
+	memset(&hmac_secret_enc, 0, sizeof(hmac_secret_enc));
+
+	if (cbor_decode_assert_authdata(item, &authdata_cbor, &authdata,
+	    &authdata_ext, &hmac_secret_enc) == 0) {
+		consume(&authdata, sizeof(authdata));
+		consume(hmac_secret_enc.ptr, hmac_secret_enc.len);
+		consume(&authdata_ext, sizeof(authdata_ext));
+	}
+
+	free(authdata_cbor.ptr);
+	free(hmac_secret_enc.ptr);
+}
+
+static void
+decode_attstmt(const cbor_item_t *item)
+{
+	fido_attstmt_t attstmt;
+
+	memset(&attstmt, 0, sizeof(attstmt));
+
+	if (cbor_decode_attstmt(item, &attstmt) == 0) {
+		consume(attstmt.x5c.ptr, attstmt.x5c.len);
+		consume(attstmt.sig.ptr, attstmt.sig.len);
+	}
+
+	free(attstmt.x5c.ptr);
+	free(attstmt.sig.ptr);
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	cbor_item_t		*item;
+	struct cbor_load_result	 cbor;
+	int			 type;
+
+	if (size < 1)
+		return (0);
+
+	type = cose_alg[data[0] % nitems(cose_alg)];
+
+	if ((item = cbor_load_checked(data + 1, size - 1, &cbor)) == NULL)
+		return (0);
+
+	decode_cred_authdata(item, type);
+	decode_assert_authdata(item);
+	decode_attstmt(item);
+
+	cbor_decref(&item);
+
+	return (0);
+}
@@ -683,6 +683,34 @@ pack(uint8_t *ptr, size_t len, const struct param *p)
 	return (max - len);
 }
 
+/*
+ * The device is allocated once and reused across inputs. It is opened for
+ * every input, so that CTAPHID_INIT is still read from the wire data; this
+ * also undoes fido_dev_force_u2f().
+ */
+static fido_dev_t *
+prepare_dev(void)
+{
+	static fido_dev_t	*dev;
+	fido_dev_io_t		 io;
+
+	io.open = dev_open;
+	io.close = dev_close;
+	io.read = dev_read;
+	io.write = dev_write;
+
+	if (dev == NULL && ((dev = fido_dev_new()) == NULL ||
+	    fido_dev_set_io_functions(dev, &io) != FIDO_OK)) {
+		fido_dev_free(&dev);
+		return (NULL);
+	}
+
+	if (fido_dev_open(dev, "nodev") != FIDO_OK)
+		return (NULL);
+
+	return (dev);
+}
+
 static void
 make_cred(fido_cred_t *cred, uint8_t u2f, int type, const struct blob *cdh,
     const char *rp_id, const char *rp_name, struct blob *user_id,
@@ -691,18 +719,9 @@ make_cred(fido_cred_t *cred, uint8_t u2f, int type, const struct blob *cdh,
     struct blob *excl_cred)
 {
 	fido_dev_t	*dev;
-	fido_dev_io_t	 io;
 
-	io.open = dev_open;
-	io.close = dev_close;
-	io.read = dev_read;
-	io.write = dev_write;
-
-	if ((dev = fido_dev_new()) == NULL || fido_dev_set_io_functions(dev,
-	    &io) != FIDO_OK || fido_dev_open(dev, "nodev") != FIDO_OK) {
-		fido_dev_free(&dev);
+	if ((dev = prepare_dev()) == NULL)
 		return;
-	}
 
 	if (u2f & 1)
 		fido_dev_force_u2f(dev);
@@ -725,7 +744,6 @@ make_cred(fido_cred_t *cred, uint8_t u2f, int type, const struct blob *cdh,
 
 	fido_dev_cancel(dev);
 	fido_dev_close(dev);
-	fido_dev_free(&dev);
 }
 
 static void
@@ -735,10 +753,11 @@ verify_cred(int type, const unsigned char *cdh_ptr, size_t cdh_len,
     const unsigned char *x5c_ptr, size_t x5c_len, const unsigned char *sig_ptr,
     size_t sig_len, const char *fmt)
 {
-	fido_cred_t	*cred;
+	static fido_cred_t *cred;
 	uint8_t		 flags;
 
-	if ((cred = fido_cred_new()) == NULL) {
+	/* reused; fido_cred_reset() leaves it as if newly allocated */
+	if (cred == NULL && (cred = fido_cred_new()) == NULL) {
 		warnx("%s: fido_cred_new", __func__);
 		return;
 	}
@@ -774,14 +793,14 @@ verify_cred(int type, const unsigned char *cdh_ptr, size_t cdh_len,
 	type = fido_cred_type(cred);
 	consume(&type, sizeof(type));
 
-	fido_cred_free(&cred);
+	fido_cred_reset(cred);
 }
 
 int
 LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
 {
 	struct param	 p;
-	fido_cred_t	*cred = NULL;
+	static fido_cred_t *cred;
 	int		 cose_alg = 0;
 
 	memset(&p, 0, sizeof(p));
@@ -793,7 +812,7 @@ LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
 
 	fido_init(0);
 
-	if ((cred = fido_cred_new()) == NULL)
+	if (cred == NULL && (cred = fido_cred_new()) == NULL)
 		return (0);
 
 	set_wire_data(p.wire_data.body, p.wire_data.len);
@@ -823,7 +842,7 @@ LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
 	    fido_cred_sig_ptr(cred), fido_cred_sig_len(cred),
 	    fido_cred_fmt(cred));
 
-	fido_cred_free(&cred);
+	fido_cred_reset(cred);
 
 	return (0);
 }
@@ -424,23 +424,30 @@ pack(uint8_t *ptr, size_t len, const struct param *p)
 	return (max - len);
 }
 
+/*
+ * The device is allocated once and reused across inputs. It is opened for
+ * every operation, so that CTAPHID_INIT is still read from the wire data.
+ */
 static fido_dev_t *
-prepare_dev()
+prepare_dev(void)
 {
-	fido_dev_t	*dev;
-	fido_dev_io_t	 io;
+	static fido_dev_t	*dev;
+	fido_dev_io_t		 io;
 
 	io.open = dev_open;
 	io.close = dev_close;
 	io.read = dev_read;
 	io.write = dev_write;
 
-	if ((dev = fido_dev_new()) == NULL || fido_dev_set_io_functions(dev,
-	    &io) != FIDO_OK || fido_dev_open(dev, "nodev") != FIDO_OK) {
+	if (dev == NULL && ((dev = fido_dev_new()) == NULL ||
+	    fido_dev_set_io_functions(dev, &io) != FIDO_OK)) {
 		fido_dev_free(&dev);
 		return (NULL);
 	}
 
+	if (fido_dev_open(dev, "nodev") != FIDO_OK)
+		return (NULL);
+
 	return (dev);
 }
 
@@ -459,7 +466,6 @@ get_metadata(struct param *p)
 	}
 	if ((metadata = fido_credman_metadata_new()) == NULL) {
 		fido_dev_close(dev);
-		fido_dev_free(&dev);
 		return;
 	}
 
@@ -472,7 +478,6 @@ get_metadata(struct param *p)
 
 	fido_credman_metadata_free(&metadata);
 	fido_dev_close(dev);
-	fido_dev_free(&dev);
 }
 
 static void
@@ -488,7 +493,6 @@ get_rp_list(struct param *p)
 	}
 	if ((rp = fido_credman_rp_new()) == NULL) {
 		fido_dev_close(dev);
-		fido_dev_free(&dev);
 		return;
 	}
 
@@ -506,7 +510,6 @@ get_rp_list(struct param *p)
 
 	fido_credman_rp_free(&rp);
 	fido_dev_close(dev);
-	fido_dev_free(&dev);
 }
 
 static void
@@ -524,7 +527,6 @@ get_rk_list(struct param *p)
 	}
 	if ((rk = fido_credman_rk_new()) == NULL) {
 		fido_dev_close(dev);
-		fido_dev_free(&dev);
 		return;
 	}
 
@@ -550,7 +552,6 @@ get_rk_list(struct param *p)
 
 	fido_credman_rk_free(&rk);
 	fido_dev_close(dev);
-	fido_dev_free(&dev);
 }
 
 static void
@@ -566,7 +567,6 @@ del_rk(struct param *p)
 
 	fido_credman_del_dev_rk(dev, p->cred_id.body, p->cred_id.len, p->pin);
 	fido_dev_close(dev);
-	fido_dev_free(&dev);
 }
 
 int
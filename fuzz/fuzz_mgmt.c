@@ -277,23 +277,30 @@ pack(uint8_t *ptr, size_t len, const struct param *p)
 	return (max - len);
 }
 
+/*
+ * The device is allocated once and reused across inputs. It is opened for
+ * every operation, so that CTAPHID_INIT is still read from the wire data.
+ */
 static fido_dev_t *
-prepare_dev()
+prepare_dev(void)
 {
-	fido_dev_t	*dev;
-	fido_dev_io_t	 io;
+	static fido_dev_t	*dev;
+	fido_dev_io_t		 io;
 
 	io.open = dev_open;
 	io.close = dev_close;
 	io.read = dev_read;
 	io.write = dev_write;
 
-	if ((dev = fido_dev_new()) == NULL || fido_dev_set_io_functions(dev,
-	    &io) != FIDO_OK || fido_dev_open(dev, "nodev") != FIDO_OK) {
+	if (dev == NULL && ((dev = fido_dev_new()) == NULL ||
+	    fido_dev_set_io_functions(dev, &io) != FIDO_OK)) {
 		fido_dev_free(&dev);
 		return (NULL);
 	}
 
+	if (fido_dev_open(dev, "nodev") != FIDO_OK)
+		return (NULL);
+
 	return (dev);
 }
 
@@ -310,7 +317,6 @@ dev_reset(struct param *p)
 
 	fido_dev_reset(dev);
 	fido_dev_close(dev);
-	fido_dev_free(&dev);
 }
 
 static void
@@ -345,13 +351,11 @@ dev_get_cbor_info(struct param *p)
 
 	if ((ci = fido_cbor_info_new()) == NULL) {
 		fido_dev_close(dev);
-		fido_dev_free(&dev);
 		return;
 	}
 
 	fido_dev_get_cbor_info(dev, ci);
 	fido_dev_close(dev);
-	fido_dev_free(&dev);
 
 	for (size_t i = 0; i < fido_cbor_info_versions_len(ci); i++) {
 		char * const *sa = fido_cbor_info_versions_ptr(ci);
@@ -392,7 +396,6 @@ dev_set_pin(struct param *p)
 
 	fido_dev_set_pin(dev, p->pin1, NULL);
 	fido_dev_close(dev);
-	fido_dev_free(&dev);
 }
 
 static void
@@ -408,7 +411,6 @@ dev_change_pin(struct param *p)
 
 	fido_dev_set_pin(dev, p->pin2, p->pin1);
 	fido_dev_close(dev);
-	fido_dev_free(&dev);
 }
 
 static void
@@ -426,7 +428,6 @@ dev_get_retry_count(struct param *p)
 	fido_dev_get_retry_count(dev, &n);
 	consume(&n, sizeof(n));
 	fido_dev_close(dev);
-	fido_dev_free(&dev);
 }
 
 int
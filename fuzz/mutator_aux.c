@@ -12,12 +12,59 @@
 #include <string.h>
 
 #include "mutator_aux.h"
+#include "fido.h"
 
 size_t LLVMFuzzerMutate(uint8_t *, size_t, size_t);
 
 static uint8_t *wire_data_ptr = NULL;
 static size_t   wire_data_len = 0;
 
+/*
+ * The library only accepts a reply on the channel of its request,
+ * answering the command sent, with its continuation frames in sequence
+ * and, for CTAPHID_INIT, echoing the nonce. Frames read are made to fit
+ * the last request written, so that the wire data reaches the parsers.
+ * The first byte of a frame, which fitting overwrites, decides: FIT_NONE
+ * leaves the frame as read, so that frames on other channels, stray
+ * commands and sequence errors reach the transport, and FIT_CID only sets
+ * the channel.
+ */
+#define FIT_NONE	0xf0
+#define FIT_CID		0xf1
+
+static struct {
+	uint8_t	cid[4];
+	uint8_t	cmd;
+	uint8_t	nonce[8];
+	size_t	nframes; /* frames of the reply read so far */
+} req;
+
+static void
+fit_reply(uint8_t *frame)
+{
+	const uint8_t mode = frame[0];
+
+	if (mode == FIT_NONE)
+		return;
+
+	memcpy(frame, req.cid, sizeof(req.cid));
+
+	if (mode == FIT_CID)
+		return;
+
+	if (req.nframes > 0)
+		frame[4] = (uint8_t)((req.nframes - 1) & 0x7f);
+	else if (frame[4] == (CTAP_FRAME_INIT | CTAP_KEEPALIVE))
+		return; /* not part of the reply */
+	else {
+		frame[4] = req.cmd;
+		if (req.cmd == (CTAP_FRAME_INIT | CTAP_CMD_INIT))
+			memcpy(frame + 7, req.nonce, sizeof(req.nonce));
+	}
+
+	req.nframes++;
+}
+
 size_t
 xstrlen(const char *s)
 {
@@ -289,6 +336,9 @@ dev_read(void *handle, unsigned char *ptr, size_t len, int ms)
 	wire_data_ptr += n;
 	wire_data_len -= n;
 
+	if (n == len)
+		fit_reply(ptr);
+
 	return ((int)n);
 }
 
@@ -300,6 +350,13 @@ dev_write(void *handle, const unsigned char *ptr, size_t len)
 
 	consume(ptr, len);
 
+	if ((ptr[5] & CTAP_FRAME_INIT) != 0) {
+		memcpy(req.cid, ptr + 1, sizeof(req.cid));
+		req.cmd = ptr[5];
+		memcpy(req.nonce, ptr + 8, sizeof(req.nonce));
+		req.nframes = 0;
+	}
+
 	if (uniform_random(400) < 1)
 		return (-1);
 
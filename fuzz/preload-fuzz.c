@@ -24,12 +24,59 @@
 #include <unistd.h>
 
 #define FUZZ_DEV_PREFIX	"nodev"
+#define REPORT_LEN	64
+#define FRAME_INIT	0x80
+#define CMD_INIT	(FRAME_INIT | 0x06)
+#define CMD_KEEPALIVE	(FRAME_INIT | 0x3b)
+#define FIT_NONE	0xf0
+#define FIT_CID		0xf1
 
 static int               fd_fuzz = -1;
 static int              (*open_f)(const char *, int, mode_t);
 static int              (*close_f)(int);
+static ssize_t          (*read_f)(int, void *, size_t);
 static ssize_t          (*write_f)(int, const void *, size_t);
 
+/*
+ * Replies read are made to fit the last request written: same channel
+ * and command, continuation frames in sequence, and the nonce of a
+ * CTAPHID_INIT echoed. The first byte of a frame picks whether it is
+ * left alone (FIT_NONE), only given the channel (FIT_CID), or fitted;
+ * see fuzz/mutator_aux.c.
+ */
+static struct {
+	unsigned char	cid[4];
+	unsigned char	cmd;
+	unsigned char	nonce[8];
+	size_t		nframes;
+} req;
+
+static void
+fit_reply(unsigned char *frame)
+{
+	const unsigned char mode = frame[0];
+
+	if (mode == FIT_NONE)
+		return;
+
+	memcpy(frame, req.cid, sizeof(req.cid));
+
+	if (mode == FIT_CID)
+		return;
+
+	if (req.nframes > 0)
+		frame[4] = (unsigned char)((req.nframes - 1) & 0x7f);
+	else if (frame[4] == CMD_KEEPALIVE)
+		return;
+	else {
+		frame[4] = req.cmd;
+		if (req.cmd == CMD_INIT)
+			memcpy(frame + 7, req.nonce, sizeof(req.nonce));
+	}
+
+	req.nframes++;
+}
+
 int
 open(const char *path, int flags, ...)
 {
@@ -85,9 +132,31 @@ close(int fd)
 	return (close_f(fd));
 }
 
+ssize_t
+read(int fd, void *buf, size_t nbytes)
+{
+	ssize_t n;
+
+	if (read_f == NULL) {
+		read_f = dlsym(RTLD_NEXT, "read");
+		if (read_f == NULL) {
+			warnx("%s: dlsym", __func__);
+			errno = EBADF;
+			return (-1);
+		}
+	}
+
+	if ((n = read_f(fd, buf, nbytes)) == REPORT_LEN && fd == fd_fuzz)
+		fit_reply(buf);
+
+	return (n);
+}
+
 ssize_t
 write(int fd, const void *buf, size_t nbytes)
 {
+	const unsigned char *p = buf;
+
 	if (write_f == NULL) {
 		write_f = dlsym(RTLD_NEXT, "write");
 		if (write_f == NULL) {
@@ -100,5 +169,13 @@ write(int fd, const void *buf, size_t nbytes)
 	if (fd != fd_fuzz)
 		return (write_f(fd, buf, nbytes));
 
+	/* report id, then the frame */
+	if (nbytes == REPORT_LEN + 1 && (p[5] & FRAME_INIT) != 0) {
+		memcpy(req.cid, p + 1, sizeof(req.cid));
+		req.cmd = p[5];
+		memcpy(req.nonce, p + 8, sizeof(req.nonce));
+		req.nframes = 0;
+	}
+
 	return (nbytes);
 }
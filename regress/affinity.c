@@ -0,0 +1,280 @@
+/*
+ * Copyright (c) 2020 Yubico AB. All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+#include <assert.h>
+#include <fido.h>
+#include <fido/affinity.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../virtual/vdev.h"
+
+#define AFFINITY_MAX	1024
+#define NCREDS		40
+
+static const unsigned char id1[] = { 0x01, 0x02, 0x03, 0x04 };
+static const unsigned char id2[] = { 0x05, 0x06, 0x07, 0x08, 0x09 };
+static const unsigned char id3[] = { 0x0a };
+
+static const unsigned char cdh[32] = {
+	0xec, 0x8d, 0x8f, 0x78, 0x42, 0x4a, 0x2b, 0xb7,
+	0x82, 0x34, 0xaa, 0xca, 0x07, 0xa1, 0xf6, 0x56,
+	0x42, 0x1c, 0xb6, 0xf6, 0xb3, 0x00, 0x86, 0x52,
+	0x35, 0x2d, 0xa2, 0x62, 0x4a, 0xbe, 0x89, 0x76,
+};
+
+static const unsigned char aaguid[16] = {
+	0xf8, 0xa0, 0x11, 0xf3, 0x8c, 0x0a, 0x4d, 0x15,
+	0x80, 0x06, 0x17, 0x11, 0x1f, 0x9e, 0xdc, 0x7d,
+};
+
+static void
+check_paths(const fido_affinity_t *af)
+{
+	assert(fido_affinity_count(af) == 2);
+	assert(strcmp(fido_affinity_path(af, id1, sizeof(id1)),
+	    "/dev/hidraw2") == 0);
+	assert(strcmp(fido_affinity_path(af, id2, sizeof(id2)),
+	    "\\\\?\\hid#vid_1050&pid_0407 with spaces") == 0);
+	assert(fido_affinity_path(af, id3, sizeof(id3)) == NULL);
+}
+
+static void
+set_and_lookup(void)
+{
+	fido_affinity_t *af;
+
+	assert((af = fido_affinity_new()) != NULL);
+	assert(fido_affinity_count(af) == 0);
+	assert(fido_affinity_path(af, id1, sizeof(id1)) == NULL);
+	assert(fido_affinity_set(af, NULL, 0, NULL, 0, "/dev/hidraw0") ==
+	    FIDO_ERR_INVALID_ARGUMENT);
+	assert(fido_affinity_set(af, id1, sizeof(id1), aaguid, 8,
+	    "/dev/hidraw0") == FIDO_ERR_INVALID_ARGUMENT);
+	assert(fido_affinity_set(af, id1, sizeof(id1), NULL, 0, NULL) ==
+	    FIDO_ERR_INVALID_ARGUMENT);
+
+	assert(fido_affinity_set(af, id1, sizeof(id1), aaguid, sizeof(aaguid),
+	    "/dev/hidraw0") == FIDO_OK);
+	assert(fido_affinity_set(af, id2, sizeof(id2), NULL, 0,
+	    "\\\\?\\hid#vid_1050&pid_0407 with spaces") == FIDO_OK);
+	/* credentials move along with their authenticator */
+	assert(fido_affinity_set(af, id1, sizeof(id1), aaguid, sizeof(aaguid),
+	    "/dev/hidraw2") == FIDO_OK);
+	check_paths(af);
+
+	fido_affinity_free(&af);
+	assert(af == NULL);
+	fido_affinity_free(&af);
+	fido_affinity_free(NULL);
+}
+
+static void
+save_and_load(void)
+{
+	fido_affinity_t	*af;
+	char		 path[] = "/tmp/regress_affinity.XXXXXX";
+	FILE		*fp;
+	int		 fd;
+
+	assert((fd = mkstemp(path)) != -1);
+	close(fd);
+
+	assert((af = fido_affinity_new()) != NULL);
+	assert(fido_affinity_set(af, id1, sizeof(id1), aaguid, sizeof(aaguid),
+	    "/dev/hidraw2") == FIDO_OK);
+	assert(fido_affinity_set(af, id2, sizeof(id2), NULL, 0,
+	    "\\\\?\\hid#vid_1050&pid_0407 with spaces") == FIDO_OK);
+	assert(fido_affinity_save(af, path) == FIDO_OK);
+	fido_affinity_free(&af);
+
+	assert((af = fido_affinity_new()) != NULL);
+	assert(fido_affinity_load(af, path) == FIDO_OK);
+	check_paths(af);
+	/* loading again replaces existing entries */
+	assert(fido_affinity_load(af, path) == FIDO_OK);
+	check_paths(af);
+	fido_affinity_free(&af);
+
+	/* malformed entries are rejected */
+	assert((fp = fopen(path, "w")) != NULL);
+	assert(fputs("00112233 /dev/hidraw0\n", fp) != EOF);
+	assert(fclose(fp) == 0);
+	assert((af = fido_affinity_new()) != NULL);
+	assert(fido_affinity_load(af, path) == FIDO_ERR_INVALID_ARGUMENT);
+	fido_affinity_free(&af);
+
+	assert(unlink(path) == 0);
+
+	assert((af = fido_affinity_new()) != NULL);
+	assert(fido_affinity_load(af, path) == FIDO_ERR_INVALID_ARGUMENT);
+	fido_affinity_free(&af);
+}
+
+static void
+bounded(void)
+{
+	fido_affinity_t	*af;
+	uint32_t	 id;
+
+	assert((af = fido_affinity_new()) != NULL);
+
+	for (id = 0; id < AFFINITY_MAX + 16; id++)
+		assert(fido_affinity_set(af, (const unsigned char *)&id,
+		    sizeof(id), NULL, 0, "/dev/hidraw0") == FIDO_OK);
+
+	assert(fido_affinity_count(af) == AFFINITY_MAX);
+	id = AFFINITY_MAX + 15;
+	assert(fido_affinity_path(af, (const unsigned char *)&id,
+	    sizeof(id)) != NULL);
+
+	fido_affinity_free(&af);
+}
+
+static void
+route_miss(void)
+{
+	fido_affinity_t	*af;
+	fido_assert_t	*a;
+	fido_dev_info_t	*devlist;
+	size_t		 idx = 42;
+
+	assert((af = fido_affinity_new()) != NULL);
+	assert((a = fido_assert_new()) != NULL);
+	assert((devlist = fido_dev_info_new(2)) != NULL);
+
+	assert(fido_affinity_set(af, id1, sizeof(id1), NULL, 0,
+	    "/dev/hidraw0") == FIDO_OK);
+
+	/* no allow list */
+	assert(fido_affinity_route(af, a, devlist, 2, &idx) ==
+	    FIDO_ERR_NO_CREDENTIALS);
+
+	/* known credential, but no such device */
+	assert(fido_assert_allow_cred(a, id2, sizeof(id2)) == FIDO_OK);
+	assert(fido_assert_allow_cred(a, id1, sizeof(id1)) == FIDO_OK);
+	assert(fido_affinity_route(af, a, devlist, 2, &idx) ==
+	    FIDO_ERR_NO_CREDENTIALS);
+	assert(fido_affinity_route(af, a, NULL, 0, &idx) ==
+	    FIDO_ERR_NO_CREDENTIALS);
+	assert(idx == 42);
+
+	fido_dev_info_free(&devlist, 2);
+	fido_assert_free(&a);
+	fido_affinity_free(&af);
+}
+
+static fido_cred_t *
+make_cred(fido_dev_t *dev)
+{
+	fido_cred_t *cred;
+
+	assert((cred = fido_cred_new()) != NULL);
+	assert(fido_cred_set_type(cred, COSE_ES256) == FIDO_OK);
+	assert(fido_cred_set_clientdata_hash(cred, cdh,
+	    sizeof(cdh)) == FIDO_OK);
+	assert(fido_cred_set_rp(cred, "example.org", "Example") == FIDO_OK);
+	assert(fido_cred_set_user(cred, id1, sizeof(id1), "jsmith",
+	    "John Smith", NULL) == FIDO_OK);
+	assert(fido_dev_make_cred(dev, cred, NULL) == FIDO_OK);
+
+	return (cred);
+}
+
+/*
+ * Assertions do not carry an aaguid; entries learnt from them take the
+ * one already known for the device, including while the map grows.
+ */
+static void
+learn_assert(void)
+{
+	fido_dev_io_t		 io;
+	vdev_t			*v;
+	fido_dev_t		*dev;
+	fido_affinity_t		*af;
+	fido_cred_t		*cred[NCREDS];
+	fido_cred_t		*known;
+	fido_assert_t		*a;
+	fido_cbor_info_t	*ci;
+	char			 path[] = "/tmp/regress_affinity.XXXXXX";
+	char			 line[512];
+	char			 hex[33];
+	FILE			*fp;
+	size_t			 n = 0;
+	int			 fd;
+
+	vdev_io(&io);
+	assert((v = vdev_new()) != NULL);
+	assert((dev = fido_dev_new()) != NULL);
+	assert(fido_dev_set_io_functions(dev, &io) == FIDO_OK);
+	assert(fido_dev_open(dev, vdev_path(v)) == FIDO_OK);
+	assert((af = fido_affinity_new()) != NULL);
+
+	/* made before the map is attached, so not known to it */
+	for (size_t i = 0; i < NCREDS; i++)
+		cred[i] = make_cred(dev);
+
+	assert((ci = fido_cbor_info_new()) != NULL);
+	assert(fido_dev_get_cbor_info(dev, ci) == FIDO_OK);
+	assert(fido_cbor_info_aaguid_len(ci) == 16);
+	for (size_t i = 0; i < 16; i++)
+		snprintf(&hex[i * 2], 3, "%02x",
+		    fido_cbor_info_aaguid_ptr(ci)[i]);
+	fido_cbor_info_free(&ci);
+
+	assert(fido_dev_set_affinity(dev, af) == FIDO_OK);
+	known = make_cred(dev);
+	assert(fido_affinity_count(af) == 1);
+
+	for (size_t i = 0; i < NCREDS; i++) {
+		assert((a = fido_assert_new()) != NULL);
+		assert(fido_assert_set_rp(a, "example.org") == FIDO_OK);
+		assert(fido_assert_set_clientdata_hash(a, cdh,
+		    sizeof(cdh)) == FIDO_OK);
+		assert(fido_assert_allow_cred(a, fido_cred_id_ptr(cred[i]),
+		    fido_cred_id_len(cred[i])) == FIDO_OK);
+		assert(fido_dev_get_assert(dev, a, NULL) == FIDO_OK);
+		fido_assert_free(&a);
+		assert(fido_affinity_count(af) == i + 2);
+		assert(strcmp(fido_affinity_path(af, fido_cred_id_ptr(cred[i]),
+		    fido_cred_id_len(cred[i])), vdev_path(v)) == 0);
+	}
+
+	assert((fd = mkstemp(path)) != -1);
+	close(fd);
+	assert(fido_affinity_save(af, path) == FIDO_OK);
+	assert((fp = fopen(path, "r")) != NULL);
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		assert(strncmp(line + 65, hex, 32) == 0);
+		n++;
+	}
+	assert(n == NCREDS + 1);
+	assert(fclose(fp) == 0);
+	assert(unlink(path) == 0);
+
+	for (size_t i = 0; i < NCREDS; i++)
+		fido_cred_free(&cred[i]);
+	fido_cred_free(&known);
+	fido_affinity_free(&af);
+	assert(fido_dev_close(dev) == FIDO_OK);
+	fido_dev_free(&dev);
+	vdev_free(&v);
+}
+
+int
+main(void)
+{
+	fido_init(0);
+
+	set_and_lookup();
+	save_and_load();
+	bounded();
+	route_miss();
+	learn_assert();
+
+	exit(0);
+}
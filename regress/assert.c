@@ -489,6 +489,39 @@ bad_cbor_serialize(void)
 	free_assert(a);
 }
 
+/* a reset assertion is empty, and can be used again */
+static void
+reset_assert(void)
+{
+	fido_assert_t *a;
+	es256_pk_t *pk;
+
+	a = alloc_assert();
+	pk = alloc_es256_pk();
+	assert(es256_pk_from_ptr(pk, es256_pk, sizeof(es256_pk)) == FIDO_OK);
+	for (int i = 0; i < 2; i++) {
+		assert(fido_assert_set_clientdata_hash(a, cdh,
+		    sizeof(cdh)) == FIDO_OK);
+		assert(fido_assert_set_rp(a, "localhost") == FIDO_OK);
+		assert(fido_assert_set_count(a, 1) == FIDO_OK);
+		assert(fido_assert_set_authdata(a, 0, authdata,
+		    sizeof(authdata)) == FIDO_OK);
+		assert(fido_assert_set_up(a, FIDO_OPT_FALSE) == FIDO_OK);
+		assert(fido_assert_set_uv(a, FIDO_OPT_FALSE) == FIDO_OK);
+		assert(fido_assert_set_sig(a, 0, sig, sizeof(sig)) == FIDO_OK);
+		assert(fido_assert_verify(a, 0, COSE_ES256, pk) == FIDO_OK);
+		fido_assert_reset(a);
+		assert(fido_assert_count(a) == 0);
+		assert(fido_assert_rp_id(a) == NULL);
+		assert(fido_assert_clientdata_hash_ptr(a) == NULL);
+		assert(fido_assert_authdata_ptr(a, 0) == NULL);
+		assert(fido_assert_verify(a, 0, COSE_ES256,
+		    pk) == FIDO_ERR_INVALID_ARGUMENT);
+	}
+	free_assert(a);
+	free_es256_pk(pk);
+}
+
 int
 main(void)
 {
@@ -506,6 +539,7 @@ main(void)
 	junk_sig();
 	wrong_options();
 	bad_cbor_serialize();
+	reset_assert();
 
 	exit(0);
 }
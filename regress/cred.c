@@ -786,6 +786,58 @@ unsorted_keys(void)
 	free_cred(c);
 }
 
+/* arrays and maps larger than their input are refused before decoding */
+static void
+oversized_cbor(void)
+{
+	const unsigned char	 array[] = { 0x9a, 0x10, 0x00, 0x00, 0x00 };
+	const unsigned char	 map[] = { 0xbb, 0x00, 0x00, 0x00, 0x01, 0x00,
+	    0x00, 0x00, 0x00, 0xa0 };
+	fido_cred_t		*c;
+
+	c = alloc_cred();
+	assert(fido_cred_set_type(c, COSE_ES256) == FIDO_OK);
+	assert(fido_cred_set_authdata(c, array,
+	    sizeof(array)) == FIDO_ERR_INVALID_ARGUMENT);
+	assert(fido_cred_set_authdata(c, map,
+	    sizeof(map)) == FIDO_ERR_INVALID_ARGUMENT);
+	assert(fido_cred_authdata_len(c) == 0);
+	free_cred(c);
+}
+
+/* a reset credential is empty, and can be used again */
+static void
+reset_cred(void)
+{
+	fido_cred_t *c;
+
+	c = alloc_cred();
+	for (int i = 0; i < 2; i++) {
+		assert(fido_cred_set_type(c, COSE_ES256) == FIDO_OK);
+		assert(fido_cred_set_clientdata_hash(c, cdh,
+		    sizeof(cdh)) == FIDO_OK);
+		assert(fido_cred_set_rp(c, rp_id, rp_name) == FIDO_OK);
+		assert(fido_cred_set_authdata(c, authdata,
+		    sizeof(authdata)) == FIDO_OK);
+		assert(fido_cred_set_rk(c, FIDO_OPT_FALSE) == FIDO_OK);
+		assert(fido_cred_set_uv(c, FIDO_OPT_FALSE) == FIDO_OK);
+		assert(fido_cred_set_x509(c, x509, sizeof(x509)) == FIDO_OK);
+		assert(fido_cred_set_sig(c, sig, sizeof(sig)) == FIDO_OK);
+		assert(fido_cred_set_fmt(c, "packed") == FIDO_OK);
+		assert(fido_cred_verify(c) == FIDO_OK);
+		fido_cred_reset(c);
+		assert(fido_cred_type(c) == 0);
+		assert(fido_cred_fmt(c) == NULL);
+		assert(fido_cred_rp_id(c) == NULL);
+		assert(fido_cred_authdata_len(c) == 0);
+		assert(fido_cred_x5c_ptr(c) == NULL);
+		assert(fido_cred_sig_ptr(c) == NULL);
+		assert(fido_cred_id_ptr(c) == NULL);
+		assert(fido_cred_verify(c) == FIDO_ERR_INVALID_ARGUMENT);
+	}
+	free_cred(c);
+}
+
 int
 main(void)
 {
@@ -811,6 +863,8 @@ main(void)
 	bad_cbor_serialize();
 	duplicate_keys();
 	unsorted_keys();
+	oversized_cbor();
+	reset_cred();
 
 	exit(0);
 }
@@ -0,0 +1,377 @@
+/*
+ * Copyright (c) 2020 Yubico AB. All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+/*
+ * Talk to a virtual authenticator through the fault injection wrapper:
+ * slow frames, dropped and corrupted frames, interleaved keepalives,
+ * stale frames, busy replies and broken replies. With -n, report
+ * operation latencies under a set of scenarios.
+ */
+
+#include <assert.h>
+#include <fido.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../virtual/vdev.h"
+
+#define DELAY_MS	10
+
+static const unsigned char cdh[32] = {
+	0xec, 0x8d, 0x8f, 0x78, 0x42, 0x4a, 0x2b, 0xb7,
+	0x82, 0x34, 0xaa, 0xca, 0x07, 0xa1, 0xf6, 0x56,
+	0x42, 0x1c, 0xb6, 0xf6, 0xb3, 0x00, 0x86, 0x52,
+	0x35, 0x2d, 0xa2, 0x62, 0x4a, 0xbe, 0x89, 0x76,
+};
+
+static const unsigned char user_id[] = { 0x01, 0x02, 0x03, 0x04 };
+
+static const struct scenario {
+	const char		*name;
+	vdev_fault_cfg_t	 cfg;
+} scenarios[] = {
+	{ "baseline",	 { 0, 0, 0, 0, 0, 1, 0, 0, 0 } },
+	{ "delay-1ms",	 { 1, 1, 0, 0, 0, 1, 0, 0, 0 } },
+	{ "keepalive-8", { 0, 0, 0, 0, 8, 1, 0, 0, 0 } },
+	{ "drop-1%",	 { 0, 0, 1, 0, 0, 1, 0, 0, 0 } },
+	{ "corrupt-1%",	 { 0, 0, 0, 1, 0, 1, 0, 0, 0 } },
+};
+
+static double
+now_ms(void)
+{
+	struct timespec ts;
+
+	assert(clock_gettime(CLOCK_MONOTONIC, &ts) == 0);
+
+	return (ts.tv_sec * 1e3 + ts.tv_nsec / 1e6);
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return ((x > y) - (x < y));
+}
+
+static fido_dev_t *
+open_dev(const vdev_fault_t *f)
+{
+	fido_dev_io_t	 io;
+	fido_dev_t	*dev;
+
+	vdev_fault_io(&io);
+
+	assert((dev = fido_dev_new()) != NULL);
+	assert(fido_dev_set_io_functions(dev, &io) == FIDO_OK);
+	if (fido_dev_open(dev, vdev_fault_path(f)) != FIDO_OK)
+		fido_dev_free(&dev);
+
+	return (dev);
+}
+
+static void
+close_dev(fido_dev_t **dev)
+{
+	fido_dev_close(*dev);
+	fido_dev_free(dev);
+}
+
+static int
+get_info(fido_dev_t *dev)
+{
+	fido_cbor_info_t	*ci;
+	int			 r;
+
+	assert((ci = fido_cbor_info_new()) != NULL);
+	r = fido_dev_get_cbor_info(dev, ci);
+	fido_cbor_info_free(&ci);
+
+	return (r);
+}
+
+/* makeCredential followed by getAssertion */
+static int
+roundtrip(fido_dev_t *dev)
+{
+	fido_cred_t	*cred;
+	fido_assert_t	*assert = NULL;
+	int		 r;
+
+	assert((cred = fido_cred_new()) != NULL);
+	assert(fido_cred_set_type(cred, COSE_ES256) == FIDO_OK);
+	assert(fido_cred_set_clientdata_hash(cred, cdh,
+	    sizeof(cdh)) == FIDO_OK);
+	assert(fido_cred_set_rp(cred, "example.org", NULL) == FIDO_OK);
+	assert(fido_cred_set_user(cred, user_id, sizeof(user_id), "jsmith",
+	    NULL, NULL) == FIDO_OK);
+	if ((r = fido_dev_make_cred(dev, cred, NULL)) != FIDO_OK)
+		goto out;
+
+	assert((assert = fido_assert_new()) != NULL);
+	assert(fido_assert_set_rp(assert, "example.org") == FIDO_OK);
+	assert(fido_assert_set_clientdata_hash(assert, cdh,
+	    sizeof(cdh)) == FIDO_OK);
+	assert(fido_assert_allow_cred(assert, fido_cred_id_ptr(cred),
+	    fido_cred_id_len(cred)) == FIDO_OK);
+	r = fido_dev_get_assert(dev, assert, NULL);
+out:
+	fido_assert_free(&assert);
+	fido_cred_free(&cred);
+
+	return (r);
+}
+
+static void
+keepalives(vdev_fault_t *f)
+{
+	vdev_fault_cfg_t	 cfg;
+	fido_dev_t		*dev;
+	uint64_t		 n_drop;
+	uint64_t		 n_corrupt;
+	uint64_t		 n_keepalive;
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.keepalives = 5;
+	vdev_fault_set(f, &cfg);
+
+	/* skipped by the library, including before CTAPHID_INIT's reply */
+	assert((dev = open_dev(f)) != NULL);
+	assert(roundtrip(dev) == FIDO_OK);
+	close_dev(&dev);
+
+	vdev_fault_stats(f, &n_drop, &n_corrupt, &n_keepalive);
+	assert(n_keepalive >= 3 * cfg.keepalives);
+}
+
+static void
+delays(vdev_fault_t *f)
+{
+	vdev_fault_cfg_t	 cfg;
+	fido_dev_t		*dev;
+	fido_ping_t		*ping;
+	double			 t0;
+
+	memset(&cfg, 0, sizeof(cfg));
+	assert((dev = open_dev(f)) != NULL);
+
+	cfg.read_delay_ms = DELAY_MS;
+	vdev_fault_set(f, &cfg);
+	t0 = now_ms();
+	assert(get_info(dev) == FIDO_OK);
+	assert(now_ms() - t0 >= DELAY_MS);
+
+	cfg.read_delay_ms = 0;
+	cfg.write_delay_ms = DELAY_MS;
+	vdev_fault_set(f, &cfg);
+	t0 = now_ms();
+	assert(get_info(dev) == FIDO_OK);
+	assert(now_ms() - t0 >= DELAY_MS);
+
+	/* the timeout covers the whole reply, keepalives included */
+	cfg.read_delay_ms = 2 * DELAY_MS;
+	cfg.write_delay_ms = 0;
+	cfg.keepalives = 20;
+	vdev_fault_set(f, &cfg);
+	assert((ping = fido_ping_new()) != NULL);
+	assert(fido_ping_set_timeout(ping, 5 * DELAY_MS) == FIDO_OK);
+	t0 = now_ms();
+	assert(fido_dev_ping(dev, 64, 1, ping) == FIDO_ERR_RX);
+	assert(now_ms() - t0 < cfg.keepalives * cfg.read_delay_ms);
+	fido_ping_free(&ping);
+
+	close_dev(&dev);
+}
+
+static void
+faults(vdev_fault_t *f)
+{
+	vdev_fault_cfg_t	 cfg;
+	fido_dev_t		*dev;
+	uint64_t		 n_drop;
+	uint64_t		 n_corrupt;
+	uint64_t		 n_keepalive;
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.seed = 1;
+	assert((dev = open_dev(f)) != NULL);
+
+	/* a lost reply is an error, not a hang */
+	cfg.drop_pct = 100;
+	vdev_fault_set(f, &cfg);
+	assert(get_info(dev) != FIDO_OK);
+	close_dev(&dev);
+
+	/* corrupted replies do not crash the library */
+	cfg.drop_pct = 0;
+	cfg.corrupt_pct = 100;
+	vdev_fault_set(f, &cfg);
+	if ((dev = open_dev(f)) != NULL) {
+		for (int i = 0; i < 16; i++)
+			(void)roundtrip(dev);
+		close_dev(&dev);
+	}
+
+	vdev_fault_stats(f, &n_drop, &n_corrupt, &n_keepalive);
+	assert(n_drop > 0 && n_corrupt > 0);
+}
+
+static uint64_t
+value(const fido_dev_t *dev, const char *name)
+{
+	fido_metrics_t	*m;
+	uint64_t	 v = 0;
+
+	assert((m = fido_metrics_new()) != NULL);
+	assert(fido_metrics_get(dev, m) == FIDO_OK);
+	for (size_t i = 0; i < fido_metrics_len(m); i++)
+		if (strcmp(fido_metrics_name(m, i), name) == 0)
+			v = fido_metrics_value(m, i);
+	fido_metrics_free(&m);
+
+	return (v);
+}
+
+static void
+recovery(vdev_fault_t *f)
+{
+	vdev_fault_cfg_t	 cfg;
+	fido_dev_t		*dev;
+	fido_ping_t		*ping;
+	double			 t0;
+
+	/* frames of an earlier session are skipped on open */
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.stale = 9;
+	vdev_fault_set(f, &cfg);
+	assert((dev = open_dev(f)) != NULL);
+	assert(value(dev, "stale_frames") == 6);
+	assert(value(dev, "cid_mismatches") == 3);
+	assert(roundtrip(dev) == FIDO_OK);
+	close_dev(&dev);
+
+	/* too many replies to someone else's CTAPHID_INIT */
+	cfg.stale = 32;
+	vdev_fault_set(f, &cfg);
+	assert(open_dev(f) == NULL);
+
+	/* requests turned away are sent again */
+	memset(&cfg, 0, sizeof(cfg));
+	vdev_fault_set(f, &cfg);
+	assert((dev = open_dev(f)) != NULL);
+	cfg.busy = 3;
+	vdev_fault_set(f, &cfg);
+	assert(roundtrip(dev) == FIDO_OK);
+	assert(value(dev, "busy_retries") == 3);
+
+	/* ... but not forever */
+	cfg.busy = 100;
+	vdev_fault_set(f, &cfg);
+	t0 = now_ms();
+	assert(get_info(dev) == FIDO_ERR_RX);
+	assert(now_ms() - t0 >= 10 + 20 + 40 + 80 + 160);
+	assert(value(dev, "busy_retries") == 3 + 5);
+
+	/* a broken reply costs that reply only */
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.desync = 1;
+	vdev_fault_set(f, &cfg);
+	assert((ping = fido_ping_new()) != NULL);
+	assert(fido_dev_ping(dev, 1024, 1, ping) == FIDO_ERR_RX);
+	assert(value(dev, "resyncs") == 1);
+	/* 18 frames, less the first, the one lost and the one out of step */
+	assert(value(dev, "stale_frames") == 18 - 3);
+	assert(fido_dev_ping(dev, 1024, 1, ping) == FIDO_OK);
+	assert(roundtrip(dev) == FIDO_OK);
+	fido_ping_free(&ping);
+	close_dev(&dev);
+}
+
+static void
+bench(vdev_fault_t *f, size_t n)
+{
+	fido_dev_t	*dev = NULL;
+	double		*t;
+	double		 t0;
+	size_t		 ok;
+	size_t		 failed;
+
+	assert((t = calloc(n, sizeof(*t))) != NULL);
+
+	for (size_t i = 0; i < sizeof(scenarios) / sizeof(*scenarios); i++) {
+		vdev_fault_set(f, &scenarios[i].cfg);
+		ok = failed = 0;
+		for (size_t j = 0; j < n; j++) {
+			t0 = now_ms();
+			/* start over after a failure */
+			if ((dev != NULL || (dev = open_dev(f)) != NULL) &&
+			    roundtrip(dev) == FIDO_OK) {
+				t[ok++] = now_ms() - t0;
+				continue;
+			}
+			failed++;
+			if (dev != NULL)
+				close_dev(&dev);
+		}
+		if (dev != NULL)
+			close_dev(&dev);
+		if (ok == 0) {
+			printf("%-12s failed=%zu\n", scenarios[i].name, failed);
+			continue;
+		}
+		qsort(t, ok, sizeof(*t), cmp_double);
+		printf("%-12s n=%zu failed=%zu p50=%.3fms p99=%.3fms "
+		    "max=%.3fms\n", scenarios[i].name, ok, failed, t[ok / 2],
+		    t[(ok * 99) / 100], t[ok - 1]);
+	}
+
+	free(t);
+}
+
+int
+main(int argc, char **argv)
+{
+	fido_dev_io_t	 io;
+	vdev_t		*v;
+	vdev_fault_t	*f;
+	size_t		 n = 0;
+	int		 ch;
+
+	while ((ch = getopt(argc, argv, "n:")) != -1) {
+		switch (ch) {
+		case 'n':
+			n = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "usage: regress_fault [-n count]\n");
+			exit(1);
+		}
+	}
+
+	fido_init(0);
+
+	vdev_io(&io);
+	assert((v = vdev_new()) != NULL);
+	assert((f = vdev_fault_new(&io, vdev_path(v))) != NULL);
+
+	keepalives(f);
+	delays(f);
+	faults(f);
+	recovery(f);
+
+	if (n > 0)
+		bench(f, n);
+
+	vdev_fault_free(&f);
+	vdev_free(&v);
+
+	exit(0);
+}
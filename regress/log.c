@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2020 Yubico AB. All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+/*
+ * Keep debug output in the per-thread ring buffer while talking to a
+ * virtual authenticator, and drain it.
+ */
+
+#include <assert.h>
+#include <fido.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../virtual/vdev.h"
+
+struct drained {
+	size_t		n_debug;
+	size_t		n_dump;
+	size_t		n_io;
+	size_t		max_len;
+	uint64_t	t;
+};
+
+static void
+handler(int level, const char *category, uint64_t t, const char *msg,
+    void *arg)
+{
+	struct drained *d = arg;
+
+	assert(category != NULL && msg != NULL);
+
+	/* oldest first */
+	assert(t >= d->t);
+	d->t = t;
+
+	if (level == FIDO_LOG_DEBUG)
+		d->n_debug++;
+	else if (level == FIDO_LOG_DUMP)
+		d->n_dump++;
+	else
+		abort();
+
+	if (strcmp(category, "io") == 0)
+		d->n_io++;
+
+	if (strlen(msg) > d->max_len)
+		d->max_len = strlen(msg);
+}
+
+static void
+get_info(const char *path)
+{
+	fido_dev_io_t		 io;
+	fido_dev_t		*dev;
+	fido_cbor_info_t	*ci;
+
+	vdev_io(&io);
+
+	assert((dev = fido_dev_new()) != NULL);
+	assert(fido_dev_set_io_functions(dev, &io) == FIDO_OK);
+	assert(fido_dev_open(dev, path) == FIDO_OK);
+	assert((ci = fido_cbor_info_new()) != NULL);
+	assert(fido_dev_get_cbor_info(dev, ci) == FIDO_OK);
+	fido_cbor_info_free(&ci);
+	assert(fido_dev_close(dev) == FIDO_OK);
+	fido_dev_free(&dev);
+}
+
+/* a replay: path naming a file that does not exist, logged in full */
+static void
+long_path(void)
+{
+	fido_dev_t	*dev;
+	char		 path[1100];
+
+	memset(path, 'x', sizeof(path) - 1);
+	path[sizeof(path) - 1] = '\0';
+	memcpy(path, "replay:/nonexistent/", 20);
+
+	assert((dev = fido_dev_new()) != NULL);
+	assert(fido_dev_open(dev, path) != FIDO_OK);
+	fido_dev_free(&dev);
+}
+
+int
+main(void)
+{
+	struct drained	 d;
+	vdev_t		*v;
+
+	fido_init(FIDO_DEBUG_RING);
+
+	assert((v = vdev_new()) != NULL);
+
+	get_info(vdev_path(v));
+	memset(&d, 0, sizeof(d));
+	assert(fido_log_drain(FIDO_LOG_DUMP, handler, &d) > 0);
+	assert(d.n_debug > 0 && d.n_dump > 0 && d.n_io > 0);
+
+	/* the ring is now empty */
+	memset(&d, 0, sizeof(d));
+	assert(fido_log_drain(FIDO_LOG_DUMP, handler, &d) == 0);
+
+	/* hex dumps are left out */
+	get_info(vdev_path(v));
+	memset(&d, 0, sizeof(d));
+	assert(fido_log_drain(FIDO_LOG_DEBUG, handler, &d) > 0);
+	assert(d.n_debug > 0 && d.n_dump == 0);
+
+	/* the oldest entries make way */
+	for (int i = 0; i < 64; i++)
+		get_info(vdev_path(v));
+	memset(&d, 0, sizeof(d));
+	assert(fido_log_drain(FIDO_LOG_DUMP, handler, &d) > 0);
+
+	/* long messages are not cut short */
+	long_path();
+	memset(&d, 0, sizeof(d));
+	assert(fido_log_drain(FIDO_LOG_DEBUG, handler, &d) > 0);
+	assert(d.max_len > 1024);
+
+	vdev_free(&v);
+
+	exit(0);
+}
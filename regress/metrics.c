@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2020 Yubico AB. All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+/*
+ * Count frames, keepalives, commands and verifications in a session with
+ * a virtual authenticator.
+ */
+
+#include <assert.h>
+#include <fido.h>
+#include <fido/es256.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../virtual/vdev.h"
+
+#define KEEPALIVES	2
+
+static const unsigned char cdh[32] = {
+	0xec, 0x8d, 0x8f, 0x78, 0x42, 0x4a, 0x2b, 0xb7,
+	0x82, 0x34, 0xaa, 0xca, 0x07, 0xa1, 0xf6, 0x56,
+	0x42, 0x1c, 0xb6, 0xf6, 0xb3, 0x00, 0x86, 0x52,
+	0x35, 0x2d, 0xa2, 0x62, 0x4a, 0xbe, 0x89, 0x76,
+};
+
+static const unsigned char user_id[] = { 0x01, 0x02, 0x03, 0x04 };
+
+static uint64_t
+value(const fido_metrics_t *m, const char *name)
+{
+	for (size_t i = 0; i < fido_metrics_len(m); i++)
+		if (strcmp(fido_metrics_name(m, i), name) == 0)
+			return (fido_metrics_value(m, i));
+
+	abort();
+}
+
+/* number of commands in a latency histogram, or in all of them */
+static uint64_t
+count(const fido_metrics_t *m, const char *name)
+{
+	const uint64_t	*b;
+	uint64_t	 n = 0;
+	int		 found = 0;
+
+	for (size_t i = 0; i < fido_metrics_latency_len(m); i++) {
+		if (name != NULL &&
+		    strcmp(fido_metrics_latency_name(m, i), name) != 0)
+			continue;
+		assert((b = fido_metrics_latency_ptr(m, i)) != NULL);
+		for (size_t j = 0; j < fido_metrics_bucket_len(m); j++)
+			n += b[j];
+		found = 1;
+	}
+
+	assert(found);
+
+	return (n);
+}
+
+static void
+session(fido_dev_t *dev)
+{
+	fido_cred_t	*cred;
+	fido_assert_t	*assert;
+	es256_pk_t	*pk;
+
+	assert((cred = fido_cred_new()) != NULL);
+	assert(fido_cred_set_type(cred, COSE_ES256) == FIDO_OK);
+	assert(fido_cred_set_clientdata_hash(cred, cdh,
+	    sizeof(cdh)) == FIDO_OK);
+	assert(fido_cred_set_rp(cred, "example.org", NULL) == FIDO_OK);
+	assert(fido_cred_set_user(cred, user_id, sizeof(user_id), "jsmith",
+	    NULL, NULL) == FIDO_OK);
+	assert(fido_dev_make_cred(dev, cred, NULL) == FIDO_OK);
+
+	assert((assert = fido_assert_new()) != NULL);
+	assert(fido_assert_set_rp(assert, "example.org") == FIDO_OK);
+	assert(fido_assert_set_clientdata_hash(assert, cdh,
+	    sizeof(cdh)) == FIDO_OK);
+	assert(fido_assert_allow_cred(assert, fido_cred_id_ptr(cred),
+	    fido_cred_id_len(cred)) == FIDO_OK);
+	assert(fido_dev_get_assert(dev, assert, NULL) == FIDO_OK);
+
+	assert((pk = es256_pk_new()) != NULL);
+	assert(es256_pk_from_ptr(pk, fido_cred_pubkey_ptr(cred),
+	    fido_cred_pubkey_len(cred)) == FIDO_OK);
+	assert(fido_assert_verify(assert, 0, COSE_ES256, pk) == FIDO_OK);
+	/* the wrong signature */
+	assert(fido_assert_set_sig(assert, 0, cdh, sizeof(cdh)) == FIDO_OK);
+	assert(fido_assert_verify(assert, 0, COSE_ES256, pk) != FIDO_OK);
+
+	es256_pk_free(&pk);
+	fido_assert_free(&assert);
+	fido_cred_free(&cred);
+}
+
+int
+main(void)
+{
+	fido_dev_io_t		 io;
+	vdev_fault_cfg_t	 cfg;
+	vdev_t			*v;
+	vdev_fault_t		*f;
+	fido_dev_t		*dev;
+	fido_metrics_t		*m;
+	fido_metrics_t		*g;
+	const uint64_t		*bound;
+
+	fido_init(0);
+
+	vdev_io(&io);
+	assert((v = vdev_new()) != NULL);
+	assert((f = vdev_fault_new(&io, vdev_path(v))) != NULL);
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.keepalives = KEEPALIVES;
+	vdev_fault_set(f, &cfg);
+
+	assert((m = fido_metrics_new()) != NULL);
+	assert((g = fido_metrics_new()) != NULL);
+
+	/* nothing yet */
+	assert(fido_metrics_get(NULL, g) == FIDO_OK);
+	for (size_t i = 0; i < fido_metrics_len(g); i++)
+		assert(fido_metrics_value(g, i) == 0);
+	assert(fido_metrics_name(g, fido_metrics_len(g)) == NULL);
+	assert(fido_metrics_latency_ptr(g, fido_metrics_latency_len(g)) ==
+	    NULL);
+
+	bound = fido_metrics_bucket_ptr(g);
+	for (size_t i = 1; i < fido_metrics_bucket_len(g); i++)
+		assert(bound[i] > bound[i - 1]);
+	assert(bound[fido_metrics_bucket_len(g) - 1] == UINT64_MAX);
+
+	vdev_fault_io(&io);
+	assert((dev = fido_dev_new()) != NULL);
+	assert(fido_dev_set_io_functions(dev, &io) == FIDO_OK);
+	assert(fido_dev_open(dev, vdev_fault_path(f)) == FIDO_OK);
+	session(dev);
+
+	assert(fido_metrics_get(dev, m) == FIDO_OK);
+	assert(count(m, "init") == 1);
+	assert(count(m, "make_cred") == 1);
+	assert(count(m, "get_assert") == 1);
+	assert(value(m, "frames_tx") >= 3);
+	assert(value(m, "frames_rx") > value(m, "keepalives"));
+	/* skipped before each reply */
+	assert(value(m, "keepalives") == KEEPALIVES * count(m, NULL));
+	assert(value(m, "bytes_tx") > 0 && value(m, "bytes_rx") > 0);
+	assert(value(m, "tx_errors") == 0 && value(m, "rx_errors") == 0);
+	assert(value(m, "cid_mismatches") == 0);
+	/* not tied to a device */
+	assert(value(m, "verify_es256_ok") == 0);
+
+	assert(fido_metrics_get(NULL, g) == FIDO_OK);
+	for (size_t i = 0; i < fido_metrics_len(g); i++)
+		assert(fido_metrics_value(g, i) >= fido_metrics_value(m, i));
+	assert(count(g, "make_cred") == 1);
+	assert(value(g, "verify_es256_ok") >= 1);
+	assert(value(g, "verify_es256_fail") >= 1);
+
+	assert(fido_dev_close(dev) == FIDO_OK);
+	fido_dev_free(&dev);
+
+	fido_metrics_free(&m);
+	fido_metrics_free(&g);
+	assert(m == NULL && g == NULL);
+	fido_metrics_free(&m);
+
+	vdev_fault_free(&f);
+	vdev_free(&v);
+
+	exit(0);
+}
@@ -0,0 +1,364 @@
+/*
+ * Copyright (c) 2020 Yubico AB. All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+/*
+ * Ping a virtual authenticator, directly, through the fault injection
+ * wrapper, and with longer hid reports, and check the statistics
+ * reported and the timeout applied to replies.
+ */
+
+#include <assert.h>
+#include <fido.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../virtual/vdev.h"
+
+#define MAX_LEN	7609
+
+static void
+check(const fido_ping_t *ping, size_t len, size_t count)
+{
+	assert(fido_ping_len(ping) == len);
+	assert(fido_ping_count(ping) == count);
+	assert(fido_ping_min_us(ping) <= fido_ping_avg_us(ping));
+	assert(fido_ping_avg_us(ping) <= fido_ping_max_us(ping));
+	assert(fido_ping_min_us(ping) <= fido_ping_p99_us(ping));
+	assert(fido_ping_p99_us(ping) <= fido_ping_max_us(ping));
+	assert(fido_ping_bytes_per_sec(ping) > 0);
+}
+
+static void
+empty(const fido_ping_t *ping)
+{
+	assert(fido_ping_count(ping) == 0);
+	assert(fido_ping_len(ping) == 0);
+	assert(fido_ping_min_us(ping) == 0);
+	assert(fido_ping_avg_us(ping) == 0);
+	assert(fido_ping_p99_us(ping) == 0);
+	assert(fido_ping_max_us(ping) == 0);
+	assert(fido_ping_bytes_per_sec(ping) == 0);
+}
+
+static uint64_t
+value(const fido_dev_t *dev, const char *name)
+{
+	fido_metrics_t	*m;
+	uint64_t	 v = 0;
+
+	assert((m = fido_metrics_new()) != NULL);
+	assert(fido_metrics_get(dev, m) == FIDO_OK);
+	for (size_t i = 0; i < fido_metrics_len(m); i++)
+		if (strcmp(fido_metrics_name(m, i), name) == 0)
+			v = fido_metrics_value(m, i);
+	fido_metrics_free(&m);
+
+	return (v);
+}
+
+/* frames carrying a message of len bytes in reports of rpt_len bytes */
+static uint64_t
+frames(size_t len, size_t rpt_len)
+{
+	size_t init_len = rpt_len - 7;
+	size_t cont_len = rpt_len - 5;
+
+	if (len <= init_len)
+		return (1);
+
+	return (1 + (len - init_len + cont_len - 1) / cont_len);
+}
+
+static void
+ping_vdev(void)
+{
+	fido_dev_io_t	 io;
+	vdev_t		*v;
+	fido_dev_t	*dev;
+	fido_ping_t	*ping;
+	const size_t	 lens[] = { 1, 57, 58, 116, 1024, MAX_LEN };
+
+	vdev_io(&io);
+	assert((v = vdev_new()) != NULL);
+	assert((dev = fido_dev_new()) != NULL);
+	assert(fido_dev_set_io_functions(dev, &io) == FIDO_OK);
+	assert((ping = fido_ping_new()) != NULL);
+
+	empty(ping);
+
+	/* not open */
+	assert(fido_dev_ping(dev, 64, 1, ping) != FIDO_OK);
+	assert(fido_ping_len(ping) == 64);
+	assert(fido_ping_count(ping) == 0);
+
+	assert(fido_dev_open(dev, vdev_path(v)) == FIDO_OK);
+
+	for (size_t i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+		assert(fido_dev_ping(dev, lens[i], 10, ping) == FIDO_OK);
+		check(ping, lens[i], 10);
+	}
+
+	/* previous results are discarded */
+	assert(fido_dev_ping(dev, 0, 10, ping) == FIDO_ERR_INVALID_ARGUMENT);
+	empty(ping);
+	assert(fido_dev_ping(dev, MAX_LEN + 1, 10,
+	    ping) == FIDO_ERR_INVALID_ARGUMENT);
+	assert(fido_dev_ping(dev, 64, 0, ping) == FIDO_ERR_INVALID_ARGUMENT);
+	assert(fido_dev_ping(dev, 64, SIZE_MAX,
+	    ping) == FIDO_ERR_INVALID_ARGUMENT);
+
+	/* the device is still usable */
+	assert(fido_dev_ping(dev, 64, 1, ping) == FIDO_OK);
+	check(ping, 64, 1);
+
+	assert(fido_dev_close(dev) == FIDO_OK);
+	fido_ping_free(&ping);
+	fido_ping_free(&ping);
+	fido_ping_free(NULL);
+	fido_dev_free(&dev);
+	vdev_free(&v);
+}
+
+static void
+ping_fault(void)
+{
+	fido_dev_io_t		 io;
+	vdev_fault_cfg_t	 cfg;
+	vdev_t			*v;
+	vdev_fault_t		*f;
+	fido_dev_t		*dev;
+	fido_ping_t		*ping;
+
+	vdev_io(&io);
+	assert((v = vdev_new()) != NULL);
+	assert((f = vdev_fault_new(&io, vdev_path(v))) != NULL);
+	vdev_fault_io(&io);
+	assert((dev = fido_dev_new()) != NULL);
+	assert(fido_dev_set_io_functions(dev, &io) == FIDO_OK);
+	assert(fido_dev_open(dev, vdev_fault_path(f)) == FIDO_OK);
+	assert((ping = fido_ping_new()) != NULL);
+
+	/* keepalives are not replies */
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.keepalives = 4;
+	cfg.seed = 1;
+	vdev_fault_set(f, &cfg);
+	assert(fido_dev_ping(dev, 256, 10, ping) == FIDO_OK);
+	check(ping, 256, 10);
+
+	/* a corrupted echo fails the ping */
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.corrupt_pct = 100;
+	cfg.seed = 1;
+	vdev_fault_set(f, &cfg);
+	assert(fido_dev_ping(dev, 256, 10, ping) != FIDO_OK);
+	assert(fido_ping_count(ping) < 10);
+
+	fido_ping_free(&ping);
+	fido_dev_close(dev);
+	fido_dev_free(&dev);
+	vdev_fault_free(&f);
+	vdev_free(&v);
+}
+
+/* a wrapper around the virtual authenticator recording read timeouts */
+static struct {
+	fido_dev_io_t	io;
+	int		min_ms;
+	int		max_ms;
+	int		silent;
+	int		stall;
+} rec;
+
+static void *
+rec_open(const char *path)
+{
+	return (rec.io.open(path));
+}
+
+static void
+rec_close(void *handle)
+{
+	rec.io.close(handle);
+}
+
+static int
+rec_read(void *handle, unsigned char *buf, size_t len, int ms)
+{
+	if (ms < rec.min_ms)
+		rec.min_ms = ms;
+	if (ms > rec.max_ms)
+		rec.max_ms = ms;
+	if (rec.silent)
+		return (-1); /* as if the read had timed out */
+	if (rec.stall > 0 && --rec.stall == 0) {
+		struct timespec ts = { 0, 50 * 1000 * 1000 };
+		nanosleep(&ts, NULL);
+	}
+
+	return (rec.io.read(handle, buf, len, ms));
+}
+
+static int
+rec_write(void *handle, const unsigned char *buf, size_t len)
+{
+	return (rec.io.write(handle, buf, len));
+}
+
+static void
+rec_reset(void)
+{
+	rec.min_ms = INT_MAX;
+	rec.max_ms = INT_MIN;
+}
+
+static void
+ping_timeout(void)
+{
+	fido_dev_io_t	 io;
+	vdev_t		*v;
+	fido_dev_t	*dev;
+	fido_ping_t	*ping;
+
+	memset(&rec, 0, sizeof(rec));
+	vdev_io(&rec.io);
+	io.open = rec_open;
+	io.close = rec_close;
+	io.read = rec_read;
+	io.write = rec_write;
+	assert((v = vdev_new()) != NULL);
+	assert((dev = fido_dev_new()) != NULL);
+	assert(fido_dev_set_io_functions(dev, &io) == FIDO_OK);
+	assert(fido_dev_open(dev, vdev_path(v)) == FIDO_OK);
+	assert((ping = fido_ping_new()) != NULL);
+
+	assert(fido_ping_set_timeout(ping, 0) == FIDO_ERR_INVALID_ARGUMENT);
+	assert(fido_ping_set_timeout(ping, -2) == FIDO_ERR_INVALID_ARGUMENT);
+
+	/* finite by default */
+	rec_reset();
+	assert(fido_dev_ping(dev, 256, 10, ping) == FIDO_OK);
+	check(ping, 256, 10);
+	assert(rec.min_ms > 0 && rec.max_ms <= 5000);
+
+	/* a single slow round trip out of 100 is not the 99th percentile */
+	rec.stall = 50;
+	assert(fido_dev_ping(dev, 64, 100, ping) == FIDO_OK);
+	check(ping, 64, 100);
+	assert(rec.stall == 0);
+	assert(fido_ping_max_us(ping) >= 50000);
+	assert(fido_ping_p99_us(ping) < fido_ping_max_us(ping));
+
+	/* kept across calls */
+	assert(fido_ping_set_timeout(ping, 50) == FIDO_OK);
+	rec_reset();
+	assert(fido_dev_ping(dev, 256, 10, ping) == FIDO_OK);
+	assert(fido_dev_ping(dev, 64, 10, ping) == FIDO_OK);
+	check(ping, 64, 10);
+	assert(rec.min_ms > 0 && rec.max_ms <= 50);
+
+	/* a device not replying fails the ping */
+	rec.silent = 1;
+	rec_reset();
+	assert(fido_dev_ping(dev, 64, 10, ping) == FIDO_ERR_RX);
+	assert(fido_ping_count(ping) == 0);
+	assert(rec.min_ms > 0 && rec.max_ms <= 50);
+	rec.silent = 0;
+
+	assert(fido_ping_set_timeout(ping, -1) == FIDO_OK);
+	rec_reset();
+	assert(fido_dev_ping(dev, 64, 1, ping) == FIDO_OK);
+	assert(rec.min_ms == -1);
+
+	fido_ping_free(&ping);
+	fido_dev_close(dev);
+	fido_dev_free(&dev);
+	vdev_free(&v);
+}
+
+static void
+ping_report_len(void)
+{
+	fido_dev_io_t	 io;
+	vdev_t		*v;
+	fido_dev_t	*dev;
+	fido_ping_t	*ping;
+	uint64_t	 tx;
+	uint64_t	 rx;
+	uint64_t	 last = UINT64_MAX;
+	const size_t	 rpt_lens[] = { 64, 128, 512, 1024 };
+
+	vdev_io(&io);
+	assert((v = vdev_new()) != NULL);
+	assert((dev = fido_dev_new()) != NULL);
+	assert(fido_dev_set_io_functions(dev, &io) == FIDO_OK);
+	assert((ping = fido_ping_new()) != NULL);
+
+	assert(fido_dev_set_report_len(dev, 7, 64) ==
+	    FIDO_ERR_INVALID_ARGUMENT);
+	assert(fido_dev_set_report_len(dev, 64, 1025) ==
+	    FIDO_ERR_INVALID_ARGUMENT);
+	assert(vdev_set_report_len(v, 1025) < 0);
+
+	/* the authenticator and the library disagree */
+	assert(vdev_set_report_len(v, 128) == 0);
+	assert(fido_dev_open(dev, vdev_path(v)) != FIDO_OK);
+
+	for (size_t i = 0; i < sizeof(rpt_lens) / sizeof(rpt_lens[0]); i++) {
+		assert(vdev_set_report_len(v, rpt_lens[i]) == 0);
+		assert(vdev_report_len(v) == rpt_lens[i]);
+		assert(fido_dev_set_report_len(dev, rpt_lens[i],
+		    rpt_lens[i]) == FIDO_OK);
+		assert(fido_dev_open(dev, vdev_path(v)) == FIDO_OK);
+		assert(fido_dev_set_report_len(dev, 64, 64) ==
+		    FIDO_ERR_INVALID_ARGUMENT);
+
+		tx = value(dev, "frames_tx");
+		rx = value(dev, "frames_rx");
+		assert(fido_dev_ping(dev, MAX_LEN, 1, ping) == FIDO_OK);
+		check(ping, MAX_LEN, 1);
+		tx = value(dev, "frames_tx") - tx;
+		rx = value(dev, "frames_rx") - rx;
+		assert(tx == frames(MAX_LEN, rpt_lens[i]));
+		assert(rx == frames(MAX_LEN, rpt_lens[i]));
+		assert(tx < last);
+		last = tx;
+
+		for (size_t len = 1; len < 3 * rpt_lens[i]; len += 61) {
+			assert(fido_dev_ping(dev, len, 1, ping) == FIDO_OK);
+			check(ping, len, 1);
+		}
+
+		assert(fido_dev_close(dev) == FIDO_OK);
+	}
+
+	/* 1017 + 128 * 1019 bytes exceed a message length of 16 bits */
+	assert(fido_dev_open(dev, vdev_path(v)) == FIDO_OK);
+	assert(fido_dev_ping(dev, UINT16_MAX + 1, 1,
+	    ping) == FIDO_ERR_INVALID_ARGUMENT);
+	assert(fido_dev_close(dev) == FIDO_OK);
+
+	fido_ping_free(&ping);
+	fido_dev_free(&dev);
+	vdev_free(&v);
+}
+
+int
+main(void)
+{
+	fido_init(0);
+
+	ping_vdev();
+	ping_fault();
+	ping_timeout();
+	ping_report_len();
+
+	exit(0);
+}
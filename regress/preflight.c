@@ -0,0 +1,531 @@
+/*
+ * Copyright (c) 2020 Yubico AB. All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+#include <assert.h>
+#include <cbor.h>
+#include <fido.h>
+#include <string.h>
+
+#define FAKE_DEV_HANDLE	((void *)0xdeadbeef)
+#define REPORT_LEN	(64 + 1)
+#define FAKE_CID	0x0a0b0c0d
+#define ID_LEN		32
+#define NUM_IDS		10
+
+/*
+ * A scripted FIDO2 authenticator advertising limits on the allow list of
+ * getAssertion requests, and recognising a single credential id.
+ */
+struct fake_dev {
+	unsigned char	req[4096];
+	size_t		req_len;
+	size_t		req_got;
+	uint8_t		req_cmd;
+	unsigned char	rx[4096];
+	size_t		rx_len;
+	size_t		rx_off;
+	uint64_t	maxcredcntlst;
+	uint64_t	maxcredidlen;
+	int		ninfo;
+	int		nprobe;	/* up=false requests */
+	int		nup;	/* up=true/omitted requests */
+	size_t		maxlist; /* longest allow list received */
+	size_t		lastlist; /* allow list of the last request */
+	size_t		maxid;	/* longest credential id received */
+};
+
+static struct fake_dev fake;
+static unsigned char ids[NUM_IDS][ID_LEN];
+static const unsigned char *known_id;
+
+static const unsigned char cdh[32] = {
+	0xec, 0x8d, 0x8f, 0x78, 0x42, 0x4a, 0x2b, 0xb7,
+	0x82, 0x34, 0xaa, 0xca, 0x07, 0xa1, 0xf6, 0x56,
+	0x42, 0x1c, 0xb6, 0xf6, 0xb3, 0x00, 0x86, 0x52,
+	0x35, 0x2d, 0xa2, 0x62, 0x4a, 0xbe, 0x89, 0x76,
+};
+
+static void
+fake_reply(uint8_t cmd, const unsigned char *ptr, size_t len)
+{
+	/* CTAPHID_INIT is answered on the broadcast channel */
+	const uint32_t	cid = cmd == (CTAP_FRAME_INIT | CTAP_CMD_INIT) ?
+			    CTAP_CID_BROADCAST : FAKE_CID;
+	unsigned char	*frame;
+	size_t		 n;
+	uint8_t		 seq = 0;
+
+	fake.rx_len = 0;
+	fake.rx_off = 0;
+
+	do {
+		assert(fake.rx_len + 64 <= sizeof(fake.rx));
+		frame = &fake.rx[fake.rx_len];
+		memset(frame, 0, 64);
+		memcpy(frame, &cid, sizeof(cid));
+		if (fake.rx_len == 0) {
+			frame[4] = cmd;
+			frame[5] = (len >> 8) & 0xff;
+			frame[6] = len & 0xff;
+			n = len < 57 ? len : 57;
+			memcpy(&frame[7], ptr, n);
+		} else {
+			frame[4] = seq++;
+			n = len < 59 ? len : 59;
+			memcpy(&frame[5], ptr, n);
+		}
+		ptr += n;
+		len -= n;
+		fake.rx_len += 64;
+	} while (len > 0);
+}
+
+static void
+fake_cbor_reply(uint8_t status, cbor_item_t *item)
+{
+	const uint8_t	 cmd = CTAP_FRAME_INIT | CTAP_CMD_CBOR;
+	unsigned char	 buf[1024];
+	unsigned char	*ptr = NULL;
+	size_t		 len = 0;
+	size_t		 alloc_len;
+
+	buf[0] = status;
+	if (item != NULL) {
+		assert((len = cbor_serialize_alloc(item, &ptr,
+		    &alloc_len)) > 0);
+		assert(len < sizeof(buf));
+		memcpy(&buf[1], ptr, len);
+		free(ptr);
+	}
+
+	fake_reply(cmd, buf, len + 1);
+}
+
+static void
+fake_map_add(cbor_item_t *map, cbor_item_t *key, cbor_item_t *val)
+{
+	struct cbor_pair pair;
+
+	assert(key != NULL && val != NULL);
+	pair.key = cbor_move(key);
+	pair.value = cbor_move(val);
+	assert(cbor_map_add(map, pair));
+}
+
+static void
+fake_get_info(void)
+{
+	cbor_item_t *info;
+	cbor_item_t *versions;
+
+	fake.ninfo++;
+
+	assert((info = cbor_new_definite_map(4)) != NULL);
+	assert((versions = cbor_new_definite_array(1)) != NULL);
+	assert(cbor_array_push(versions, cbor_move(cbor_build_string(
+	    "FIDO_2_0"))));
+	fake_map_add(info, cbor_build_uint8(1), versions);
+	fake_map_add(info, cbor_build_uint8(5), cbor_build_uint16(1200));
+	fake_map_add(info, cbor_build_uint8(7),
+	    cbor_build_uint64(fake.maxcredcntlst));
+	fake_map_add(info, cbor_build_uint8(8),
+	    cbor_build_uint64(fake.maxcredidlen));
+	fake_cbor_reply(0, info);
+	cbor_decref(&info);
+}
+
+static bool
+fake_allow_list(const cbor_item_t *list)
+{
+	cbor_item_t	**v;
+	struct cbor_pair *pair;
+	bool		  found = false;
+
+	assert(cbor_isa_array(list));
+	v = cbor_array_handle(list);
+	fake.lastlist = cbor_array_size(list);
+	if (fake.lastlist > fake.maxlist)
+		fake.maxlist = fake.lastlist;
+
+	for (size_t i = 0; i < cbor_array_size(list); i++) {
+		assert(cbor_isa_map(v[i]));
+		pair = cbor_map_handle(v[i]);
+		for (size_t j = 0; j < cbor_map_size(v[i]); j++) {
+			const cbor_item_t *id = pair[j].value;
+			if (cbor_isa_bytestring(id) == false)
+				continue;
+			if (cbor_bytestring_length(id) > fake.maxid)
+				fake.maxid = cbor_bytestring_length(id);
+			if (cbor_bytestring_length(id) == ID_LEN &&
+			    memcmp(cbor_bytestring_handle(id), known_id,
+			    ID_LEN) == 0)
+				found = true;
+		}
+	}
+
+	return (found);
+}
+
+static bool
+fake_up(const cbor_item_t *opt)
+{
+	struct cbor_pair *pair;
+
+	assert(cbor_isa_map(opt));
+	pair = cbor_map_handle(opt);
+
+	for (size_t i = 0; i < cbor_map_size(opt); i++)
+		if (cbor_string_length(pair[i].key) == 2 &&
+		    memcmp(cbor_string_handle(pair[i].key), "up", 2) == 0)
+			return (cbor_ctrl_value(pair[i].value) ==
+			    CBOR_CTRL_TRUE);
+
+	return (true);
+}
+
+static void
+fake_get_assert(void)
+{
+	struct cbor_load_result	 cbor;
+	cbor_item_t		*req;
+	cbor_item_t		*reply;
+	cbor_item_t		*cred;
+	struct cbor_pair	*pair;
+	unsigned char		 authdata[37];
+	bool			 found = false;
+	bool			 up = true;
+
+	assert((req = cbor_load(&fake.req[1], fake.req_len - 1,
+	    &cbor)) != NULL);
+	assert(cbor_isa_map(req));
+	pair = cbor_map_handle(req);
+
+	for (size_t i = 0; i < cbor_map_size(req); i++) {
+		switch (cbor_get_int(pair[i].key)) {
+		case 3: /* allowList */
+			found = fake_allow_list(pair[i].value);
+			break;
+		case 5: /* options */
+			up = fake_up(pair[i].value);
+			break;
+		}
+	}
+
+	cbor_decref(&req);
+
+	if (up)
+		fake.nup++;
+	else
+		fake.nprobe++;
+
+	if (found == false) {
+		fake_cbor_reply(0x2e, NULL); /* CTAP2_ERR_NO_CREDENTIALS */
+		return;
+	}
+
+	memset(authdata, 0, sizeof(authdata));
+	authdata[32] = up ? CTAP_AUTHDATA_USER_PRESENT : 0;
+	authdata[36] = 42; /* counter */
+
+	assert((reply = cbor_new_definite_map(3)) != NULL);
+	assert((cred = cbor_new_definite_map(2)) != NULL);
+	fake_map_add(cred, cbor_build_string("id"),
+	    cbor_build_bytestring(known_id, ID_LEN));
+	fake_map_add(cred, cbor_build_string("type"),
+	    cbor_build_string("public-key"));
+	fake_map_add(reply, cbor_build_uint8(1), cred);
+	fake_map_add(reply, cbor_build_uint8(2),
+	    cbor_build_bytestring(authdata, sizeof(authdata)));
+	fake_map_add(reply, cbor_build_uint8(3),
+	    cbor_build_bytestring((const unsigned char *)"sig", 3));
+	fake_cbor_reply(0, reply);
+	cbor_decref(&reply);
+}
+
+static void
+fake_init(void)
+{
+	const uint32_t	cid = FAKE_CID;
+	unsigned char	attr[17];
+
+	assert(fake.req_len == 8);
+
+	memset(attr, 0, sizeof(attr));
+	memcpy(attr, fake.req, 8);		/* nonce */
+	memcpy(&attr[8], &cid, sizeof(cid));	/* cid */
+	attr[12] = 2;				/* protocol */
+	attr[16] = FIDO_CAP_CBOR;		/* fido2 */
+
+	fake_reply(CTAP_FRAME_INIT | CTAP_CMD_INIT, attr, sizeof(attr));
+}
+
+static void *
+fake_open(const char *path)
+{
+	(void)path;
+
+	return (FAKE_DEV_HANDLE);
+}
+
+static void
+fake_close(void *handle)
+{
+	assert(handle == FAKE_DEV_HANDLE);
+}
+
+static int
+fake_read(void *handle, unsigned char *ptr, size_t len, int ms)
+{
+	(void)ms;
+
+	assert(handle == FAKE_DEV_HANDLE);
+	assert(len == 64);
+
+	if (fake.rx_off >= fake.rx_len)
+		return (-1);
+
+	memcpy(ptr, &fake.rx[fake.rx_off], len);
+	fake.rx_off += len;
+
+	return ((int)len);
+}
+
+static int
+fake_write(void *handle, const unsigned char *ptr, size_t len)
+{
+	const unsigned char	*frame = ptr + 1;
+	size_t			 n;
+
+	assert(handle == FAKE_DEV_HANDLE);
+	assert(len == REPORT_LEN);
+
+	if (frame[4] & CTAP_FRAME_INIT) {
+		fake.req_cmd = frame[4];
+		fake.req_len = (size_t)((frame[5] << 8) | frame[6]);
+		fake.req_got = 0;
+		assert(fake.req_len <= sizeof(fake.req));
+		n = fake.req_len < 57 ? fake.req_len : 57;
+		memcpy(fake.req, &frame[7], n);
+	} else {
+		n = fake.req_len - fake.req_got;
+		n = n < 59 ? n : 59;
+		memcpy(&fake.req[fake.req_got], &frame[5], n);
+	}
+
+	if ((fake.req_got += n) < fake.req_len)
+		return ((int)len);
+
+	switch (fake.req_cmd) {
+	case CTAP_FRAME_INIT | CTAP_CMD_INIT:
+		fake_init();
+		break;
+	case CTAP_FRAME_INIT | CTAP_CMD_CBOR:
+		assert(fake.req_len > 0);
+		if (fake.req[0] == CTAP_CBOR_GETINFO)
+			fake_get_info();
+		else if (fake.req[0] == CTAP_CBOR_ASSERT)
+			fake_get_assert();
+		else
+			abort();
+		break;
+	default:
+		abort();
+	}
+
+	return ((int)len);
+}
+
+static fido_dev_t *
+open_dev(uint64_t maxcredcntlst, uint64_t maxcredidlen, bool preflight)
+{
+	fido_dev_t	*dev;
+	fido_dev_io_t	 io;
+
+	io.open = fake_open;
+	io.close = fake_close;
+	io.read = fake_read;
+	io.write = fake_write;
+
+	memset(&fake, 0, sizeof(fake));
+	fake.maxcredcntlst = maxcredcntlst;
+	fake.maxcredidlen = maxcredidlen;
+
+	assert((dev = fido_dev_new()) != NULL);
+	assert(fido_dev_set_io_functions(dev, &io) == FIDO_OK);
+	assert(fido_dev_set_preflight(dev, preflight) == FIDO_OK);
+	assert(fido_dev_open(dev, "fake") == FIDO_OK);
+	assert(fido_dev_is_fido2(dev) == true);
+
+	return (dev);
+}
+
+static void
+close_dev(fido_dev_t **dev)
+{
+	assert(fido_dev_close(*dev) == FIDO_OK);
+	fido_dev_free(dev);
+}
+
+static fido_assert_t *
+new_assert(size_t n)
+{
+	fido_assert_t *a;
+
+	assert((a = fido_assert_new()) != NULL);
+	assert(fido_assert_set_clientdata_hash(a, cdh, sizeof(cdh)) == FIDO_OK);
+	assert(fido_assert_set_rp(a, "localhost") == FIDO_OK);
+	for (size_t i = 0; i < n; i++)
+		assert(fido_assert_allow_cred(a, ids[i], ID_LEN) == FIDO_OK);
+
+	return (a);
+}
+
+static void
+check_assert(const fido_assert_t *a)
+{
+	assert(fido_assert_count(a) == 1);
+	assert(fido_assert_id_len(a, 0) == ID_LEN);
+	assert(memcmp(fido_assert_id_ptr(a, 0), known_id, ID_LEN) == 0);
+	assert(fido_assert_flags(a, 0) & CTAP_AUTHDATA_USER_PRESENT);
+	assert(fido_assert_sigcount(a, 0) == 42);
+}
+
+/* the whole list is sent in one request unless preflight is enabled */
+static void
+no_preflight(void)
+{
+	fido_dev_t	*dev;
+	fido_assert_t	*a;
+
+	dev = open_dev(4, 0, false);
+	a = new_assert(NUM_IDS);
+	known_id = ids[NUM_IDS - 1];
+
+	assert(fido_dev_get_assert(dev, a, NULL) == FIDO_OK);
+	check_assert(a);
+	assert(fake.ninfo == 0);
+	assert(fake.nprobe == 0);
+	assert(fake.nup == 1);
+	assert(fake.maxlist == NUM_IDS);
+
+	fido_assert_free(&a);
+	close_dev(&dev);
+}
+
+/* lists within the device's limits are sent as they are */
+static void
+fits(void)
+{
+	fido_dev_t	*dev;
+	fido_assert_t	*a;
+
+	dev = open_dev(4, 0, true);
+	a = new_assert(3);
+	known_id = ids[1];
+
+	assert(fido_dev_get_assert(dev, a, NULL) == FIDO_OK);
+	check_assert(a);
+	assert(fake.ninfo == 1);
+	assert(fake.nprobe == 0);
+	assert(fake.nup == 1);
+	assert(fake.lastlist == 3);
+
+	fido_assert_free(&a);
+	close_dev(&dev);
+}
+
+/* large lists are probed in chunks, and the user is asked once */
+static void
+chunked(void)
+{
+	fido_dev_t	*dev;
+	fido_assert_t	*a;
+
+	dev = open_dev(4, 0, true);
+	a = new_assert(NUM_IDS);
+	known_id = ids[NUM_IDS - 1];
+
+	assert(fido_dev_get_assert(dev, a, NULL) == FIDO_OK);
+	check_assert(a);
+	assert(fake.nprobe == 3); /* 4 + 4 + 2 */
+	assert(fake.nup == 1);
+	assert(fake.maxlist == 4);
+	assert(fake.lastlist == 1);
+
+	/* the allow list is left untouched; getInfo is not repeated */
+	known_id = ids[0];
+	fake.nprobe = 0;
+	fake.nup = 0;
+	assert(fido_dev_get_assert(dev, a, NULL) == FIDO_OK);
+	check_assert(a);
+	assert(fake.nprobe == 1);
+	assert(fake.nup == 1);
+	assert(fake.ninfo == 1);
+
+	fido_assert_free(&a);
+	close_dev(&dev);
+}
+
+/* no user presence is requested if no credential is recognised */
+static void
+unknown(void)
+{
+	static const unsigned char	 other[ID_LEN];
+	fido_dev_t			*dev;
+	fido_assert_t			*a;
+
+	dev = open_dev(4, 0, true);
+	a = new_assert(NUM_IDS);
+	known_id = other;
+
+	assert(fido_dev_get_assert(dev, a, NULL) == FIDO_ERR_NO_CREDENTIALS);
+	assert(fake.nprobe == 3);
+	assert(fake.nup == 0);
+
+	fido_assert_free(&a);
+	close_dev(&dev);
+}
+
+/* ids longer than maxCredentialIdLength are never sent */
+static void
+long_id(void)
+{
+	unsigned char	 big[ID_LEN * 2];
+	fido_dev_t	*dev;
+	fido_assert_t	*a;
+
+	dev = open_dev(0, ID_LEN, true);
+	a = new_assert(2);
+	memset(big, 0xff, sizeof(big));
+	assert(fido_assert_allow_cred(a, big, sizeof(big)) == FIDO_OK);
+	known_id = ids[1];
+
+	assert(fido_dev_get_assert(dev, a, NULL) == FIDO_OK);
+	check_assert(a);
+	assert(fake.nprobe == 1);
+	assert(fake.nup == 1);
+	assert(fake.maxid == ID_LEN);
+
+	fido_assert_free(&a);
+	close_dev(&dev);
+}
+
+int
+main(void)
+{
+	fido_init(0);
+
+	for (size_t i = 0; i < NUM_IDS; i++)
+		memset(ids[i], (int)i + 1, ID_LEN);
+
+	no_preflight();
+	fits();
+	chunked();
+	unknown();
+	long_id();
+
+	exit(0);
+}
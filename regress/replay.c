@@ -0,0 +1,250 @@
+/*
+ * Copyright (c) 2020 Yubico AB. All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+/*
+ * Record a session with a virtual authenticator and play it back
+ * through a "replay:" device path.
+ */
+
+#include <assert.h>
+#include <fido.h>
+#include <fido/es256.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../virtual/vdev.h"
+
+#define DELAY_MS	5
+
+static const unsigned char cdh[32] = {
+	0xec, 0x8d, 0x8f, 0x78, 0x42, 0x4a, 0x2b, 0xb7,
+	0x82, 0x34, 0xaa, 0xca, 0x07, 0xa1, 0xf6, 0x56,
+	0x42, 0x1c, 0xb6, 0xf6, 0xb3, 0x00, 0x86, 0x52,
+	0x35, 0x2d, 0xa2, 0x62, 0x4a, 0xbe, 0x89, 0x76,
+};
+
+static const unsigned char user_id[] = { 0x01, 0x02, 0x03, 0x04 };
+
+static fido_dev_io_t	vdev_frame_io;
+static size_t		n_read;
+
+/* a slow device */
+static int
+delay_read(void *handle, unsigned char *buf, size_t len, int ms)
+{
+	struct timespec ts = { 0, DELAY_MS * 1000000L };
+
+	n_read++;
+	nanosleep(&ts, NULL);
+
+	return (vdev_frame_io.read(handle, buf, len, ms));
+}
+
+static double
+now_ms(void)
+{
+	struct timespec ts;
+
+	assert(clock_gettime(CLOCK_MONOTONIC, &ts) == 0);
+
+	return (ts.tv_sec * 1e3 + ts.tv_nsec / 1e6);
+}
+
+/*
+ * A fixed conversation: getInfo, makeCredential and getAssertion. The
+ * credential id is returned.
+ */
+static void
+session(fido_dev_t *dev, unsigned char *id, size_t *id_len)
+{
+	fido_cbor_info_t	*ci;
+	fido_cred_t		*cred;
+	fido_assert_t		*assert;
+	es256_pk_t		*pk;
+
+	assert((ci = fido_cbor_info_new()) != NULL);
+	assert(fido_dev_get_cbor_info(dev, ci) == FIDO_OK);
+	assert(fido_cbor_info_versions_len(ci) > 0);
+	fido_cbor_info_free(&ci);
+
+	assert((cred = fido_cred_new()) != NULL);
+	assert(fido_cred_set_type(cred, COSE_ES256) == FIDO_OK);
+	assert(fido_cred_set_clientdata_hash(cred, cdh,
+	    sizeof(cdh)) == FIDO_OK);
+	assert(fido_cred_set_rp(cred, "example.org", NULL) == FIDO_OK);
+	assert(fido_cred_set_user(cred, user_id, sizeof(user_id), "jsmith",
+	    NULL, NULL) == FIDO_OK);
+	assert(fido_dev_make_cred(dev, cred, NULL) == FIDO_OK);
+	assert(fido_cred_verify(cred) == FIDO_OK);
+
+	assert((assert = fido_assert_new()) != NULL);
+	assert(fido_assert_set_rp(assert, "example.org") == FIDO_OK);
+	assert(fido_assert_set_clientdata_hash(assert, cdh,
+	    sizeof(cdh)) == FIDO_OK);
+	assert(fido_assert_allow_cred(assert, fido_cred_id_ptr(cred),
+	    fido_cred_id_len(cred)) == FIDO_OK);
+	assert(fido_dev_get_assert(dev, assert, NULL) == FIDO_OK);
+	assert(fido_assert_count(assert) == 1);
+
+	assert((pk = es256_pk_new()) != NULL);
+	assert(es256_pk_from_ptr(pk, fido_cred_pubkey_ptr(cred),
+	    fido_cred_pubkey_len(cred)) == FIDO_OK);
+	assert(fido_assert_verify(assert, 0, COSE_ES256, pk) == FIDO_OK);
+
+	assert(fido_cred_id_len(cred) <= *id_len);
+	*id_len = fido_cred_id_len(cred);
+	memcpy(id, fido_cred_id_ptr(cred), *id_len);
+
+	es256_pk_free(&pk);
+	fido_assert_free(&assert);
+	fido_cred_free(&cred);
+}
+
+static void
+record(vdev_t *v, const char *file, unsigned char *id, size_t *id_len)
+{
+	fido_dev_io_t	 io;
+	fido_dev_t	*dev;
+
+	vdev_io(&vdev_frame_io);
+	io = vdev_frame_io;
+	io.read = delay_read;
+
+	assert((dev = fido_dev_new()) != NULL);
+	assert(fido_dev_set_io_functions(dev, &io) == FIDO_OK);
+	assert(fido_dev_set_record(dev, file) == FIDO_OK);
+	assert(fido_dev_open(dev, vdev_path(v)) == FIDO_OK);
+	assert(fido_dev_set_record(dev, NULL) == FIDO_ERR_INVALID_ARGUMENT);
+	session(dev, id, id_len);
+	assert(fido_dev_close(dev) == FIDO_OK);
+	fido_dev_free(&dev);
+}
+
+static double
+replay(const char *path, double scale, const unsigned char *id,
+    size_t id_len)
+{
+	fido_dev_t	*dev;
+	fido_cbor_info_t *ci;
+	unsigned char	 replay_id[1024];
+	size_t		 replay_id_len = sizeof(replay_id);
+	double		 t0;
+	double		 t;
+
+	assert((dev = fido_dev_new()) != NULL);
+	assert(fido_dev_set_replay_scale(dev, scale) == FIDO_OK);
+
+	t0 = now_ms();
+	assert(fido_dev_open(dev, path) == FIDO_OK);
+	assert(fido_dev_is_fido2(dev));
+	session(dev, replay_id, &replay_id_len);
+	t = now_ms() - t0;
+
+	assert(replay_id_len == id_len);
+	assert(memcmp(replay_id, id, id_len) == 0);
+
+	/* the recording is over */
+	assert((ci = fido_cbor_info_new()) != NULL);
+	assert(fido_dev_get_cbor_info(dev, ci) != FIDO_OK);
+	fido_cbor_info_free(&ci);
+
+	assert(fido_dev_close(dev) == FIDO_OK);
+	fido_dev_free(&dev);
+
+	return (t);
+}
+
+/* requests not matching the recording are refused */
+static void
+diverge(const char *path)
+{
+	fido_dev_t *dev;
+
+	assert((dev = fido_dev_new()) != NULL);
+	assert(fido_dev_set_replay_scale(dev, -1) ==
+	    FIDO_ERR_INVALID_ARGUMENT);
+	assert(fido_dev_set_replay_scale(dev, 0) == FIDO_OK);
+	assert(fido_dev_open(dev, path) == FIDO_OK);
+	assert(fido_dev_cancel(dev) == FIDO_ERR_TX);
+	assert(fido_dev_close(dev) == FIDO_OK);
+
+	assert(fido_dev_open(dev, "replay:/nonexistent") ==
+	    FIDO_ERR_INTERNAL);
+	fido_dev_free(&dev);
+}
+
+/* a recording keeps the report lengths of the device */
+static void
+long_reports(const char *file, const char *path)
+{
+	vdev_t		*v;
+	fido_dev_io_t	 io;
+	fido_dev_t	*dev;
+	unsigned char	 id[1024];
+	size_t		 id_len = sizeof(id);
+
+	assert((v = vdev_new()) != NULL);
+	assert(vdev_set_report_len(v, 128) == 0);
+	vdev_io(&io);
+
+	assert((dev = fido_dev_new()) != NULL);
+	assert(fido_dev_set_io_functions(dev, &io) == FIDO_OK);
+	assert(fido_dev_set_report_len(dev, 128, 128) == FIDO_OK);
+	assert(fido_dev_set_record(dev, file) == FIDO_OK);
+	assert(fido_dev_open(dev, vdev_path(v)) == FIDO_OK);
+	session(dev, id, &id_len);
+	assert(fido_dev_close(dev) == FIDO_OK);
+	fido_dev_free(&dev);
+	vdev_free(&v);
+
+	assert((dev = fido_dev_new()) != NULL);
+	assert(fido_dev_open(dev, path) == FIDO_OK);
+	assert(fido_dev_report_in_len(dev) == 128);
+	assert(fido_dev_report_out_len(dev) == 128);
+	assert(fido_dev_close(dev) == FIDO_OK);
+	fido_dev_free(&dev);
+
+	replay(path, 0, id, id_len);
+}
+
+int
+main(void)
+{
+	vdev_t		*v;
+	char		 file[] = "/tmp/regress_replay.XXXXXX";
+	char		 path[64];
+	unsigned char	 id[1024];
+	size_t		 id_len = sizeof(id);
+	double		 fast;
+	double		 slow;
+	int		 fd;
+
+	fido_init(0);
+
+	assert((fd = mkstemp(file)) >= 0);
+	close(fd);
+	snprintf(path, sizeof(path), "replay:%s", file);
+
+	assert((v = vdev_new()) != NULL);
+	record(v, file, id, &id_len);
+	vdev_free(&v);
+
+	/* no delays, then the recorded ones */
+	fast = replay(path, 0, id, id_len);
+	slow = replay(path, 1, id, id_len);
+	assert(slow >= 0.9 * DELAY_MS * n_read);
+	assert(fast < slow);
+
+	diverge(path);
+	long_reports(file, path);
+
+	assert(unlink(file) == 0);
+
+	exit(0);
+}
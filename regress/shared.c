@@ -0,0 +1,510 @@
+/*
+ * Copyright (c) 2020 Yubico AB. All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+#include <assert.h>
+#include <fido.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "../virtual/vdev.h"
+
+#define FAKE_DEV_HANDLE	((void *)0xdeadbeef)
+#define REPORT_LEN	(64 + 1)
+#define FIRST_CID	0x0a0b0c00
+#define MAX_FRAMES	160
+#define PING_LEN	7000	/* more than 64 frames */
+#define SHORT_PING_LEN	16	/* a single frame */
+#define NROUNDS		4
+#define TIMEOUT_MS	100
+
+/*
+ * A scripted authenticator accessed from several threads. Each
+ * CTAPHID_INIT on the broadcast channel allocates a new channel. Like a
+ * real authenticator, it handles one transaction at a time: a request
+ * must not arrive before the reply to the previous one has been read,
+ * except for single-frame CTAPHID_INIT, CTAPHID_PING and getInfo
+ * requests while a reset waits for user presence, which is signalled
+ * with keepalives. Replies are read slowly, to give other threads a
+ * chance to break that rule.
+ */
+struct fake_dev {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	int		nopen;
+	uint32_t	next_cid;
+	unsigned char	req[8192];
+	size_t		req_len;
+	size_t		req_got;
+	uint32_t	req_cid;
+	uint8_t		req_cmd;
+	unsigned char	rx[MAX_FRAMES][64];
+	size_t		rx_len;
+	int		ninfo;
+	int		nping;
+	uint32_t	up_cid;	/* reset waiting for user presence */
+};
+
+static struct fake_dev fake = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.next_cid = FIRST_CID,
+};
+
+/* status + { 1: [ "FIDO_2_0" ] } */
+static const unsigned char info_reply[] = {
+	0x00, 0xa1, 0x01, 0x81, 0x68, 0x46, 0x49, 0x44,
+	0x4f, 0x5f, 0x32, 0x5f, 0x30,
+};
+
+/* called with fake.lock held */
+static void
+fake_reply(uint32_t cid, uint8_t cmd, const unsigned char *ptr, size_t len)
+{
+	unsigned char	*frame;
+	size_t		 n;
+	uint8_t		 seq = 0;
+	bool		 first = true;
+
+	do {
+		assert(fake.rx_len < MAX_FRAMES);
+		frame = fake.rx[fake.rx_len++];
+		memset(frame, 0, 64);
+		memcpy(frame, &cid, sizeof(cid));
+		if (first) {
+			frame[4] = cmd;
+			frame[5] = (len >> 8) & 0xff;
+			frame[6] = len & 0xff;
+			n = len < 57 ? len : 57;
+			memcpy(&frame[7], ptr, n);
+			first = false;
+		} else {
+			frame[4] = seq++;
+			n = len < 59 ? len : 59;
+			memcpy(&frame[5], ptr, n);
+		}
+		ptr += n;
+		len -= n;
+	} while (len > 0);
+
+	pthread_cond_broadcast(&fake.cond);
+}
+
+/* called with fake.lock held */
+static void
+fake_msg(void)
+{
+	const uint8_t	cbor = CTAP_FRAME_INIT | CTAP_CMD_CBOR;
+	unsigned char	attr[17];
+	uint32_t	cid;
+
+	switch (fake.req_cmd) {
+	case CTAP_FRAME_INIT | CTAP_CMD_INIT:
+		assert(fake.req_cid == CTAP_CID_BROADCAST);
+		assert(fake.req_len == 8);
+		cid = fake.next_cid++;
+		memset(attr, 0, sizeof(attr));
+		memcpy(attr, fake.req, 8);		/* nonce */
+		memcpy(&attr[8], &cid, sizeof(cid));	/* cid */
+		attr[12] = 2;				/* protocol */
+		attr[16] = FIDO_CAP_CBOR;
+		fake_reply(CTAP_CID_BROADCAST, fake.req_cmd, attr,
+		    sizeof(attr));
+		break;
+	case CTAP_FRAME_INIT | CTAP_CMD_CBOR:
+		assert(fake.req_len == 1);
+		if (fake.req[0] == CTAP_CBOR_RESET) {
+			assert(fake.up_cid == 0);
+			fake.up_cid = fake.req_cid;
+			break;
+		}
+		assert(fake.req[0] == CTAP_CBOR_GETINFO);
+		fake.ninfo++;
+		fake_reply(fake.req_cid, cbor, info_reply, sizeof(info_reply));
+		break;
+	case CTAP_FRAME_INIT | CTAP_CMD_PING:
+		assert(fake.req_len == PING_LEN ||
+		    fake.req_len == SHORT_PING_LEN);
+		fake.nping++;
+		fake_reply(fake.req_cid, fake.req_cmd, fake.req, fake.req_len);
+		break;
+	case CTAP_FRAME_INIT | CTAP_CMD_CANCEL:
+		break;
+	default:
+		abort();
+	}
+}
+
+/* the user touches the authenticator; called with fake.lock held */
+static void
+fake_touch(void)
+{
+	const unsigned char ok = 0;
+
+	assert(fake.up_cid != 0);
+	fake_reply(fake.up_cid, CTAP_FRAME_INIT | CTAP_CMD_CBOR, &ok,
+	    sizeof(ok));
+	fake.up_cid = 0;
+}
+
+static void *
+fake_open(const char *path)
+{
+	(void)path;
+
+	pthread_mutex_lock(&fake.lock);
+	fake.nopen++;
+	pthread_mutex_unlock(&fake.lock);
+
+	return (FAKE_DEV_HANDLE);
+}
+
+static void
+fake_close(void *handle)
+{
+	assert(handle == FAKE_DEV_HANDLE);
+
+	pthread_mutex_lock(&fake.lock);
+	fake.nopen--;
+	pthread_mutex_unlock(&fake.lock);
+}
+
+static int
+fake_read(void *handle, unsigned char *ptr, size_t len, int ms)
+{
+	const struct timespec	delay = { 0, 100000 };
+	const struct timespec	up_delay = { 0, 5000000 };
+	const unsigned char	upneeded = 2;
+	struct timespec		ts;
+	int			r = -1;
+
+	assert(handle == FAKE_DEV_HANDLE);
+	assert(len == 64);
+
+	nanosleep(&delay, NULL);
+
+	/* keepalives while waiting for the user */
+	pthread_mutex_lock(&fake.lock);
+	if (fake.rx_len == 0 && fake.up_cid != 0) {
+		pthread_mutex_unlock(&fake.lock);
+		nanosleep(&up_delay, NULL);
+		pthread_mutex_lock(&fake.lock);
+		if (fake.rx_len == 0 && fake.up_cid != 0)
+			fake_reply(fake.up_cid, CTAP_FRAME_INIT |
+			    CTAP_KEEPALIVE, &upneeded, sizeof(upneeded));
+	}
+	pthread_mutex_unlock(&fake.lock);
+
+	assert(clock_gettime(CLOCK_REALTIME, &ts) == 0);
+	if (ms >= 0) {
+		ts.tv_sec += ms / 1000;
+		ts.tv_nsec += (long)(ms % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+	}
+
+	pthread_mutex_lock(&fake.lock);
+	while (fake.rx_len == 0) {
+		if (ms < 0)
+			pthread_cond_wait(&fake.cond, &fake.lock);
+		else if (pthread_cond_timedwait(&fake.cond, &fake.lock,
+		    &ts) != 0)
+			goto out;
+	}
+	memcpy(ptr, fake.rx[0], len);
+	memmove(fake.rx[0], fake.rx[1], --fake.rx_len * sizeof(fake.rx[0]));
+	r = (int)len;
+out:
+	pthread_mutex_unlock(&fake.lock);
+
+	return (r);
+}
+
+/* requests allowed while waiting for user presence */
+static bool
+fake_short(const unsigned char *frame)
+{
+	size_t bcnt = (size_t)((frame[5] << 8) | frame[6]);
+
+	switch (frame[4]) {
+	case CTAP_FRAME_INIT | CTAP_CMD_INIT:
+	case CTAP_FRAME_INIT | CTAP_CMD_CANCEL:
+		return (true);
+	case CTAP_FRAME_INIT | CTAP_CMD_PING:
+		return (bcnt <= 57);
+	case CTAP_FRAME_INIT | CTAP_CMD_CBOR:
+		return (bcnt == 1 && frame[7] == CTAP_CBOR_GETINFO);
+	default:
+		return (false);
+	}
+}
+
+static int
+fake_write(void *handle, const unsigned char *ptr, size_t len)
+{
+	const unsigned char	*frame = ptr + 1;
+	uint32_t		 cid;
+	size_t			 n;
+
+	assert(handle == FAKE_DEV_HANDLE);
+	assert(len == REPORT_LEN);
+
+	memcpy(&cid, frame, sizeof(cid));
+
+	pthread_mutex_lock(&fake.lock);
+
+	if (frame[4] & CTAP_FRAME_INIT) {
+		/* messages must not be interleaved */
+		assert(fake.req_got == fake.req_len);
+		/* nor sent while a reply is pending, unless short */
+		assert(fake.rx_len == 0 || fake.up_cid != 0);
+		assert(fake.up_cid == 0 || fake_short(frame));
+		fake.req_cid = cid;
+		fake.req_cmd = frame[4];
+		fake.req_len = (size_t)((frame[5] << 8) | frame[6]);
+		fake.req_got = 0;
+		assert(fake.req_len <= sizeof(fake.req));
+		n = fake.req_len < 57 ? fake.req_len : 57;
+		memcpy(fake.req, &frame[7], n);
+	} else {
+		assert(cid == fake.req_cid);
+		n = fake.req_len - fake.req_got;
+		n = n < 59 ? n : 59;
+		memcpy(&fake.req[fake.req_got], &frame[5], n);
+	}
+
+	if ((fake.req_got += n) == fake.req_len)
+		fake_msg();
+
+	pthread_mutex_unlock(&fake.lock);
+
+	return ((int)len);
+}
+
+static void *
+session(void *arg)
+{
+	fido_dev_shared_t	*sh = arg;
+	fido_dev_t		*dev;
+	fido_cbor_info_t	*ci;
+	fido_ping_t		*ping;
+
+	assert((dev = fido_dev_new()) != NULL);
+	assert((ping = fido_ping_new()) != NULL);
+	assert(fido_dev_open_shared(dev, sh) == FIDO_OK);
+	assert(fido_dev_is_fido2(dev) == true);
+
+	for (int i = 0; i < NROUNDS; i++) {
+		assert((ci = fido_cbor_info_new()) != NULL);
+		assert(fido_dev_get_cbor_info(dev, ci) == FIDO_OK);
+		assert(fido_cbor_info_versions_len(ci) == 1);
+		assert(strcmp(fido_cbor_info_versions_ptr(ci)[0],
+		    "FIDO_2_0") == 0);
+		fido_cbor_info_free(&ci);
+		assert(fido_dev_ping(dev, PING_LEN, 1, ping) == FIDO_OK);
+		assert(fido_ping_count(ping) == 1);
+	}
+
+	assert(fido_dev_close(dev) == FIDO_OK);
+	fido_dev_free(&dev);
+	fido_ping_free(&ping);
+
+	return (NULL);
+}
+
+/*
+ * Two sessions issue requests concurrently, some with replies longer
+ * than 64 frames. Their transactions must not overlap.
+ */
+static void
+concurrent_sessions(void)
+{
+	fido_dev_shared_t	*sh;
+	fido_dev_t		*dev;
+	fido_dev_io_t		 io;
+	pthread_t		 thread;
+
+	io.open = fake_open;
+	io.close = fake_close;
+	io.read = fake_read;
+	io.write = fake_write;
+
+	assert((sh = fido_dev_shared_new()) != NULL);
+	assert(fido_dev_shared_set_io_functions(sh, &io) == FIDO_OK);
+	assert((dev = fido_dev_new()) != NULL);
+	assert(fido_dev_open_shared(dev, sh) == FIDO_ERR_INVALID_ARGUMENT);
+	assert(fido_dev_shared_close(sh) == FIDO_ERR_INVALID_ARGUMENT);
+	assert(fido_dev_shared_open(sh, "fake") == FIDO_OK);
+	assert(fido_dev_shared_open(sh, "fake") == FIDO_ERR_INVALID_ARGUMENT);
+	assert(fido_dev_shared_set_io_functions(sh, &io) ==
+	    FIDO_ERR_INVALID_ARGUMENT);
+
+	/* sessions can't be opened by path */
+	assert(fido_dev_open(dev, "fake") == FIDO_ERR_INTERNAL);
+	assert(fake.nopen == 1);
+	assert(fido_dev_open_shared(dev, sh) == FIDO_OK);
+	assert(fido_dev_shared_close(sh) == FIDO_ERR_INVALID_ARGUMENT);
+	assert(fido_dev_close(dev) == FIDO_OK);
+	fido_dev_free(&dev);
+
+	assert(pthread_create(&thread, NULL, session, sh) == 0);
+	session(sh);
+	assert(pthread_join(thread, NULL) == 0);
+
+	assert(fake.ninfo == 2 * NROUNDS);
+	assert(fake.nping == 2 * NROUNDS);
+	assert(fake.next_cid == FIRST_CID + 3);
+	assert(fake.nopen == 1);
+
+	assert(fido_dev_shared_close(sh) == FIDO_OK);
+	assert(fake.nopen == 0);
+	fido_dev_shared_free(&sh);
+	assert(sh == NULL);
+	fido_dev_shared_free(&sh);
+}
+
+static void *
+reset(void *arg)
+{
+	assert(fido_dev_reset(arg) == FIDO_OK);
+
+	return (NULL);
+}
+
+static double
+now_ms(void)
+{
+	struct timespec ts;
+
+	assert(clock_gettime(CLOCK_MONOTONIC, &ts) == 0);
+
+	return (ts.tv_sec * 1e3 + ts.tv_nsec / 1e6);
+}
+
+/*
+ * While a session waits for user presence, other sessions may open, get
+ * info and ping with a single frame. Longer requests wait, but only as
+ * long as their timeout.
+ */
+static void
+overtake(void)
+{
+	fido_dev_shared_t	*sh;
+	fido_dev_t		*dev[2];
+	fido_dev_io_t		 io;
+	fido_cbor_info_t	*ci;
+	fido_ping_t		*ping;
+	pthread_t		 thread;
+	double			 t0;
+	int			 ninfo;
+
+	io.open = fake_open;
+	io.close = fake_close;
+	io.read = fake_read;
+	io.write = fake_write;
+
+	assert((sh = fido_dev_shared_new()) != NULL);
+	assert(fido_dev_shared_set_io_functions(sh, &io) == FIDO_OK);
+	assert(fido_dev_shared_open(sh, "fake") == FIDO_OK);
+	assert((dev[0] = fido_dev_new()) != NULL);
+	assert((dev[1] = fido_dev_new()) != NULL);
+	assert(fido_dev_open_shared(dev[0], sh) == FIDO_OK);
+	assert(pthread_create(&thread, NULL, reset, dev[0]) == 0);
+
+	/* wait for the reset to reach the authenticator */
+	pthread_mutex_lock(&fake.lock);
+	while (fake.up_cid == 0)
+		pthread_cond_wait(&fake.cond, &fake.lock);
+	ninfo = fake.ninfo;
+	pthread_mutex_unlock(&fake.lock);
+
+	assert(fido_dev_open_shared(dev[1], sh) == FIDO_OK);
+	assert((ci = fido_cbor_info_new()) != NULL);
+	assert(fido_dev_get_cbor_info(dev[1], ci) == FIDO_OK);
+	assert(fido_cbor_info_versions_len(ci) == 1);
+	assert((ping = fido_ping_new()) != NULL);
+	assert(fido_dev_ping(dev[1], SHORT_PING_LEN, 1, ping) == FIDO_OK);
+
+	assert(fido_ping_set_timeout(ping, TIMEOUT_MS) == FIDO_OK);
+	t0 = now_ms();
+	assert(fido_dev_ping(dev[1], PING_LEN, 1, ping) != FIDO_OK);
+	assert(now_ms() - t0 < 10 * TIMEOUT_MS);
+
+	pthread_mutex_lock(&fake.lock);
+	assert(fake.up_cid != 0);
+	assert(fake.ninfo == ninfo + 1);
+	fake_touch();
+	pthread_mutex_unlock(&fake.lock);
+	assert(pthread_join(thread, NULL) == 0);
+
+	/* the device is free again */
+	assert(fido_ping_set_timeout(ping, -1) == FIDO_OK);
+	assert(fido_dev_ping(dev[1], PING_LEN, 1, ping) == FIDO_OK);
+
+	for (size_t i = 0; i < 2; i++) {
+		assert(fido_dev_close(dev[i]) == FIDO_OK);
+		fido_dev_free(&dev[i]);
+	}
+	assert(fido_dev_shared_close(sh) == FIDO_OK);
+	fido_dev_shared_free(&sh);
+	fido_cbor_info_free(&ci);
+	fido_ping_free(&ping);
+}
+
+/* sessions use the report lengths of the device behind the handle */
+static void
+long_reports(void)
+{
+	fido_dev_shared_t	*sh;
+	fido_dev_t		*dev;
+	fido_dev_io_t		 io;
+	fido_ping_t		*ping;
+	vdev_t			*v;
+
+	assert((v = vdev_new()) != NULL);
+	assert(vdev_set_report_len(v, 128) == 0);
+	vdev_io(&io);
+
+	assert((sh = fido_dev_shared_new()) != NULL);
+	assert(fido_dev_shared_set_io_functions(sh, &io) == FIDO_OK);
+	assert(fido_dev_shared_set_report_len(sh, 7, 128) ==
+	    FIDO_ERR_INVALID_ARGUMENT);
+	assert(fido_dev_shared_set_report_len(sh, 128, 1025) ==
+	    FIDO_ERR_INVALID_ARGUMENT);
+	assert(fido_dev_shared_set_report_len(sh, 128, 128) == FIDO_OK);
+	assert(fido_dev_shared_open(sh, vdev_path(v)) == FIDO_OK);
+	assert(fido_dev_shared_set_report_len(sh, 64, 64) ==
+	    FIDO_ERR_INVALID_ARGUMENT);
+
+	assert((dev = fido_dev_new()) != NULL);
+	assert((ping = fido_ping_new()) != NULL);
+	assert(fido_dev_open_shared(dev, sh) == FIDO_OK);
+	assert(fido_dev_report_in_len(dev) == 128);
+	assert(fido_dev_report_out_len(dev) == 128);
+	assert(fido_dev_ping(dev, PING_LEN, 1, ping) == FIDO_OK);
+	assert(fido_ping_count(ping) == 1);
+	assert(fido_dev_close(dev) == FIDO_OK);
+
+	assert(fido_dev_shared_close(sh) == FIDO_OK);
+	fido_dev_shared_free(&sh);
+	fido_ping_free(&ping);
+	fido_dev_free(&dev);
+	vdev_free(&v);
+}
+
+int
+main(void)
+{
+	fido_init(0);
+
+	concurrent_sessions();
+	overtake();
+	long_reports();
+
+	exit(0);
+}
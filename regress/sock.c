@@ -0,0 +1,240 @@
+/*
+ * Copyright (c) 2020 Yubico AB. All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+/*
+ * Reach a virtual authenticator through "unix:" and "tcp:" device paths,
+ * with a minimal forwarder standing in for fido2-forward(1), using the
+ * report lengths it announces.
+ */
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <netinet/in.h>
+
+#include <arpa/inet.h>
+
+#include <assert.h>
+#include <fido.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../virtual/vdev.h"
+
+#define RPT_MAX		256
+
+static const unsigned char cdh[32] = {
+	0xec, 0x8d, 0x8f, 0x78, 0x42, 0x4a, 0x2b, 0xb7,
+	0x82, 0x34, 0xaa, 0xca, 0x07, 0xa1, 0xf6, 0x56,
+	0x42, 0x1c, 0xb6, 0xf6, 0xb3, 0x00, 0x86, 0x52,
+	0x35, 0x2d, 0xa2, 0x62, 0x4a, 0xbe, 0x89, 0x76,
+};
+
+static const unsigned char user_id[] = { 0x01, 0x02, 0x03, 0x04 };
+
+struct forwarder {
+	pthread_t	 thread;
+	int		 lfd;
+	vdev_t		*v;
+	size_t		 rpt_len;  /* of the virtual authenticator */
+	size_t		 max_recv; /* largest single read from the client */
+	size_t		 n_send;   /* batches sent to the client */
+	size_t		 n_frame;  /* frames sent to the client */
+};
+
+static void *
+forward(void *arg)
+{
+	struct forwarder	*f = arg;
+	fido_dev_io_t		 io;
+	void			*port;
+	unsigned char		 in[129 * RPT_MAX];
+	unsigned char		 out[129 * RPT_MAX];
+	unsigned char		 report[RPT_MAX + 1];
+	const size_t		 rpt_len = f->rpt_len;
+	size_t			 in_len = 0;
+	size_t			 out_len;
+	ssize_t			 n;
+	int			 fd;
+
+	vdev_io(&io);
+	assert((port = io.open(vdev_path(f->v))) != NULL);
+	assert((fd = accept(f->lfd, NULL, NULL)) >= 0);
+
+	/* input and output report lengths */
+	out[0] = out[2] = (rpt_len >> 8) & 0xff;
+	out[1] = out[3] = rpt_len & 0xff;
+	assert(send(fd, out, 4, 0) == 4);
+
+	while ((n = recv(fd, in + in_len, sizeof(in) - in_len, 0)) > 0) {
+		if ((size_t)n > f->max_recv)
+			f->max_recv = (size_t)n;
+		in_len += (size_t)n;
+		while (in_len >= rpt_len) {
+			report[0] = 0;
+			memcpy(report + 1, in, rpt_len);
+			assert(io.write(port, report, rpt_len + 1) ==
+			    (int)rpt_len + 1);
+			memmove(in, in + rpt_len, in_len - rpt_len);
+			in_len -= rpt_len;
+		}
+		out_len = 0;
+		while (out_len + rpt_len <= sizeof(out) && io.read(port,
+		    out + out_len, rpt_len, 0) == (int)rpt_len) {
+			out_len += rpt_len;
+			f->n_frame++;
+		}
+		if (out_len > 0) {
+			assert(send(fd, out, out_len, 0) == (ssize_t)out_len);
+			f->n_send++;
+		}
+	}
+
+	close(fd);
+	io.close(port);
+
+	return (NULL);
+}
+
+static void
+roundtrip(const char *path, size_t rpt_len)
+{
+	fido_dev_t	*dev;
+	fido_cred_t	*cred;
+	fido_assert_t	*assert;
+
+	assert((dev = fido_dev_new()) != NULL);
+	assert(fido_dev_open(dev, path) == FIDO_OK);
+	assert(fido_dev_is_fido2(dev));
+	assert(fido_dev_report_in_len(dev) == rpt_len);
+	assert(fido_dev_report_out_len(dev) == rpt_len);
+
+	assert((cred = fido_cred_new()) != NULL);
+	assert(fido_cred_set_type(cred, COSE_RS256) == FIDO_OK);
+	assert(fido_cred_set_clientdata_hash(cred, cdh,
+	    sizeof(cdh)) == FIDO_OK);
+	assert(fido_cred_set_rp(cred, "example.org", "Example") == FIDO_OK);
+	assert(fido_cred_set_user(cred, user_id, sizeof(user_id), "jsmith",
+	    "John Smith", NULL) == FIDO_OK);
+	assert(fido_dev_make_cred(dev, cred, NULL) == FIDO_OK);
+	assert(fido_cred_verify(cred) == FIDO_OK);
+
+	assert((assert = fido_assert_new()) != NULL);
+	assert(fido_assert_set_rp(assert, "example.org") == FIDO_OK);
+	assert(fido_assert_set_clientdata_hash(assert, cdh,
+	    sizeof(cdh)) == FIDO_OK);
+	assert(fido_assert_allow_cred(assert, fido_cred_id_ptr(cred),
+	    fido_cred_id_len(cred)) == FIDO_OK);
+	assert(fido_dev_get_assert(dev, assert, NULL) == FIDO_OK);
+	assert(fido_assert_count(assert) == 1);
+
+	fido_assert_free(&assert);
+	fido_cred_free(&cred);
+	assert(fido_dev_close(dev) == FIDO_OK);
+	fido_dev_free(&dev);
+}
+
+static void
+run(int lfd, const char *path, size_t rpt_len)
+{
+	struct forwarder f;
+
+	memset(&f, 0, sizeof(f));
+	f.lfd = lfd;
+	f.rpt_len = rpt_len;
+	assert((f.v = vdev_new()) != NULL);
+	assert(vdev_set_report_len(f.v, rpt_len) == 0);
+	assert(listen(lfd, 1) == 0);
+	assert(pthread_create(&f.thread, NULL, forward, &f) == 0);
+
+	roundtrip(path, rpt_len);
+
+	assert(pthread_join(f.thread, NULL) == 0);
+	vdev_free(&f.v);
+
+	/* multi-frame messages arrive in one piece */
+	assert(f.max_recv > rpt_len);
+	assert(f.n_frame > f.n_send);
+}
+
+static void
+unix_path(void)
+{
+	struct sockaddr_un	 sun;
+	char			 dir[] = "/tmp/regress_sock.XXXXXX";
+	char			 path[sizeof(sun.sun_path) + 8];
+	int			 fd;
+
+	assert(mkdtemp(dir) != NULL);
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	snprintf(sun.sun_path, sizeof(sun.sun_path), "%s/sock", dir);
+	snprintf(path, sizeof(path), "unix:%s", sun.sun_path);
+
+	assert((fd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0);
+	assert(bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == 0);
+
+	run(fd, path, 64);
+	run(fd, path, 128);
+
+	close(fd);
+	assert(unlink(sun.sun_path) == 0);
+	assert(rmdir(dir) == 0);
+}
+
+static void
+tcp_path(void)
+{
+	struct sockaddr_in	sin;
+	socklen_t		len = sizeof(sin);
+	char			path[64];
+	int			fd;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	assert((fd = socket(AF_INET, SOCK_STREAM, 0)) >= 0);
+	assert(bind(fd, (struct sockaddr *)&sin, sizeof(sin)) == 0);
+	assert(getsockname(fd, (struct sockaddr *)&sin, &len) == 0);
+	snprintf(path, sizeof(path), "tcp:127.0.0.1:%u",
+	    (unsigned)ntohs(sin.sin_port));
+
+	run(fd, path, 64);
+	run(fd, path, 128);
+
+	close(fd);
+}
+
+static void
+bad_path(void)
+{
+	fido_dev_t *dev;
+
+	assert((dev = fido_dev_new()) != NULL);
+	assert(fido_dev_open(dev, "unix:/nonexistent/sock") ==
+	    FIDO_ERR_INTERNAL);
+	assert(fido_dev_open(dev, "tcp:127.0.0.1") == FIDO_ERR_INTERNAL);
+	assert(fido_dev_open(dev, "tcp:[::1]:") == FIDO_ERR_INTERNAL);
+	fido_dev_free(&dev);
+}
+
+int
+main(void)
+{
+	fido_init(0);
+
+	unix_path();
+	tcp_path();
+	bad_path();
+
+	exit(0);
+}
@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2020 Yubico AB. All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+/*
+ * Trace a session with a virtual authenticator, with keepalives
+ * interleaved by the fault injection wrapper.
+ */
+
+#include <assert.h>
+#include <fido.h>
+#include <fido/es256.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../virtual/vdev.h"
+
+#define MAX_EVENTS	1024
+
+static const unsigned char cdh[32] = {
+	0xec, 0x8d, 0x8f, 0x78, 0x42, 0x4a, 0x2b, 0xb7,
+	0x82, 0x34, 0xaa, 0xca, 0x07, 0xa1, 0xf6, 0x56,
+	0x42, 0x1c, 0xb6, 0xf6, 0xb3, 0x00, 0x86, 0x52,
+	0x35, 0x2d, 0xa2, 0x62, 0x4a, 0xbe, 0x89, 0x76,
+};
+
+static const unsigned char user_id[] = { 0x01, 0x02, 0x03, 0x04 };
+
+struct trace {
+	fido_trace_event_t	ev[MAX_EVENTS];
+	size_t			n;
+	size_t			n_type[8];
+};
+
+static void
+collect(const fido_trace_event_t *ev, void *arg)
+{
+	struct trace *t = arg;
+
+	assert(ev->type >= FIDO_TRACE_TX && ev->type <= FIDO_TRACE_CRYPTO);
+	assert(t->n < MAX_EVENTS);
+
+	t->ev[t->n] = *ev;
+	t->ev[t->n].ptr = NULL; /* only valid during the callback */
+	t->n++;
+	t->n_type[ev->type]++;
+
+	if (ev->type <= FIDO_TRACE_KEEPALIVE)
+		assert(ev->ptr != NULL && ev->len == 64);
+}
+
+static void
+session(const char *path)
+{
+	fido_dev_io_t	 io;
+	fido_dev_t	*dev;
+	fido_cred_t	*cred;
+	fido_assert_t	*assert;
+	es256_pk_t	*pk;
+
+	vdev_fault_io(&io);
+
+	assert((dev = fido_dev_new()) != NULL);
+	assert(fido_dev_set_io_functions(dev, &io) == FIDO_OK);
+	assert(fido_dev_open(dev, path) == FIDO_OK);
+
+	assert((cred = fido_cred_new()) != NULL);
+	assert(fido_cred_set_type(cred, COSE_ES256) == FIDO_OK);
+	assert(fido_cred_set_clientdata_hash(cred, cdh,
+	    sizeof(cdh)) == FIDO_OK);
+	assert(fido_cred_set_rp(cred, "example.org", NULL) == FIDO_OK);
+	assert(fido_cred_set_user(cred, user_id, sizeof(user_id), "jsmith",
+	    NULL, NULL) == FIDO_OK);
+	assert(fido_dev_make_cred(dev, cred, NULL) == FIDO_OK);
+	assert(fido_cred_verify(cred) == FIDO_OK);
+
+	assert((assert = fido_assert_new()) != NULL);
+	assert(fido_assert_set_rp(assert, "example.org") == FIDO_OK);
+	assert(fido_assert_set_clientdata_hash(assert, cdh,
+	    sizeof(cdh)) == FIDO_OK);
+	assert(fido_assert_allow_cred(assert, fido_cred_id_ptr(cred),
+	    fido_cred_id_len(cred)) == FIDO_OK);
+	assert(fido_dev_get_assert(dev, assert, NULL) == FIDO_OK);
+
+	assert((pk = es256_pk_new()) != NULL);
+	assert(es256_pk_from_ptr(pk, fido_cred_pubkey_ptr(cred),
+	    fido_cred_pubkey_len(cred)) == FIDO_OK);
+	assert(fido_assert_verify(assert, 0, COSE_ES256, pk) == FIDO_OK);
+
+	es256_pk_free(&pk);
+	fido_assert_free(&assert);
+	fido_cred_free(&cred);
+	assert(fido_dev_close(dev) == FIDO_OK);
+	fido_dev_free(&dev);
+}
+
+static void
+check(const struct trace *t)
+{
+	const fido_trace_event_t	*ev;
+	uint32_t			 cid = 0;
+	int				 open = 0;
+
+	for (size_t i = 0; i < t->n; i++) {
+		ev = &t->ev[i];
+		if (i > 0)
+			assert(ev->t >= t->ev[i - 1].t);
+		switch (ev->type) {
+		case FIDO_TRACE_CMD_START:
+			assert(open == 0);
+			open = 1;
+			/* CTAPHID_INIT goes out on the broadcast channel */
+			if (ev->cmd == CTAP_CMD_INIT)
+				assert(ev->cid == 0xffffffff);
+			else
+				cid = ev->cid;
+			break;
+		case FIDO_TRACE_CMD_END:
+			assert(open == 1);
+			open = 0;
+			assert(ev->status == 0 && ev->len > 0);
+			break;
+		case FIDO_TRACE_RX:
+			/* keepalives are only reported as such */
+			assert(ev->cmd != CTAP_KEEPALIVE);
+			/* FALLTHROUGH */
+		case FIDO_TRACE_TX:
+		case FIDO_TRACE_KEEPALIVE:
+			assert(open == 1);
+			if (cid != 0)
+				assert(ev->cid == cid);
+			break;
+		case FIDO_TRACE_PARSE:
+		case FIDO_TRACE_CRYPTO:
+			assert(ev->status == 0);
+			assert(ev->t >= ev->dur);
+			break;
+		}
+	}
+
+	assert(open == 0);
+	assert(cid != 0 && cid != 0xffffffff);
+	/* init, makeCredential, getAssertion */
+	assert(t->n_type[FIDO_TRACE_CMD_START] >= 3);
+	assert(t->n_type[FIDO_TRACE_CMD_END] ==
+	    t->n_type[FIDO_TRACE_CMD_START]);
+	assert(t->n_type[FIDO_TRACE_TX] >= t->n_type[FIDO_TRACE_CMD_START]);
+	assert(t->n_type[FIDO_TRACE_RX] > t->n_type[FIDO_TRACE_KEEPALIVE]);
+	assert(t->n_type[FIDO_TRACE_KEEPALIVE] >= 2);
+	assert(t->n_type[FIDO_TRACE_PARSE] >= 2);
+	/* attestation, assertion */
+	assert(t->n_type[FIDO_TRACE_CRYPTO] >= 2);
+}
+
+int
+main(void)
+{
+	fido_dev_io_t		 io;
+	vdev_fault_cfg_t	 cfg;
+	vdev_t			*v;
+	vdev_fault_t		*f;
+	struct trace		*t;
+
+	fido_init(0);
+
+	vdev_io(&io);
+	assert((v = vdev_new()) != NULL);
+	assert((f = vdev_fault_new(&io, vdev_path(v))) != NULL);
+	assert((t = calloc(1, sizeof(*t))) != NULL);
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.keepalives = 1;
+	vdev_fault_set(f, &cfg);
+
+	fido_set_trace_callback(collect, t);
+	session(vdev_fault_path(f));
+	check(t);
+
+	/* no events without a callback */
+	memset(t, 0, sizeof(*t));
+	fido_set_trace_callback(NULL, t);
+	session(vdev_fault_path(f));
+	assert(t->n == 0);
+
+	free(t);
+	vdev_fault_free(&f);
+	vdev_free(&v);
+
+	exit(0);
+}
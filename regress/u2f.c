@@ -0,0 +1,480 @@
+/*
+ * Copyright (c) 2020 Yubico AB. All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+#include <assert.h>
+#include <fido.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define FAKE_DEV_HANDLE	((void *)0xdeadbeef)
+#define REPORT_LEN	(64 + 1)
+#define FAKE_CID	0x0a0b0c0d
+
+/*
+ * A scripted U2F authenticator holding a single key handle, unless it is
+ * gone. A signing request is answered with SW_CONDITIONS_NOT_SATISFIED
+ * until the scripted touch deadline has passed (or forever, if touch_ms
+ * is -1). Registrations are counted and refused.
+ */
+struct fake_dev {
+	unsigned char	req[1024];
+	size_t		req_len;
+	size_t		req_got;
+	uint8_t		req_cmd;
+	unsigned char	rx[4096];
+	size_t		rx_len;
+	size_t		rx_off;
+	long long	touch_ms;
+	long long	t0;
+	int		npoll;
+	int		nprobe;
+	int		nregister;
+	int		gone;
+};
+
+static struct fake_dev fake;
+
+static const unsigned char cdh[32] = {
+	0xec, 0x8d, 0x8f, 0x78, 0x42, 0x4a, 0x2b, 0xb7,
+	0x82, 0x34, 0xaa, 0xca, 0x07, 0xa1, 0xf6, 0x56,
+	0x42, 0x1c, 0xb6, 0xf6, 0xb3, 0x00, 0x86, 0x52,
+	0x35, 0x2d, 0xa2, 0x62, 0x4a, 0xbe, 0x89, 0x76,
+};
+
+static const unsigned char key_handle[32] = {
+	0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
+	0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10,
+	0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18,
+	0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20,
+};
+
+static const unsigned char unknown_key_handle[32] = {
+	0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+	0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff, 0x00,
+	0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18,
+	0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20,
+};
+
+static long long
+now_ms(void)
+{
+	struct timespec ts;
+
+	assert(clock_gettime(CLOCK_MONOTONIC, &ts) == 0);
+
+	return ((long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static void
+fake_reply(uint8_t cmd, const unsigned char *ptr, size_t len)
+{
+	/* CTAPHID_INIT is answered on the broadcast channel */
+	const uint32_t	cid = cmd == (CTAP_FRAME_INIT | CTAP_CMD_INIT) ?
+			    CTAP_CID_BROADCAST : FAKE_CID;
+	unsigned char	*frame;
+	size_t		 n;
+	uint8_t		 seq = 0;
+
+	fake.rx_len = 0;
+	fake.rx_off = 0;
+
+	do {
+		assert(fake.rx_len + 64 <= sizeof(fake.rx));
+		frame = &fake.rx[fake.rx_len];
+		memset(frame, 0, 64);
+		memcpy(frame, &cid, sizeof(cid));
+		if (fake.rx_len == 0) {
+			frame[4] = cmd;
+			frame[5] = (len >> 8) & 0xff;
+			frame[6] = len & 0xff;
+			n = len < 57 ? len : 57;
+			memcpy(&frame[7], ptr, n);
+		} else {
+			frame[4] = seq++;
+			n = len < 59 ? len : 59;
+			memcpy(&frame[5], ptr, n);
+		}
+		ptr += n;
+		len -= n;
+		fake.rx_len += 64;
+	} while (len > 0);
+}
+
+static void
+fake_msg(void)
+{
+	static const unsigned char	sw_pending[] = { 0x69, 0x85 };
+	static const unsigned char	sig_ok[] = {
+		0x01,			/* user present */
+		0x00, 0x00, 0x00, 0x2a,	/* counter */
+		0x30, 0x06, 0x02, 0x01, 0x01, 0x02, 0x01, 0x01, /* sig */
+		0x90, 0x00,		/* sw */
+	};
+	static const unsigned char	sw_wrong_data[] = { 0x6a, 0x80 };
+	const uint8_t			cmd = CTAP_FRAME_INIT | CTAP_CMD_MSG;
+	int				found;
+
+	if (fake.req[1] == U2F_CMD_REGISTER) {
+		/* header (7), challenge (32), application (32) */
+		assert(fake.req_len >= 71);
+		if (fake.req[39] != 0xff) /* not a dummy registration */
+			fake.nregister++;
+		fake_reply(cmd, sw_wrong_data, sizeof(sw_wrong_data));
+		return;
+	}
+
+	/* header (7), challenge (32), application (32), kh_len (1), kh */
+	assert(fake.req_len >= 72 + sizeof(key_handle));
+	assert(fake.req[1] == U2F_CMD_AUTH);
+	assert(fake.req[71] == sizeof(key_handle));
+
+	found = !fake.gone &&
+	    memcmp(&fake.req[72], key_handle, sizeof(key_handle)) == 0;
+
+	if (fake.req[2] == U2F_AUTH_CHECK) {
+		fake.nprobe++;
+		if (found)
+			fake_reply(cmd, sw_pending, sizeof(sw_pending));
+		else
+			fake_reply(cmd, sw_wrong_data, sizeof(sw_wrong_data));
+		return;
+	}
+
+	if (!found) {
+		fake_reply(cmd, sw_wrong_data, sizeof(sw_wrong_data));
+		return;
+	}
+
+	fake.npoll++;
+
+	if (fake.touch_ms < 0 || now_ms() - fake.t0 < fake.touch_ms)
+		fake_reply(cmd, sw_pending, sizeof(sw_pending));
+	else
+		fake_reply(cmd, sig_ok, sizeof(sig_ok));
+}
+
+static void
+fake_init(void)
+{
+	const uint32_t	cid = FAKE_CID;
+	unsigned char	attr[17];
+
+	assert(fake.req_len == 8);
+
+	memset(attr, 0, sizeof(attr));
+	memcpy(attr, fake.req, 8);		/* nonce */
+	memcpy(&attr[8], &cid, sizeof(cid));	/* cid */
+	attr[12] = 2;				/* protocol */
+	attr[16] = 0;				/* no cbor: u2f only */
+
+	fake_reply(CTAP_FRAME_INIT | CTAP_CMD_INIT, attr, sizeof(attr));
+}
+
+static void *
+fake_open(const char *path)
+{
+	(void)path;
+
+	return (FAKE_DEV_HANDLE);
+}
+
+static void
+fake_close(void *handle)
+{
+	assert(handle == FAKE_DEV_HANDLE);
+}
+
+static int
+fake_read(void *handle, unsigned char *ptr, size_t len, int ms)
+{
+	(void)ms;
+
+	assert(handle == FAKE_DEV_HANDLE);
+	assert(len == 64);
+
+	if (fake.rx_off >= fake.rx_len)
+		return (-1);
+
+	memcpy(ptr, &fake.rx[fake.rx_off], len);
+	fake.rx_off += len;
+
+	return ((int)len);
+}
+
+static int
+fake_write(void *handle, const unsigned char *ptr, size_t len)
+{
+	const unsigned char	*frame = ptr + 1;
+	size_t			 n;
+
+	assert(handle == FAKE_DEV_HANDLE);
+	assert(len == REPORT_LEN);
+
+	if (frame[4] & CTAP_FRAME_INIT) {
+		fake.req_cmd = frame[4];
+		fake.req_len = (size_t)((frame[5] << 8) | frame[6]);
+		fake.req_got = 0;
+		assert(fake.req_len <= sizeof(fake.req));
+		n = fake.req_len < 57 ? fake.req_len : 57;
+		memcpy(fake.req, &frame[7], n);
+	} else {
+		n = fake.req_len - fake.req_got;
+		n = n < 59 ? n : 59;
+		memcpy(&fake.req[fake.req_got], &frame[5], n);
+	}
+
+	if ((fake.req_got += n) < fake.req_len)
+		return ((int)len);
+
+	switch (fake.req_cmd) {
+	case CTAP_FRAME_INIT | CTAP_CMD_INIT:
+		fake_init();
+		break;
+	case CTAP_FRAME_INIT | CTAP_CMD_MSG:
+		fake_msg();
+		break;
+	case CTAP_FRAME_INIT | CTAP_CMD_CBOR:
+		/* authenticatorReset */
+		assert(fake.req_len == 1 && fake.req[0] == CTAP_CBOR_RESET);
+		fake_reply(fake.req_cmd, (const unsigned char *)"", 1);
+		break;
+	default:
+		abort();
+	}
+
+	return ((int)len);
+}
+
+static fido_dev_t *
+open_dev(void)
+{
+	fido_dev_t	*dev;
+	fido_dev_io_t	 io;
+
+	io.open = fake_open;
+	io.close = fake_close;
+	io.read = fake_read;
+	io.write = fake_write;
+
+	memset(&fake, 0, sizeof(fake));
+
+	assert((dev = fido_dev_new()) != NULL);
+	assert(fido_dev_set_io_functions(dev, &io) == FIDO_OK);
+	assert(fido_dev_open(dev, "fake") == FIDO_OK);
+	assert(fido_dev_is_fido2(dev) == false);
+
+	return (dev);
+}
+
+static int
+get_assert(fido_dev_t *dev, long long touch_ms, long long *elapsed_ms)
+{
+	fido_assert_t	*a;
+	int		 r;
+
+	assert((a = fido_assert_new()) != NULL);
+	assert(fido_assert_set_clientdata_hash(a, cdh, sizeof(cdh)) == FIDO_OK);
+	assert(fido_assert_set_rp(a, "localhost") == FIDO_OK);
+	assert(fido_assert_allow_cred(a, key_handle,
+	    sizeof(key_handle)) == FIDO_OK);
+
+	fake.npoll = 0;
+	fake.nprobe = 0;
+	fake.touch_ms = touch_ms;
+	fake.t0 = now_ms();
+	r = fido_dev_get_assert(dev, a, NULL);
+	*elapsed_ms = now_ms() - fake.t0;
+
+	if (r == FIDO_OK) {
+		assert(fido_assert_count(a) == 1);
+		assert(fido_assert_sigcount(a, 0) == 42);
+	}
+
+	fido_assert_free(&a);
+
+	return (r);
+}
+
+static void
+bad_poll_args(void)
+{
+	fido_dev_t *dev;
+
+	assert((dev = fido_dev_new()) != NULL);
+	assert(fido_dev_set_u2f_poll(dev, 0, 100, -1) ==
+	    FIDO_ERR_INVALID_ARGUMENT);
+	assert(fido_dev_set_u2f_poll(dev, 10, 5, -1) ==
+	    FIDO_ERR_INVALID_ARGUMENT);
+	assert(fido_dev_set_u2f_poll(dev, 10, 100, -2) ==
+	    FIDO_ERR_INVALID_ARGUMENT);
+	assert(fido_dev_set_u2f_poll(dev, 10, 100, 0) == FIDO_OK);
+	fido_dev_free(&dev);
+}
+
+/*
+ * Measure the delay between the (scripted) touch and the completion of
+ * fido_dev_get_assert() for a fixed and an adaptive polling strategy.
+ */
+static void
+touch_latency(void)
+{
+	const long long	touch_ms = 150;
+	fido_dev_t	*dev;
+	long long	 fixed;
+	long long	 adaptive;
+	int		 fixed_npoll;
+
+	dev = open_dev();
+	assert(fido_dev_set_u2f_poll(dev, 100, 100, -1) == FIDO_OK);
+	assert(get_assert(dev, touch_ms, &fixed) == FIDO_OK);
+	fixed_npoll = fake.npoll;
+	fido_dev_close(dev);
+	fido_dev_free(&dev);
+
+	dev = open_dev();
+	assert(fido_dev_set_u2f_poll(dev, 5, 40, -1) == FIDO_OK);
+	assert(get_assert(dev, touch_ms, &adaptive) == FIDO_OK);
+	fido_dev_close(dev);
+	fido_dev_free(&dev);
+
+	assert(fixed >= touch_ms && adaptive >= touch_ms);
+
+	printf("u2f poll: fixed 100ms: +%lldms after touch, %d polls\n",
+	    fixed - touch_ms, fixed_npoll);
+	printf("u2f poll: 5ms..40ms: +%lldms after touch, %d polls\n",
+	    adaptive - touch_ms, fake.npoll);
+}
+
+/*
+ * Key handles found on the device are probed once per open device, and
+ * duplicates in the allow list are probed (and signed with) once.
+ */
+static void
+probe_cache(void)
+{
+	fido_dev_t	*dev;
+	fido_assert_t	*a;
+
+	dev = open_dev();
+	assert(fido_dev_set_u2f_poll(dev, 1, 1, -1) == FIDO_OK);
+
+	for (int i = 0; i < 2; i++) {
+		assert((a = fido_assert_new()) != NULL);
+		assert(fido_assert_set_clientdata_hash(a, cdh,
+		    sizeof(cdh)) == FIDO_OK);
+		assert(fido_assert_set_rp(a, "localhost") == FIDO_OK);
+		assert(fido_assert_allow_cred(a, key_handle,
+		    sizeof(key_handle)) == FIDO_OK);
+		assert(fido_assert_allow_cred(a, unknown_key_handle,
+		    sizeof(unknown_key_handle)) == FIDO_OK);
+		assert(fido_assert_allow_cred(a, key_handle,
+		    sizeof(key_handle)) == FIDO_OK);
+		fake.npoll = 0;
+		fake.nprobe = 0;
+		fake.touch_ms = 0;
+		fake.t0 = now_ms();
+		assert(fido_dev_get_assert(dev, a, NULL) == FIDO_OK);
+		assert(fido_assert_count(a) == 1);
+		assert(fake.npoll == 1);
+		/* the second time around, only the unknown handle is probed */
+		assert(fake.nprobe == (i == 0 ? 2 : 1));
+		fido_assert_free(&a);
+	}
+
+	fido_dev_close(dev);
+	fido_dev_free(&dev);
+}
+
+static int
+make_cred(fido_dev_t *dev)
+{
+	fido_cred_t	*c;
+	int		 r;
+
+	assert((c = fido_cred_new()) != NULL);
+	assert(fido_cred_set_type(c, COSE_ES256) == FIDO_OK);
+	assert(fido_cred_set_clientdata_hash(c, cdh, sizeof(cdh)) == FIDO_OK);
+	assert(fido_cred_set_rp(c, "localhost", NULL) == FIDO_OK);
+	assert(fido_cred_exclude(c, key_handle, sizeof(key_handle)) == FIDO_OK);
+	fake.nregister = 0;
+	r = fido_dev_make_cred(dev, c, NULL);
+	fido_cred_free(&c);
+
+	return (r);
+}
+
+/*
+ * A cached key handle that has since gone from the device is skipped,
+ * as an unknown one would be, and does not exclude a registration. A
+ * reset empties the cache.
+ */
+static void
+stale_cache(void)
+{
+	fido_dev_t	*dev;
+	long long	 elapsed;
+
+	dev = open_dev();
+	assert(fido_dev_set_u2f_poll(dev, 1, 1, -1) == FIDO_OK);
+	assert(get_assert(dev, 0, &elapsed) == FIDO_OK);
+	assert(fake.nprobe == 1);
+	assert(get_assert(dev, 0, &elapsed) == FIDO_OK);
+	assert(fake.nprobe == 0);
+
+	fake.gone = 1;
+	assert(get_assert(dev, 0, &elapsed) == FIDO_ERR_NO_CREDENTIALS);
+	assert(fake.nprobe == 1);
+	assert(get_assert(dev, 0, &elapsed) == FIDO_ERR_NO_CREDENTIALS);
+	assert(fake.nprobe == 1);
+	assert(fake.npoll == 0);
+
+	fake.gone = 0;
+	assert(get_assert(dev, 0, &elapsed) == FIDO_OK);
+	assert(make_cred(dev) == FIDO_ERR_CREDENTIAL_EXCLUDED);
+	assert(fake.nregister == 0);
+	fake.gone = 1;
+	assert(make_cred(dev) != FIDO_ERR_CREDENTIAL_EXCLUDED);
+	assert(fake.nregister == 1);
+
+	fake.gone = 0;
+	assert(get_assert(dev, 0, &elapsed) == FIDO_OK);
+	assert(fake.nprobe == 1);
+	assert(fido_dev_reset(dev) == FIDO_OK);
+	assert(get_assert(dev, 0, &elapsed) == FIDO_OK);
+	assert(fake.nprobe == 1);
+
+	fido_dev_close(dev);
+	fido_dev_free(&dev);
+}
+
+static void
+deadline(void)
+{
+	fido_dev_t	*dev;
+	long long	 elapsed;
+
+	dev = open_dev();
+	assert(fido_dev_set_u2f_poll(dev, 5, 20, 100) == FIDO_OK);
+	assert(get_assert(dev, -1, &elapsed) == FIDO_ERR_USER_ACTION_TIMEOUT);
+	assert(elapsed >= 100);
+	fido_dev_close(dev);
+	fido_dev_free(&dev);
+}
+
+int
+main(void)
+{
+	fido_init(0);
+
+	bad_poll_args();
+	touch_latency();
+	probe_cache();
+	stale_cache();
+	deadline();
+
+	exit(0);
+}
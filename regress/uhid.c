@@ -0,0 +1,290 @@
+/*
+ * Copyright (c) 2020 Yubico AB. All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+/*
+ * Drive a virtual authenticator through /dev/uhid and the library's
+ * hidraw backend, directly and through io_uring where available. Skipped
+ * if /dev/uhid is not accessible. With -n, report enumeration and
+ * round-trip latencies.
+ */
+
+#include <assert.h>
+#include <fido.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../virtual/vdev.h"
+
+#define MAX_DEVS	64
+#define WAIT_MS		5000
+#define LATENCY_MS	50
+
+static const unsigned char cdh[32] = {
+	0xec, 0x8d, 0x8f, 0x78, 0x42, 0x4a, 0x2b, 0xb7,
+	0x82, 0x34, 0xaa, 0xca, 0x07, 0xa1, 0xf6, 0x56,
+	0x42, 0x1c, 0xb6, 0xf6, 0xb3, 0x00, 0x86, 0x52,
+	0x35, 0x2d, 0xa2, 0x62, 0x4a, 0xbe, 0x89, 0x76,
+};
+
+static const unsigned char user_id[] = { 0x01, 0x02, 0x03, 0x04 };
+
+static double
+now_ms(void)
+{
+	struct timespec ts;
+
+	assert(clock_gettime(CLOCK_MONOTONIC, &ts) == 0);
+
+	return (ts.tv_sec * 1e3 + ts.tv_nsec / 1e6);
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return ((x > y) - (x < y));
+}
+
+static void
+report(const char *what, double *v, size_t n)
+{
+	qsort(v, n, sizeof(*v), cmp_double);
+	printf("%-12s n=%zu min=%.3fms p50=%.3fms p99=%.3fms max=%.3fms\n",
+	    what, n, v[0], v[n / 2], v[(n * 99) / 100], v[n - 1]);
+}
+
+/*
+ * Enumerate devices until the virtual authenticator appears; return its
+ * hidraw path.
+ */
+static char *
+find_dev(double *elapsed)
+{
+	fido_dev_info_t		*devlist;
+	const fido_dev_info_t	*di;
+	char			*path = NULL;
+	size_t			 ndevs;
+	double			 t0;
+
+	assert((devlist = fido_dev_info_new(MAX_DEVS)) != NULL);
+
+	for (t0 = now_ms(); path == NULL && now_ms() - t0 < WAIT_MS;) {
+		assert(fido_dev_info_manifest(devlist, MAX_DEVS,
+		    &ndevs) == FIDO_OK);
+		for (size_t i = 0; path == NULL && i < ndevs; i++) {
+			di = fido_dev_info_ptr(devlist, i);
+			if (fido_dev_info_vendor(di) == 0x1209 &&
+			    fido_dev_info_product(di) == 0x0001 &&
+			    strcmp(fido_dev_info_product_string(di),
+			    "Virtual Authenticator") == 0)
+				assert((path = strdup(fido_dev_info_path(di))) !=
+				    NULL);
+		}
+		if (path == NULL)
+			usleep(10000);
+	}
+
+	*elapsed = now_ms() - t0;
+	fido_dev_info_free(&devlist, MAX_DEVS);
+
+	return (path);
+}
+
+/* the "uring:" path of a hidraw device, or NULL if io_uring is unusable */
+static char *
+uring_path(const char *path)
+{
+	fido_dev_t	*dev;
+	char		*upath;
+
+	assert((upath = malloc(strlen(path) + 7)) != NULL);
+	snprintf(upath, strlen(path) + 7, "uring:%s", path);
+	assert((dev = fido_dev_new()) != NULL);
+	if (fido_dev_open(dev, upath) != FIDO_OK) {
+		free(upath);
+		upath = NULL;
+	} else
+		assert(fido_dev_close(dev) == FIDO_OK);
+	fido_dev_free(&dev);
+
+	return (upath);
+}
+
+static void
+roundtrip(const char *path)
+{
+	fido_dev_t	*dev;
+	fido_cred_t	*cred;
+	fido_assert_t	*assert;
+
+	assert((dev = fido_dev_new()) != NULL);
+	assert(fido_dev_open(dev, path) == FIDO_OK);
+	assert(fido_dev_is_fido2(dev));
+
+	assert((cred = fido_cred_new()) != NULL);
+	assert(fido_cred_set_type(cred, COSE_ES256) == FIDO_OK);
+	assert(fido_cred_set_clientdata_hash(cred, cdh,
+	    sizeof(cdh)) == FIDO_OK);
+	assert(fido_cred_set_rp(cred, "example.org", NULL) == FIDO_OK);
+	assert(fido_cred_set_user(cred, user_id, sizeof(user_id), "jsmith",
+	    NULL, NULL) == FIDO_OK);
+	assert(fido_dev_make_cred(dev, cred, NULL) == FIDO_OK);
+	assert(fido_cred_verify(cred) == FIDO_OK);
+
+	assert((assert = fido_assert_new()) != NULL);
+	assert(fido_assert_set_rp(assert, "example.org") == FIDO_OK);
+	assert(fido_assert_set_clientdata_hash(assert, cdh,
+	    sizeof(cdh)) == FIDO_OK);
+	assert(fido_assert_allow_cred(assert, fido_cred_id_ptr(cred),
+	    fido_cred_id_len(cred)) == FIDO_OK);
+	assert(fido_dev_get_assert(dev, assert, NULL) == FIDO_OK);
+	assert(fido_assert_count(assert) == 1);
+
+	fido_assert_free(&assert);
+	fido_cred_free(&cred);
+	assert(fido_dev_close(dev) == FIDO_OK);
+	fido_dev_free(&dev);
+}
+
+static double
+get_info(fido_dev_t *dev)
+{
+	fido_cbor_info_t	*ci;
+	double			 t0;
+	double			 t;
+
+	assert((ci = fido_cbor_info_new()) != NULL);
+	t0 = now_ms();
+	assert(fido_dev_get_cbor_info(dev, ci) == FIDO_OK);
+	t = now_ms() - t0;
+	fido_cbor_info_free(&ci);
+
+	return (t);
+}
+
+static void
+bench(vdev_uhid_t *u, const char *path, size_t n)
+{
+	fido_dev_info_t	*devlist;
+	fido_dev_t	*dev;
+	double		*t;
+	size_t		 ndevs;
+	uint64_t	 n_out;
+	uint64_t	 n_in;
+
+	assert((t = calloc(n, sizeof(*t))) != NULL);
+	assert((devlist = fido_dev_info_new(MAX_DEVS)) != NULL);
+
+	for (size_t i = 0; i < n; i++) {
+		double t0 = now_ms();
+		assert(fido_dev_info_manifest(devlist, MAX_DEVS,
+		    &ndevs) == FIDO_OK);
+		t[i] = now_ms() - t0;
+	}
+	report("manifest", t, n);
+	fido_dev_info_free(&devlist, MAX_DEVS);
+
+	for (size_t i = 0; i < n; i++) {
+		double t0 = now_ms();
+		assert((dev = fido_dev_new()) != NULL);
+		assert(fido_dev_open(dev, path) == FIDO_OK);
+		t[i] = now_ms() - t0;
+		assert(fido_dev_close(dev) == FIDO_OK);
+		fido_dev_free(&dev);
+	}
+	report("open", t, n);
+
+	assert((dev = fido_dev_new()) != NULL);
+	assert(fido_dev_open(dev, path) == FIDO_OK);
+	for (size_t i = 0; i < n; i++)
+		t[i] = get_info(dev);
+	report("getinfo", t, n);
+
+	vdev_uhid_set_latency(u, LATENCY_MS);
+	for (size_t i = 0; i < n && i < 10; i++)
+		t[i] = get_info(dev);
+	report("getinfo+50ms", t, n < 10 ? n : 10);
+	vdev_uhid_set_latency(u, 0);
+
+	assert(fido_dev_close(dev) == FIDO_OK);
+	fido_dev_free(&dev);
+
+	vdev_uhid_stats(u, &n_out, &n_in);
+	printf("reports      out=%llu in=%llu\n", (unsigned long long)n_out,
+	    (unsigned long long)n_in);
+
+	free(t);
+}
+
+int
+main(int argc, char **argv)
+{
+	vdev_t		*v;
+	vdev_uhid_t	*u;
+	fido_dev_t	*dev;
+	char		*path;
+	char		*upath;
+	double		 elapsed;
+	size_t		 n = 0;
+	int		 ch;
+
+	while ((ch = getopt(argc, argv, "n:")) != -1) {
+		switch (ch) {
+		case 'n':
+			n = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "usage: regress_uhid [-n count]\n");
+			exit(1);
+		}
+	}
+
+	if (access("/dev/uhid", R_OK | W_OK) != 0) {
+		if (n > 0)
+			fprintf(stderr, "/dev/uhid not accessible\n");
+		exit(n > 0 ? 1 : 0); /* skip */
+	}
+
+	fido_init(0);
+
+	assert((v = vdev_new()) != NULL);
+	assert((u = vdev_uhid_new(v)) != NULL);
+	assert((path = find_dev(&elapsed)) != NULL);
+
+	roundtrip(path);
+	if ((upath = uring_path(path)) != NULL)
+		roundtrip(upath);
+
+	/* an injected delay shows up in the round trip */
+	vdev_uhid_set_latency(u, LATENCY_MS);
+	assert((dev = fido_dev_new()) != NULL);
+	assert(fido_dev_open(dev, path) == FIDO_OK);
+	assert(get_info(dev) >= LATENCY_MS);
+	assert(fido_dev_close(dev) == FIDO_OK);
+	fido_dev_free(&dev);
+	vdev_uhid_set_latency(u, 0);
+
+	if (n > 0) {
+		printf("appeared     %.3fms\n", elapsed);
+		bench(u, path, n);
+		if (upath != NULL) {
+			printf("through io_uring\n");
+			bench(u, upath, n);
+		}
+	}
+
+	free(upath);
+	free(path);
+	vdev_uhid_free(&u);
+	vdev_free(&v);
+
+	exit(0);
+}
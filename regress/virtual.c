@@ -0,0 +1,418 @@
+/*
+ * Copyright (c) 2020 Yubico AB. All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+#include <assert.h>
+#include <fido.h>
+#include <fido/credman.h>
+#include <fido/eddsa.h>
+#include <fido/es256.h>
+#include <fido/rs256.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../virtual/vdev.h"
+
+#define RP_ID	"example.org"
+
+static const unsigned char cdh[32] = {
+	0xec, 0x8d, 0x8f, 0x78, 0x42, 0x4a, 0x2b, 0xb7,
+	0x82, 0x34, 0xaa, 0xca, 0x07, 0xa1, 0xf6, 0x56,
+	0x42, 0x1c, 0xb6, 0xf6, 0xb3, 0x00, 0x86, 0x52,
+	0x35, 0x2d, 0xa2, 0x62, 0x4a, 0xbe, 0x89, 0x76,
+};
+
+static const unsigned char user_a[] = { 0x01, 0x02, 0x03, 0x04 };
+static const unsigned char user_b[] = { 0x05, 0x06, 0x07, 0x08 };
+
+static fido_dev_io_t		vdev_frame_io;
+static fido_dev_transport_t	vdev_msg_io;
+static size_t			n_write;
+static size_t			n_tx;
+static size_t			n_rx;
+
+static fido_dev_t *
+open_dev(const vdev_t *v)
+{
+	fido_dev_io_t	 io;
+	fido_dev_t	*dev;
+
+	vdev_io(&io);
+
+	assert((dev = fido_dev_new()) != NULL);
+	assert(fido_dev_set_io_functions(dev, &io) == FIDO_OK);
+	assert(fido_dev_open(dev, vdev_path(v)) == FIDO_OK);
+	assert(fido_dev_is_fido2(dev));
+
+	return (dev);
+}
+
+static void
+close_dev(fido_dev_t **dev)
+{
+	assert(fido_dev_close(*dev) == FIDO_OK);
+	fido_dev_free(dev);
+}
+
+static int
+make_cred(fido_dev_t *dev, fido_cred_t **cred, int type, bool rk,
+    const unsigned char *user, const char *pin)
+{
+	int r;
+
+	assert((*cred = fido_cred_new()) != NULL);
+	assert(fido_cred_set_type(*cred, type) == FIDO_OK);
+	assert(fido_cred_set_clientdata_hash(*cred, cdh,
+	    sizeof(cdh)) == FIDO_OK);
+	assert(fido_cred_set_rp(*cred, RP_ID, "Example") == FIDO_OK);
+	assert(fido_cred_set_user(*cred, user, sizeof(user_a), "jsmith",
+	    "John Smith", NULL) == FIDO_OK);
+	if (rk)
+		assert(fido_cred_set_rk(*cred, FIDO_OPT_TRUE) == FIDO_OK);
+
+	if ((r = fido_dev_make_cred(dev, *cred, pin)) == FIDO_OK)
+		assert(fido_cred_verify(*cred) == FIDO_OK);
+	else
+		fido_cred_free(cred);
+
+	return (r);
+}
+
+static void
+verify_assert(const fido_assert_t *assert, size_t idx, const fido_cred_t *cred)
+{
+	es256_pk_t	*es256;
+	rs256_pk_t	*rs256;
+	eddsa_pk_t	*eddsa;
+
+	switch (fido_cred_type(cred)) {
+	case COSE_ES256:
+		assert((es256 = es256_pk_new()) != NULL);
+		assert(es256_pk_from_ptr(es256, fido_cred_pubkey_ptr(cred),
+		    fido_cred_pubkey_len(cred)) == FIDO_OK);
+		assert(fido_assert_verify(assert, idx, COSE_ES256,
+		    es256) == FIDO_OK);
+		es256_pk_free(&es256);
+		break;
+	case COSE_RS256:
+		assert((rs256 = rs256_pk_new()) != NULL);
+		assert(rs256_pk_from_ptr(rs256, fido_cred_pubkey_ptr(cred),
+		    fido_cred_pubkey_len(cred)) == FIDO_OK);
+		assert(fido_assert_verify(assert, idx, COSE_RS256,
+		    rs256) == FIDO_OK);
+		rs256_pk_free(&rs256);
+		break;
+	default:
+		assert((eddsa = eddsa_pk_new()) != NULL);
+		assert(eddsa_pk_from_ptr(eddsa, fido_cred_pubkey_ptr(cred),
+		    fido_cred_pubkey_len(cred)) == FIDO_OK);
+		assert(fido_assert_verify(assert, idx, COSE_EDDSA,
+		    eddsa) == FIDO_OK);
+		eddsa_pk_free(&eddsa);
+		break;
+	}
+}
+
+static int
+get_assert(fido_dev_t *dev, fido_assert_t **assert, const fido_cred_t *cred,
+    const char *pin)
+{
+	int r;
+
+	assert((*assert = fido_assert_new()) != NULL);
+	assert(fido_assert_set_rp(*assert, RP_ID) == FIDO_OK);
+	assert(fido_assert_set_clientdata_hash(*assert, cdh,
+	    sizeof(cdh)) == FIDO_OK);
+	if (cred != NULL)
+		assert(fido_assert_allow_cred(*assert, fido_cred_id_ptr(cred),
+		    fido_cred_id_len(cred)) == FIDO_OK);
+
+	if ((r = fido_dev_get_assert(dev, *assert, pin)) != FIDO_OK)
+		fido_assert_free(assert);
+
+	return (r);
+}
+
+/*
+ * Register credentials of every supported type and use them.
+ */
+static void
+cred_types(void)
+{
+	const int	 types[] = { COSE_ES256, COSE_RS256, COSE_EDDSA };
+	vdev_t		*v;
+	fido_dev_t	*dev;
+	fido_cred_t	*cred;
+	fido_assert_t	*assert;
+	uint32_t	 sigcount = 0;
+	int		 r;
+
+	assert((v = vdev_new()) != NULL);
+	dev = open_dev(v);
+
+	for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+		r = make_cred(dev, &cred, types[i], false, user_a, NULL);
+		if (types[i] == COSE_EDDSA &&
+		    r == FIDO_ERR_UNSUPPORTED_ALGORITHM)
+			continue; /* no ed25519 in libcrypto */
+		assert(r == FIDO_OK);
+		assert(get_assert(dev, &assert, cred, NULL) == FIDO_OK);
+		assert(fido_assert_count(assert) == 1);
+		assert(fido_assert_sigcount(assert, 0) > sigcount);
+		sigcount = fido_assert_sigcount(assert, 0);
+		verify_assert(assert, 0, cred);
+		fido_assert_free(&assert);
+		fido_cred_free(&cred);
+	}
+
+	/* only rs256 credentials are stored */
+	assert(vdev_cred_count(v) == 1);
+
+	/* unknown credential */
+	assert((assert = fido_assert_new()) != NULL);
+	assert(fido_assert_set_rp(assert, RP_ID) == FIDO_OK);
+	assert(fido_assert_set_clientdata_hash(assert, cdh,
+	    sizeof(cdh)) == FIDO_OK);
+	assert(fido_assert_allow_cred(assert, user_a,
+	    sizeof(user_a)) == FIDO_OK);
+	assert(fido_dev_get_assert(dev, assert,
+	    NULL) == FIDO_ERR_NO_CREDENTIALS);
+	fido_assert_free(&assert);
+
+	close_dev(&dev);
+	vdev_free(&v);
+}
+
+/*
+ * Discoverable credentials, PIN management and credential management.
+ */
+static void
+resident(void)
+{
+	vdev_t			*v;
+	fido_dev_t		*dev;
+	fido_cred_t		*cred_a;
+	fido_cred_t		*cred_b;
+	fido_cred_t		*cred;
+	fido_assert_t		*assert;
+	fido_credman_metadata_t	*meta;
+	fido_credman_rp_t	*rp;
+	fido_credman_rk_t	*rk;
+	int			 retries;
+
+	assert((v = vdev_new()) != NULL);
+	dev = open_dev(v);
+
+	assert(make_cred(dev, &cred_a, COSE_ES256, true, user_a,
+	    NULL) == FIDO_OK);
+	assert(make_cred(dev, &cred_b, COSE_ES256, true, user_b,
+	    NULL) == FIDO_OK);
+	assert(vdev_cred_count(v) == 2);
+
+	/* no user verification: user ids only */
+	assert(get_assert(dev, &assert, NULL, NULL) == FIDO_OK);
+	assert(fido_assert_count(assert) == 2);
+	assert(fido_assert_user_id_len(assert, 0) == sizeof(user_b));
+	assert(memcmp(fido_assert_user_id_ptr(assert, 0), user_b,
+	    sizeof(user_b)) == 0);
+	assert(fido_assert_user_name(assert, 0) == NULL);
+	verify_assert(assert, 0, cred_b);
+	verify_assert(assert, 1, cred_a);
+	fido_assert_free(&assert);
+
+	/* pin */
+	assert(fido_dev_set_pin(dev, "1234", NULL) == FIDO_OK);
+	assert(fido_dev_get_retry_count(dev, &retries) == FIDO_OK);
+	assert(retries == 8);
+	assert(make_cred(dev, &cred, COSE_ES256, false, user_a,
+	    NULL) == FIDO_ERR_PIN_REQUIRED);
+	assert(make_cred(dev, &cred, COSE_ES256, false, user_a,
+	    "4321") == FIDO_ERR_PIN_INVALID);
+	assert(fido_dev_get_retry_count(dev, &retries) == FIDO_OK);
+	assert(retries == 7);
+	assert(fido_dev_set_pin(dev, "5678", "1234") == FIDO_OK);
+	assert(fido_dev_get_retry_count(dev, &retries) == FIDO_OK);
+	assert(retries == 8);
+
+	/* user verification: full user entities */
+	assert(get_assert(dev, &assert, NULL, "5678") == FIDO_OK);
+	assert(fido_assert_count(assert) == 2);
+	assert(fido_assert_flags(assert, 0) & CTAP_AUTHDATA_USER_VERIFIED);
+	assert(strcmp(fido_assert_user_name(assert, 1), "jsmith") == 0);
+	assert(strcmp(fido_assert_user_display_name(assert, 1),
+	    "John Smith") == 0);
+	fido_assert_free(&assert);
+
+	/* credential management */
+	assert((meta = fido_credman_metadata_new()) != NULL);
+	assert(fido_credman_get_dev_metadata(dev, meta, "5678") == FIDO_OK);
+	assert(fido_credman_rk_existing(meta) == 2);
+	fido_credman_metadata_free(&meta);
+
+	assert((rp = fido_credman_rp_new()) != NULL);
+	assert(fido_credman_get_dev_rp(dev, rp, "5678") == FIDO_OK);
+	assert(fido_credman_rp_count(rp) == 1);
+	assert(strcmp(fido_credman_rp_id(rp, 0), RP_ID) == 0);
+	assert(strcmp(fido_credman_rp_name(rp, 0), "Example") == 0);
+	fido_credman_rp_free(&rp);
+
+	assert((rk = fido_credman_rk_new()) != NULL);
+	assert(fido_credman_get_dev_rk(dev, RP_ID, rk, "5678") == FIDO_OK);
+	assert(fido_credman_rk_count(rk) == 2);
+	fido_credman_rk_free(&rk);
+
+	assert(fido_credman_del_dev_rk(dev, fido_cred_id_ptr(cred_a),
+	    fido_cred_id_len(cred_a), "5678") == FIDO_OK);
+	assert(fido_credman_del_dev_rk(dev, fido_cred_id_ptr(cred_a),
+	    fido_cred_id_len(cred_a), "5678") == FIDO_ERR_NO_CREDENTIALS);
+	assert(vdev_cred_count(v) == 1);
+
+	/* reset */
+	assert(fido_dev_reset(dev) == FIDO_OK);
+	assert(vdev_cred_count(v) == 0);
+	assert(get_assert(dev, &assert, NULL, NULL) == FIDO_ERR_NO_CREDENTIALS);
+	assert(make_cred(dev, &cred, COSE_ES256, false, user_a,
+	    NULL) == FIDO_OK);
+
+	fido_cred_free(&cred);
+	fido_cred_free(&cred_a);
+	fido_cred_free(&cred_b);
+	close_dev(&dev);
+	vdev_free(&v);
+}
+
+/*
+ * A saved authenticator keeps its credentials and PIN.
+ */
+static void
+persistence(void)
+{
+	char		 path[] = "/tmp/regress_virtual.XXXXXX";
+	vdev_t		*v;
+	fido_dev_t	*dev;
+	fido_cred_t	*cred_nrk;
+	fido_cred_t	*cred_rk;
+	fido_assert_t	*assert;
+	int		 fd;
+
+	assert((fd = mkstemp(path)) >= 0);
+	close(fd);
+
+	assert((v = vdev_new()) != NULL);
+	dev = open_dev(v);
+	assert(make_cred(dev, &cred_nrk, COSE_ES256, false, user_a,
+	    NULL) == FIDO_OK);
+	assert(make_cred(dev, &cred_rk, COSE_ES256, true, user_b,
+	    NULL) == FIDO_OK);
+	assert(fido_dev_set_pin(dev, "1234", NULL) == FIDO_OK);
+	close_dev(&dev);
+	assert(vdev_save(v, path) == FIDO_OK);
+	vdev_free(&v);
+
+	assert((v = vdev_new()) != NULL);
+	assert(vdev_load(v, "/nonexistent") == FIDO_ERR_INVALID_ARGUMENT);
+	assert(vdev_load(v, path) == FIDO_OK);
+	assert(vdev_cred_count(v) == 1);
+	dev = open_dev(v);
+	assert(get_assert(dev, &assert, cred_nrk, NULL) == FIDO_OK);
+	verify_assert(assert, 0, cred_nrk);
+	fido_assert_free(&assert);
+	assert(get_assert(dev, &assert, NULL, "1234") == FIDO_OK);
+	verify_assert(assert, 0, cred_rk);
+	fido_assert_free(&assert);
+	close_dev(&dev);
+	vdev_free(&v);
+
+	assert(unlink(path) == 0);
+
+	fido_cred_free(&cred_nrk);
+	fido_cred_free(&cred_rk);
+}
+
+static int
+count_write(void *handle, const unsigned char *buf, size_t len)
+{
+	n_write++;
+
+	return (vdev_frame_io.write(handle, buf, len));
+}
+
+static int
+count_tx(void *handle, uint8_t cmd, const unsigned char *buf, size_t len)
+{
+	n_tx++;
+
+	return (vdev_msg_io.tx(handle, cmd, buf, len));
+}
+
+static int
+count_rx(void *handle, uint8_t cmd, unsigned char *buf, size_t len, int ms)
+{
+	n_rx++;
+
+	return (vdev_msg_io.rx(handle, cmd, buf, len, ms));
+}
+
+/*
+ * With message-level transport functions, each request and reply takes
+ * a single call, however many frames it would otherwise span.
+ */
+static void
+transport(void)
+{
+	vdev_t			*v;
+	fido_dev_t		*dev;
+	fido_dev_io_t		 io;
+	fido_dev_transport_t	 t;
+	fido_cred_t		*cred;
+	fido_assert_t		*assert;
+
+	vdev_io(&vdev_frame_io);
+	vdev_transport(&vdev_msg_io);
+
+	io = vdev_frame_io;
+	io.write = count_write;
+	t.tx = count_tx;
+	t.rx = count_rx;
+
+	assert((v = vdev_new()) != NULL);
+	assert((dev = fido_dev_new()) != NULL);
+	assert(fido_dev_set_io_functions(dev, &io) == FIDO_OK);
+	assert(fido_dev_set_transport_functions(dev, NULL) ==
+	    FIDO_ERR_INVALID_ARGUMENT);
+	assert(fido_dev_set_transport_functions(dev, &t) == FIDO_OK);
+	assert(fido_dev_open(dev, vdev_path(v)) == FIDO_OK);
+	assert(fido_dev_is_fido2(dev));
+	assert(fido_dev_set_transport_functions(dev, &t) ==
+	    FIDO_ERR_INVALID_ARGUMENT);
+
+	n_tx = n_rx = 0;
+	assert(make_cred(dev, &cred, COSE_RS256, false, user_a,
+	    NULL) == FIDO_OK);
+	assert(n_tx == 1 && n_rx == 1);
+	assert(get_assert(dev, &assert, cred, NULL) == FIDO_OK);
+	verify_assert(assert, 0, cred);
+	assert(n_tx == 2 && n_rx == 2);
+	assert(n_write == 0);
+
+	fido_assert_free(&assert);
+	fido_cred_free(&cred);
+	close_dev(&dev);
+	vdev_free(&v);
+}
+
+int
+main(void)
+{
+	fido_init(0);
+
+	cred_types();
+	resident();
+	persistence();
+	transport();
+
+	exit(0);
+}
@@ -0,0 +1,397 @@
+/*
+ * Copyright (c) 2020 Yubico AB. All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+#include <openssl/sha.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "fido.h"
+#include "fido/affinity.h"
+
+/*
+ * A map from credential ids to the device (path and aaguid) that last
+ * used them. Credential ids are stored as sha256 digests. The map holds
+ * at most FIDO_AFFINITY_MAX entries; once full, entries are replaced in a
+ * round-robin fashion.
+ *
+ * On disk, each entry is stored as a line of the form
+ *
+ *	<hex(sha256(credential id))> <hex(aaguid)> <path>
+ */
+
+static const unsigned char zero_aaguid[16];
+
+static int
+hash_id(const unsigned char *id, size_t id_len, unsigned char *hash)
+{
+	if (SHA256(id, id_len, hash) != hash) {
+		fido_log_debug("%s: sha256", __func__);
+		return (-1);
+	}
+
+	return (0);
+}
+
+static struct fido_affinity_entry *
+find_hash(const fido_affinity_t *af, const unsigned char *hash)
+{
+	for (size_t i = 0; i < af->n_used; i++)
+		if (memcmp(af->ptr[i].id_hash, hash, 32) == 0)
+			return (&af->ptr[i]);
+
+	return (NULL);
+}
+
+static const unsigned char *
+find_aaguid(const fido_affinity_t *af, const char *path)
+{
+	for (size_t i = 0; i < af->n_used; i++)
+		if (strcmp(af->ptr[i].path, path) == 0 &&
+		    memcmp(af->ptr[i].aaguid, zero_aaguid, 16) != 0)
+			return (af->ptr[i].aaguid);
+
+	return (NULL);
+}
+
+/*
+ * Check that the authenticator at path is the one an entry refers to.
+ * Device paths are reused, e.g. when authenticators are unplugged and
+ * plugged back in a different order.
+ */
+static bool
+dev_has_aaguid(const char *path, const unsigned char *aaguid)
+{
+	fido_dev_t		*dev = NULL;
+	fido_cbor_info_t	*ci = NULL;
+	bool			 ok = false;
+
+	if ((dev = fido_dev_new()) == NULL ||
+	    (ci = fido_cbor_info_new()) == NULL ||
+	    fido_dev_open(dev, path) != FIDO_OK) {
+		fido_log_debug("%s: fido_dev_open %s", __func__, path);
+		goto fail;
+	}
+
+	if (fido_dev_get_cbor_info(dev, ci) != FIDO_OK ||
+	    fido_cbor_info_aaguid_len(ci) != 16) {
+		fido_log_debug("%s: fido_dev_get_cbor_info %s", __func__,
+		    path);
+	} else
+		ok = memcmp(fido_cbor_info_aaguid_ptr(ci), aaguid, 16) == 0;
+
+	fido_dev_close(dev);
+fail:
+	fido_dev_free(&dev);
+	fido_cbor_info_free(&ci);
+
+	return (ok);
+}
+
+static int
+set_hash(fido_affinity_t *af, const unsigned char *hash,
+    const unsigned char *aaguid, const char *path)
+{
+	struct fido_affinity_entry	*e;
+	unsigned char			 buf[16];
+	char				*p;
+
+	if ((p = strdup(path)) == NULL)
+		return (-1);
+
+	if (aaguid == NULL && (aaguid = find_aaguid(af, path)) == NULL)
+		aaguid = zero_aaguid;
+	/* copied, as af->ptr may be reallocated or the entry replaced below */
+	memcpy(buf, aaguid, sizeof(buf));
+
+	if ((e = find_hash(af, hash)) == NULL) {
+		if (af->n_used < af->n_alloc)
+			e = &af->ptr[af->n_used++];
+		else if (af->n_alloc < FIDO_AFFINITY_MAX) {
+			size_t n = af->n_alloc ? af->n_alloc * 2 : 16;
+			if (n > FIDO_AFFINITY_MAX)
+				n = FIDO_AFFINITY_MAX;
+			if ((e = recallocarray(af->ptr, af->n_alloc, n,
+			    sizeof(*e))) == NULL) {
+				free(p);
+				return (-1);
+			}
+			af->ptr = e;
+			af->n_alloc = n;
+			e = &af->ptr[af->n_used++];
+		} else {
+			e = &af->ptr[af->next++ % af->n_alloc];
+		}
+		memcpy(e->id_hash, hash, sizeof(e->id_hash));
+	}
+
+	memcpy(e->aaguid, buf, sizeof(e->aaguid));
+	free(e->path);
+	e->path = p;
+
+	return (0);
+}
+
+static int
+set_id(fido_affinity_t *af, const fido_blob_t *id, const unsigned char *aaguid,
+    const char *path)
+{
+	unsigned char hash[SHA256_DIGEST_LENGTH];
+
+	if (fido_blob_is_empty(id) || hash_id(id->ptr, id->len, hash) < 0 ||
+	    set_hash(af, hash, aaguid, path) < 0) {
+		fido_log_debug("%s: failed", __func__);
+		return (-1);
+	}
+
+	return (0);
+}
+
+void
+fido_affinity_learn_cred(const fido_dev_t *dev, const fido_cred_t *cred)
+{
+	if (dev->affinity == NULL || dev->path == NULL)
+		return;
+
+	if (set_id(dev->affinity, &cred->attcred.id, cred->attcred.aaguid,
+	    dev->path) < 0)
+		fido_log_debug("%s: set_id", __func__);
+}
+
+void
+fido_affinity_learn_assert(const fido_dev_t *dev, const fido_assert_t *assert)
+{
+	const fido_blob_t *id;
+
+	if (dev->affinity == NULL || dev->path == NULL)
+		return;
+
+	for (size_t i = 0; i < assert->stmt_len; i++) {
+		id = &assert->stmt[i].id;
+		/* the credential id may be omitted if the list has one entry */
+		if (fido_blob_is_empty(id) && assert->allow_list.len == 1)
+			id = &assert->allow_list.ptr[0];
+		if (set_id(dev->affinity, id, NULL, dev->path) < 0)
+			fido_log_debug("%s: set_id %zu", __func__, i);
+	}
+}
+
+static int
+decode_hex(const char *hex, unsigned char *ptr, size_t len)
+{
+	unsigned int x;
+
+	if (strlen(hex) != len * 2)
+		return (-1);
+
+	for (size_t i = 0; i < len; i++) {
+		if (sscanf(&hex[i * 2], "%2x", &x) != 1)
+			return (-1);
+		ptr[i] = (unsigned char)x;
+	}
+
+	return (0);
+}
+
+static int
+load_line(fido_affinity_t *af, const char *line)
+{
+	unsigned char	hash[32];
+	unsigned char	aaguid[16];
+	char		hash_hex[65];
+	char		aaguid_hex[33];
+	char		path[1024];
+	int		n = 0;
+
+	if (sscanf(line, "%64s %32s %n", hash_hex, aaguid_hex, &n) != 2 ||
+	    n <= 0 || decode_hex(hash_hex, hash, sizeof(hash)) < 0 ||
+	    decode_hex(aaguid_hex, aaguid, sizeof(aaguid)) < 0)
+		return (-1);
+
+	if (strlcpy(path, &line[n], sizeof(path)) >= sizeof(path))
+		return (-1);
+
+	path[strcspn(path, "\r\n")] = '\0';
+	if (path[0] == '\0')
+		return (-1);
+
+	return (set_hash(af, hash, aaguid, path));
+}
+
+int
+fido_affinity_load(fido_affinity_t *af, const char *file)
+{
+	FILE	*fp;
+	char	 line[1024];
+	int	 r;
+
+	if ((fp = fopen(file, "r")) == NULL) {
+		fido_log_debug("%s: fopen %s", __func__, file);
+		return (FIDO_ERR_INVALID_ARGUMENT);
+	}
+
+	r = FIDO_OK;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (load_line(af, line) < 0) {
+			fido_log_debug("%s: load_line", __func__);
+			r = FIDO_ERR_INVALID_ARGUMENT;
+			break;
+		}
+	}
+
+	if (ferror(fp)) {
+		fido_log_debug("%s: fgets", __func__);
+		r = FIDO_ERR_INTERNAL;
+	}
+
+	fclose(fp);
+
+	return (r);
+}
+
+int
+fido_affinity_save(const fido_affinity_t *af, const char *file)
+{
+	const struct fido_affinity_entry	*e;
+	FILE					*fp;
+	int					 r;
+
+	if ((fp = fopen(file, "w")) == NULL) {
+		fido_log_debug("%s: fopen %s", __func__, file);
+		return (FIDO_ERR_INVALID_ARGUMENT);
+	}
+
+	r = FIDO_OK;
+
+	for (size_t i = 0; i < af->n_used && r == FIDO_OK; i++) {
+		e = &af->ptr[i];
+		for (size_t j = 0; j < sizeof(e->id_hash); j++)
+			if (fprintf(fp, "%02x", e->id_hash[j]) < 0)
+				r = FIDO_ERR_INTERNAL;
+		if (fputc(' ', fp) == EOF)
+			r = FIDO_ERR_INTERNAL;
+		for (size_t j = 0; j < sizeof(e->aaguid); j++)
+			if (fprintf(fp, "%02x", e->aaguid[j]) < 0)
+				r = FIDO_ERR_INTERNAL;
+		if (fprintf(fp, " %s\n", e->path) < 0)
+			r = FIDO_ERR_INTERNAL;
+	}
+
+	if (fclose(fp) != 0)
+		r = FIDO_ERR_INTERNAL;
+
+	return (r);
+}
+
+int
+fido_affinity_route(const fido_affinity_t *af, const fido_assert_t *assert,
+    const fido_dev_info_t *devlist, size_t ndevs, size_t *idx)
+{
+	const struct fido_affinity_entry	*e;
+	unsigned char				 hash[SHA256_DIGEST_LENGTH];
+	size_t					 j;
+
+	for (size_t i = 0; i < assert->allow_list.len; i++) {
+		const fido_blob_t *id = &assert->allow_list.ptr[i];
+		if (hash_id(id->ptr, id->len, hash) < 0)
+			return (FIDO_ERR_INTERNAL);
+		if ((e = find_hash(af, hash)) == NULL)
+			continue;
+		for (j = 0; j < ndevs; j++)
+			if (devlist[j].path != NULL &&
+			    strcmp(devlist[j].path, e->path) == 0)
+				break;
+		if (j == ndevs) {
+			fido_log_debug("%s: %s not present", __func__, e->path);
+			continue;
+		}
+		/* an unknown aaguid matches any authenticator */
+		if (memcmp(e->aaguid, zero_aaguid, 16) != 0 &&
+		    !dev_has_aaguid(e->path, e->aaguid)) {
+			fido_log_debug("%s: %s aaguid mismatch", __func__,
+			    e->path);
+			continue;
+		}
+		*idx = j;
+		return (FIDO_OK);
+	}
+
+	return (FIDO_ERR_NO_CREDENTIALS);
+}
+
+/*
+ * get/set functions for fido_affinity_t; always at the end of the file
+ */
+
+fido_affinity_t *
+fido_affinity_new(void)
+{
+	return (calloc(1, sizeof(fido_affinity_t)));
+}
+
+void
+fido_affinity_free(fido_affinity_t **af_p)
+{
+	fido_affinity_t *af;
+
+	if (af_p == NULL || (af = *af_p) == NULL)
+		return;
+
+	for (size_t i = 0; i < af->n_used; i++)
+		free(af->ptr[i].path);
+
+	free(af->ptr);
+	free(af);
+
+	*af_p = NULL;
+}
+
+int
+fido_affinity_set(fido_affinity_t *af, const unsigned char *id,
+    size_t id_len, const unsigned char *aaguid, size_t aaguid_len,
+    const char *path)
+{
+	unsigned char hash[SHA256_DIGEST_LENGTH];
+
+	if (id == NULL || id_len == 0 || path == NULL || (aaguid != NULL &&
+	    aaguid_len != sizeof(af->ptr->aaguid)))
+		return (FIDO_ERR_INVALID_ARGUMENT);
+
+	if (hash_id(id, id_len, hash) < 0 ||
+	    set_hash(af, hash, aaguid, path) < 0)
+		return (FIDO_ERR_INTERNAL);
+
+	return (FIDO_OK);
+}
+
+int
+fido_dev_set_affinity(fido_dev_t *dev, fido_affinity_t *af)
+{
+	dev->affinity = af;
+
+	return (FIDO_OK);
+}
+
+const char *
+fido_affinity_path(const fido_affinity_t *af, const unsigned char *id,
+    size_t id_len)
+{
+	const struct fido_affinity_entry	*e;
+	unsigned char				 hash[SHA256_DIGEST_LENGTH];
+
+	if (id == NULL || id_len == 0 || hash_id(id, id_len, hash) < 0 ||
+	    (e = find_hash(af, hash)) == NULL)
+		return (NULL);
+
+	return (e->path);
+}
+
+size_t
+fido_affinity_count(const fido_affinity_t *af)
+{
+	return (af->n_used);
+}
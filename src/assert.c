@@ -170,15 +170,15 @@ fail:
 static int
 fido_dev_get_assert_rx(fido_dev_t *dev, fido_assert_t *assert, int ms)
 {
-	const uint8_t	cmd = CTAP_FRAME_INIT | CTAP_CMD_CBOR;
-	unsigned char	reply[2048];
-	int		reply_len;
-	int		r;
+	const uint8_t		 cmd = CTAP_FRAME_INIT | CTAP_CMD_CBOR;
+	const unsigned char	*reply;
+	int			 reply_len;
+	int			 r;
 
 	fido_assert_reset_rx(assert);
 
-	if ((reply_len = fido_rx(dev, cmd, &reply, sizeof(reply), ms)) < 0) {
-		fido_log_debug("%s: fido_rx", __func__);
+	if ((reply_len = fido_rx_buf(dev, cmd, &reply, ms)) < 0) {
+		fido_log_debug("%s: fido_rx_buf", __func__);
 		return (FIDO_ERR_RX);
 	}
 
@@ -225,13 +225,13 @@ fido_get_next_assert_tx(fido_dev_t *dev)
 static int
 fido_get_next_assert_rx(fido_dev_t *dev, fido_assert_t *assert, int ms)
 {
-	const uint8_t	cmd = CTAP_FRAME_INIT | CTAP_CMD_CBOR;
-	unsigned char	reply[2048];
-	int		reply_len;
-	int		r;
+	const uint8_t		 cmd = CTAP_FRAME_INIT | CTAP_CMD_CBOR;
+	const unsigned char	*reply;
+	int			 reply_len;
+	int			 r;
 
-	if ((reply_len = fido_rx(dev, cmd, &reply, sizeof(reply), ms)) < 0) {
-		fido_log_debug("%s: fido_rx", __func__);
+	if ((reply_len = fido_rx_buf(dev, cmd, &reply, ms)) < 0) {
+		fido_log_debug("%s: fido_rx_buf", __func__);
 		return (FIDO_ERR_RX);
 	}
 
@@ -271,6 +271,202 @@ fido_dev_get_assert_wait(fido_dev_t *dev, fido_assert_t *assert,
 	return (FIDO_OK);
 }
 
+/*
+ * Upper bound on the CBOR encoding of an allow list entry, i.e.
+ * { "id": bstr, "type": "public-key" }.
+ */
+static size_t
+allow_list_entry_len(const fido_blob_t *id)
+{
+	return (1 + 3 + 9 + id->len + 5 + 11);
+}
+
+/*
+ * Upper bound on the CBOR encoding of a silent getAssertion request,
+ * excluding the allow list entries.
+ */
+static size_t
+assert_probe_len(const fido_assert_t *assert)
+{
+	return (64 + strlen(assert->rp_id) + assert->cdh.len);
+}
+
+/*
+ * Number of credentials, starting at 'id', that fit in a single silent
+ * getAssertion request given the authenticator's advertised limits.
+ */
+static size_t
+allow_list_chunk_len(const fido_assert_t *assert, const fido_blob_t *id,
+    size_t len, uint64_t maxcnt, uint64_t maxmsgsiz)
+{
+	size_t	msglen;
+	size_t	n;
+
+	msglen = assert_probe_len(assert);
+
+	for (n = 0; n < len && (maxcnt == 0 || n < maxcnt); n++) {
+		if ((msglen += allow_list_entry_len(&id[n])) > maxmsgsiz)
+			break;
+	}
+
+	return (n);
+}
+
+/*
+ * Issue silent (up=false) assertions over chunks of the allow list until
+ * the authenticator recognises one of the credentials; its id is copied
+ * to 'found'. Credential ids longer than 'maxidlen' cannot have been
+ * issued by the authenticator and are skipped.
+ */
+static int
+fido_dev_get_assert_probe(fido_dev_t *dev, fido_assert_t *assert,
+    uint64_t maxcnt, uint64_t maxidlen, uint64_t maxmsgsiz, fido_blob_t *found,
+    int ms)
+{
+	fido_blob_array_t	 allow_list = assert->allow_list;
+	fido_opt_t		 up = assert->up;
+	fido_opt_t		 uv = assert->uv;
+	int			 ext = assert->ext;
+	fido_blob_t		*id = NULL;
+	fido_blob_t		*match;
+	size_t			 len = 0;
+	size_t			 n;
+	int			 r;
+
+	if ((id = calloc(allow_list.len, sizeof(*id))) == NULL)
+		return (FIDO_ERR_INTERNAL);
+
+	for (size_t i = 0; i < allow_list.len; i++) {
+		if (maxidlen != 0 && allow_list.ptr[i].len > maxidlen) {
+			fido_log_debug("%s: skipping id %zu, len=%zu", __func__,
+			    i, allow_list.ptr[i].len);
+			continue;
+		}
+		id[len++] = allow_list.ptr[i]; /* shallow */
+	}
+
+	assert->up = FIDO_OPT_FALSE;
+	assert->uv = FIDO_OPT_OMIT;
+	assert->ext = 0;
+
+	r = FIDO_ERR_NO_CREDENTIALS;
+
+	for (size_t off = 0; off < len; off += n) {
+		if ((n = allow_list_chunk_len(assert, &id[off], len - off,
+		    maxcnt, maxmsgsiz)) == 0) {
+			fido_log_debug("%s: skipping id %zu", __func__, off);
+			n = 1;
+			continue;
+		}
+		fido_log_debug("%s: probing %zu@%zu", __func__, n, off);
+		assert->allow_list.ptr = &id[off];
+		assert->allow_list.len = n;
+		if ((r = fido_dev_get_assert_tx(dev, assert, NULL, NULL,
+		    NULL)) != FIDO_OK ||
+		    (r = fido_dev_get_assert_rx(dev, assert, ms)) != FIDO_OK) {
+			if (r == FIDO_ERR_NO_CREDENTIALS)
+				continue;
+			fido_log_debug("%s: fido_dev_get_assert", __func__);
+			break;
+		}
+		/* the credential id may be omitted if the list has one entry */
+		if (assert->stmt[0].id.ptr != NULL)
+			match = &assert->stmt[0].id;
+		else if (n == 1)
+			match = &id[off];
+		else {
+			fido_log_debug("%s: missing credential id", __func__);
+			r = FIDO_ERR_INVALID_CBOR;
+			break;
+		}
+		if (fido_blob_set(found, match->ptr, match->len) < 0)
+			r = FIDO_ERR_INTERNAL;
+		break;
+	}
+
+	assert->allow_list = allow_list;
+	assert->up = up;
+	assert->uv = uv;
+	assert->ext = ext;
+
+	fido_assert_reset_rx(assert);
+	free(id);
+
+	return (r);
+}
+
+/*
+ * Assertion over an allow list that may not fit in a single request: the
+ * matching credential is first located using silent assertions, and a
+ * single assertion honouring the caller's options is then issued for it.
+ * The user is therefore only asked for presence once.
+ */
+static int
+fido_dev_get_assert_chunked(fido_dev_t *dev, fido_assert_t *assert,
+    const es256_pk_t *pk, const fido_blob_t *ecdh, const char *pin, int ms)
+{
+	fido_cbor_info_t	*ci = NULL;
+	fido_blob_array_t	 allow_list = assert->allow_list;
+	fido_blob_t		 found;
+	uint64_t		 maxcnt;
+	uint64_t		 maxidlen;
+	uint64_t		 maxmsgsiz;
+	int			 r;
+
+	memset(&found, 0, sizeof(found));
+
+	/* the limits are learnt once per open device */
+	if (dev->info_known == false) {
+		if ((ci = fido_cbor_info_new()) == NULL) {
+			r = FIDO_ERR_INTERNAL;
+			goto fail;
+		}
+		if ((r = fido_dev_get_cbor_info(dev, ci)) != FIDO_OK) {
+			fido_log_debug("%s: fido_dev_get_cbor_info", __func__);
+			goto fail;
+		}
+	}
+
+	maxcnt = dev->maxcredcntlst;
+	maxidlen = dev->maxcredidlen;
+	if ((maxmsgsiz = dev->maxmsgsiz) == 0)
+		maxmsgsiz = CTAP_MAX_MSG_LEN;
+
+	fido_log_debug("%s: maxcnt=%llu, maxidlen=%llu, maxmsgsiz=%llu",
+	    __func__, (unsigned long long)maxcnt,
+	    (unsigned long long)maxidlen, (unsigned long long)maxmsgsiz);
+
+	/* does the whole list fit in a single request? */
+	if (allow_list_chunk_len(assert, allow_list.ptr, allow_list.len,
+	    maxcnt, maxmsgsiz) == allow_list.len) {
+		size_t i;
+		for (i = 0; i < allow_list.len; i++)
+			if (maxidlen != 0 && allow_list.ptr[i].len > maxidlen)
+				break;
+		if (i == allow_list.len) {
+			r = fido_dev_get_assert_wait(dev, assert, pk, ecdh,
+			    pin, ms);
+			goto fail;
+		}
+	}
+
+	if ((r = fido_dev_get_assert_probe(dev, assert, maxcnt, maxidlen,
+	    maxmsgsiz, &found, ms)) != FIDO_OK) {
+		fido_log_debug("%s: fido_dev_get_assert_probe", __func__);
+		goto fail;
+	}
+
+	assert->allow_list.ptr = &found;
+	assert->allow_list.len = 1;
+	r = fido_dev_get_assert_wait(dev, assert, pk, ecdh, pin, ms);
+	assert->allow_list = allow_list;
+fail:
+	fido_cbor_info_free(&ci);
+	free(found.ptr);
+
+	return (r);
+}
+
 static int
 decrypt_hmac_secrets(fido_assert_t *assert, const fido_blob_t *key)
 {
@@ -305,7 +501,9 @@ fido_dev_get_assert(fido_dev_t *dev, fido_assert_t *assert, const char *pin)
 	if (fido_dev_is_fido2(dev) == false) {
 		if (pin != NULL || assert->ext != 0)
 			return (FIDO_ERR_UNSUPPORTED_OPTION);
-		return (u2f_authenticate(dev, assert, -1));
+		if ((r = u2f_authenticate(dev, assert, -1)) == FIDO_OK)
+			fido_affinity_learn_assert(dev, assert);
+		return (r);
 	}
 
 	if (pin != NULL || assert->ext != 0) {
@@ -315,7 +513,11 @@ fido_dev_get_assert(fido_dev_t *dev, fido_assert_t *assert, const char *pin)
 		}
 	}
  
-	r = fido_dev_get_assert_wait(dev, assert, pk, ecdh, pin, -1);
+	if (dev->preflight && assert->allow_list.len > 0)
+		r = fido_dev_get_assert_chunked(dev, assert, pk, ecdh, pin,
+		    -1);
+	else
+		r = fido_dev_get_assert_wait(dev, assert, pk, ecdh, pin, -1);
 	if (r == FIDO_OK && assert->ext & FIDO_EXT_HMAC_SECRET)
 		if (decrypt_hmac_secrets(assert, ecdh) < 0) {
 			fido_log_debug("%s: decrypt_hmac_secrets", __func__);
@@ -323,6 +525,8 @@ fido_dev_get_assert(fido_dev_t *dev, fido_assert_t *assert, const char *pin)
 			goto fail;
 		}
 
+	if (r == FIDO_OK)
+		fido_affinity_learn_assert(dev, assert);
 fail:
 	es256_pk_free(&pk);
 	fido_blob_free(&ecdh);
@@ -419,13 +623,16 @@ fido_verify_sig_es256(const fido_blob_t *dgst, const es256_pk_t *pk,
 {
 	EVP_PKEY	*pkey = NULL;
 	EC_KEY		*ec = NULL;
+	uint64_t	 t0 = fido_trace_begin();
 	int		 ok = -1;
 
+	FIDO_PROBE1(verify__sig__start, COSE_ES256);
+
 	/* ECDSA_verify needs ints */
 	if (dgst->len > INT_MAX || sig->len > INT_MAX) {
 		fido_log_debug("%s: dgst->len=%zu, sig->len=%zu", __func__,
 		    dgst->len, sig->len);
-		return (-1);
+		goto fail;
 	}
 
 	if ((pkey = es256_pk_to_EVP_PKEY(pk)) == NULL ||
@@ -445,6 +652,11 @@ fail:
 	if (pkey != NULL)
 		EVP_PKEY_free(pkey);
 
+	fido_metrics_add(NULL, ok == 0 ? FIDO_METRIC_VERIFY_ES256_OK :
+	    FIDO_METRIC_VERIFY_ES256_FAIL, 1);
+	fido_trace_end(FIDO_TRACE_CRYPTO, t0, ok);
+	FIDO_PROBE2(verify__sig__done, COSE_ES256, ok);
+
 	return (ok);
 }
 
@@ -454,13 +666,16 @@ fido_verify_sig_rs256(const fido_blob_t *dgst, const rs256_pk_t *pk,
 {
 	EVP_PKEY	*pkey = NULL;
 	RSA		*rsa = NULL;
+	uint64_t	 t0 = fido_trace_begin();
 	int		 ok = -1;
 
+	FIDO_PROBE1(verify__sig__start, COSE_RS256);
+
 	/* RSA_verify needs unsigned ints */
 	if (dgst->len > UINT_MAX || sig->len > UINT_MAX) {
 		fido_log_debug("%s: dgst->len=%zu, sig->len=%zu", __func__,
 		    dgst->len, sig->len);
-		return (-1);
+		goto fail;
 	}
 
 	if ((pkey = rs256_pk_to_EVP_PKEY(pk)) == NULL ||
@@ -480,6 +695,11 @@ fail:
 	if (pkey != NULL)
 		EVP_PKEY_free(pkey);
 
+	fido_metrics_add(NULL, ok == 0 ? FIDO_METRIC_VERIFY_RS256_OK :
+	    FIDO_METRIC_VERIFY_RS256_FAIL, 1);
+	fido_trace_end(FIDO_TRACE_CRYPTO, t0, ok);
+	FIDO_PROBE2(verify__sig__done, COSE_RS256, ok);
+
 	return (ok);
 }
 
@@ -489,13 +709,16 @@ fido_verify_sig_eddsa(const fido_blob_t *dgst, const eddsa_pk_t *pk,
 {
 	EVP_PKEY	*pkey = NULL;
 	EVP_MD_CTX	*mdctx = NULL;
+	uint64_t	 t0 = fido_trace_begin();
 	int		 ok = -1;
 
+	FIDO_PROBE1(verify__sig__start, COSE_EDDSA);
+
 	/* EVP_DigestVerify needs ints */
 	if (dgst->len > INT_MAX || sig->len > INT_MAX) {
 		fido_log_debug("%s: dgst->len=%zu, sig->len=%zu", __func__,
 		    dgst->len, sig->len);
-		return (-1);
+		goto fail;
 	}
 
 	if ((pkey = eddsa_pk_to_EVP_PKEY(pk)) == NULL) {
@@ -527,6 +750,11 @@ fail:
 	if (pkey != NULL)
 		EVP_PKEY_free(pkey);
 
+	fido_metrics_add(NULL, ok == 0 ? FIDO_METRIC_VERIFY_EDDSA_OK :
+	    FIDO_METRIC_VERIFY_EDDSA_FAIL, 1);
+	fido_trace_end(FIDO_TRACE_CRYPTO, t0, ok);
+	FIDO_PROBE2(verify__sig__done, COSE_EDDSA, ok);
+
 	return (ok);
 }
 
@@ -540,6 +768,8 @@ fido_assert_verify(const fido_assert_t *assert, size_t idx, int cose_alg,
 	int			 ok = -1;
 	int			 r;
 
+	FIDO_PROBE2(assert__verify__start, idx, cose_alg);
+
 	dgst.ptr = buf;
 	dgst.len = sizeof(buf);
 
@@ -610,6 +840,8 @@ fido_assert_verify(const fido_assert_t *assert, size_t idx, int cose_alg,
 out:
 	explicit_bzero(buf, sizeof(buf));
 
+	FIDO_PROBE1(assert__verify__done, r);
+
 	return (r);
 }
 
@@ -783,6 +1015,13 @@ fido_assert_reset_rx(fido_assert_t *assert)
 	assert->stmt_cnt = 0;
 }
 
+void
+fido_assert_reset(fido_assert_t *assert)
+{
+	fido_assert_reset_tx(assert);
+	fido_assert_reset_rx(assert);
+}
+
 void
 fido_assert_free(fido_assert_t **assert_p)
 {
@@ -791,8 +1030,7 @@ fido_assert_free(fido_assert_t **assert_p)
 	if (assert_p == NULL || (assert = *assert_p) == NULL)
 		return;
 
-	fido_assert_reset_tx(assert);
-	fido_assert_reset_rx(assert);
+	fido_assert_reset(assert);
 
 	free(assert);
 
@@ -973,7 +1211,7 @@ fido_assert_set_authdata(fido_assert_t *assert, size_t idx,
 	stmt = &assert->stmt[idx];
 	fido_assert_clean_authdata(stmt);
 
-	if ((item = cbor_load(ptr, len, &cbor)) == NULL) {
+	if ((item = cbor_load_checked(ptr, len, &cbor)) == NULL) {
 		fido_log_debug("%s: cbor_load", __func__);
 		r = FIDO_ERR_INVALID_ARGUMENT;
 		goto fail;
@@ -235,15 +235,15 @@ bio_parse_template_array(const cbor_item_t *key, const cbor_item_t *val,
 static int
 bio_rx_template_array(fido_dev_t *dev, fido_bio_template_array_t *ta, int ms)
 {
-	const uint8_t	cmd = CTAP_FRAME_INIT | CTAP_CMD_CBOR;
-	unsigned char	reply[2048];
-	int		reply_len;
-	int		r;
+	const uint8_t		 cmd = CTAP_FRAME_INIT | CTAP_CMD_CBOR;
+	const unsigned char	*reply;
+	int			 reply_len;
+	int			 r;
 
 	bio_reset_template_array(ta);
 
-	if ((reply_len = fido_rx(dev, cmd, &reply, sizeof(reply), ms)) < 0) {
-		fido_log_debug("%s: fido_rx", __func__);
+	if ((reply_len = fido_rx_buf(dev, cmd, &reply, ms)) < 0) {
+		fido_log_debug("%s: fido_rx_buf", __func__);
 		return (FIDO_ERR_RX);
 	}
 
@@ -382,18 +382,18 @@ static int
 bio_rx_enroll_begin(fido_dev_t *dev, fido_bio_template_t *t,
     fido_bio_enroll_t *e, int ms)
 {
-	const uint8_t	cmd = CTAP_FRAME_INIT | CTAP_CMD_CBOR;
-	unsigned char	reply[2048];
-	int		reply_len;
-	int		r;
+	const uint8_t		 cmd = CTAP_FRAME_INIT | CTAP_CMD_CBOR;
+	const unsigned char	*reply;
+	int			 reply_len;
+	int			 r;
 
 	bio_reset_template(t);
 
 	e->remaining_samples = 0;
 	e->last_status = 0;
 
-	if ((reply_len = fido_rx(dev, cmd, &reply, sizeof(reply), ms)) < 0) {
-		fido_log_debug("%s: fido_rx", __func__);
+	if ((reply_len = fido_rx_buf(dev, cmd, &reply, ms)) < 0) {
+		fido_log_debug("%s: fido_rx_buf", __func__);
 		return (FIDO_ERR_RX);
 	}
 
@@ -482,16 +482,16 @@ fail:
 static int
 bio_rx_enroll_continue(fido_dev_t *dev, fido_bio_enroll_t *e, int ms)
 {
-	const uint8_t	cmd = CTAP_FRAME_INIT | CTAP_CMD_CBOR;
-	unsigned char	reply[2048];
-	int		reply_len;
-	int		r;
+	const uint8_t		 cmd = CTAP_FRAME_INIT | CTAP_CMD_CBOR;
+	const unsigned char	*reply;
+	int			 reply_len;
+	int			 r;
 
 	e->remaining_samples = 0;
 	e->last_status = 0;
 
-	if ((reply_len = fido_rx(dev, cmd, &reply, sizeof(reply), ms)) < 0) {
-		fido_log_debug("%s: fido_rx", __func__);
+	if ((reply_len = fido_rx_buf(dev, cmd, &reply, ms)) < 0) {
+		fido_log_debug("%s: fido_rx_buf", __func__);
 		return (FIDO_ERR_RX);
 	}
 
@@ -643,15 +643,15 @@ bio_parse_info(const cbor_item_t *key, const cbor_item_t *val, void *arg)
 static int
 bio_rx_info(fido_dev_t *dev, fido_bio_info_t *i, int ms)
 {
-	const uint8_t	cmd = CTAP_FRAME_INIT | CTAP_CMD_CBOR;
-	unsigned char	reply[2048];
-	int		reply_len;
-	int		r;
+	const uint8_t		 cmd = CTAP_FRAME_INIT | CTAP_CMD_CBOR;
+	const unsigned char	*reply;
+	int			 reply_len;
+	int			 r;
 
 	bio_reset_info(i);
 
-	if ((reply_len = fido_rx(dev, cmd, &reply, sizeof(reply), ms)) < 0) {
-		fido_log_debug("%s: fido_rx", __func__);
+	if ((reply_len = fido_rx_buf(dev, cmd, &reply, ms)) < 0) {
+		fido_log_debug("%s: fido_rx_buf", __func__);
 		return (FIDO_ERR_RX);
 	}
 
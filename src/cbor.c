@@ -11,6 +11,8 @@
 #include <string.h>
 #include "fido.h"
 
+#define CBOR_MAX_DEPTH	32
+
 static int
 check_key_type(cbor_item_t *item)
 {
@@ -119,14 +121,123 @@ cbor_array_iter(const cbor_item_t *item, void *arg, int(*f)(const cbor_item_t *,
 	return (0);
 }
 
+/*
+ * Walk the headers of the first CBOR item in ptr, checking that strings
+ * fit in the buffer and that arrays and maps do not declare more elements
+ * than there are bytes left. libcbor allocates arrays and maps upfront,
+ * from their declared size, so an unchecked 9-byte header can cost
+ * gigabytes of zeroed memory.
+ */
+static int
+cbor_check_lengths(const unsigned char *ptr, size_t len)
+{
+	uint64_t	left[CBOR_MAX_DEPTH]; /* items left at each level */
+	uint64_t	n;
+	size_t		depth = 1;
+	size_t		hlen;
+	uint8_t		type;
+	uint8_t		info;
+
+	left[0] = 1;
+
+	while (depth > 0) {
+		if (len == 0)
+			return (-1);
+		if (ptr[0] == 0xff) {
+			/* break; closes an indefinite item */
+			if (left[depth - 1] != UINT64_MAX)
+				return (-1);
+			ptr++;
+			len--;
+			depth--;
+			goto pop;
+		}
+
+		type = ptr[0] >> 5;
+		info = ptr[0] & 0x1f;
+		hlen = 1;
+		n = info;
+
+		if (info >= 24 && info <= 27) {
+			hlen += (size_t)1 << (info - 24);
+			if (len < hlen)
+				return (-1);
+			n = 0;
+			for (size_t i = 1; i < hlen; i++)
+				n = (n << 8) | ptr[i];
+		} else if (info > 27 && (info != 31 || type < 2 || type > 5))
+			return (-1);
+
+		ptr += hlen;
+		len -= hlen;
+
+		/* a tag and the item it tags count as one */
+		if (type != 6 && left[depth - 1] != UINT64_MAX)
+			left[depth - 1]--;
+
+		if (info == 31) {
+			if (depth == CBOR_MAX_DEPTH)
+				return (-1);
+			left[depth++] = UINT64_MAX;
+			continue;
+		}
+
+		switch (type) {
+		case 2: /* byte string */
+		case 3: /* text string */
+			if (n > len)
+				return (-1);
+			ptr += n;
+			len -= n;
+			break;
+		case 4: /* array */
+		case 5: /* map */
+			if (type == 5 && n > UINT64_MAX / 2)
+				return (-1);
+			if (type == 5)
+				n *= 2;
+			if (n > len)
+				return (-1);
+			if (n == 0)
+				break;
+			if (depth == CBOR_MAX_DEPTH)
+				return (-1);
+			left[depth++] = n;
+			break;
+		}
+pop:
+		while (depth > 0 && left[depth - 1] == 0)
+			depth--;
+	}
+
+	return (0);
+}
+
+cbor_item_t *
+cbor_load_checked(const unsigned char *ptr, size_t len,
+    struct cbor_load_result *res)
+{
+	if (cbor_check_lengths(ptr, len) < 0) {
+		fido_log_debug("%s: cbor_check_lengths", __func__);
+		memset(res, 0, sizeof(*res));
+		res->error.code = CBOR_ERR_MALFORMATED;
+		return (NULL);
+	}
+
+	return (cbor_load(ptr, len, res));
+}
+
 int
 cbor_parse_reply(const unsigned char *blob, size_t blob_len, void *arg,
     int(*parser)(const cbor_item_t *, const cbor_item_t *, void *))
 {
 	cbor_item_t		*item = NULL;
 	struct cbor_load_result	 cbor;
+	uint64_t		 t0 = fido_trace_begin();
 	int			 r;
 
+	FIDO_PROBE1(cbor__parse__start, blob_len);
+
 	if (blob_len < 1) {
 		fido_log_debug("%s: blob_len=%zu", __func__, blob_len);
 		r = FIDO_ERR_RX;
@@ -139,7 +250,8 @@ cbor_parse_reply(const unsigned char *blob, size_t blob_len, void *arg,
 		goto fail;
 	}
 
-	if ((item = cbor_load(blob + 1, blob_len - 1, &cbor)) == NULL) {
+	if ((item = cbor_load_checked(blob + 1, blob_len - 1,
+	    &cbor)) == NULL) {
 		fido_log_debug("%s: cbor_load", __func__);
 		r = FIDO_ERR_RX_NOT_CBOR;
 		goto fail;
@@ -163,6 +275,12 @@ fail:
 	if (item != NULL)
 		cbor_decref(&item);
 
+	if (r == FIDO_ERR_RX_NOT_CBOR || r == FIDO_ERR_RX_INVALID_CBOR)
+		fido_metrics_add(NULL, FIDO_METRIC_CBOR_ERRORS, 1);
+
+	fido_trace_end(FIDO_TRACE_PARSE, t0, r);
+	FIDO_PROBE1(cbor__parse__done, r);
+
 	return (r);
 }
 
@@ -1051,7 +1169,7 @@ decode_attcred(const unsigned char **buf, size_t *len, int cose_alg,
 		return (-1);
 	}
 
-	if ((item = cbor_load(*buf, *len, &cbor)) == NULL) {
+	if ((item = cbor_load_checked(*buf, *len, &cbor)) == NULL) {
 		fido_log_debug("%s: cbor_load", __func__);
 		fido_log_xxd(*buf, *len);
 		goto fail;
@@ -1121,7 +1239,7 @@ decode_extensions(const unsigned char **buf, size_t *len, int *authdata_ext)
 
 	*authdata_ext = 0;
 
-	if ((item = cbor_load(*buf, *len, &cbor)) == NULL) {
+	if ((item = cbor_load_checked(*buf, *len, &cbor)) == NULL) {
 		fido_log_debug("%s: cbor_load", __func__);
 		fido_log_xxd(*buf, *len);
 		goto fail;
@@ -1176,7 +1294,7 @@ decode_hmac_secret(const unsigned char **buf, size_t *len, fido_blob_t *out)
 	fido_log_debug("%s: buf=%p, len=%zu", __func__, (const void *)*buf,
 	    *len);
 
-	if ((item = cbor_load(*buf, *len, &cbor)) == NULL) {
+	if ((item = cbor_load_checked(*buf, *len, &cbor)) == NULL) {
 		fido_log_debug("%s: cbor_load", __func__);
 		fido_log_xxd(*buf, *len);
 		goto fail;
@@ -126,15 +126,15 @@ fail:
 static int
 fido_dev_make_cred_rx(fido_dev_t *dev, fido_cred_t *cred, int ms)
 {
-	const uint8_t	cmd = CTAP_FRAME_INIT | CTAP_CMD_CBOR;
-	unsigned char	reply[2048];
-	int		reply_len;
-	int		r;
+	const uint8_t		 cmd = CTAP_FRAME_INIT | CTAP_CMD_CBOR;
+	const unsigned char	*reply;
+	int			 reply_len;
+	int			 r;
 
 	fido_cred_reset_rx(cred);
 
-	if ((reply_len = fido_rx(dev, cmd, &reply, sizeof(reply), ms)) < 0) {
-		fido_log_debug("%s: fido_rx", __func__);
+	if ((reply_len = fido_rx_buf(dev, cmd, &reply, ms)) < 0) {
+		fido_log_debug("%s: fido_rx_buf", __func__);
 		return (FIDO_ERR_RX);
 	}
 
@@ -169,13 +169,19 @@ fido_dev_make_cred_wait(fido_dev_t *dev, fido_cred_t *cred, const char *pin, int
 int
 fido_dev_make_cred(fido_dev_t *dev, fido_cred_t *cred, const char *pin)
 {
+	int r;
+
 	if (fido_dev_is_fido2(dev) == false) {
 		if (pin != NULL || cred->rk == FIDO_OPT_TRUE || cred->ext != 0)
 			return (FIDO_ERR_UNSUPPORTED_OPTION);
-		return (u2f_register(dev, cred, -1));
-	}
+		r = u2f_register(dev, cred, -1);
+	} else
+		r = fido_dev_make_cred_wait(dev, cred, pin, -1);
+
+	if (r == FIDO_OK)
+		fido_affinity_learn_cred(dev, cred);
 
-	return (fido_dev_make_cred_wait(dev, cred, pin, -1));
+	return (r);
 }
 
 static int
@@ -282,13 +288,16 @@ verify_sig(const fido_blob_t *dgst, const fido_blob_t *x5c,
 	X509		*cert = NULL;
 	EVP_PKEY	*pkey = NULL;
 	EC_KEY		*ec;
+	uint64_t	 t0 = fido_trace_begin();
 	int		 ok = -1;
 
+	FIDO_PROBE1(verify__sig__start, COSE_ES256);
+
 	/* openssl needs ints */
 	if (dgst->len > INT_MAX || x5c->len > INT_MAX || sig->len > INT_MAX) {
 		fido_log_debug("%s: dgst->len=%zu, x5c->len=%zu, sig->len=%zu",
 		    __func__, dgst->len, x5c->len, sig->len);
-		return (-1);
+		goto fail;
 	}
 
 	/* fetch key from x509 */
@@ -315,6 +324,11 @@ fail:
 	if (pkey != NULL)
 		EVP_PKEY_free(pkey);
 
+	fido_metrics_add(NULL, ok == 0 ? FIDO_METRIC_VERIFY_ES256_OK :
+	    FIDO_METRIC_VERIFY_ES256_FAIL, 1);
+	fido_trace_end(FIDO_TRACE_CRYPTO, t0, ok);
+	FIDO_PROBE2(verify__sig__done, COSE_ES256, ok);
+
 	return (ok);
 }
 
@@ -325,6 +339,8 @@ fido_cred_verify(const fido_cred_t *cred)
 	fido_blob_t	dgst;
 	int		r;
 
+	FIDO_PROBE1(cred__verify__start, cred->type);
+
 	dgst.ptr = buf;
 	dgst.len = sizeof(buf);
 
@@ -389,6 +405,8 @@ fido_cred_verify(const fido_cred_t *cred)
 out:
 	explicit_bzero(buf, sizeof(buf));
 
+	FIDO_PROBE1(cred__verify__done, r);
+
 	return (r);
 }
 
@@ -400,6 +418,8 @@ fido_cred_verify_self(const fido_cred_t *cred)
 	int		ok = -1;
 	int		r;
 
+	FIDO_PROBE1(cred__verify__start, cred->type);
+
 	dgst.ptr = buf;
 	dgst.len = sizeof(buf);
 
@@ -482,6 +502,8 @@ fido_cred_verify_self(const fido_cred_t *cred)
 out:
 	explicit_bzero(buf, sizeof(buf));
 
+	FIDO_PROBE1(cred__verify__done, r);
+
 	return (r);
 }
 
@@ -553,6 +575,13 @@ fido_cred_reset_rx(fido_cred_t *cred)
 	fido_cred_clean_sig(cred);
 }
 
+void
+fido_cred_reset(fido_cred_t *cred)
+{
+	fido_cred_reset_tx(cred);
+	fido_cred_reset_rx(cred);
+}
+
 void
 fido_cred_free(fido_cred_t **cred_p)
 {
@@ -561,8 +590,7 @@ fido_cred_free(fido_cred_t **cred_p)
 	if (cred_p == NULL || (cred = *cred_p) == NULL)
 		return;
 
-	fido_cred_reset_tx(cred);
-	fido_cred_reset_rx(cred);
+	fido_cred_reset(cred);
 
 	free(cred);
 
@@ -583,7 +611,7 @@ fido_cred_set_authdata(fido_cred_t *cred, const unsigned char *ptr, size_t len)
 		goto fail;
 	}
 
-	if ((item = cbor_load(ptr, len, &cbor)) == NULL) {
+	if ((item = cbor_load_checked(ptr, len, &cbor)) == NULL) {
 		fido_log_debug("%s: cbor_load", __func__);
 		r = FIDO_ERR_INVALID_ARGUMENT;
 		goto fail;
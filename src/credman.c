@@ -181,15 +181,15 @@ credman_parse_metadata(const cbor_item_t *key, const cbor_item_t *val,
 static int
 credman_rx_metadata(fido_dev_t *dev, fido_credman_metadata_t *metadata, int ms)
 {
-	const uint8_t	cmd = CTAP_FRAME_INIT | CTAP_CMD_CBOR;
-	unsigned char	reply[512];
-	int		reply_len;
-	int		r;
+	const uint8_t		 cmd = CTAP_FRAME_INIT | CTAP_CMD_CBOR;
+	const unsigned char	*reply;
+	int			 reply_len;
+	int			 r;
 
 	memset(metadata, 0, sizeof(*metadata));
 
-	if ((reply_len = fido_rx(dev, cmd, &reply, sizeof(reply), ms)) < 0) {
-		fido_log_debug("%s: fido_rx", __func__);
+	if ((reply_len = fido_rx_buf(dev, cmd, &reply, ms)) < 0) {
+		fido_log_debug("%s: fido_rx_buf", __func__);
 		return (FIDO_ERR_RX);
 	}
 
@@ -300,15 +300,15 @@ credman_parse_rk_count(const cbor_item_t *key, const cbor_item_t *val,
 static int
 credman_rx_rk(fido_dev_t *dev, fido_credman_rk_t *rk, int ms)
 {
-	const uint8_t	cmd = CTAP_FRAME_INIT | CTAP_CMD_CBOR;
-	unsigned char	reply[2048];
-	int		reply_len;
-	int		r;
+	const uint8_t		 cmd = CTAP_FRAME_INIT | CTAP_CMD_CBOR;
+	const unsigned char	*reply;
+	int			 reply_len;
+	int			 r;
 
 	credman_reset_rk(rk);
 
-	if ((reply_len = fido_rx(dev, cmd, &reply, sizeof(reply), ms)) < 0) {
-		fido_log_debug("%s: fido_rx", __func__);
+	if ((reply_len = fido_rx_buf(dev, cmd, &reply, ms)) < 0) {
+		fido_log_debug("%s: fido_rx_buf", __func__);
 		return (FIDO_ERR_RX);
 	}
 
@@ -339,13 +339,13 @@ credman_rx_rk(fido_dev_t *dev, fido_credman_rk_t *rk, int ms)
 static int
 credman_rx_next_rk(fido_dev_t *dev, fido_credman_rk_t *rk, int ms)
 {
-	const uint8_t	cmd = CTAP_FRAME_INIT | CTAP_CMD_CBOR;
-	unsigned char	reply[2048];
-	int		reply_len;
-	int		r;
+	const uint8_t		 cmd = CTAP_FRAME_INIT | CTAP_CMD_CBOR;
+	const unsigned char	*reply;
+	int			 reply_len;
+	int			 r;
 
-	if ((reply_len = fido_rx(dev, cmd, &reply, sizeof(reply), ms)) < 0) {
-		fido_log_debug("%s: fido_rx", __func__);
+	if ((reply_len = fido_rx_buf(dev, cmd, &reply, ms)) < 0) {
+		fido_log_debug("%s: fido_rx_buf", __func__);
 		return (FIDO_ERR_RX);
 	}
 
@@ -514,15 +514,15 @@ credman_parse_rp_count(const cbor_item_t *key, const cbor_item_t *val,
 static int
 credman_rx_rp(fido_dev_t *dev, fido_credman_rp_t *rp, int ms)
 {
-	const uint8_t	cmd = CTAP_FRAME_INIT | CTAP_CMD_CBOR;
-	unsigned char	reply[2048];
-	int		reply_len;
-	int		r;
+	const uint8_t		 cmd = CTAP_FRAME_INIT | CTAP_CMD_CBOR;
+	const unsigned char	*reply;
+	int			 reply_len;
+	int			 r;
 
 	credman_reset_rp(rp);
 
-	if ((reply_len = fido_rx(dev, cmd, &reply, sizeof(reply), ms)) < 0) {
-		fido_log_debug("%s: fido_rx", __func__);
+	if ((reply_len = fido_rx_buf(dev, cmd, &reply, ms)) < 0) {
+		fido_log_debug("%s: fido_rx_buf", __func__);
 		return (FIDO_ERR_RX);
 	}
 
@@ -553,13 +553,13 @@ credman_rx_rp(fido_dev_t *dev, fido_credman_rp_t *rp, int ms)
 static int
 credman_rx_next_rp(fido_dev_t *dev, fido_credman_rp_t *rp, int ms)
 {
-	const uint8_t	cmd = CTAP_FRAME_INIT | CTAP_CMD_CBOR;
-	unsigned char	reply[2048];
-	int		reply_len;
-	int		r;
+	const uint8_t		 cmd = CTAP_FRAME_INIT | CTAP_CMD_CBOR;
+	const unsigned char	*reply;
+	int			 reply_len;
+	int			 r;
 
-	if ((reply_len = fido_rx(dev, cmd, &reply, sizeof(reply), ms)) < 0) {
-		fido_log_debug("%s: fido_rx", __func__);
+	if ((reply_len = fido_rx_buf(dev, cmd, &reply, ms)) < 0) {
+		fido_log_debug("%s: fido_rx_buf", __func__);
 		return (FIDO_ERR_RX);
 	}
 
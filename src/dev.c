@@ -17,6 +17,8 @@
 
 #include "fido.h"
 
+#define MAX_STALE_INIT	8 /* CTAPHID_INIT replies skipped on open */
+
 #if defined(_WIN32)
 #include <windows.h>
 
@@ -65,10 +67,113 @@ fail:
 #endif /* _WIN32 */
 
 static int
-fido_dev_open_tx(fido_dev_t *dev, const char *path)
+fido_dev_init_tx(fido_dev_t *dev)
 {
 	const uint8_t cmd = CTAP_FRAME_INIT | CTAP_CMD_INIT;
 
+	if (obtain_nonce(&dev->nonce) < 0) {
+		fido_log_debug("%s: obtain_nonce", __func__);
+		return (FIDO_ERR_INTERNAL);
+	}
+
+	if (fido_tx(dev, cmd, &dev->nonce, sizeof(dev->nonce)) < 0) {
+		fido_log_debug("%s: fido_tx", __func__);
+		return (FIDO_ERR_TX);
+	}
+
+	return (FIDO_OK);
+}
+
+/*
+ * Switch between the built-in hid, io_uring, socket and replay i/o
+ * functions according to the scheme of path. Functions installed by the
+ * caller are left alone.
+ */
+void
+fido_io_select(fido_dev_io_t *io, const char *path)
+{
+	if (io->open != fido_hid_open && io->open != fido_uring_open &&
+	    io->open != fido_sock_open && io->open != fido_replay_open)
+		return;
+
+	if (fido_uring_is_path(path)) {
+		io->open = fido_uring_open;
+		io->close = fido_uring_close;
+		io->read = fido_uring_read;
+		io->write = fido_uring_write;
+	} else if (fido_sock_is_path(path)) {
+		io->open = fido_sock_open;
+		io->close = fido_sock_close;
+		io->read = fido_sock_read;
+		io->write = fido_sock_write;
+	} else if (fido_replay_is_path(path)) {
+		io->open = fido_replay_open;
+		io->close = fido_replay_close;
+		io->read = fido_replay_read;
+		io->write = fido_replay_write;
+	} else {
+		io->open = fido_hid_open;
+		io->close = fido_hid_close;
+		io->read = fido_hid_read;
+		io->write = fido_hid_write;
+	}
+}
+
+/*
+ * Report lengths of an open handle of the built-in i/o functions; -1 if
+ * io belongs to the caller, whose lengths the library cannot tell.
+ */
+int
+fido_io_report_len(const fido_dev_io_t *io, void *handle, size_t *in_len,
+    size_t *out_len)
+{
+	if (io->open == fido_hid_open)
+		fido_hid_report_len(handle, in_len, out_len);
+	else if (io->open == fido_uring_open)
+		fido_uring_report_len(handle, in_len, out_len);
+	else if (io->open == fido_sock_open)
+		fido_sock_report_len(handle, in_len, out_len);
+	else if (io->open == fido_replay_open)
+		fido_replay_report_len(handle, in_len, out_len);
+	else if (io->open == fido_shared_open)
+		fido_shared_report_len(handle, in_len, out_len);
+	else
+		return (-1);
+
+	return (0);
+}
+
+/*
+ * Report lengths in effect while dev is open: those of the device with
+ * the built-in i/o functions, and those set by fido_dev_set_report_len()
+ * with i/o functions installed by the caller, 64 bytes by default.
+ */
+static int
+fido_dev_report_len(fido_dev_t *dev)
+{
+	size_t in_len = dev->io_rpt_in_len;
+	size_t out_len = dev->io_rpt_out_len;
+
+	(void)fido_io_report_len(&dev->io, dev->io_handle, &in_len, &out_len);
+
+	if (in_len < CTAP_MIN_RPT_SIZE || in_len > CTAP_MAX_RPT_SIZE ||
+	    out_len < CTAP_MIN_RPT_SIZE || out_len > CTAP_MAX_RPT_SIZE) {
+		fido_log_debug("%s: in_len=%zu, out_len=%zu", __func__,
+		    in_len, out_len);
+		return (-1);
+	}
+
+	dev->rpt_in_len = in_len;
+	dev->rpt_out_len = out_len;
+
+	return (0);
+}
+
+static int
+fido_dev_open_tx(fido_dev_t *dev, const char *path)
+{
+	int r;
+
 	if (dev->io_handle != NULL) {
 		fido_log_debug("%s: handle=%p", __func__, dev->io_handle);
 		return (FIDO_ERR_INVALID_ARGUMENT);
@@ -79,52 +184,89 @@ fido_dev_open_tx(fido_dev_t *dev, const char *path)
 		return (FIDO_ERR_INVALID_ARGUMENT);
 	}
 
-	if (obtain_nonce(&dev->nonce) < 0) {
-		fido_log_debug("%s: obtain_nonce", __func__);
+	fido_io_select(&dev->io, path);
+	free(dev->path);
+
+	if ((dev->path = strdup(path)) == NULL) {
+		fido_log_debug("%s: strdup", __func__);
 		return (FIDO_ERR_INTERNAL);
 	}
 
 	if ((dev->io_handle = dev->io.open(path)) == NULL) {
 		fido_log_debug("%s: dev->io.open", __func__);
+		free(dev->path);
+		dev->path = NULL;
 		return (FIDO_ERR_INTERNAL);
 	}
 
-	if (fido_tx(dev, cmd, &dev->nonce, sizeof(dev->nonce)) < 0) {
-		fido_log_debug("%s: fido_tx", __func__);
-		dev->io.close(dev->io_handle);
-		dev->io_handle = NULL;
-		return (FIDO_ERR_TX);
+	if (dev->io.open == fido_replay_open)
+		fido_replay_set_scale(dev->io_handle, dev->replay_scale);
+
+	if (fido_dev_report_len(dev) < 0) {
+		fido_log_debug("%s: fido_dev_report_len", __func__);
+		r = FIDO_ERR_INTERNAL;
+		goto fail;
+	}
+
+	if (fido_record_open(dev) < 0) {
+		fido_log_debug("%s: fido_record_open", __func__);
+		r = FIDO_ERR_INTERNAL;
+		goto fail;
+	}
+
+	if ((r = fido_dev_init_tx(dev)) != FIDO_OK) {
+		fido_log_debug("%s: fido_dev_init_tx", __func__);
+		goto fail;
 	}
 
 	return (FIDO_OK);
+fail:
+	fido_record_close(dev);
+	dev->io.close(dev->io_handle);
+	dev->io_handle = NULL;
+	free(dev->path);
+	dev->path = NULL;
+
+	return (r);
 }
 
+/*
+ * Replies to a CTAPHID_INIT sent by someone else, such as a process that
+ * went away before reading them, are skipped, up to MAX_STALE_INIT.
+ */
 static int
 fido_dev_open_rx(fido_dev_t *dev, int ms)
 {
 	const uint8_t	cmd = CTAP_FRAME_INIT | CTAP_CMD_INIT;
 	int		n;
 
-	if ((n = fido_rx(dev, cmd, &dev->attr, sizeof(dev->attr), ms)) < 0) {
-		fido_log_debug("%s: fido_rx", __func__);
-		goto fail;
-	}
-
-#ifdef FIDO_FUZZ
-	dev->attr.nonce = dev->nonce;
-#endif
-
-	if ((size_t)n != sizeof(dev->attr) || dev->attr.nonce != dev->nonce) {
+	for (int i = 0;; i++) {
+		if ((n = fido_rx(dev, cmd, &dev->attr, sizeof(dev->attr),
+		    ms)) < 0) {
+			fido_log_debug("%s: fido_rx", __func__);
+			goto fail;
+		}
+		if ((size_t)n != sizeof(dev->attr)) {
+			fido_log_debug("%s: invalid reply", __func__);
+			goto fail;
+		}
+		if (dev->attr.nonce == dev->nonce)
+			break;
 		fido_log_debug("%s: invalid nonce", __func__);
-		goto fail;
+		fido_metrics_add(dev, FIDO_METRIC_STALE_FRAMES, 1);
+		if (i == MAX_STALE_INIT)
+			goto fail;
 	}
 
 	dev->cid = dev->attr.cid;
 
 	return (FIDO_OK);
 fail:
+	fido_record_close(dev);
 	dev->io.close(dev->io_handle);
 	dev->io_handle = NULL;
+	free(dev->path);
+	dev->path = NULL;
 
 	return (FIDO_ERR_RX);
 }
@@ -147,14 +289,75 @@ fido_dev_open(fido_dev_t *dev, const char *path)
 	return (fido_dev_open_wait(dev, path, -1));
 }
 
+int
+fido_dev_open_shared(fido_dev_t *dev, fido_dev_shared_t *sh)
+{
+	fido_dev_io_t	io;
+	int		r;
+
+	if (dev->io_handle != NULL || dev->transport.tx != NULL) {
+		fido_log_debug("%s: handle=%p", __func__, dev->io_handle);
+		return (FIDO_ERR_INVALID_ARGUMENT);
+	}
+
+	io.open = fido_shared_open;
+	io.close = fido_shared_close;
+	io.read = fido_shared_read;
+	io.write = fido_shared_write;
+
+	if ((r = fido_dev_set_io_functions(dev, &io)) != FIDO_OK)
+		return (r);
+
+	if ((dev->io_handle = fido_shared_attach(sh)) == NULL) {
+		fido_log_debug("%s: fido_shared_attach", __func__);
+		return (FIDO_ERR_INVALID_ARGUMENT);
+	}
+
+	free(dev->path);
+
+	if ((dev->path = strdup(fido_shared_path(sh))) == NULL ||
+	    fido_dev_report_len(dev) < 0 || fido_record_open(dev) < 0) {
+		r = FIDO_ERR_INTERNAL;
+		goto fail;
+	}
+
+	if ((r = fido_dev_init_tx(dev)) != FIDO_OK) {
+		fido_log_debug("%s: fido_dev_init_tx", __func__);
+		goto fail;
+	}
+
+	return (fido_dev_open_rx(dev, -1));
+fail:
+	fido_record_close(dev);
+	dev->io.close(dev->io_handle);
+	dev->io_handle = NULL;
+	free(dev->path);
+	dev->path = NULL;
+
+	return (r);
+}
+
 int
 fido_dev_close(fido_dev_t *dev)
 {
 	if (dev->io_handle == NULL || dev->io.close == NULL)
 		return (FIDO_ERR_INVALID_ARGUMENT);
 
+	fido_record_close(dev);
 	dev->io.close(dev->io_handle);
 	dev->io_handle = NULL;
+	dev->cid = CTAP_CID_BROADCAST;
+	explicit_bzero(&dev->u2f_cache, sizeof(dev->u2f_cache));
+	fido_rx_buf_free(dev);
+	fido_tx_buf_free(dev);
+	dev->maxmsgsiz = 0;
+	dev->maxcredcntlst = 0;
+	dev->maxcredidlen = 0;
+	dev->info_known = false;
+	dev->rpt_in_len = CTAP_RPT_SIZE;
+	dev->rpt_out_len = CTAP_RPT_SIZE;
+	free(dev->path);
+	dev->path = NULL;
 
 	return (FIDO_OK);
 }
@@ -190,11 +393,77 @@ fido_dev_set_io_functions(fido_dev_t *dev, const fido_dev_io_t *io)
 	return (FIDO_OK);
 }
 
+int
+fido_dev_set_report_len(fido_dev_t *dev, size_t in_len, size_t out_len)
+{
+	if (dev->io_handle != NULL) {
+		fido_log_debug("%s: device open", __func__);
+		return (FIDO_ERR_INVALID_ARGUMENT);
+	}
+
+	if (in_len < CTAP_MIN_RPT_SIZE || in_len > CTAP_MAX_RPT_SIZE ||
+	    out_len < CTAP_MIN_RPT_SIZE || out_len > CTAP_MAX_RPT_SIZE) {
+		fido_log_debug("%s: in_len=%zu, out_len=%zu", __func__,
+		    in_len, out_len);
+		return (FIDO_ERR_INVALID_ARGUMENT);
+	}
+
+	dev->io_rpt_in_len = in_len;
+	dev->io_rpt_out_len = out_len;
+
+	return (FIDO_OK);
+}
+
+int
+fido_dev_set_transport_functions(fido_dev_t *dev, const fido_dev_transport_t *t)
+{
+	if (dev->io_handle != NULL) {
+		fido_log_debug("%s: NULL handle", __func__);
+		return (FIDO_ERR_INVALID_ARGUMENT);
+	}
+
+	if (t == NULL || t->rx == NULL || t->tx == NULL) {
+		fido_log_debug("%s: NULL function", __func__);
+		return (FIDO_ERR_INVALID_ARGUMENT);
+	}
+
+	dev->transport.rx = t->rx;
+	dev->transport.tx = t->tx;
+
+	return (FIDO_OK);
+}
+
+int
+fido_dev_set_u2f_poll(fido_dev_t *dev, int min_ms, int max_ms, int timeout_ms)
+{
+	if (min_ms <= 0 || max_ms < min_ms || timeout_ms < -1) {
+		fido_log_debug("%s: min_ms=%d, max_ms=%d, timeout_ms=%d",
+		    __func__, min_ms, max_ms, timeout_ms);
+		return (FIDO_ERR_INVALID_ARGUMENT);
+	}
+
+	dev->u2f_poll.min_ms = min_ms;
+	dev->u2f_poll.max_ms = max_ms;
+	dev->u2f_poll.timeout_ms = timeout_ms;
+
+	return (FIDO_OK);
+}
+
+int
+fido_dev_set_preflight(fido_dev_t *dev, bool enable)
+{
+	dev->preflight = enable;
+
+	return (FIDO_OK);
+}
+
 void
 fido_init(int flags)
 {
-	if (flags & FIDO_DEBUG || getenv("FIDO_DEBUG") != NULL)
-		fido_log_init();
+	if (flags & FIDO_DEBUG_RING)
+		fido_log_init(FIDO_DEBUG_RING);
+	else if (flags & FIDO_DEBUG || getenv("FIDO_DEBUG") != NULL)
+		fido_log_init(FIDO_DEBUG);
 }
 
 fido_dev_t *
@@ -207,6 +476,14 @@ fido_dev_new(void)
 		return (NULL);
 
 	dev->cid = CTAP_CID_BROADCAST;
+	dev->u2f_poll.min_ms = 10;
+	dev->u2f_poll.max_ms = 100;
+	dev->u2f_poll.timeout_ms = -1;
+	dev->replay_scale = 1.0;
+	dev->rpt_in_len = CTAP_RPT_SIZE;
+	dev->rpt_out_len = CTAP_RPT_SIZE;
+	dev->io_rpt_in_len = CTAP_RPT_SIZE;
+	dev->io_rpt_out_len = CTAP_RPT_SIZE;
 
 	io.open = fido_hid_open;
 	io.close = fido_hid_close;
@@ -230,6 +507,10 @@ fido_dev_free(fido_dev_t **dev_p)
 	if (dev_p == NULL || (dev = *dev_p) == NULL)
 		return;
 
+	fido_rx_buf_free(dev);
+	fido_tx_buf_free(dev);
+	free(dev->path);
+	free(dev->record_path);
 	free(dev);
 
 	*dev_p = NULL;
@@ -265,6 +546,18 @@ fido_dev_flags(const fido_dev_t *dev)
 	return (dev->attr.flags);
 }
 
+size_t
+fido_dev_report_in_len(const fido_dev_t *dev)
+{
+	return (dev->rpt_in_len);
+}
+
+size_t
+fido_dev_report_out_len(const fido_dev_t *dev)
+{
+	return (dev->rpt_out_len);
+}
+
 bool
 fido_dev_is_fido2(const fido_dev_t *dev)
 {
@@ -17,8 +17,11 @@ do_ecdh(const es256_sk_t *sk, const es256_pk_t *pk, fido_blob_t **ecdh)
 	EVP_PKEY	*sk_evp = NULL;
 	EVP_PKEY_CTX	*ctx = NULL;
 	fido_blob_t	*secret = NULL;
+	uint64_t	 t0 = fido_trace_begin();
 	int		 ok = -1;
 
+	FIDO_PROBE0(ecdh__start);
+
 	*ecdh = NULL;
 
 	/* allocate blobs for secret & ecdh */
@@ -70,6 +73,9 @@ fail:
 
 	fido_blob_free(&secret);
 
+	fido_trace_end(FIDO_TRACE_CRYPTO, t0, ok);
+	FIDO_PROBE1(ecdh__done, ok);
+
 	return (ok);
 }
 
@@ -107,6 +113,8 @@ fido_do_ecdh(fido_dev_t *dev, es256_pk_t **pk, fido_blob_t **ecdh)
 		goto fail;
 	}
 
+	fido_metrics_add(dev, FIDO_METRIC_ECDH, 1);
+
 	r = FIDO_OK;
 fail:
 	es256_sk_free(&sk);
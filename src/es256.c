@@ -13,6 +13,26 @@
 #include "fido.h"
 #include "fido/es256.h"
 
+/*
+ * Serialise bn into a big-endian, zero-padded buffer of exactly len bytes.
+ * BN_bn2binpad() would do, but it is not available in OpenSSL 1.0.
+ */
+static int
+bn2bin_pad(const BIGNUM *bn, unsigned char *buf, size_t len)
+{
+	int n;
+
+	if ((n = BN_num_bytes(bn)) < 0 || (size_t)n > len)
+		return (-1);
+
+	explicit_bzero(buf, len);
+
+	if (BN_bn2bin(bn, buf + len - (size_t)n) != n)
+		return (-1);
+
+	return (0);
+}
+
 static int
 decode_coord(const cbor_item_t *item, void *xy, size_t xy_len)
 {
@@ -210,7 +230,6 @@ es256_sk_create(es256_sk_t *key)
 	const EC_KEY	*ec;
 	const BIGNUM	*d;
 	const int	 nid = NID_X9_62_prime256v1;
-	int		 n;
 	int		 ok = -1;
 
 	if ((pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL)) == NULL ||
@@ -229,8 +248,7 @@ es256_sk_create(es256_sk_t *key)
 
 	if ((ec = EVP_PKEY_get0_EC_KEY(k)) == NULL ||
 	    (d = EC_KEY_get0_private_key(ec)) == NULL ||
-	    (n = BN_num_bytes(d)) < 0 || (size_t)n > sizeof(key->d) ||
-	    (n = BN_bn2bin(d, key->d)) < 0 || (size_t)n > sizeof(key->d)) {
+	    bn2bin_pad(d, key->d, sizeof(key->d)) < 0) {
 		fido_log_debug("%s: EC_KEY_get0_private_key", __func__);
 		goto fail;
 	}
@@ -338,9 +356,9 @@ es256_pk_from_EC_KEY(es256_pk_t *pk, const EC_KEY *ec)
 		goto fail;
 	}
 
-	if ((n = BN_bn2bin(x, pk->x)) < 0 || (size_t)n > sizeof(pk->x) ||
-	    (n = BN_bn2bin(y, pk->y)) < 0 || (size_t)n > sizeof(pk->y)) {
-		fido_log_debug("%s: BN_bn2bin", __func__);
+	if (bn2bin_pad(x, pk->x, sizeof(pk->x)) < 0 ||
+	    bn2bin_pad(y, pk->y, sizeof(pk->y)) < 0) {
+		fido_log_debug("%s: bn2bin_pad", __func__);
 		goto fail;
 	}
 
@@ -10,6 +10,14 @@
 		es256_pk_from_ptr;
 		es256_pk_new;
 		es256_pk_to_EVP_PKEY;
+		fido_affinity_count;
+		fido_affinity_free;
+		fido_affinity_load;
+		fido_affinity_new;
+		fido_affinity_path;
+		fido_affinity_route;
+		fido_affinity_save;
+		fido_affinity_set;
 		fido_assert_allow_cred;
 		fido_assert_authdata_len;
 		fido_assert_authdata_ptr;
@@ -23,6 +31,7 @@
 		fido_assert_id_len;
 		fido_assert_id_ptr;
 		fido_assert_new;
+		fido_assert_reset;
 		fido_assert_rp_id;
 		fido_assert_set_authdata;
 		fido_assert_set_authdata_raw;
@@ -75,6 +84,8 @@
 		fido_cbor_info_extensions_len;
 		fido_cbor_info_extensions_ptr;
 		fido_cbor_info_free;
+		fido_cbor_info_maxcredcntlst;
+		fido_cbor_info_maxcredidlen;
 		fido_cbor_info_maxmsgsiz;
 		fido_cbor_info_new;
 		fido_cbor_info_options_len;
@@ -117,6 +128,7 @@
 		fido_cred_new;
 		fido_cred_pubkey_len;
 		fido_cred_pubkey_ptr;
+		fido_cred_reset;
 		fido_cred_rp_id;
 		fido_cred_rp_name;
 		fido_cred_set_authdata;
@@ -167,11 +179,52 @@
 		fido_dev_minor;
 		fido_dev_new;
 		fido_dev_open;
+		fido_dev_open_shared;
+		fido_dev_ping;
 		fido_dev_protocol;
 		fido_dev_reset;
+		fido_dev_report_in_len;
+		fido_dev_report_out_len;
+		fido_dev_set_affinity;
 		fido_dev_set_io_functions;
 		fido_dev_set_pin;
+		fido_dev_set_preflight;
+		fido_dev_set_record;
+		fido_dev_set_replay_scale;
+		fido_dev_set_report_len;
+		fido_dev_set_transport_functions;
+		fido_dev_set_u2f_poll;
+		fido_dev_shared_close;
+		fido_dev_shared_free;
+		fido_dev_shared_new;
+		fido_dev_shared_open;
+		fido_dev_shared_set_io_functions;
+		fido_dev_shared_set_report_len;
 		fido_init;
+		fido_log_drain;
+		fido_metrics_bucket_len;
+		fido_metrics_bucket_ptr;
+		fido_metrics_free;
+		fido_metrics_get;
+		fido_metrics_latency_len;
+		fido_metrics_latency_name;
+		fido_metrics_latency_ptr;
+		fido_metrics_latency_sum;
+		fido_metrics_len;
+		fido_metrics_name;
+		fido_metrics_new;
+		fido_metrics_value;
+		fido_ping_avg_us;
+		fido_ping_bytes_per_sec;
+		fido_ping_count;
+		fido_ping_free;
+		fido_ping_len;
+		fido_ping_max_us;
+		fido_ping_min_us;
+		fido_ping_new;
+		fido_ping_p99_us;
+		fido_ping_set_timeout;
+		fido_set_trace_callback;
 		fido_strerr;
 		rs256_pk_free;
 		rs256_pk_from_ptr;
@@ -60,6 +60,8 @@ int cbor_bytestring_copy(const cbor_item_t *, unsigned char **, size_t *);
 int cbor_map_iter(const cbor_item_t *, void *, int(*)(const cbor_item_t *,
     const cbor_item_t *, void *));
 int cbor_string_copy(const cbor_item_t *, char **);
+cbor_item_t *cbor_load_checked(const unsigned char *, size_t,
+    struct cbor_load_result *);
 int cbor_parse_reply(const unsigned char *, size_t, void *,
     int(*)(const cbor_item_t *, const cbor_item_t *, void *));
 int cbor_add_pin_params(fido_dev_t *, const fido_blob_t *, const es256_pk_t *,
@@ -79,11 +81,57 @@ void *fido_hid_open(const char *);
 void  fido_hid_close(void *);
 int   fido_hid_read(void *, unsigned char *, size_t, int);
 int   fido_hid_write(void *, const unsigned char *, size_t);
+void  fido_hid_report_len(void *, size_t *, size_t *);
+int   fido_hid_fd(void *);
+
+/* socket i/o */
+int   fido_sock_is_path(const char *);
+void *fido_sock_open(const char *);
+void  fido_sock_close(void *);
+int   fido_sock_read(void *, unsigned char *, size_t, int);
+int   fido_sock_write(void *, const unsigned char *, size_t);
+void  fido_sock_report_len(void *, size_t *, size_t *);
+
+/* hidraw through io_uring */
+int   fido_uring_is_path(const char *);
+void *fido_uring_open(const char *);
+void  fido_uring_close(void *);
+int   fido_uring_read(void *, unsigned char *, size_t, int);
+int   fido_uring_write(void *, const unsigned char *, size_t);
+void  fido_uring_report_len(void *, size_t *, size_t *);
+
+/* recording and replay */
+int   fido_record_open(fido_dev_t *);
+void  fido_record_close(fido_dev_t *);
+void  fido_record_rx(fido_dev_t *, const unsigned char *, size_t);
+void  fido_record_tx(fido_dev_t *, const unsigned char *, size_t);
+int   fido_replay_is_path(const char *);
+void *fido_replay_open(const char *);
+void  fido_replay_close(void *);
+int   fido_replay_read(void *, unsigned char *, size_t, int);
+int   fido_replay_write(void *, const unsigned char *, size_t);
+void  fido_replay_set_scale(void *, double);
+void  fido_replay_report_len(void *, size_t *, size_t *);
 
 /* generic i/o */
+void fido_io_select(fido_dev_io_t *, const char *);
+int fido_io_report_len(const fido_dev_io_t *, void *, size_t *, size_t *);
 int fido_rx_cbor_status(fido_dev_t *, int);
 int fido_rx(fido_dev_t *, uint8_t, void *, size_t, int);
+int fido_rx_buf(fido_dev_t *, uint8_t, const unsigned char **, int);
+void fido_rx_buf_free(fido_dev_t *);
 int fido_tx(fido_dev_t *, uint8_t, const void *, size_t);
+void fido_tx_buf_free(fido_dev_t *);
+size_t fido_max_msg_len(const fido_dev_t *);
+
+/* shared device handles */
+void *fido_shared_attach(fido_dev_shared_t *);
+const char *fido_shared_path(const fido_dev_shared_t *);
+void *fido_shared_open(const char *);
+void  fido_shared_close(void *);
+int fido_shared_read(void *, unsigned char *, size_t, int);
+int fido_shared_write(void *, const unsigned char *, size_t);
+void fido_shared_report_len(void *, size_t *, size_t *);
 
 /* log */
 #ifdef FIDO_NO_DIAGNOSTIC
@@ -91,18 +139,48 @@ int fido_tx(fido_dev_t *, uint8_t, const void *, size_t);
 #define fido_log_debug(...)	do { /* nothing */ } while (0)
 #define fido_log_xxd(...)	do { /* nothing */ } while (0)
 #else
+#define fido_log_debug(...)	fido_log_msg(__FILE__, __VA_ARGS__)
 #ifdef __GNUC__
-void fido_log_init(void);
-void fido_log_debug(const char *, ...)
-    __attribute__((__format__ (printf, 1, 2)));
+void fido_log_init(int);
+void fido_log_msg(const char *, const char *, ...)
+    __attribute__((__format__ (printf, 2, 3)));
 void fido_log_xxd(const void *, size_t);
 #else
-void fido_log_init(void);
-void fido_log_debug(const char *, ...);
+void fido_log_init(int);
+void fido_log_msg(const char *, const char *, ...);
 void fido_log_xxd(const void *, size_t);
 #endif /* __GNUC__ */
 #endif /* FIDO_NO_DIAGNOSTIC */
 
+/* metrics */
+void fido_metrics_add(fido_dev_t *, int, uint64_t);
+void fido_metrics_cmd_end(fido_dev_t *);
+void fido_metrics_cmd_start(fido_dev_t *, uint8_t, const void *, size_t);
+
+/* trace */
+bool fido_trace_enabled(void);
+uint64_t fido_trace_now(void);
+void fido_trace_cmd_end(fido_dev_t *, uint8_t, int);
+void fido_trace_cmd_start(fido_dev_t *, uint8_t, size_t);
+void fido_trace_frame(int, const unsigned char *, size_t);
+void fido_trace_span(int, uint64_t, int);
+
+/* with no callback set, tracing costs a call, a load and a branch */
+#define fido_trace_begin()	(fido_trace_enabled() ? fido_trace_now() : 0)
+#define fido_trace_end(type, t0, status) do {				\
+	if (fido_trace_enabled() && (t0) != 0)				\
+		fido_trace_span((type), (t0), (status));		\
+} while (0)
+
+/* time */
+int fido_time_elapsed_ms(uint64_t, int *);
+int fido_time_now(uint64_t *);
+int fido_time_sleep(int);
+
+/* affinity */
+void fido_affinity_learn_assert(const fido_dev_t *, const fido_assert_t *);
+void fido_affinity_learn_cred(const fido_dev_t *, const fido_cred_t *);
+
 /* u2f */
 int u2f_register(fido_dev_t *, fido_cred_t *, int);
 int u2f_authenticate(fido_dev_t *, fido_assert_t *, int);
@@ -26,6 +26,30 @@ typedef struct fido_dev_io {
 	fido_dev_io_write_t *write;
 } fido_dev_io_t;
 
+typedef int   fido_dev_rx_t(void *, uint8_t, unsigned char *, size_t, int);
+typedef int   fido_dev_tx_t(void *, uint8_t, const unsigned char *, size_t);
+
+typedef struct fido_dev_transport {
+	fido_dev_rx_t *rx;
+	fido_dev_tx_t *tx;
+} fido_dev_transport_t;
+
+typedef struct fido_trace_event {
+	int                  type;   /* FIDO_TRACE_* */
+	uint64_t             t;      /* monotonic time, ns */
+	uint64_t             dur;    /* duration, ns */
+	uint32_t             cid;    /* channel id */
+	uint8_t              cmd;    /* CTAPHID command */
+	int                  status; /* outcome or keepalive status */
+	const unsigned char *ptr;    /* frame */
+	size_t               len;    /* frame or payload length */
+} fido_trace_event_t;
+
+typedef void fido_trace_cb_t(const fido_trace_event_t *, void *);
+
+typedef void fido_log_handler_t(int, const char *, uint64_t, const char *,
+    void *);
+
 typedef enum {
 	FIDO_OPT_OMIT = 0, /* use authenticator's default */
 	FIDO_OPT_FALSE,    /* explicitly set option to false */
@@ -39,6 +63,7 @@ typedef enum {
 #include "blob.h"
 #include "../openbsd-compat/openbsd-compat.h"
 #include "iso7816.h"
+#include "probe.h"
 #include "types.h"
 #include "extern.h"
 #endif
@@ -52,6 +77,9 @@ typedef struct fido_cbor_info fido_cbor_info_t;
 typedef struct fido_cred fido_cred_t;
 typedef struct fido_dev fido_dev_t;
 typedef struct fido_dev_info fido_dev_info_t;
+typedef struct fido_dev_shared fido_dev_shared_t;
+typedef struct fido_metrics fido_metrics_t;
+typedef struct fido_ping fido_ping_t;
 typedef struct es256_pk es256_pk_t;
 typedef struct es256_sk es256_sk_t;
 typedef struct rs256_pk rs256_pk_t;
@@ -62,21 +90,45 @@ fido_assert_t *fido_assert_new(void);
 fido_cred_t *fido_cred_new(void);
 fido_dev_t *fido_dev_new(void);
 fido_dev_info_t *fido_dev_info_new(size_t);
+fido_dev_shared_t *fido_dev_shared_new(void);
 fido_cbor_info_t *fido_cbor_info_new(void);
+fido_metrics_t *fido_metrics_new(void);
+fido_ping_t *fido_ping_new(void);
 
 void fido_assert_free(fido_assert_t **);
+void fido_assert_reset(fido_assert_t *);
 void fido_cbor_info_free(fido_cbor_info_t **);
 void fido_cred_free(fido_cred_t **);
+void fido_cred_reset(fido_cred_t *);
 void fido_dev_force_fido2(fido_dev_t *);
 void fido_dev_force_u2f(fido_dev_t *);
 void fido_dev_free(fido_dev_t **);
 void fido_dev_info_free(fido_dev_info_t **, size_t);
+void fido_dev_shared_free(fido_dev_shared_t **);
+void fido_metrics_free(fido_metrics_t **);
+void fido_ping_free(fido_ping_t **);
 
 /* fido_init() flags. */
 #define FIDO_DEBUG	0x01
+#define FIDO_DEBUG_RING	0x02	/* log to a per-thread ring buffer */
+
+/* fido_log_drain() levels. */
+#define FIDO_LOG_DEBUG	1	/* messages */
+#define FIDO_LOG_DUMP	2	/* hex dumps */
 
 void fido_init(int);
 
+/* fido_set_trace_callback() event types. */
+#define FIDO_TRACE_TX		1	/* frame written */
+#define FIDO_TRACE_RX		2	/* frame read */
+#define FIDO_TRACE_KEEPALIVE	3	/* keepalive frame read */
+#define FIDO_TRACE_CMD_START	4	/* request about to be sent */
+#define FIDO_TRACE_CMD_END	5	/* reply received */
+#define FIDO_TRACE_PARSE	6	/* cbor reply parsed */
+#define FIDO_TRACE_CRYPTO	7	/* signature verified, key agreed */
+
+void fido_set_trace_callback(fido_trace_cb_t *, void *);
+
 const unsigned char *fido_assert_authdata_ptr(const fido_assert_t *, size_t);
 const unsigned char *fido_assert_clientdata_hash_ptr(const fido_assert_t *);
 const unsigned char *fido_assert_hmac_secret_ptr(const fido_assert_t *, size_t);
@@ -100,7 +152,11 @@ const char *fido_cred_user_name(const fido_cred_t *);
 const char *fido_dev_info_manufacturer_string(const fido_dev_info_t *);
 const char *fido_dev_info_path(const fido_dev_info_t *);
 const char *fido_dev_info_product_string(const fido_dev_info_t *);
+const char *fido_metrics_latency_name(const fido_metrics_t *, size_t);
+const char *fido_metrics_name(const fido_metrics_t *, size_t);
 const fido_dev_info_t *fido_dev_info_ptr(const fido_dev_info_t *, size_t);
+const uint64_t *fido_metrics_bucket_ptr(const fido_metrics_t *);
+const uint64_t *fido_metrics_latency_ptr(const fido_metrics_t *, size_t);
 const uint8_t *fido_cbor_info_protocols_ptr(const fido_cbor_info_t *);
 const unsigned char *fido_cbor_info_aaguid_ptr(const fido_cbor_info_t *);
 const unsigned char *fido_cred_authdata_ptr(const fido_cred_t *);
@@ -153,9 +209,25 @@ int fido_dev_get_retry_count(fido_dev_t *, int *);
 int fido_dev_info_manifest(fido_dev_info_t *, size_t, size_t *);
 int fido_dev_make_cred(fido_dev_t *, fido_cred_t *, const char *);
 int fido_dev_open(fido_dev_t *, const char *);
+int fido_dev_open_shared(fido_dev_t *, fido_dev_shared_t *);
+int fido_dev_ping(fido_dev_t *, size_t, size_t, fido_ping_t *);
 int fido_dev_reset(fido_dev_t *);
 int fido_dev_set_io_functions(fido_dev_t *, const fido_dev_io_t *);
 int fido_dev_set_pin(fido_dev_t *, const char *, const char *);
+int fido_dev_set_preflight(fido_dev_t *, bool);
+int fido_dev_set_record(fido_dev_t *, const char *);
+int fido_dev_set_replay_scale(fido_dev_t *, double);
+int fido_dev_set_report_len(fido_dev_t *, size_t, size_t);
+int fido_dev_set_transport_functions(fido_dev_t *,
+    const fido_dev_transport_t *);
+int fido_dev_set_u2f_poll(fido_dev_t *, int, int, int);
+int fido_dev_shared_close(fido_dev_shared_t *);
+int fido_dev_shared_open(fido_dev_shared_t *, const char *);
+int fido_dev_shared_set_io_functions(fido_dev_shared_t *,
+    const fido_dev_io_t *);
+int fido_dev_shared_set_report_len(fido_dev_shared_t *, size_t, size_t);
+int fido_metrics_get(const fido_dev_t *, fido_metrics_t *);
+int fido_ping_set_timeout(fido_ping_t *, int);
 
 size_t fido_assert_authdata_len(const fido_assert_t *, size_t);
 size_t fido_assert_clientdata_hash_len(const fido_assert_t *);
@@ -176,6 +248,14 @@ size_t fido_cred_user_id_len(const fido_cred_t *);
 size_t fido_cred_pubkey_len(const fido_cred_t *);
 size_t fido_cred_sig_len(const fido_cred_t *);
 size_t fido_cred_x5c_len(const fido_cred_t *);
+size_t fido_log_drain(int, fido_log_handler_t *, void *);
+size_t fido_metrics_bucket_len(const fido_metrics_t *);
+size_t fido_metrics_latency_len(const fido_metrics_t *);
+size_t fido_metrics_len(const fido_metrics_t *);
+size_t fido_dev_report_in_len(const fido_dev_t *);
+size_t fido_dev_report_out_len(const fido_dev_t *);
+size_t fido_ping_count(const fido_ping_t *);
+size_t fido_ping_len(const fido_ping_t *);
 
 uint8_t  fido_assert_flags(const fido_assert_t *, size_t);
 uint32_t  fido_assert_sigcount(const fido_assert_t *, size_t);
@@ -188,6 +268,15 @@ uint8_t  fido_dev_flags(const fido_dev_t *);
 int16_t  fido_dev_info_vendor(const fido_dev_info_t *);
 int16_t  fido_dev_info_product(const fido_dev_info_t *);
 uint64_t fido_cbor_info_maxmsgsiz(const fido_cbor_info_t *);
+uint64_t fido_cbor_info_maxcredcntlst(const fido_cbor_info_t *);
+uint64_t fido_cbor_info_maxcredidlen(const fido_cbor_info_t *);
+uint64_t fido_metrics_latency_sum(const fido_metrics_t *, size_t);
+uint64_t fido_metrics_value(const fido_metrics_t *, size_t);
+uint64_t fido_ping_avg_us(const fido_ping_t *);
+uint64_t fido_ping_bytes_per_sec(const fido_ping_t *);
+uint64_t fido_ping_max_us(const fido_ping_t *);
+uint64_t fido_ping_min_us(const fido_ping_t *);
+uint64_t fido_ping_p99_us(const fido_ping_t *);
 
 bool fido_dev_is_fido2(const fido_dev_t *);
 
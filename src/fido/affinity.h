@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2020 Yubico AB. All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+#ifndef _FIDO_AFFINITY_H
+#define _FIDO_AFFINITY_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "fido/err.h"
+#include "fido/param.h"
+
+#ifdef _FIDO_INTERNAL
+/* maximum number of credentials remembered */
+#define FIDO_AFFINITY_MAX	1024
+
+struct fido_affinity_entry {
+	unsigned char  id_hash[32]; /* sha256 of the credential id */
+	unsigned char  aaguid[16];  /* authenticator's aaguid, if known */
+	char          *path;        /* device path */
+};
+
+struct fido_affinity {
+	struct fido_affinity_entry *ptr;
+	size_t n_alloc; /* number of allocated entries */
+	size_t n_used;  /* number of populated entries */
+	size_t next;    /* next entry to be replaced once full */
+};
+#endif
+
+typedef struct fido_affinity fido_affinity_t;
+
+fido_affinity_t *fido_affinity_new(void);
+
+const char *fido_affinity_path(const fido_affinity_t *, const unsigned char *,
+    size_t);
+
+int fido_affinity_load(fido_affinity_t *, const char *);
+int fido_affinity_route(const fido_affinity_t *, const fido_assert_t *,
+    const fido_dev_info_t *, size_t, size_t *);
+int fido_affinity_save(const fido_affinity_t *, const char *);
+int fido_affinity_set(fido_affinity_t *, const unsigned char *, size_t,
+    const unsigned char *, size_t, const char *);
+int fido_dev_set_affinity(fido_dev_t *, fido_affinity_t *);
+
+size_t fido_affinity_count(const fido_affinity_t *);
+
+void fido_affinity_free(fido_affinity_t **);
+
+#endif /* !_FIDO_AFFINITY_H */
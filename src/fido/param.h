@@ -22,6 +22,7 @@
 #define CTAP_CMD_CBOR			0x10
 #define CTAP_CMD_CANCEL			0x11
 #define CTAP_KEEPALIVE			0x3b
+#define CTAP_CMD_ERROR			0x3f
 #define CTAP_FRAME_INIT			0x80
 
 /* CTAPHID CBOR command opcodes. */
@@ -53,6 +54,13 @@
 /* Expected size of a HID report in bytes. */
 #define CTAP_RPT_SIZE			64
 
+/* Range of HID report sizes in bytes accepted from a report descriptor. */
+#define CTAP_MIN_RPT_SIZE		8
+#define CTAP_MAX_RPT_SIZE		1024
+
+/* Maximum message size assumed if the authenticator doesn't report one. */
+#define CTAP_MAX_MSG_LEN		1024
+
 /* Randomness device on UNIX-like platforms. */
 #ifndef FIDO_RANDOM_DEV
 #define FIDO_RANDOM_DEV			"/dev/urandom"
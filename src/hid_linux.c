@@ -11,12 +11,19 @@
 
 #include <fcntl.h>
 #include <libudev.h>
+#include <poll.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "fido.h"
 
-#define REPORT_LEN	65
+#define MAX_STALE	256 /* input reports discarded on open */
+
+struct hid_linux {
+	int	fd;
+	size_t	report_in_len;
+	size_t	report_out_len;
+};
 
 static int
 get_key_len(uint8_t tag, uint8_t *key, size_t *key_len)
@@ -95,36 +102,104 @@ get_usage_info(const struct hidraw_report_descriptor *hrd, uint32_t *usage_page,
 	return (0);
 }
 
+/*
+ * Add up the input and output items of a report descriptor, each being
+ * report size times report count bits long. Numbered reports, and thus
+ * report ids, are not used by CTAPHID devices.
+ */
 static int
-get_report_descriptor(const char *path, struct hidraw_report_descriptor *hrd)
+get_report_len(const struct hidraw_report_descriptor *hrd, size_t *in_len,
+    size_t *out_len)
 {
-	int	r;
-	int	s = -1;
-	int	fd;
-	int	ok = -1;
+	const uint8_t	*ptr;
+	size_t		 len;
+	uint32_t	 report_size = 0;
+	uint32_t	 report_count = 0;
+	uint64_t	 in_bits = 0;
+	uint64_t	 out_bits = 0;
 
-	if ((fd = open(path, O_RDONLY)) < 0) {
-		fido_log_debug("%s: open", __func__);
-		return (-1);
+	ptr = hrd->value;
+	len = hrd->size;
+
+	while (len > 0) {
+		const uint8_t tag = ptr[0];
+		ptr++;
+		len--;
+
+		uint8_t  key;
+		size_t   key_len;
+		uint32_t key_val;
+
+		if (get_key_len(tag, &key, &key_len) < 0 || key_len > len ||
+		    get_key_val(ptr, key_len, &key_val) < 0) {
+			return (-1);
+		}
+
+		if (key == 0x74) {
+			report_size = key_val;
+		} else if (key == 0x94) {
+			report_count = key_val;
+		} else if (key == 0x84) {
+			fido_log_debug("%s: report id", __func__);
+			return (-1);
+		} else if (key == 0x80) {
+			in_bits += (uint64_t)report_size * report_count;
+		} else if (key == 0x90) {
+			out_bits += (uint64_t)report_size * report_count;
+		}
+
+		if (in_bits > CTAP_MAX_RPT_SIZE * 8 ||
+		    out_bits > CTAP_MAX_RPT_SIZE * 8) {
+			fido_log_debug("%s: in_bits=%llu, out_bits=%llu",
+			    __func__, (unsigned long long)in_bits,
+			    (unsigned long long)out_bits);
+			return (-1);
+		}
+
+		ptr += key_len;
+		len -= key_len;
 	}
 
-	if ((r = ioctl(fd, HIDIOCGRDESCSIZE, &s)) < 0 || s < 0 ||
+	*in_len = (size_t)(in_bits / 8);
+	*out_len = (size_t)(out_bits / 8);
+
+	return (0);
+}
+
+static int
+get_report_descriptor_fd(int fd, struct hidraw_report_descriptor *hrd)
+{
+	int s = -1;
+
+	if (ioctl(fd, HIDIOCGRDESCSIZE, &s) < 0 || s < 0 ||
 	    (unsigned)s > HID_MAX_DESCRIPTOR_SIZE) {
 		fido_log_debug("%s: ioctl HIDIOCGRDESCSIZE", __func__);
-		goto fail;
+		return (-1);
 	}
 
 	hrd->size = s;
 
-	if ((r = ioctl(fd, HIDIOCGRDESC, hrd)) < 0) {
+	if (ioctl(fd, HIDIOCGRDESC, hrd) < 0) {
 		fido_log_debug("%s: ioctl HIDIOCGRDESC", __func__);
-		goto fail;
+		return (-1);
 	}
 
-	ok = 0;
-fail:
-	if (fd != -1)
-		close(fd);
+	return (0);
+}
+
+static int
+get_report_descriptor(const char *path, struct hidraw_report_descriptor *hrd)
+{
+	int	fd;
+	int	ok;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		fido_log_debug("%s: open", __func__);
+		return (-1);
+	}
+
+	ok = get_report_descriptor_fd(fd, hrd);
+	close(fd);
 
 	return (ok);
 }
@@ -147,7 +222,8 @@ is_fido(const char *path)
 }
 
 static int
-parse_uevent(struct udev_device *dev, int16_t *vendor_id, int16_t *product_id)
+parse_uevent(struct udev_device *dev, int16_t *vendor_id, int16_t *product_id,
+    char **hid_name)
 {
 	const char		*uevent;
 	char			*cp;
@@ -157,6 +233,8 @@ parse_uevent(struct udev_device *dev, int16_t *vendor_id, int16_t *product_id)
 	short unsigned int	 x;
 	short unsigned int	 y;
 
+	*hid_name = NULL;
+
 	if ((uevent = udev_device_get_sysattr_value(dev, "uevent")) == NULL)
 		return (-1);
 
@@ -170,12 +248,22 @@ parse_uevent(struct udev_device *dev, int16_t *vendor_id, int16_t *product_id)
 				*product_id = (int16_t)y;
 				ok = 0;
 			}
-			break;
+		} else if (strncmp(p, "HID_NAME=", 9) == 0) {
+			free(*hid_name);
+			if ((*hid_name = strdup(p + 9)) == NULL) {
+				ok = -1;
+				break;
+			}
 		}
 	}
 
 	free(s);
 
+	if (ok < 0) {
+		free(*hid_name);
+		*hid_name = NULL;
+	}
+
 	return (ok);
 }
 
@@ -185,8 +273,9 @@ copy_info(fido_dev_info_t *di, struct udev *udev,
 {
 	const char		*name;
 	const char		*path;
-	const char		*manufacturer;
-	const char		*product;
+	const char		*manufacturer = NULL;
+	const char		*product = NULL;
+	char			*hid_name = NULL;
 	struct udev_device	*dev = NULL;
 	struct udev_device	*hid_parent;
 	struct udev_device	*usb_parent;
@@ -201,18 +290,22 @@ copy_info(fido_dev_info_t *di, struct udev *udev,
 		goto fail;
 
 	if ((hid_parent = udev_device_get_parent_with_subsystem_devtype(dev,
-	    "hid", NULL)) == NULL)
+	    "hid", NULL)) == NULL ||
+	    parse_uevent(hid_parent, &di->vendor_id, &di->product_id,
+	    &hid_name) < 0)
 		goto fail;
 
+	/* devices without a usb parent (e.g. uhid) are named by the hid layer */
 	if ((usb_parent = udev_device_get_parent_with_subsystem_devtype(dev,
-	    "usb", "usb_device")) == NULL)
-		goto fail;
+	    "usb", "usb_device")) != NULL) {
+		manufacturer = udev_device_get_sysattr_value(usb_parent,
+		    "manufacturer");
+		product = udev_device_get_sysattr_value(usb_parent, "product");
+	}
 
-	if (parse_uevent(hid_parent, &di->vendor_id, &di->product_id) < 0 ||
-	    (manufacturer = udev_device_get_sysattr_value(usb_parent,
-	    "manufacturer")) == NULL ||
-	    (product = udev_device_get_sysattr_value(usb_parent,
-	    "product")) == NULL)
+	if (manufacturer == NULL)
+		manufacturer = "unknown";
+	if (product == NULL && (product = hid_name) == NULL)
 		goto fail;
 
 	di->path = strdup(path);
@@ -229,6 +322,8 @@ fail:
 	if (dev != NULL)
 		udev_device_unref(dev);
 
+	free(hid_name);
+
 	if (ok < 0) {
 		free(di->path);
 		free(di->manufacturer);
@@ -282,63 +377,144 @@ fail:
 	return (r);
 }
 
+/*
+ * Discard input reports already queued, such as the tail of a reply to a
+ * process that went away, without waiting for more.
+ */
+static void
+drain(const struct hid_linux *ctx)
+{
+	struct pollfd	pfd;
+	unsigned char	buf[CTAP_MAX_RPT_SIZE];
+	int		n = 0;
+
+	memset(&pfd, 0, sizeof(pfd));
+	pfd.fd = ctx->fd;
+	pfd.events = POLLIN;
+
+	while (n < MAX_STALE && poll(&pfd, 1, 0) == 1 &&
+	    (pfd.revents & POLLIN) && read(ctx->fd, buf, sizeof(buf)) > 0)
+		n++;
+
+	if (n > 0)
+		fido_log_debug("%s: %d stale reports", __func__, n);
+}
+
+/* wait up to ms milliseconds, or indefinitely if ms is -1, for a report */
+static int
+waitfd(int fd, int ms)
+{
+	struct pollfd	pfd;
+	int		n;
+
+	memset(&pfd, 0, sizeof(pfd));
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	if ((n = poll(&pfd, 1, ms)) <= 0 || (pfd.revents & POLLIN) == 0) {
+		fido_log_debug("%s: poll: %d", __func__, n);
+		return (-1);
+	}
+
+	return (0);
+}
+
 void *
 fido_hid_open(const char *path)
 {
-	int *fd;
+	struct hid_linux		*ctx;
+	struct hidraw_report_descriptor	 hrd;
 
-	if ((fd = malloc(sizeof(*fd))) == NULL ||
-	    (*fd = open(path, O_RDWR)) < 0) {
-		free(fd);
+	if ((ctx = calloc(1, sizeof(*ctx))) == NULL ||
+	    (ctx->fd = open(path, O_RDWR)) < 0) {
+		free(ctx);
 		return (NULL);
 	}
 
-	return (fd);
+	memset(&hrd, 0, sizeof(hrd));
+
+	if (get_report_descriptor_fd(ctx->fd, &hrd) < 0 ||
+	    get_report_len(&hrd, &ctx->report_in_len,
+	    &ctx->report_out_len) < 0 ||
+	    ctx->report_in_len < CTAP_MIN_RPT_SIZE ||
+	    ctx->report_out_len < CTAP_MIN_RPT_SIZE) {
+		fido_log_debug("%s: using %d-byte reports", __func__,
+		    CTAP_RPT_SIZE);
+		ctx->report_in_len = CTAP_RPT_SIZE;
+		ctx->report_out_len = CTAP_RPT_SIZE;
+	}
+
+	fido_log_debug("%s: inlen=%zu, outlen=%zu", __func__,
+	    ctx->report_in_len, ctx->report_out_len);
+
+	drain(ctx);
+
+	return (ctx);
 }
 
 void
 fido_hid_close(void *handle)
 {
-	int *fd = handle;
+	struct hid_linux *ctx = handle;
 
-	close(*fd);
-	free(fd);
+	close(ctx->fd);
+	free(ctx);
 }
 
 int
 fido_hid_read(void *handle, unsigned char *buf, size_t len, int ms)
 {
-	int	*fd = handle;
-	ssize_t	 r;
+	struct hid_linux	*ctx = handle;
+	ssize_t			 r;
 
-	(void)ms; /* XXX */
-
-	if (len != REPORT_LEN - 1) {
-		fido_log_debug("%s: invalid len", __func__);
+	if (len != ctx->report_in_len) {
+		fido_log_debug("%s: invalid len: got %zu, want %zu", __func__,
+		    len, ctx->report_in_len);
 		return (-1);
 	}
 
-	if ((r = read(*fd, buf, len)) < 0 || r != REPORT_LEN - 1)
+	if (waitfd(ctx->fd, ms) < 0)
+		return (-1);
+
+	if ((r = read(ctx->fd, buf, len)) < 0 || (size_t)r != len)
 		return (-1);
 
-	return (REPORT_LEN - 1);
+	return ((int)len);
 }
 
 int
 fido_hid_write(void *handle, const unsigned char *buf, size_t len)
 {
-	int	*fd = handle;
-	ssize_t	 r;
+	struct hid_linux	*ctx = handle;
+	ssize_t			 r;
 
-	if (len != REPORT_LEN) {
-		fido_log_debug("%s: invalid len", __func__);
+	if (len != ctx->report_out_len + 1) {
+		fido_log_debug("%s: invalid len: got %zu, want %zu", __func__,
+		    len, ctx->report_out_len + 1);
 		return (-1);
 	}
 
-	if ((r = write(*fd, buf, len)) < 0 || r != REPORT_LEN) {
+	if ((r = write(ctx->fd, buf, len)) < 0 || (size_t)r != len) {
 		fido_log_debug("%s: write", __func__);
 		return (-1);
 	}
 
-	return (REPORT_LEN);
+	return ((int)len);
+}
+
+void
+fido_hid_report_len(void *handle, size_t *in_len, size_t *out_len)
+{
+	struct hid_linux *ctx = handle;
+
+	*in_len = ctx->report_in_len;
+	*out_len = ctx->report_out_len;
+}
+
+int
+fido_hid_fd(void *handle)
+{
+	struct hid_linux *ctx = handle;
+
+	return (ctx->fd);
 }
@@ -21,6 +21,7 @@
 
 #define MAX_UHID	64
 #define MAX_REPORT_LEN	(sizeof(((struct usb_ctl_report *)(NULL))->ucr_data))
+#define MAX_STALE	256 /* input reports discarded on open */
 
 struct hid_openbsd {
 	int fd;
@@ -174,6 +175,51 @@ terrible_ping_kludge(struct hid_openbsd *ctx)
 	return -1;
 }
 
+/*
+ * The uhid queue outlives open and close, and may hold the tail of a
+ * reply to a process that went away. Discard it without waiting.
+ */
+static void
+drain(struct hid_openbsd *ctx)
+{
+	u_char data[MAX_REPORT_LEN];
+	struct pollfd pfd;
+	int n = 0;
+
+	memset(&pfd, 0, sizeof(pfd));
+	pfd.fd = ctx->fd;
+	pfd.events = POLLIN;
+
+	while (n < MAX_STALE && poll(&pfd, 1, 0) == 1 &&
+	    (pfd.revents & POLLIN) && read(ctx->fd, data, sizeof(data)) > 0)
+		n++;
+
+	if (n > 0)
+		fido_log_debug("%s: %d stale reports", __func__, n);
+}
+
+/* wait up to ms milliseconds, or indefinitely if ms is -1, for a report */
+static int
+waitfd(int fd, int ms)
+{
+	struct pollfd pfd;
+	int n;
+
+	memset(&pfd, 0, sizeof(pfd));
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	if ((n = poll(&pfd, 1, ms)) == -1) {
+		fido_log_debug("%s: poll: %s", __func__, strerror(errno));
+		return (-1);
+	}
+	if (n == 0 || (pfd.revents & POLLIN) == 0) {
+		fido_log_debug("%s: timeout", __func__);
+		return (-1);
+	}
+	return (0);
+}
+
 void *
 fido_hid_open(const char *path)
 {
@@ -224,6 +270,7 @@ fido_hid_open(const char *path)
 		fido_hid_close(ret);
 		return NULL;
 	}
+	drain(ret);
 
 	return (ret);
 }
@@ -243,13 +290,13 @@ fido_hid_read(void *handle, unsigned char *buf, size_t len, int ms)
 	struct hid_openbsd *ctx = (struct hid_openbsd *)handle;
 	ssize_t r;
 
-	(void)ms; /* XXX */
-
 	if (len != ctx->report_in_len) {
 		fido_log_debug("%s: invalid len: got %zu, want %zu", __func__,
 		    len, ctx->report_in_len);
 		return (-1);
 	}
+	if (waitfd(ctx->fd, ms) < 0)
+		return (-1);
 	if ((r = read(ctx->fd, buf, len)) == -1 || (size_t)r != len) {
 		fido_log_debug("%s: read: %s", __func__, strerror(errno));
 		return (-1);
@@ -275,3 +322,12 @@ fido_hid_write(void *handle, const unsigned char *buf, size_t len)
 	}
 	return ((int)len);
 }
+
+void
+fido_hid_report_len(void *handle, size_t *in_len, size_t *out_len)
+{
+	struct hid_openbsd *ctx = (struct hid_openbsd *)handle;
+
+	*in_len = ctx->report_in_len;
+	*out_len = ctx->report_out_len;
+}
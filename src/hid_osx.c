@@ -408,3 +408,12 @@ fido_hid_write(void *handle, const unsigned char *buf, size_t len)
 
 	return (REPORT_LEN);
 }
+
+void
+fido_hid_report_len(void *handle, size_t *in_len, size_t *out_len)
+{
+	(void)handle;
+
+	*in_len = REPORT_LEN - 1;
+	*out_len = REPORT_LEN - 1;
+}
@@ -264,6 +264,10 @@ fido_hid_open(const char *path)
 	if (dev == INVALID_HANDLE_VALUE)
 		return (NULL);
 
+	/* discard input reports queued for a process that went away */
+	if (HidD_FlushQueue(dev) == false)
+		fido_log_debug("%s: HidD_FlushQueue", __func__);
+
 	return (dev);
 }
 
@@ -322,3 +326,12 @@ fido_hid_write(void *handle, const unsigned char *buf, size_t len)
 
 	return (REPORT_LEN);
 }
+
+void
+fido_hid_report_len(void *handle, size_t *in_len, size_t *out_len)
+{
+	(void)handle;
+
+	*in_len = REPORT_LEN - 1;
+	*out_len = REPORT_LEN - 1;
+}
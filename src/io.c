@@ -6,6 +6,7 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "fido.h"
@@ -20,11 +21,11 @@ struct frame {
 			uint8_t cmd;
 			uint8_t bcnth;
 			uint8_t bcntl;
-			uint8_t data[CTAP_RPT_SIZE - 7];
+			uint8_t data[CTAP_MAX_RPT_SIZE - 7];
 		} init;
 		struct {
 			uint8_t seq;
-			uint8_t data[CTAP_RPT_SIZE - 5];
+			uint8_t data[CTAP_MAX_RPT_SIZE - 5];
 		} cont;
 	} body;
 })
@@ -33,30 +34,85 @@ struct frame {
 #define MIN(x, y) ((x) > (y) ? (y) : (x))
 #endif
 
+#define CTAP_INIT_HDR_LEN	7	/* cid, cmd, bcnt */
+#define CTAP_CONT_HDR_LEN	5	/* cid, seq */
+
+#define RX_HDR_LEN	CTAP_INIT_HDR_LEN
+#define RX_SLACK	CTAP_MAX_RPT_SIZE
+#define RX_MIN_LEN	2048	/* initial size of a receive buffer */
+
+#define RX_BUSY		-2	/* the device is busy with another channel */
+#define RX_DESYNC	-3	/* the reply was broken off */
+
+#define BUSY_RETRIES	5	/* resends of a request to a busy device */
+#define BUSY_DELAY_MS	10	/* before the first resend; doubled after */
+#define RESYNC_FRAMES	256	/* frames read looking for a resync reply */
+#define RESYNC_MS	500	/* time allowed for a resync reply */
+
+/*
+ * A reply is waited for ms milliseconds in all, however many frames it
+ * takes or have to be skipped, or indefinitely if ms is -1.
+ */
+struct deadline {
+	uint64_t	t0;
+	int		ms;
+};
+
+/*
+ * Frames are as long as the reports of the device, which need not be 64
+ * bytes; see fido_dev_report_len().
+ */
+static size_t
+init_data_len(size_t rpt_len)
+{
+	return (rpt_len - CTAP_INIT_HDR_LEN);
+}
+
+static size_t
+cont_data_len(size_t rpt_len)
+{
+	return (rpt_len - CTAP_CONT_HDR_LEN);
+}
+
+/* longest message carried by an initiation and 128 continuation frames */
+static size_t
+max_msg_len(size_t rpt_len)
+{
+	return (MIN(UINT16_MAX, init_data_len(rpt_len) + 128 *
+	    cont_data_len(rpt_len)));
+}
+
 static size_t
 tx_preamble(fido_dev_t *d,  uint8_t cmd, const void *buf, size_t count)
 {
 	struct frame	*fp;
 	unsigned char	pkt[sizeof(*fp) + 1];
+	size_t		len = d->rpt_out_len + 1;
 	int		n;
 
 	if (d->io.write == NULL || (cmd & 0x80) == 0)
 		return (0);
 
-	memset(&pkt, 0, sizeof(pkt));
+	memset(&pkt, 0, len);
 	fp = (struct frame *)(pkt + 1);
 	fp->cid = d->cid;
 	fp->body.init.cmd = 0x80 | cmd;
 	fp->body.init.bcnth = (count >> 8) & 0xff;
 	fp->body.init.bcntl = count & 0xff;
-	count = MIN(count, sizeof(fp->body.init.data));
+	count = MIN(count, init_data_len(d->rpt_out_len));
 	if (count)
 		memcpy(&fp->body.init.data, buf, count);
 
-	n = d->io.write(d->io_handle, pkt, sizeof(pkt));
-	if (n < 0 || (size_t)n != sizeof(pkt))
+	n = d->io.write(d->io_handle, pkt, len);
+	if (n < 0 || (size_t)n != len)
 		return (0);
 
+	fido_record_tx(d, pkt + 1, len - 1);
+	fido_metrics_add(d, FIDO_METRIC_FRAMES_TX, 1);
+	FIDO_PROBE3(frame__tx, d, d->cid, pkt + 1);
+	if (fido_trace_enabled())
+		fido_trace_frame(FIDO_TRACE_TX, pkt + 1, len - 1);
+
 	return (count);
 }
 
@@ -65,41 +121,121 @@ tx_frame(fido_dev_t *d, int seq, const void *buf, size_t count)
 {
 	struct frame	*fp;
 	unsigned char	 pkt[sizeof(*fp) + 1];
+	size_t		 len = d->rpt_out_len + 1;
 	int		 n;
 
 	if (d->io.write == NULL || seq < 0 || seq > UINT8_MAX)
 		return (0);
 
-	memset(&pkt, 0, sizeof(pkt));
+	memset(&pkt, 0, len);
 	fp = (struct frame *)(pkt + 1);
 	fp->cid = d->cid;
 	fp->body.cont.seq = (uint8_t)seq;
-	count = MIN(count, sizeof(fp->body.cont.data));
+	count = MIN(count, cont_data_len(d->rpt_out_len));
 	memcpy(&fp->body.cont.data, buf, count);
 
-	n = d->io.write(d->io_handle, pkt, sizeof(pkt));
-	if (n < 0 || (size_t)n != sizeof(pkt))
+	n = d->io.write(d->io_handle, pkt, len);
+	if (n < 0 || (size_t)n != len)
 		return (0);
 
+	fido_record_tx(d, pkt + 1, len - 1);
+	fido_metrics_add(d, FIDO_METRIC_FRAMES_TX, 1);
+	FIDO_PROBE3(frame__tx, d, d->cid, pkt + 1);
+	if (fido_trace_enabled())
+		fido_trace_frame(FIDO_TRACE_TX, pkt + 1, len - 1);
+
 	return (count);
 }
 
-int
-fido_tx(fido_dev_t *d, uint8_t cmd, const void *buf, size_t count)
+/*
+ * With message-level transport functions, whole messages are exchanged
+ * and CTAPHID framing is left to the transport.
+ */
+static int
+tx_message(fido_dev_t *d, uint8_t cmd, const void *buf, size_t count)
 {
-	int	seq = 0;
-	size_t	sent;
+	int n;
 
-	fido_log_debug("%s: d=%p, cmd=0x%02x, buf=%p, count=%zu", __func__,
-	    (void *)d, cmd, buf, count);
-	fido_log_xxd(buf, count);
+	if ((cmd & 0x80) == 0)
+		return (-1);
 
-	if (d->io_handle == NULL || count > UINT16_MAX) {
-		fido_log_debug("%s: invalid argument (%p, %zu)", __func__,
-		    d->io_handle, count);
+	n = d->transport.tx(d->io_handle, cmd & 0x7f, buf, count);
+	if (n < 0 || (size_t)n != count)
 		return (-1);
+
+	return (0);
+}
+
+static int
+rx_message(fido_dev_t *d, uint8_t cmd, void *buf, size_t count, int ms)
+{
+	int n;
+
+	n = d->transport.rx(d->io_handle, cmd & 0x7f, buf, count, ms);
+	if (n < 0 || (size_t)n > count) {
+		fido_log_debug("%s: n=%d, count=%zu", __func__, n, count);
+		return (-1);
+	}
+
+	fido_log_debug("%s: payload at %p, len %zu", __func__, buf, (size_t)n);
+	fido_log_xxd(buf, (size_t)n);
+
+	return (n);
+}
+
+/*
+ * The last request sent is kept until its reply is in, so that it can be
+ * sent again if the device replies that it is busy with another channel;
+ * see rx_resend(). The buffer is allocated once per device, large enough
+ * for any message, and kept until the device is closed. It may hold a
+ * PIN, and is wiped as soon as the reply is in; see tx_wipe().
+ */
+static void
+tx_save(fido_dev_t *d, uint8_t cmd, const void *buf, size_t count)
+{
+	unsigned char	*ptr;
+	size_t		 len;
+
+	d->tx_cmd = 0;
+	d->tx_len = 0;
+
+	if (count > d->tx_buf_len) {
+		if ((len = max_msg_len(d->rpt_out_len)) < count) {
+			fido_log_debug("%s: count=%zu", __func__, count);
+			return;
+		}
+		if ((ptr = recallocarray(d->tx_buf, d->tx_buf_len, len,
+		    1)) == NULL) {
+			fido_log_debug("%s: recallocarray", __func__);
+			return;
+		}
+		d->tx_buf = ptr;
+		d->tx_buf_len = len;
 	}
 
+	if (count)
+		memcpy(d->tx_buf, buf, count);
+
+	d->tx_len = count;
+	d->tx_cmd = cmd;
+}
+
+static void
+tx_wipe(fido_dev_t *d)
+{
+	if (d->tx_buf != NULL)
+		explicit_bzero(d->tx_buf, d->tx_len);
+
+	d->tx_len = 0;
+	d->tx_cmd = 0;
+}
+
+static int
+tx_frames(fido_dev_t *d, uint8_t cmd, const void *buf, size_t count)
+{
+	int	seq = 0;
+	size_t	sent;
+
 	if ((sent = tx_preamble(d, cmd, buf, count)) == 0) {
 		fido_log_debug("%s: tx_preamble", __func__);
 		return (-1);
@@ -122,111 +258,266 @@ fido_tx(fido_dev_t *d, uint8_t cmd, const void *buf, size_t count)
 	return (0);
 }
 
+int
+fido_tx(fido_dev_t *d, uint8_t cmd, const void *buf, size_t count)
+{
+	int r;
+
+	fido_log_debug("%s: d=%p, cmd=0x%02x, buf=%p, count=%zu", __func__,
+	    (void *)d, cmd, buf, count);
+	fido_log_xxd(buf, count);
+
+	if (d->io_handle == NULL || count > UINT16_MAX) {
+		fido_log_debug("%s: invalid argument (%p, %zu)", __func__,
+		    d->io_handle, count);
+		return (-1);
+	}
+
+	FIDO_PROBE3(tx__start, d, cmd, count);
+
+	if (fido_trace_enabled())
+		fido_trace_cmd_start(d, cmd, count);
+
+	fido_metrics_cmd_start(d, cmd, buf, count);
+
+	if (d->transport.tx != NULL)
+		r = tx_message(d, cmd, buf, count);
+	else {
+		tx_save(d, cmd, buf, count);
+		if ((r = tx_frames(d, cmd, buf, count)) < 0)
+			tx_wipe(d); /* no reply to wait for */
+	}
+
+	if (r < 0)
+		fido_metrics_add(d, FIDO_METRIC_TX_ERRORS, 1);
+	else
+		fido_metrics_add(d, FIDO_METRIC_BYTES_TX, count);
+
+	FIDO_PROBE3(tx__done, d, cmd, r);
+
+	return (r);
+}
+
+void
+fido_tx_buf_free(fido_dev_t *d)
+{
+	if (d->tx_buf != NULL)
+		explicit_bzero(d->tx_buf, d->tx_buf_len);
+
+	free(d->tx_buf);
+	d->tx_buf = NULL;
+	d->tx_buf_len = 0;
+	d->tx_len = 0;
+	d->tx_cmd = 0;
+}
+
+static int
+deadline_set(struct deadline *dl, int ms)
+{
+	dl->ms = ms;
+
+	return (ms < 0 ? 0 : fido_time_now(&dl->t0));
+}
+
+/* milliseconds left before dl, -1 if there is none, 0 once it passed */
+static int
+deadline_left(const struct deadline *dl)
+{
+	int elapsed;
+
+	if (dl->ms < 0)
+		return (-1);
+	if (fido_time_elapsed_ms(dl->t0, &elapsed) < 0 || elapsed >= dl->ms)
+		return (0);
+
+	return (dl->ms - elapsed);
+}
+
+/* after a frame was skipped: whether to keep on reading */
+static int
+deadline_check(const struct deadline *dl, const char *func)
+{
+	if (deadline_left(dl) != 0)
+		return (0);
+
+	fido_log_debug("%s: timeout", func);
+
+	return (-1);
+}
+
+/* longest message that can be exchanged with d in either direction */
+size_t
+fido_max_msg_len(const fido_dev_t *d)
+{
+	return (max_msg_len(MIN(d->rpt_in_len, d->rpt_out_len)));
+}
+
 static int
-rx_frame(fido_dev_t *d, struct frame *fp, int ms)
+rx_frame(fido_dev_t *d, struct frame *fp, const struct deadline *dl)
 {
 	int n;
 
 	if (d->io.read == NULL)
 		return (-1);
 
-	n = d->io.read(d->io_handle, (unsigned char *)fp, sizeof(*fp), ms);
-	if (n < 0 || (size_t)n != sizeof(*fp))
+	n = d->io.read(d->io_handle, (unsigned char *)fp, d->rpt_in_len,
+	    deadline_left(dl));
+	FIDO_PROBE3(frame__rx, d, fp, n);
+	if (n < 0 || (size_t)n != d->rpt_in_len) {
+		fido_record_rx(d, NULL, 0);
 		return (-1);
+	}
+
+	fido_record_rx(d, (const unsigned char *)fp, d->rpt_in_len);
+	fido_metrics_add(d, FIDO_METRIC_FRAMES_RX, 1);
+	if (fido_trace_enabled())
+		fido_trace_frame(FIDO_TRACE_RX, (const unsigned char *)fp,
+		    d->rpt_in_len);
 
 	return (0);
 }
 
+/* a frame on another channel, e.g. a reply to another process */
+static void
+rx_other_cid(fido_dev_t *d, const struct frame *fp)
+{
+	fido_log_debug("%s: cid (0x%x, 0x%x)", __func__, fp->cid, d->cid);
+	fido_metrics_add(d, FIDO_METRIC_CID_MISMATCHES, 1);
+}
+
+/*
+ * Read the initiation frame of a reply, skipping frames on other
+ * channels, keepalives, and continuation frames left over from a reply
+ * that was given up on, for as long as dl allows.
+ */
 static int
-rx_preamble(fido_dev_t *d, struct frame *fp, int ms)
+rx_preamble(fido_dev_t *d, struct frame *fp, const struct deadline *dl)
 {
-	do {
-		if (rx_frame(d, fp, ms) < 0)
+	for (;;) {
+		if (rx_frame(d, fp, dl) < 0)
 			return (-1);
-#ifdef FIDO_FUZZ
-		fp->cid = d->cid;
-#endif
-	} while (fp->cid == d->cid &&
-	    fp->body.init.cmd == (CTAP_FRAME_INIT | CTAP_KEEPALIVE));
+		if (fp->cid != d->cid)
+			rx_other_cid(d, fp);
+		else if (fp->body.init.cmd == (CTAP_FRAME_INIT |
+		    CTAP_KEEPALIVE))
+			fido_metrics_add(d, FIDO_METRIC_KEEPALIVES, 1);
+		else if ((fp->body.init.cmd & CTAP_FRAME_INIT) == 0) {
+			fido_log_debug("%s: stale seq %d", __func__,
+			    fp->body.cont.seq);
+			fido_metrics_add(d, FIDO_METRIC_STALE_FRAMES, 1);
+		} else
+			break;
+		if (deadline_check(dl, __func__) < 0)
+			return (-1);
+	}
 
 	return (0);
 }
 
-int
-fido_rx(fido_dev_t *d, uint8_t cmd, void *buf, size_t count, int ms)
+/*
+ * A device busy with another channel answers CTAPHID_ERROR with
+ * ERR_CHANNEL_BUSY, without having looked at the request, which can
+ * then be sent again. Any other command means that the reply belongs to
+ * an earlier request, and the channel is out of step.
+ */
+static int
+rx_check_init(fido_dev_t *d, struct frame *fp, uint8_t cmd)
 {
-	struct frame	f;
-	uint16_t	r;
-	uint16_t	flen;
-	int		seq;
+	fido_log_debug("%s: initiation frame at %p, len %zu", __func__,
+	    (void *)fp, d->rpt_in_len);
+	fido_log_xxd(fp, d->rpt_in_len);
 
-	if (d->io_handle == NULL || (cmd & 0x80) == 0) {
-		fido_log_debug("%s: invalid argument (%p, 0x%02x)", __func__,
-		    d->io_handle, cmd);
-		return (-1);
+	if (fp->body.init.cmd == cmd)
+		return (0);
+
+	fido_log_debug("%s: cmd (0x%02x, 0x%02x)", __func__,
+	    fp->body.init.cmd, cmd);
+
+	if (fp->body.init.cmd != (CTAP_FRAME_INIT | CTAP_CMD_ERROR))
+		return (RX_DESYNC);
+	if (fp->body.init.bcnth == 0 && fp->body.init.bcntl == 1 &&
+	    fp->body.init.data[0] == FIDO_ERR_CHANNEL_BUSY)
+		return (RX_BUSY);
+
+	return (-1);
+}
+
+/*
+ * Read continuation frame seq of a reply, skipping frames on other
+ * channels. A frame out of sequence means that the reply is lost.
+ */
+static int
+rx_cont(fido_dev_t *d, struct frame *fp, int seq, const struct deadline *dl)
+{
+	for (;;) {
+		if (rx_frame(d, fp, dl) < 0)
+			return (-1);
+		if (fp->cid == d->cid)
+			break;
+		rx_other_cid(d, fp);
+		if (deadline_check(dl, __func__) < 0)
+			return (-1);
 	}
 
-	if (rx_preamble(d, &f, ms) < 0) {
-		fido_log_debug("%s: rx_preamble", __func__);
-		return (-1);
+	fido_log_debug("%s: continuation frame at %p, len %zu", __func__,
+	    (void *)fp, d->rpt_in_len);
+	fido_log_xxd(fp, d->rpt_in_len);
+
+	if (fp->body.cont.seq != seq) {
+		fido_log_debug("%s: seq (%d, %d)", __func__, fp->body.cont.seq,
+		    seq);
+		return (RX_DESYNC);
 	}
 
-	fido_log_debug("%s: initiation frame at %p, len %zu", __func__,
-	    (void *)&f, sizeof(f));
-	fido_log_xxd(&f, sizeof(f));
+	return (0);
+}
 
-#ifdef FIDO_FUZZ
-	f.cid = d->cid;
-	f.body.init.cmd = cmd;
-#endif
+static int
+rx_frames(fido_dev_t *d, uint8_t cmd, void *buf, size_t count,
+    const struct deadline *dl)
+{
+	struct frame	f;
+	uint16_t	r;
+	uint16_t	flen;
+	size_t		init_len = init_data_len(d->rpt_in_len);
+	size_t		cont_len = cont_data_len(d->rpt_in_len);
+	int		seq;
+	int		n;
 
-	if (f.cid != d->cid || f.body.init.cmd != cmd) {
-		fido_log_debug("%s: cid (0x%x, 0x%x), cmd (0x%02x, 0x%02x)",
-		    __func__, f.cid, d->cid, f.body.init.cmd, cmd);
+	if (rx_preamble(d, &f, dl) < 0) {
+		fido_log_debug("%s: rx_preamble", __func__);
 		return (-1);
 	}
 
+	if ((n = rx_check_init(d, &f, cmd)) < 0)
+		return (n);
+
 	flen = (f.body.init.bcnth << 8) | f.body.init.bcntl;
 	if (count < (size_t)flen) {
 		fido_log_debug("%s: count < flen (%zu, %zu)", __func__, count,
 		    (size_t)flen);
 		return (-1);
 	}
-	if (flen < sizeof(f.body.init.data)) {
+	if (flen < init_len) {
 		memcpy(buf, f.body.init.data, flen);
 		return (flen);
 	}
 
-	memcpy(buf, f.body.init.data, sizeof(f.body.init.data));
-	r = sizeof(f.body.init.data);
+	memcpy(buf, f.body.init.data, init_len);
+	r = (uint16_t)init_len;
 	seq = 0;
 
 	while ((size_t)r < flen) {
-		if (rx_frame(d, &f, ms) < 0) {
-			fido_log_debug("%s: rx_frame", __func__);
-			return (-1);
-		}
-
-		fido_log_debug("%s: continuation frame at %p, len %zu",
-		    __func__, (void *)&f, sizeof(f));
-		fido_log_xxd(&f, sizeof(f));
-
-#ifdef FIDO_FUZZ
-		f.cid = d->cid;
-		f.body.cont.seq = seq;
-#endif
-
-		if (f.cid != d->cid || f.body.cont.seq != seq++) {
-			fido_log_debug("%s: cid (0x%x, 0x%x), seq (%d, %d)",
-			    __func__, f.cid, d->cid, f.body.cont.seq, seq);
-			return (-1);
+		if ((n = rx_cont(d, &f, seq++, dl)) < 0) {
+			fido_log_debug("%s: rx_cont", __func__);
+			return (n);
 		}
 
 		uint8_t *p = (uint8_t *)buf + r;
 
-		if ((size_t)(flen - r) > sizeof(f.body.cont.data)) {
-			memcpy(p, f.body.cont.data, sizeof(f.body.cont.data));
-			r += sizeof(f.body.cont.data);
+		if ((size_t)(flen - r) > cont_len) {
+			memcpy(p, f.body.cont.data, cont_len);
+			r += (uint16_t)cont_len;
 		} else {
 			memcpy(p, f.body.cont.data, flen - r);
 			r += (flen - r); /* break */
@@ -239,16 +530,304 @@ fido_rx(fido_dev_t *d, uint8_t cmd, void *buf, size_t count, int ms)
 	return (r);
 }
 
+/*
+ * The receive buffer of a device holds room for the header of an
+ * initiation frame, the payload, and a frame's worth of slack, so that
+ * frames can be read in place: the header of a frame lands on the tail
+ * of the previous one, which is saved and put back, and its data where
+ * it belongs in the payload.
+ */
+static int
+rx_buf_reserve(fido_dev_t *d, size_t len)
+{
+	unsigned char	*ptr;
+	size_t		 old;
+
+	if (len <= d->rx_buf_len)
+		return (0);
+
+	if (len > max_msg_len(d->rpt_in_len)) {
+		fido_log_debug("%s: len=%zu", __func__, len);
+		return (-1);
+	}
+
+	old = d->rx_buf != NULL ? RX_HDR_LEN + d->rx_buf_len + RX_SLACK : 0;
+	if ((ptr = recallocarray(d->rx_buf, old, RX_HDR_LEN + len + RX_SLACK,
+	    1)) == NULL) {
+		fido_log_debug("%s: recallocarray", __func__);
+		return (-1);
+	}
+
+	d->rx_buf = ptr;
+	d->rx_buf_len = len;
+
+	return (0);
+}
+
+/* initial size of the receive buffer; grown as needed */
+static size_t
+rx_buf_len(const fido_dev_t *d)
+{
+	size_t max = max_msg_len(d->rpt_in_len);
+
+	if (d->maxmsgsiz > max)
+		return (max);
+	if (d->maxmsgsiz > RX_MIN_LEN)
+		return ((size_t)d->maxmsgsiz);
+
+	return (RX_MIN_LEN);
+}
+
+static int
+rx_frames_buf(fido_dev_t *d, uint8_t cmd, const struct deadline *dl)
+{
+	struct frame	*fp;
+	unsigned char	*p;
+	unsigned char	 save[CTAP_CONT_HDR_LEN];
+	size_t		 r;
+	uint16_t	 flen;
+	int		 seq;
+	int		 n;
+
+	if (rx_buf_reserve(d, rx_buf_len(d)) < 0)
+		return (-1);
+
+	fp = (struct frame *)d->rx_buf;
+
+	if (rx_preamble(d, fp, dl) < 0) {
+		fido_log_debug("%s: rx_preamble", __func__);
+		return (-1);
+	}
+
+	if ((n = rx_check_init(d, fp, cmd)) < 0)
+		return (n);
+
+	/* the initiation frame is preserved */
+	flen = (fp->body.init.bcnth << 8) | fp->body.init.bcntl;
+	if (rx_buf_reserve(d, flen) < 0) {
+		fido_log_debug("%s: flen=%zu", __func__, (size_t)flen);
+		return (-1);
+	}
+
+	r = MIN(flen, init_data_len(d->rpt_in_len));
+	seq = 0;
+
+	while (r < flen) {
+		p = d->rx_buf + RX_HDR_LEN + r;
+		fp = (struct frame *)(p - CTAP_CONT_HDR_LEN);
+		memcpy(save, fp, sizeof(save));
+
+		if ((n = rx_cont(d, fp, seq++, dl)) < 0) {
+			fido_log_debug("%s: rx_cont", __func__);
+			return (n);
+		}
+
+		memcpy(fp, save, sizeof(save));
+		r += MIN(flen - r, cont_data_len(d->rpt_in_len));
+	}
+
+	p = d->rx_buf + RX_HDR_LEN;
+
+	fido_log_debug("%s: payload at %p, len %zu", __func__, (void *)p, r);
+	fido_log_xxd(p, r);
+
+	return ((int)r);
+}
+
+static int
+rx_message_buf(fido_dev_t *d, uint8_t cmd, int ms)
+{
+	/* the length of the reply is not known in advance */
+	if (rx_buf_reserve(d, max_msg_len(d->rpt_in_len)) < 0)
+		return (-1);
+
+	return (rx_message(d, cmd, d->rx_buf + RX_HDR_LEN, d->rx_buf_len, ms));
+}
+
+/*
+ * Send the last request again after a busy reply, waiting a little longer
+ * each time, up to BUSY_RETRIES times.
+ */
+static int
+rx_resend(fido_dev_t *d, uint8_t cmd, int retry)
+{
+	if (retry >= BUSY_RETRIES || d->tx_cmd != cmd) {
+		fido_log_debug("%s: retry=%d, cmd=0x%02x", __func__, retry,
+		    d->tx_cmd);
+		return (-1);
+	}
+
+	if (fido_time_sleep(BUSY_DELAY_MS << retry) < 0 ||
+	    tx_frames(d, d->tx_cmd, d->tx_buf, d->tx_len) < 0) {
+		fido_log_debug("%s: resend", __func__);
+		return (-1);
+	}
+
+	fido_metrics_add(d, FIDO_METRIC_BUSY_RETRIES, 1);
+
+	return (0);
+}
+
+/*
+ * After a broken reply, the rest of it may still be on its way. A
+ * CTAPHID_INIT on the channel makes the device drop what it was doing,
+ * and whatever precedes its reply is discarded, so that the next command
+ * starts afresh. This takes up to RESYNC_MS, whatever the timeout of the
+ * broken reply.
+ */
+static void
+rx_resync(fido_dev_t *d)
+{
+	const uint8_t	cmd = CTAP_FRAME_INIT | CTAP_CMD_INIT;
+	struct deadline	dl;
+	struct frame	f;
+	uint64_t	nonce = ++d->nonce;
+	size_t		len = MIN(sizeof(nonce), init_data_len(d->rpt_in_len));
+
+	if (d->cid == CTAP_CID_BROADCAST)
+		return; /* no channel yet */
+
+	fido_metrics_add(d, FIDO_METRIC_RESYNCS, 1);
+
+	if (tx_frames(d, cmd, &nonce, sizeof(nonce)) < 0 ||
+	    deadline_set(&dl, RESYNC_MS) < 0) {
+		fido_log_debug("%s: tx_frames", __func__);
+		return;
+	}
+
+	for (int i = 0; i < RESYNC_FRAMES; i++) {
+		if (i > 0 && deadline_check(&dl, __func__) < 0)
+			return;
+		if (rx_frame(d, &f, &dl) < 0) {
+			fido_log_debug("%s: rx_frame", __func__);
+			return;
+		}
+		if (f.cid == d->cid && f.body.init.cmd == cmd &&
+		    memcmp(f.body.init.data, &nonce, len) == 0)
+			return;
+		if (f.cid != d->cid)
+			rx_other_cid(d, &f);
+		else
+			fido_metrics_add(d, FIDO_METRIC_STALE_FRAMES, 1);
+	}
+
+	fido_log_debug("%s: gave up", __func__);
+}
+
+static int
+rx_done(fido_dev_t *d, uint8_t cmd, int n)
+{
+	if (n < 0)
+		fido_metrics_add(d, FIDO_METRIC_RX_ERRORS, 1);
+	else {
+		fido_metrics_add(d, FIDO_METRIC_BYTES_RX, (uint64_t)n);
+		fido_metrics_cmd_end(d);
+	}
+
+	if (fido_trace_enabled())
+		fido_trace_cmd_end(d, cmd, n);
+
+	FIDO_PROBE3(rx__done, d, cmd, n);
+
+	return (n);
+}
+
+int
+fido_rx(fido_dev_t *d, uint8_t cmd, void *buf, size_t count, int ms)
+{
+	struct deadline	dl;
+	int		n;
+
+	if (d->io_handle == NULL || (cmd & 0x80) == 0) {
+		fido_log_debug("%s: invalid argument (%p, 0x%02x)", __func__,
+		    d->io_handle, cmd);
+		return (-1);
+	}
+
+	FIDO_PROBE3(rx__start, d, cmd, ms);
+
+	if (d->transport.rx != NULL)
+		n = rx_message(d, cmd, buf, count, ms);
+	else if (deadline_set(&dl, ms) < 0)
+		n = -1;
+	else {
+		for (int i = 0; (n = rx_frames(d, cmd, buf, count,
+		    &dl)) == RX_BUSY; i++)
+			if (rx_resend(d, cmd, i) < 0)
+				break;
+		if (n == RX_DESYNC)
+			rx_resync(d);
+	}
+
+	tx_wipe(d);
+
+	return (rx_done(d, cmd, n < 0 ? -1 : n));
+}
+
+/*
+ * Receive a message into the receive buffer of the device. On success,
+ * *ptr points to the payload, and is valid until the next call to
+ * fido_rx_buf() or fido_dev_close() on d.
+ */
+int
+fido_rx_buf(fido_dev_t *d, uint8_t cmd, const unsigned char **ptr, int ms)
+{
+	struct deadline	dl;
+	int		n;
+
+	*ptr = NULL;
+
+	if (d->io_handle == NULL || (cmd & 0x80) == 0) {
+		fido_log_debug("%s: invalid argument (%p, 0x%02x)", __func__,
+		    d->io_handle, cmd);
+		return (-1);
+	}
+
+	FIDO_PROBE3(rx__start, d, cmd, ms);
+
+	if (d->transport.rx != NULL)
+		n = rx_message_buf(d, cmd, ms);
+	else if (deadline_set(&dl, ms) < 0)
+		n = -1;
+	else {
+		for (int i = 0; (n = rx_frames_buf(d, cmd, &dl)) == RX_BUSY;
+		    i++)
+			if (rx_resend(d, cmd, i) < 0)
+				break;
+		if (n == RX_DESYNC)
+			rx_resync(d);
+	}
+
+	tx_wipe(d);
+
+	if (n >= 0)
+		*ptr = d->rx_buf + RX_HDR_LEN;
+
+	return (rx_done(d, cmd, n < 0 ? -1 : n));
+}
+
+void
+fido_rx_buf_free(fido_dev_t *d)
+{
+	if (d->rx_buf != NULL)
+		explicit_bzero(d->rx_buf, RX_HDR_LEN + d->rx_buf_len +
+		    RX_SLACK);
+
+	free(d->rx_buf);
+	d->rx_buf = NULL;
+	d->rx_buf_len = 0;
+}
+
 int
 fido_rx_cbor_status(fido_dev_t *d, int ms)
 {
-	const uint8_t	cmd = CTAP_FRAME_INIT | CTAP_CMD_CBOR;
-	unsigned char	reply[2048];
-	int		reply_len;
+	const uint8_t		 cmd = CTAP_FRAME_INIT | CTAP_CMD_CBOR;
+	const unsigned char	*reply;
+	int			 reply_len;
 
-	if ((reply_len = fido_rx(d, cmd, &reply, sizeof(reply), ms)) < 0 ||
+	if ((reply_len = fido_rx_buf(d, cmd, &reply, ms)) < 0 ||
 	    (size_t)reply_len < 1) {
-		fido_log_debug("%s: fido_rx", __func__);
+		fido_log_debug("%s: fido_rx_buf", __func__);
 		return (FIDO_ERR_RX);
 	}
 
@@ -7,6 +7,7 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "fido.h"
 
 #ifndef FIDO_NO_DIAGNOSTIC
@@ -15,49 +16,320 @@
 #define TLS
 #endif
 
+#define LOG_MSG_LEN	256	/* formatted on the stack */
+#define LOG_TEXT_MAX	2048	/* longest message kept in the ring */
+#define LOG_RING_SIZE	16384	/* per-thread ring, in bytes */
+#define LOG_XXD_MAX	2048	/* longest hex dump kept */
+
+#define REC_TEXT	0
+#define REC_XXD		1
+
+/*
+ * In ring mode, messages are appended to a per-thread ring buffer as
+ * records; hex dumps are stored as raw bytes and only formatted when
+ * the ring is drained. When the ring is full, the oldest records are
+ * discarded. Since each thread only touches its own ring, no locking
+ * takes place. Without thread-local storage, the ring would be shared
+ * by all threads; it is left out, and ring mode logs to stderr instead.
+ */
+#ifdef HAVE_TLS
+#define LOG_RING
+#endif
+
+struct log_rec {
+	uint64_t	 t;	/* monotonic time, ns */
+	const char	*file;	/* source file; the record's category */
+	uint32_t	 len;	/* payload length */
+	uint8_t		 level;
+	uint8_t		 kind;
+};
+
+struct log_ring {
+	unsigned char	buf[LOG_RING_SIZE];
+	uint64_t	w;	/* total bytes written */
+	uint64_t	r;	/* total bytes discarded or drained */
+	uint64_t	lost;	/* records discarded */
+};
+
 static TLS int logging;
 
 void
-fido_log_init(void)
+fido_log_init(int mode)
+{
+#ifndef LOG_RING
+	if (mode == FIDO_DEBUG_RING)
+		mode = FIDO_DEBUG;
+#endif
+	logging = mode;
+}
+
+#ifdef LOG_RING
+static TLS struct log_ring ring;
+
+static void
+ring_copy_in(struct log_ring *lr, uint64_t pos, const void *ptr, size_t len)
+{
+	size_t off = (size_t)(pos % LOG_RING_SIZE);
+	size_t n = LOG_RING_SIZE - off;
+
+	if (n > len)
+		n = len;
+
+	memcpy(lr->buf + off, ptr, n);
+	memcpy(lr->buf, (const unsigned char *)ptr + n, len - n);
+}
+
+static void
+ring_copy_out(const struct log_ring *lr, uint64_t pos, void *ptr, size_t len)
+{
+	size_t off = (size_t)(pos % LOG_RING_SIZE);
+	size_t n = LOG_RING_SIZE - off;
+
+	if (n > len)
+		n = len;
+
+	memcpy(ptr, lr->buf + off, n);
+	memcpy((unsigned char *)ptr + n, lr->buf, len - n);
+}
+
+static void
+ring_put(int level, int kind, const char *file, const void *ptr, size_t len)
 {
-	logging = 1;
+	struct log_rec	rec;
+	struct log_rec	old;
+
+	memset(&rec, 0, sizeof(rec));
+	if (fido_time_now(&rec.t) < 0)
+		rec.t = 0;
+	rec.file = file;
+	rec.len = (uint32_t)len;
+	rec.level = (uint8_t)level;
+	rec.kind = (uint8_t)kind;
+
+	while (LOG_RING_SIZE - (ring.w - ring.r) < sizeof(rec) + len) {
+		ring_copy_out(&ring, ring.r, &old, sizeof(old));
+		ring.r += sizeof(old) + old.len;
+		ring.lost++;
+	}
+
+	ring_copy_in(&ring, ring.w, &rec, sizeof(rec));
+	ring_copy_in(&ring, ring.w + sizeof(rec), ptr, len);
+	ring.w += sizeof(rec) + len;
+}
+#endif /* LOG_RING */
+
+/* format a hex dump as "  xx xx ...", 16 bytes per line */
+static size_t
+xxd(char *out, size_t size, const uint8_t *ptr, size_t count)
+{
+	static const char hex[] = "0123456789abcdef";
+	size_t n = 0;
+
+	if (size < 3)
+		return (0);
+
+	out[n++] = ' ';
+	out[n++] = ' ';
+
+	for (size_t i = 0; i < count && n + 7 <= size; i++) {
+		out[n++] = hex[ptr[i] >> 4];
+		out[n++] = hex[ptr[i] & 0xf];
+		out[n++] = ' ';
+		if ((i + 1) % 16 == 0 && i + 1 < count) {
+			out[n++] = '\n';
+			out[n++] = ' ';
+			out[n++] = ' ';
+		}
+	}
+
+	out[n] = '\0';
+
+	return (n);
 }
 
 void
 fido_log_xxd(const void *buf, size_t count)
 {
-	const uint8_t	*ptr = buf;
-	size_t		 i;
+	char line[64];
 
 	if (!logging)
 		return;
 
-	fprintf(stderr, "  ");
-
-	for (i = 0; i < count; i++) {
-		fprintf(stderr, "%02x ", *ptr++);
-		if ((i + 1) % 16 == 0 && i + 1 < count)
-			fprintf(stderr, "\n  ");
+#ifdef LOG_RING
+	if (logging == FIDO_DEBUG_RING) {
+		ring_put(FIDO_LOG_DUMP, REC_XXD, NULL, buf,
+		    count < LOG_XXD_MAX ? count : LOG_XXD_MAX);
+		return;
 	}
+#endif
+
+	/* one line at a time */
+	do {
+		size_t n = count < 16 ? count : 16;
+		xxd(line, sizeof(line), buf, n);
+		fprintf(stderr, "%s\n", line);
+		buf = (const uint8_t *)buf + n;
+		count -= n;
+	} while (count > 0);
 
-	fprintf(stderr, "\n");
 	fflush(stderr);
 }
 
 void
-fido_log_debug(const char *fmt, ...)
+fido_log_msg(const char *file, const char *fmt, ...)
 {
+	char	 buf[LOG_MSG_LEN];
+	char	*msg = buf;
 	va_list	 ap;
+	int	 n;
+	int	 r;
 
 	if (!logging)
 		return;
 
 	va_start(ap, fmt);
-	vfprintf(stderr, fmt, ap);
+	n = vsnprintf(buf, sizeof(buf), fmt, ap);
 	va_end(ap);
 
-	fprintf(stderr, "\n");
+	if (n < 0)
+		return;
+
+	/* longer messages are formatted again, into a buffer of their size */
+	if ((size_t)n >= sizeof(buf)) {
+		if ((msg = malloc((size_t)n + 1)) == NULL) {
+			msg = buf;
+			n = sizeof(buf) - 1;
+		} else {
+			va_start(ap, fmt);
+			r = vsnprintf(msg, (size_t)n + 1, fmt, ap);
+			va_end(ap);
+			if (r != n)
+				goto out;
+		}
+	}
+
+#ifdef LOG_RING
+	if (logging == FIDO_DEBUG_RING) {
+		ring_put(FIDO_LOG_DEBUG, REC_TEXT, file, msg,
+		    (size_t)n < LOG_TEXT_MAX ? (size_t)n : LOG_TEXT_MAX);
+		goto out;
+	}
+#else
+	(void)file;
+#endif
+
+	fwrite(msg, 1, (size_t)n, stderr);
+	fputc('\n', stderr);
 	fflush(stderr);
+out:
+	if (msg != buf)
+		free(msg);
+}
+
+#ifdef LOG_RING
+/* "src/io.c" -> "io" */
+static const char *
+category(const char *file, char *buf, size_t size)
+{
+	const char	*p;
+	size_t		 n;
+
+	if (file == NULL)
+		return ("");
+
+	for (p = file; *file != '\0'; file++)
+		if (*file == '/' || *file == '\\')
+			p = file + 1;
+
+	n = strcspn(p, ".");
+	if (n >= size)
+		n = size - 1;
+
+	memcpy(buf, p, n);
+	buf[n] = '\0';
+
+	return (buf);
+}
+
+static void
+log_stderr(int level, const char *cat, uint64_t t, const char *msg,
+    void *arg)
+{
+	(void)level;
+	(void)arg;
+
+	fprintf(stderr, "%llu.%09llu %s: %s\n",
+	    (unsigned long long)(t / 1000000000),
+	    (unsigned long long)(t % 1000000000), cat, msg);
 }
 
+size_t
+fido_log_drain(int level, fido_log_handler_t *handler, void *arg)
+{
+	struct log_rec	 rec;
+	const char	*cat = "";
+	char		 cat_buf[32];
+	char		*msg = NULL;
+	unsigned char	*payload = NULL;
+	size_t		 msg_len;
+	size_t		 n = 0;
+
+	if (handler == NULL)
+		handler = log_stderr;
+
+	/* a hex dump of up to LOG_XXD_MAX bytes, formatted */
+	msg_len = LOG_XXD_MAX * 3 + (LOG_XXD_MAX / 16) * 3 + 8;
+
+	if ((msg = malloc(msg_len)) == NULL ||
+	    (payload = malloc(LOG_XXD_MAX + LOG_TEXT_MAX)) == NULL)
+		goto out;
+
+	if (ring.lost > 0 && level >= FIDO_LOG_DEBUG) {
+		snprintf(msg, msg_len, "%llu records lost",
+		    (unsigned long long)ring.lost);
+		handler(FIDO_LOG_DEBUG, "log", 0, msg, arg);
+		ring.lost = 0;
+	}
+
+	while (ring.r < ring.w) {
+		ring_copy_out(&ring, ring.r, &rec, sizeof(rec));
+		ring_copy_out(&ring, ring.r + sizeof(rec), payload, rec.len);
+		ring.r += sizeof(rec) + rec.len;
+		/* hex dumps belong to the preceding message */
+		if (rec.kind == REC_TEXT)
+			cat = category(rec.file, cat_buf, sizeof(cat_buf));
+		if (rec.level > level)
+			continue;
+		if (rec.kind == REC_XXD)
+			xxd(msg, msg_len, payload, rec.len);
+		else {
+			memcpy(msg, payload, rec.len);
+			msg[rec.len] = '\0';
+		}
+		handler(rec.level, cat, rec.t, msg, arg);
+		n++;
+	}
+
+	if (handler == log_stderr)
+		fflush(stderr);
+out:
+	free(msg);
+	free(payload);
+
+	return (n);
+}
+#endif /* LOG_RING */
+
 #endif /* !FIDO_NO_DIAGNOSTIC */
+
+#if defined(FIDO_NO_DIAGNOSTIC) || !defined(LOG_RING)
+size_t
+fido_log_drain(int level, fido_log_handler_t *handler, void *arg)
+{
+	(void)level;
+	(void)handler;
+	(void)arg;
+
+	return (0);
+}
+#endif
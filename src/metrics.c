@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2020 Yubico AB. All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+#include <string.h>
+
+#include "fido.h"
+
+/*
+ * Cumulative counters and per-command latency histograms. Each device
+ * keeps its own, updated without synchronisation like the rest of the
+ * device; a process-wide copy is updated with relaxed atomic additions.
+ * Counters not tied to a device, such as signature verifications, are
+ * only kept process-wide.
+ */
+
+#if defined(_MSC_VER)
+#include <windows.h>
+#define metric_add(p, v)	InterlockedExchangeAdd64((volatile LONG64 *)(p), \
+				    (LONG64)(v))
+#define metric_load(p)		(uint64_t)InterlockedCompareExchange64( \
+				    (volatile LONG64 *)(p), 0, 0)
+#else
+#define metric_add(p, v)	__atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#define metric_load(p)		__atomic_load_n((p), __ATOMIC_RELAXED)
+#endif
+
+static fido_metrics_t global;
+
+static const char *metric_name[FIDO_METRIC_MAX] = {
+	[FIDO_METRIC_FRAMES_TX] = "frames_tx",
+	[FIDO_METRIC_FRAMES_RX] = "frames_rx",
+	[FIDO_METRIC_BYTES_TX] = "bytes_tx",
+	[FIDO_METRIC_BYTES_RX] = "bytes_rx",
+	[FIDO_METRIC_TX_ERRORS] = "tx_errors",
+	[FIDO_METRIC_RX_ERRORS] = "rx_errors",
+	[FIDO_METRIC_KEEPALIVES] = "keepalives",
+	[FIDO_METRIC_CID_MISMATCHES] = "cid_mismatches",
+	[FIDO_METRIC_U2F_POLLS] = "u2f_polls",
+	[FIDO_METRIC_CBOR_ERRORS] = "cbor_errors",
+	[FIDO_METRIC_ECDH] = "ecdh",
+	[FIDO_METRIC_PIN_TOKENS] = "pin_tokens",
+	[FIDO_METRIC_VERIFY_ES256_OK] = "verify_es256_ok",
+	[FIDO_METRIC_VERIFY_ES256_FAIL] = "verify_es256_fail",
+	[FIDO_METRIC_VERIFY_RS256_OK] = "verify_rs256_ok",
+	[FIDO_METRIC_VERIFY_RS256_FAIL] = "verify_rs256_fail",
+	[FIDO_METRIC_VERIFY_EDDSA_OK] = "verify_eddsa_ok",
+	[FIDO_METRIC_VERIFY_EDDSA_FAIL] = "verify_eddsa_fail",
+	[FIDO_METRIC_STALE_FRAMES] = "stale_frames",
+	[FIDO_METRIC_RESYNCS] = "resyncs",
+	[FIDO_METRIC_BUSY_RETRIES] = "busy_retries",
+};
+
+/* CTAPHID commands, and CTAP2 commands sent through CTAPHID_CBOR */
+static const struct latency {
+	uint8_t		 cmd;
+	int		 cbor_cmd;	/* -1 if not CTAPHID_CBOR */
+	const char	*name;
+} latency[FIDO_METRIC_LATENCY_MAX] = {
+	{ CTAP_CMD_INIT, -1, "init" },
+	{ CTAP_CMD_PING, -1, "ping" },
+	{ CTAP_CMD_MSG, -1, "msg" },
+	{ CTAP_CMD_WINK, -1, "wink" },
+	{ CTAP_CMD_LOCK, -1, "lock" },
+	{ CTAP_CMD_CBOR, CTAP_CBOR_MAKECRED, "make_cred" },
+	{ CTAP_CMD_CBOR, CTAP_CBOR_ASSERT, "get_assert" },
+	{ CTAP_CMD_CBOR, CTAP_CBOR_GETINFO, "get_info" },
+	{ CTAP_CMD_CBOR, CTAP_CBOR_CLIENT_PIN, "client_pin" },
+	{ CTAP_CMD_CBOR, CTAP_CBOR_RESET, "reset" },
+	{ CTAP_CMD_CBOR, CTAP_CBOR_NEXT_ASSERT, "next_assert" },
+	{ CTAP_CMD_CBOR, CTAP_CBOR_BIO_ENROLL_PRE, "bio_enroll" },
+	{ CTAP_CMD_CBOR, CTAP_CBOR_CRED_MGMT_PRE, "cred_mgmt" },
+	{ 0, -1, "other" },
+};
+
+/* upper bounds, in microseconds */
+static const uint64_t bucket[FIDO_METRIC_BUCKET_MAX] = {
+	1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000,
+	1000000, 2000000, 5000000, 10000000, UINT64_MAX,
+};
+
+void
+fido_metrics_add(fido_dev_t *dev, int id, uint64_t v)
+{
+	if (dev != NULL)
+		dev->metrics.counter[id] += v;
+
+	metric_add(&global.counter[id], v);
+}
+
+void
+fido_metrics_cmd_start(fido_dev_t *dev, uint8_t cmd, const void *buf,
+    size_t count)
+{
+	int cbor_cmd = -1;
+	int i;
+
+	cmd &= 0x7f;
+	if (cmd == CTAP_CMD_CBOR && count > 0)
+		cbor_cmd = *(const uint8_t *)buf;
+
+	for (i = 0; i < FIDO_METRIC_LATENCY_MAX - 1; i++)
+		if (latency[i].cmd == cmd && latency[i].cbor_cmd == cbor_cmd)
+			break;
+
+	dev->cmd_idx = i;
+
+	if (fido_time_now(&dev->cmd_t0) < 0)
+		dev->cmd_t0 = 0;
+}
+
+void
+fido_metrics_cmd_end(fido_dev_t *dev)
+{
+	uint64_t	now;
+	uint64_t	us;
+	int		i = dev->cmd_idx;
+	int		j;
+
+	if (dev->cmd_t0 == 0 || fido_time_now(&now) < 0 || now < dev->cmd_t0)
+		return;
+
+	us = (now - dev->cmd_t0) / 1000;
+	dev->cmd_t0 = 0;
+
+	for (j = 0; us > bucket[j]; j++)
+		continue;
+
+	dev->metrics.latency[i][j]++;
+	dev->metrics.latency_sum[i] += us;
+	metric_add(&global.latency[i][j], 1);
+	metric_add(&global.latency_sum[i], us);
+}
+
+fido_metrics_t *
+fido_metrics_new(void)
+{
+	return (calloc(1, sizeof(fido_metrics_t)));
+}
+
+void
+fido_metrics_free(fido_metrics_t **m_p)
+{
+	if (m_p == NULL || *m_p == NULL)
+		return;
+
+	free(*m_p);
+	*m_p = NULL;
+}
+
+int
+fido_metrics_get(const fido_dev_t *dev, fido_metrics_t *m)
+{
+	if (dev != NULL) {
+		*m = dev->metrics;
+		return (FIDO_OK);
+	}
+
+	for (size_t i = 0; i < FIDO_METRIC_MAX; i++)
+		m->counter[i] = metric_load(&global.counter[i]);
+
+	for (size_t i = 0; i < FIDO_METRIC_LATENCY_MAX; i++) {
+		for (size_t j = 0; j < FIDO_METRIC_BUCKET_MAX; j++)
+			m->latency[i][j] = metric_load(&global.latency[i][j]);
+		m->latency_sum[i] = metric_load(&global.latency_sum[i]);
+	}
+
+	return (FIDO_OK);
+}
+
+size_t
+fido_metrics_len(const fido_metrics_t *m)
+{
+	(void)m;
+
+	return (FIDO_METRIC_MAX);
+}
+
+const char *
+fido_metrics_name(const fido_metrics_t *m, size_t idx)
+{
+	(void)m;
+
+	if (idx >= FIDO_METRIC_MAX)
+		return (NULL);
+
+	return (metric_name[idx]);
+}
+
+uint64_t
+fido_metrics_value(const fido_metrics_t *m, size_t idx)
+{
+	if (idx >= FIDO_METRIC_MAX)
+		return (0);
+
+	return (m->counter[idx]);
+}
+
+size_t
+fido_metrics_latency_len(const fido_metrics_t *m)
+{
+	(void)m;
+
+	return (FIDO_METRIC_LATENCY_MAX);
+}
+
+const char *
+fido_metrics_latency_name(const fido_metrics_t *m, size_t idx)
+{
+	(void)m;
+
+	if (idx >= FIDO_METRIC_LATENCY_MAX)
+		return (NULL);
+
+	return (latency[idx].name);
+}
+
+const uint64_t *
+fido_metrics_latency_ptr(const fido_metrics_t *m, size_t idx)
+{
+	if (idx >= FIDO_METRIC_LATENCY_MAX)
+		return (NULL);
+
+	return (m->latency[idx]);
+}
+
+uint64_t
+fido_metrics_latency_sum(const fido_metrics_t *m, size_t idx)
+{
+	if (idx >= FIDO_METRIC_LATENCY_MAX)
+		return (0);
+
+	return (m->latency_sum[idx]);
+}
+
+size_t
+fido_metrics_bucket_len(const fido_metrics_t *m)
+{
+	(void)m;
+
+	return (FIDO_METRIC_BUCKET_MAX);
+}
+
+const uint64_t *
+fido_metrics_bucket_ptr(const fido_metrics_t *m)
+{
+	(void)m;
+
+	return (bucket);
+}
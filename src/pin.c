@@ -71,19 +71,19 @@ static int
 fido_dev_get_pin_token_rx(fido_dev_t *dev, const fido_blob_t *ecdh,
     fido_blob_t *token, int ms)
 {
-	const uint8_t	 cmd = CTAP_FRAME_INIT | CTAP_CMD_CBOR;
-	fido_blob_t	*aes_token = NULL;
-	unsigned char	 reply[2048];
-	int		 reply_len;
-	int		 r;
+	const uint8_t		 cmd = CTAP_FRAME_INIT | CTAP_CMD_CBOR;
+	fido_blob_t		*aes_token = NULL;
+	const unsigned char	*reply;
+	int			 reply_len;
+	int			 r;
 
 	if ((aes_token = fido_blob_new()) == NULL) {
 		r = FIDO_ERR_INTERNAL;
 		goto fail;
 	}
 
-	if ((reply_len = fido_rx(dev, cmd, &reply, sizeof(reply), ms)) < 0) {
-		fido_log_debug("%s: fido_rx", __func__);
+	if ((reply_len = fido_rx_buf(dev, cmd, &reply, ms)) < 0) {
+		fido_log_debug("%s: fido_rx_buf", __func__);
 		r = FIDO_ERR_RX;
 		goto fail;
 	}
@@ -117,6 +117,8 @@ fido_dev_get_pin_token_wait(fido_dev_t *dev, const char *pin,
 	    (r = fido_dev_get_pin_token_rx(dev, ecdh, token, ms)) != FIDO_OK)
 		return (r);
 
+	fido_metrics_add(dev, FIDO_METRIC_PIN_TOKENS, 1);
+
 	return (FIDO_OK);
 }
 
@@ -356,15 +358,15 @@ fail:
 static int
 fido_dev_get_retry_count_rx(fido_dev_t *dev, int *retries, int ms)
 {
-	const uint8_t	cmd = CTAP_FRAME_INIT | CTAP_CMD_CBOR;
-	unsigned char	reply[512];
-	int		reply_len;
-	int		r;
+	const uint8_t		 cmd = CTAP_FRAME_INIT | CTAP_CMD_CBOR;
+	const unsigned char	*reply;
+	int			 reply_len;
+	int			 r;
 
 	*retries = 0;
 
-	if ((reply_len = fido_rx(dev, cmd, &reply, sizeof(reply), ms)) < 0) {
-		fido_log_debug("%s: fido_rx", __func__);
+	if ((reply_len = fido_rx_buf(dev, cmd, &reply, ms)) < 0) {
+		fido_log_debug("%s: fido_rx_buf", __func__);
 		return (FIDO_ERR_RX);
 	}
 
@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2020 Yubico AB. All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "fido.h"
+
+/*
+ * CTAPHID_PING round trips, measuring the transport alone: the payload is
+ * echoed by the authenticator without being interpreted.
+ */
+
+#define PING_MS	5000	/* default round trip timeout */
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return ((x > y) - (x < y));
+}
+
+static void
+fido_ping_reset(fido_ping_t *ping)
+{
+	int ms = ping->ms;
+
+	free(ping->rtt);
+	memset(ping, 0, sizeof(*ping));
+	ping->ms = ms;
+}
+
+/* a payload differing between round trips, so stale replies are caught */
+static void
+fill_payload(unsigned char *ptr, size_t len, size_t seq)
+{
+	for (size_t i = 0; i < len; i++)
+		ptr[i] = (unsigned char)(seq + i);
+}
+
+static int
+ping_rtt(fido_dev_t *dev, const unsigned char *payload, size_t len,
+    int ms, uint64_t *ns)
+{
+	const uint8_t		 cmd = CTAP_FRAME_INIT | CTAP_CMD_PING;
+	const unsigned char	*reply;
+	uint64_t		 t0;
+	uint64_t		 t1;
+	int			 n;
+
+	if (fido_time_now(&t0) < 0)
+		return (FIDO_ERR_INTERNAL);
+
+	if (fido_tx(dev, cmd, payload, len) < 0) {
+		fido_log_debug("%s: fido_tx", __func__);
+		return (FIDO_ERR_TX);
+	}
+
+	if ((n = fido_rx_buf(dev, cmd, &reply, ms)) < 0) {
+		fido_log_debug("%s: fido_rx_buf", __func__);
+		return (FIDO_ERR_RX);
+	}
+
+	if (fido_time_now(&t1) < 0 || t1 < t0)
+		return (FIDO_ERR_INTERNAL);
+
+	if ((size_t)n != len || memcmp(payload, reply, len) != 0) {
+		fido_log_debug("%s: reply mismatch (%d, %zu)", __func__, n,
+		    len);
+		return (FIDO_ERR_RX);
+	}
+
+	*ns = t1 - t0;
+
+	return (FIDO_OK);
+}
+
+int
+fido_dev_ping(fido_dev_t *dev, size_t len, size_t count, fido_ping_t *ping)
+{
+	unsigned char	*payload = NULL;
+	uint64_t	 ns;
+	int		 r;
+
+	fido_ping_reset(ping);
+
+	if (len == 0 || len > fido_max_msg_len(dev) || count == 0 ||
+	    count > SIZE_MAX / sizeof(*ping->rtt)) {
+		fido_log_debug("%s: len=%zu, count=%zu", __func__, len, count);
+		return (FIDO_ERR_INVALID_ARGUMENT);
+	}
+
+	if ((payload = malloc(len)) == NULL ||
+	    (ping->rtt = calloc(count, sizeof(*ping->rtt))) == NULL) {
+		r = FIDO_ERR_INTERNAL;
+		goto fail;
+	}
+
+	ping->len = len;
+
+	for (size_t i = 0; i < count; i++) {
+		fill_payload(payload, len, i);
+		if ((r = ping_rtt(dev, payload, len, ping->ms, &ns)) != FIDO_OK)
+			goto fail;
+		ping->rtt[ping->count++] = ns;
+		ping->total += ns;
+	}
+
+	r = FIDO_OK;
+fail:
+	/* round trips completed before a failure are kept */
+	if (ping->count > 0)
+		qsort(ping->rtt, ping->count, sizeof(*ping->rtt), cmp_u64);
+
+	free(payload);
+
+	return (r);
+}
+
+fido_ping_t *
+fido_ping_new(void)
+{
+	fido_ping_t *ping;
+
+	if ((ping = calloc(1, sizeof(*ping))) == NULL)
+		return (NULL);
+
+	ping->ms = PING_MS;
+
+	return (ping);
+}
+
+void
+fido_ping_free(fido_ping_t **ping_p)
+{
+	fido_ping_t *ping;
+
+	if (ping_p == NULL || (ping = *ping_p) == NULL)
+		return;
+
+	fido_ping_reset(ping);
+	free(ping);
+
+	*ping_p = NULL;
+}
+
+int
+fido_ping_set_timeout(fido_ping_t *ping, int ms)
+{
+	if (ms == 0 || ms < -1) {
+		fido_log_debug("%s: ms=%d", __func__, ms);
+		return (FIDO_ERR_INVALID_ARGUMENT);
+	}
+
+	ping->ms = ms;
+
+	return (FIDO_OK);
+}
+
+size_t
+fido_ping_count(const fido_ping_t *ping)
+{
+	return (ping->count);
+}
+
+size_t
+fido_ping_len(const fido_ping_t *ping)
+{
+	return (ping->len);
+}
+
+uint64_t
+fido_ping_min_us(const fido_ping_t *ping)
+{
+	if (ping->count == 0)
+		return (0);
+
+	return (ping->rtt[0] / 1000);
+}
+
+uint64_t
+fido_ping_avg_us(const fido_ping_t *ping)
+{
+	if (ping->count == 0)
+		return (0);
+
+	return (ping->total / ping->count / 1000);
+}
+
+uint64_t
+fido_ping_p99_us(const fido_ping_t *ping)
+{
+	if (ping->count == 0)
+		return (0);
+
+	/* nearest rank: ceil(0.99 * count) - 1 */
+	return (ping->rtt[(ping->count * 99 + 99) / 100 - 1] / 1000);
+}
+
+uint64_t
+fido_ping_max_us(const fido_ping_t *ping)
+{
+	if (ping->count == 0)
+		return (0);
+
+	return (ping->rtt[ping->count - 1] / 1000);
+}
+
+/* payload bytes sent and echoed back per second */
+uint64_t
+fido_ping_bytes_per_sec(const fido_ping_t *ping)
+{
+	if (ping->total == 0)
+		return (0);
+
+	return ((uint64_t)((double)ping->len * 2 * (double)ping->count * 1e9 /
+	    (double)ping->total));
+}
@@ -0,0 +1,27 @@
+/*
+ * Copyright (c) 2020 Yubico AB. All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+#ifndef _PROBE_H
+#define _PROBE_H
+
+/*
+ * USDT probes, compiled in with -DUSDT=1. A probe is a single nop until a
+ * tracer attaches to it; its arguments must be cheap to compute.
+ */
+#if defined(USE_USDT)
+#include <sys/sdt.h>
+#define FIDO_PROBE0(name)		DTRACE_PROBE(libfido2, name)
+#define FIDO_PROBE1(name, a)		DTRACE_PROBE1(libfido2, name, a)
+#define FIDO_PROBE2(name, a, b)		DTRACE_PROBE2(libfido2, name, a, b)
+#define FIDO_PROBE3(name, a, b, c)	DTRACE_PROBE3(libfido2, name, a, b, c)
+#else
+#define FIDO_PROBE0(name)		do { /* nothing */ } while (0)
+#define FIDO_PROBE1(name, a)		do { /* nothing */ } while (0)
+#define FIDO_PROBE2(name, a, b)		do { /* nothing */ } while (0)
+#define FIDO_PROBE3(name, a, b, c)	do { /* nothing */ } while (0)
+#endif
+
+#endif /* !_PROBE_H */
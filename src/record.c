@@ -0,0 +1,420 @@
+/*
+ * Copyright (c) 2020 Yubico AB. All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "fido.h"
+
+/*
+ * Recording and replay of CTAPHID traffic.
+ *
+ * A recording starts with an 8-byte magic, followed by one event per
+ * frame exchanged with the device. Each event consists of a type (1
+ * byte), the time elapsed since the previous event in microseconds (4
+ * bytes, big-endian, saturated), a payload length (2 bytes, big-endian),
+ * and the payload. Frames are stored without report ids.
+ *
+ * A "replay:<file>" device path plays a recording back: the frames
+ * written by the library are checked against the recorded ones, and the
+ * recorded replies returned, after the recorded delay multiplied by the
+ * device's replay scale. Only the command of each initialisation frame is
+ * checked, since requests carry nonces and ephemeral keys; the nonce of a
+ * CTAPHID_INIT reply is patched to match the request. The report lengths
+ * of the replayed device are those of the first frames written and read.
+ */
+
+#define RECORD_MAGIC		"FIDOREC1"
+#define RECORD_MAGIC_LEN	8
+#define RECORD_HDR_LEN		7
+
+#define EV_OPEN		1	/* payload: device path */
+#define EV_TX		2	/* payload: frame written */
+#define EV_RX		3	/* payload: frame read */
+#define EV_RX_ERR	4	/* read failed or timed out */
+#define EV_CLOSE	5
+
+#define REPLAY_PREFIX	"replay:"
+
+struct fido_record {
+	FILE		*fp;
+	uint64_t	 t;	/* time of the previous event */
+};
+
+struct replay {
+	unsigned char	*buf;	/* recording */
+	size_t		 len;
+	size_t		 off;	/* next event */
+	double		 scale;	/* delay multiplier */
+	unsigned char	 nonce[8];
+	size_t		 in_len;  /* input report length */
+	size_t		 out_len; /* output report length */
+};
+
+static void
+record_event(fido_dev_t *dev, uint8_t type, const void *ptr, size_t len)
+{
+	struct fido_record	*rec = dev->record;
+	unsigned char		 hdr[RECORD_HDR_LEN];
+	uint64_t		 now;
+	uint64_t		 us;
+
+	if (rec == NULL)
+		return;
+
+	if (fido_time_now(&now) < 0)
+		now = rec->t;
+
+	us = now > rec->t ? (now - rec->t) / 1000 : 0;
+	if (us > UINT32_MAX)
+		us = UINT32_MAX;
+	rec->t = now;
+
+	hdr[0] = type;
+	hdr[1] = (us >> 24) & 0xff;
+	hdr[2] = (us >> 16) & 0xff;
+	hdr[3] = (us >> 8) & 0xff;
+	hdr[4] = us & 0xff;
+	hdr[5] = (len >> 8) & 0xff;
+	hdr[6] = len & 0xff;
+
+	if (fwrite(hdr, 1, sizeof(hdr), rec->fp) != sizeof(hdr) ||
+	    (len && fwrite(ptr, 1, len, rec->fp) != len)) {
+		fido_log_debug("%s: fwrite", __func__);
+		fclose(rec->fp);
+		free(rec);
+		dev->record = NULL;
+	}
+}
+
+int
+fido_record_open(fido_dev_t *dev)
+{
+	struct fido_record *rec;
+
+	if (dev->record_path == NULL || dev->record != NULL)
+		return (0);
+
+	if ((rec = calloc(1, sizeof(*rec))) == NULL ||
+	    (rec->fp = fopen(dev->record_path, "wb")) == NULL) {
+		fido_log_debug("%s: %s", __func__, dev->record_path);
+		free(rec);
+		return (-1);
+	}
+
+	if (fwrite(RECORD_MAGIC, 1, RECORD_MAGIC_LEN,
+	    rec->fp) != RECORD_MAGIC_LEN || fido_time_now(&rec->t) < 0) {
+		fido_log_debug("%s: fwrite", __func__);
+		fclose(rec->fp);
+		free(rec);
+		return (-1);
+	}
+
+	dev->record = rec;
+	record_event(dev, EV_OPEN, dev->path, strlen(dev->path));
+
+	return (0);
+}
+
+void
+fido_record_close(fido_dev_t *dev)
+{
+	if (dev->record == NULL)
+		return;
+
+	record_event(dev, EV_CLOSE, NULL, 0);
+
+	if (dev->record != NULL) {
+		if (fclose(dev->record->fp) != 0)
+			fido_log_debug("%s: fclose", __func__);
+		free(dev->record);
+		dev->record = NULL;
+	}
+}
+
+void
+fido_record_tx(fido_dev_t *dev, const unsigned char *frame, size_t len)
+{
+	record_event(dev, EV_TX, frame, len);
+}
+
+void
+fido_record_rx(fido_dev_t *dev, const unsigned char *frame, size_t len)
+{
+	if (frame == NULL)
+		record_event(dev, EV_RX_ERR, NULL, 0);
+	else
+		record_event(dev, EV_RX, frame, len);
+}
+
+int
+fido_dev_set_record(fido_dev_t *dev, const char *path)
+{
+	char *p = NULL;
+
+	if (dev->io_handle != NULL) {
+		fido_log_debug("%s: device open", __func__);
+		return (FIDO_ERR_INVALID_ARGUMENT);
+	}
+
+	if (path != NULL && (p = strdup(path)) == NULL)
+		return (FIDO_ERR_INTERNAL);
+
+	free(dev->record_path);
+	dev->record_path = p;
+
+	return (FIDO_OK);
+}
+
+int
+fido_dev_set_replay_scale(fido_dev_t *dev, double scale)
+{
+	if (!(scale >= 0)) {
+		fido_log_debug("%s: scale=%f", __func__, scale);
+		return (FIDO_ERR_INVALID_ARGUMENT);
+	}
+
+	dev->replay_scale = scale;
+
+	return (FIDO_OK);
+}
+
+int
+fido_replay_is_path(const char *path)
+{
+	return (strncmp(path, REPLAY_PREFIX, strlen(REPLAY_PREFIX)) == 0);
+}
+
+/*
+ * Fetch the next event of a replay; returns its type, or -1 at the end
+ * of the recording.
+ */
+static int
+next_event(struct replay *r, uint32_t *us, const unsigned char **ptr,
+    size_t *len)
+{
+	const unsigned char *p = r->buf + r->off;
+
+	if (r->len - r->off < RECORD_HDR_LEN)
+		return (-1);
+
+	*us = ((uint32_t)p[1] << 24) | ((uint32_t)p[2] << 16) |
+	    ((uint32_t)p[3] << 8) | p[4];
+	*len = ((size_t)p[5] << 8) | p[6];
+	*ptr = p + RECORD_HDR_LEN;
+
+	if (r->len - r->off - RECORD_HDR_LEN < *len) {
+		fido_log_debug("%s: truncated event", __func__);
+		return (-1);
+	}
+
+	r->off += RECORD_HDR_LEN + *len;
+
+	return (p[0]);
+}
+
+static unsigned char *
+read_file(const char *path, size_t *len)
+{
+	FILE		*fp;
+	unsigned char	*buf = NULL;
+	long		 n;
+
+	if ((fp = fopen(path, "rb")) == NULL) {
+		fido_log_debug("%s: fopen %s", __func__, path);
+		return (NULL);
+	}
+
+	if (fseek(fp, 0, SEEK_END) != 0 || (n = ftell(fp)) < 0 ||
+	    fseek(fp, 0, SEEK_SET) != 0 || (size_t)n < RECORD_MAGIC_LEN ||
+	    (buf = malloc((size_t)n)) == NULL ||
+	    fread(buf, 1, (size_t)n, fp) != (size_t)n ||
+	    memcmp(buf, RECORD_MAGIC, RECORD_MAGIC_LEN) != 0) {
+		fido_log_debug("%s: invalid recording %s", __func__, path);
+		free(buf);
+		fclose(fp);
+		return (NULL);
+	}
+
+	fclose(fp);
+	*len = (size_t)n;
+
+	return (buf);
+}
+
+/* take the report lengths from the first frames of the session */
+static int
+replay_scan(struct replay *r)
+{
+	const unsigned char	*ptr;
+	size_t			 off = r->off;
+	size_t			 len;
+	uint32_t		 us;
+	int			 type;
+
+	r->in_len = r->out_len = 0;
+
+	while ((r->in_len == 0 || r->out_len == 0) &&
+	    (type = next_event(r, &us, &ptr, &len)) != -1) {
+		if (type == EV_TX && r->out_len == 0)
+			r->out_len = len;
+		else if (type == EV_RX && r->in_len == 0)
+			r->in_len = len;
+	}
+
+	r->off = off;
+
+	if (r->in_len == 0)
+		r->in_len = CTAP_RPT_SIZE;
+	if (r->out_len == 0)
+		r->out_len = CTAP_RPT_SIZE;
+
+	if (r->in_len < CTAP_MIN_RPT_SIZE || r->in_len > CTAP_MAX_RPT_SIZE ||
+	    r->out_len < CTAP_MIN_RPT_SIZE || r->out_len > CTAP_MAX_RPT_SIZE) {
+		fido_log_debug("%s: in_len=%zu, out_len=%zu", __func__,
+		    r->in_len, r->out_len);
+		return (-1);
+	}
+
+	return (0);
+}
+
+void *
+fido_replay_open(const char *path)
+{
+	struct replay		*r;
+	const unsigned char	*ptr;
+	size_t			 len;
+	uint32_t		 us;
+
+	if (!fido_replay_is_path(path) || (r = calloc(1, sizeof(*r))) == NULL)
+		return (NULL);
+
+	if ((r->buf = read_file(path + strlen(REPLAY_PREFIX),
+	    &r->len)) == NULL) {
+		free(r);
+		return (NULL);
+	}
+
+	r->off = RECORD_MAGIC_LEN;
+	r->scale = 1.0;
+
+	if (next_event(r, &us, &ptr, &len) != EV_OPEN ||
+	    replay_scan(r) < 0) {
+		fido_log_debug("%s: no session in %s", __func__, path);
+		free(r->buf);
+		free(r);
+		return (NULL);
+	}
+
+	return (r);
+}
+
+void
+fido_replay_report_len(void *handle, size_t *in_len, size_t *out_len)
+{
+	struct replay *r = handle;
+
+	*in_len = r->in_len;
+	*out_len = r->out_len;
+}
+
+void
+fido_replay_set_scale(void *handle, double scale)
+{
+	struct replay *r = handle;
+
+	r->scale = scale;
+}
+
+void
+fido_replay_close(void *handle)
+{
+	struct replay *r = handle;
+
+	free(r->buf);
+	free(r);
+}
+
+int
+fido_replay_write(void *handle, const unsigned char *buf, size_t len)
+{
+	struct replay		*r = handle;
+	const unsigned char	*ptr;
+	size_t			 ev_len;
+	uint32_t		 us;
+
+	if (len != r->out_len + 1) {
+		fido_log_debug("%s: invalid len", __func__);
+		return (-1);
+	}
+
+	buf++; /* skip report id */
+
+	if (next_event(r, &us, &ptr, &ev_len) != EV_TX ||
+	    ev_len != r->out_len) {
+		fido_log_debug("%s: unexpected write", __func__);
+		return (-1);
+	}
+
+	if ((buf[4] & CTAP_FRAME_INIT) != (ptr[4] & CTAP_FRAME_INIT) ||
+	    ((buf[4] & CTAP_FRAME_INIT) && buf[4] != ptr[4])) {
+		fido_log_debug("%s: cmd 0x%02x, recorded 0x%02x", __func__,
+		    buf[4], ptr[4]);
+		return (-1);
+	}
+
+	if (buf[4] == (CTAP_FRAME_INIT | CTAP_CMD_INIT))
+		memcpy(r->nonce, buf + 7, sizeof(r->nonce));
+
+	return ((int)len);
+}
+
+static void
+replay_sleep(const struct replay *r, uint32_t us, int ms)
+{
+	double d = (us / 1000.0) * r->scale;
+
+	if (ms >= 0 && d > ms)
+		d = ms;
+	if (d >= 1)
+		fido_time_sleep((int)d);
+}
+
+int
+fido_replay_read(void *handle, unsigned char *buf, size_t len, int ms)
+{
+	struct replay		*r = handle;
+	const unsigned char	*ptr;
+	size_t			 ev_len;
+	uint32_t		 us;
+	int			 type;
+
+	if (len != r->in_len) {
+		fido_log_debug("%s: invalid len", __func__);
+		return (-1);
+	}
+
+	type = next_event(r, &us, &ptr, &ev_len);
+
+	if (type == EV_RX_ERR) {
+		replay_sleep(r, us, ms);
+		return (-1);
+	}
+
+	if (type != EV_RX || ev_len != len) {
+		fido_log_debug("%s: unexpected read", __func__);
+		return (-1);
+	}
+
+	replay_sleep(r, us, ms);
+	memcpy(buf, ptr, len);
+
+	if (buf[4] == (CTAP_FRAME_INIT | CTAP_CMD_INIT))
+		memcpy(buf + 7, r->nonce, sizeof(r->nonce));
+
+	return ((int)len);
+}
@@ -26,6 +26,9 @@ fido_dev_reset_wait(fido_dev_t *dev, int ms)
 {
 	int r;
 
+	/* u2f key handles found so far do not survive a reset */
+	explicit_bzero(&dev->u2f_cache, sizeof(dev->u2f_cache));
+
 	if ((r = fido_dev_reset_tx(dev)) != FIDO_OK ||
 	    (r = fido_rx_cbor_status(dev, ms)) != FIDO_OK)
 		return (r);
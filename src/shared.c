@@ -0,0 +1,792 @@
+/*
+ * Copyright (c) 2020 Yubico AB. All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "fido.h"
+
+/*
+ * A shared device handle lets several fido_dev_t sessions, possibly in
+ * different threads, talk to the same authenticator concurrently. Each
+ * session obtains its own CTAPHID channel. Transactions are serialised
+ * as a whole: a session owns the device from the first frame of a request
+ * until the last frame of its reply, so that frames belonging to different
+ * channels are never interleaved and the authenticator never sees a
+ * request while busy with another. The one exception is a single-frame
+ * CTAPHID_INIT, CTAPHID_PING or getInfo request, sent alongside a
+ * transaction waiting for user presence. A request is held until its
+ * session reads the reply, so that waiting for the device counts against
+ * the read's timeout. Incoming frames are read by whichever session is
+ * waiting first, and queued for the session owning their channel id.
+ */
+
+#if defined(_WIN32)
+#include <windows.h>
+
+typedef CRITICAL_SECTION	shared_mutex_t;
+typedef CONDITION_VARIABLE	shared_cond_t;
+#else
+#include <pthread.h>
+#include <time.h>
+
+typedef pthread_mutex_t		shared_mutex_t;
+typedef pthread_cond_t		shared_cond_t;
+#endif
+
+#define SHARED_MAX_FRAMES	129	/* init frame + 128 continuation frames */
+#define SHARED_QUEUE_LEN	SHARED_MAX_FRAMES /* frames queued per session */
+#define KEEPALIVE_UPNEEDED	0x02	/* keepalive status */
+
+struct shared_session {
+	fido_dev_shared_t	*sh;
+	uint32_t		 cid;     /* allocated channel id, or 0 */
+	uint64_t		 nonce;   /* nonce of a pending CTAPHID_INIT */
+	bool			 init;    /* CTAPHID_INIT pending */
+	bool			 side;    /* request sent alongside the owner's */
+	unsigned char		*tx;      /* request held until read */
+	size_t			 tx_held; /* frames held */
+	size_t			 tx_left; /* frames left in outgoing message */
+	size_t			 rx_left; /* frames left in incoming reply */
+	unsigned char		*q;       /* SHARED_QUEUE_LEN input reports */
+	size_t			 q_head;
+	size_t			 q_len;
+	bool			 q_lost;  /* frames dropped, queue full */
+	struct shared_session	*next;
+};
+
+struct fido_dev_shared {
+	fido_dev_io_t		 io;       /* underlying i/o functions */
+	void			*handle;   /* underlying i/o handle */
+	char			*path;     /* device path */
+	size_t			 rpt_in_len;  /* report lengths in use */
+	size_t			 rpt_out_len;
+	size_t			 io_rpt_in_len; /* ... with the caller's i/o */
+	size_t			 io_rpt_out_len;
+	shared_mutex_t		 wlock;    /* serialises writes */
+	shared_mutex_t		 lock;     /* protects the fields below */
+	shared_cond_t		 cond;     /* frame queued or reader gone */
+	bool			 reading;  /* a session is reading */
+	struct shared_session	*owner;    /* session in a transaction */
+	bool			 upneeded; /* owner waiting for user presence */
+	size_t			 nside;    /* requests sent alongside */
+	struct shared_session	*sessions;
+};
+
+#if defined(_WIN32)
+static void
+mutex_init(shared_mutex_t *m)
+{
+	InitializeCriticalSection(m);
+}
+
+static void
+mutex_destroy(shared_mutex_t *m)
+{
+	DeleteCriticalSection(m);
+}
+
+static void
+mutex_lock(shared_mutex_t *m)
+{
+	EnterCriticalSection(m);
+}
+
+static void
+mutex_unlock(shared_mutex_t *m)
+{
+	LeaveCriticalSection(m);
+}
+
+static void
+cond_init(shared_cond_t *c)
+{
+	InitializeConditionVariable(c);
+}
+
+static void
+cond_destroy(shared_cond_t *c)
+{
+	(void)c;
+}
+
+static void
+cond_broadcast(shared_cond_t *c)
+{
+	WakeAllConditionVariable(c);
+}
+
+static void
+cond_wait(shared_cond_t *c, shared_mutex_t *m, int ms)
+{
+	SleepConditionVariableCS(c, m, ms < 0 ? INFINITE : (DWORD)ms);
+}
+#else
+static void
+mutex_init(shared_mutex_t *m)
+{
+	pthread_mutex_init(m, NULL);
+}
+
+static void
+mutex_destroy(shared_mutex_t *m)
+{
+	pthread_mutex_destroy(m);
+}
+
+static void
+mutex_lock(shared_mutex_t *m)
+{
+	pthread_mutex_lock(m);
+}
+
+static void
+mutex_unlock(shared_mutex_t *m)
+{
+	pthread_mutex_unlock(m);
+}
+
+static void
+cond_init(shared_cond_t *c)
+{
+	pthread_cond_init(c, NULL);
+}
+
+static void
+cond_destroy(shared_cond_t *c)
+{
+	pthread_cond_destroy(c);
+}
+
+static void
+cond_broadcast(shared_cond_t *c)
+{
+	pthread_cond_broadcast(c);
+}
+
+static void
+cond_wait(shared_cond_t *c, shared_mutex_t *m, int ms)
+{
+	struct timespec ts;
+
+	if (ms < 0) {
+		pthread_cond_wait(c, m);
+		return;
+	}
+
+	if (clock_gettime(CLOCK_REALTIME, &ts) != 0) {
+		fido_log_debug("%s: clock_gettime", __func__);
+		return;
+	}
+
+	ts.tv_sec += ms / 1000;
+	ts.tv_nsec += (long)(ms % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	pthread_cond_timedwait(c, m, &ts);
+}
+#endif /* _WIN32 */
+
+/* number of rpt_len frames making up the message started by frame */
+static size_t
+msg_frames(const unsigned char *frame, size_t rpt_len)
+{
+	size_t bcnt = (size_t)((frame[5] << 8) | frame[6]);
+	size_t init_len = rpt_len - 7;
+	size_t cont_len = rpt_len - 5;
+
+	if (bcnt <= init_len)
+		return (1);
+
+	return (1 + (bcnt - init_len + cont_len - 1) / cont_len);
+}
+
+/*
+ * A queue holds a whole reply, so it only fills up if the authenticator
+ * misbehaves. Lost frames are then reported to the session by its next
+ * read.
+ */
+static void
+enqueue(struct shared_session *s, const unsigned char *frame)
+{
+	if (s->q_len == SHARED_QUEUE_LEN) {
+		fido_log_debug("%s: cid=0x%x, queue full", __func__, s->cid);
+		s->q_lost = true;
+		return;
+	}
+
+	memcpy(s->q + ((s->q_head + s->q_len++) % SHARED_QUEUE_LEN) *
+	    s->sh->rpt_in_len, frame, s->sh->rpt_in_len);
+}
+
+static void
+dequeue(struct shared_session *s, unsigned char *frame)
+{
+	memcpy(frame, s->q + s->q_head * s->sh->rpt_in_len,
+	    s->sh->rpt_in_len);
+	s->q_head = (s->q_head + 1) % SHARED_QUEUE_LEN;
+	s->q_len--;
+}
+
+/*
+ * Hand a frame over to the session owning its channel. Replies to
+ * CTAPHID_INIT on the broadcast channel are matched using their nonce,
+ * and carry the channel id allocated to the session.
+ */
+static void
+dispatch(fido_dev_shared_t *sh, const unsigned char *frame)
+{
+	const uint8_t		 init = CTAP_FRAME_INIT | CTAP_CMD_INIT;
+	struct shared_session	*s;
+	uint32_t		 cid;
+
+	memcpy(&cid, frame, sizeof(cid));
+
+	for (s = sh->sessions; s != NULL; s = s->next) {
+		if (cid == CTAP_CID_BROADCAST && frame[4] == init && s->init &&
+		    memcmp(&frame[7], &s->nonce, sizeof(s->nonce)) == 0) {
+			memcpy(&s->cid, &frame[15], sizeof(s->cid));
+			s->init = false;
+			enqueue(s, frame);
+			return;
+		}
+		if (cid != CTAP_CID_BROADCAST && s->cid != 0 && cid == s->cid) {
+			if (s == sh->owner && frame[4] == (CTAP_FRAME_INIT |
+			    CTAP_KEEPALIVE) && frame[7] == KEEPALIVE_UPNEEDED)
+				sh->upneeded = true;
+			enqueue(s, frame);
+			return;
+		}
+	}
+
+	fido_log_debug("%s: cid=0x%x, dropped", __func__, cid);
+}
+
+/*
+ * Whether the request held by s, of nframes frames, may be sent while
+ * another session waits for user presence: a single frame, answered by
+ * the authenticator without touching its state. Called with sh->lock
+ * held.
+ */
+static bool
+may_overtake(const fido_dev_shared_t *sh, const struct shared_session *s,
+    size_t nframes)
+{
+	const unsigned char	*frame = s->tx + 1;
+	size_t			 bcnt = (size_t)((frame[5] << 8) | frame[6]);
+
+	if (sh->owner == NULL || sh->owner == s || !sh->upneeded ||
+	    nframes != 1)
+		return (false);
+
+	switch (frame[4]) {
+	case CTAP_FRAME_INIT | CTAP_CMD_INIT:
+	case CTAP_FRAME_INIT | CTAP_CMD_PING:
+		return (true);
+	case CTAP_FRAME_INIT | CTAP_CMD_CBOR:
+		return (bcnt == 1 && frame[7] == CTAP_CBOR_GETINFO);
+	default:
+		return (false);
+	}
+}
+
+/*
+ * Wait up to ms milliseconds since t0 for the device, to send the
+ * nframes frames held by s: either start a transaction once the one in
+ * progress, and requests sent alongside it, have ended, or go alongside
+ * it once its owner waits for user presence. Frames still queued belong
+ * to replies the session gave up on. A session already owning the device
+ * starts over, e.g. to resynchronise its channel. Called with sh->lock
+ * held.
+ */
+static int
+acquire(fido_dev_shared_t *sh, struct shared_session *s, size_t nframes,
+    uint64_t t0, int ms)
+{
+	int elapsed;
+	int remaining = -1;
+
+	for (;;) {
+		if (may_overtake(sh, s, nframes)) {
+			s->side = true;
+			s->rx_left = 0;
+			sh->nside++;
+			return (0);
+		}
+		if ((sh->owner == NULL || sh->owner == s) && sh->nside == 0)
+			break;
+		if (ms >= 0) {
+			if (fido_time_elapsed_ms(t0, &elapsed) < 0 ||
+			    (remaining = ms - elapsed) <= 0) {
+				fido_log_debug("%s: cid=0x%x, timeout",
+				    __func__, s->cid);
+				return (-1);
+			}
+		}
+		cond_wait(&sh->cond, &sh->lock, remaining);
+	}
+
+	if (sh->owner == NULL && s->q_len > 0) {
+		fido_log_debug("%s: cid=0x%x, discarding %zu frames", __func__,
+		    s->cid, s->q_len);
+		s->q_head = s->q_len = 0;
+	}
+
+	sh->owner = s;
+	sh->upneeded = false;
+	s->rx_left = 0;
+
+	return (0);
+}
+
+/* called with sh->lock held */
+static void
+end_side(fido_dev_shared_t *sh, struct shared_session *s)
+{
+	if (!s->side)
+		return;
+
+	s->side = false;
+	s->rx_left = 0;
+	sh->nside--;
+	cond_broadcast(&sh->cond);
+}
+
+/* called with sh->lock held */
+static void
+release(fido_dev_shared_t *sh, struct shared_session *s)
+{
+	end_side(sh, s);
+
+	if (sh->owner != s)
+		return;
+
+	sh->owner = NULL;
+	sh->upneeded = false;
+	s->rx_left = 0;
+	cond_broadcast(&sh->cond);
+}
+
+/*
+ * Send the request held by s; see acquire(). Called with sh->lock held,
+ * which is dropped while writing.
+ */
+static int
+send_held(fido_dev_shared_t *sh, struct shared_session *s, uint64_t t0,
+    int ms)
+{
+	const unsigned char	*frame = s->tx + 1;
+	const size_t		 len = sh->rpt_out_len + 1;
+	size_t			 nframes = s->tx_held;
+	uint32_t		 cid;
+	int			 ok = 1;
+
+	s->tx_held = 0;
+
+	/* an earlier request sent alongside is left unanswered */
+	end_side(sh, s);
+
+	if (acquire(sh, s, nframes, t0, ms) < 0)
+		return (-1);
+
+	memcpy(&cid, frame, sizeof(cid));
+	if (cid == CTAP_CID_BROADCAST &&
+	    frame[4] == (CTAP_FRAME_INIT | CTAP_CMD_INIT)) {
+		memcpy(&s->nonce, &frame[7], sizeof(s->nonce));
+		s->init = true;
+	}
+
+	mutex_unlock(&sh->lock);
+	mutex_lock(&sh->wlock);
+	for (size_t i = 0; ok && i < nframes; i++)
+		ok = sh->io.write(sh->handle, s->tx + i * len, len) ==
+		    (int)len;
+	mutex_unlock(&sh->wlock);
+	mutex_lock(&sh->lock);
+
+	if (!ok) {
+		fido_log_debug("%s: write", __func__);
+		release(sh, s);
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Track the reply to the session's request, and end the transaction once
+ * its last frame has been read. Keepalives do not count towards the
+ * reply. Called with sh->lock held.
+ */
+static void
+reply_frame(fido_dev_shared_t *sh, struct shared_session *s,
+    const unsigned char *frame)
+{
+	if (sh->owner != s && !s->side)
+		return;
+
+	if (frame[4] & CTAP_FRAME_INIT) {
+		if (frame[4] == (CTAP_FRAME_INIT | CTAP_KEEPALIVE))
+			return;
+		if (sh->owner == s)
+			sh->upneeded = false;
+		s->rx_left = msg_frames(frame, sh->rpt_in_len);
+	} else if (s->rx_left == 0)
+		return;
+
+	if (--s->rx_left == 0)
+		release(sh, s);
+}
+
+void *
+fido_shared_open(const char *path)
+{
+	fido_log_debug("%s: %s: use fido_dev_open_shared()", __func__, path);
+
+	return (NULL);
+}
+
+void
+fido_shared_close(void *handle)
+{
+	struct shared_session	 *s = handle;
+	fido_dev_shared_t	 *sh = s->sh;
+	struct shared_session	**sp;
+
+	mutex_lock(&sh->lock);
+	for (sp = &sh->sessions; *sp != NULL; sp = &(*sp)->next)
+		if (*sp == s) {
+			*sp = s->next;
+			break;
+		}
+	release(sh, s);
+	mutex_unlock(&sh->lock);
+
+	free(s->tx);
+	free(s->q);
+	free(s);
+}
+
+void
+fido_shared_report_len(void *handle, size_t *in_len, size_t *out_len)
+{
+	struct shared_session *s = handle;
+
+	*in_len = s->sh->rpt_in_len;
+	*out_len = s->sh->rpt_out_len;
+}
+
+int
+fido_shared_read(void *handle, unsigned char *buf, size_t len, int ms)
+{
+	struct shared_session	*s = handle;
+	fido_dev_shared_t	*sh = s->sh;
+	unsigned char		 frame[CTAP_MAX_RPT_SIZE];
+	uint64_t		 t0 = 0;
+	int			 elapsed;
+	int			 remaining = -1;
+	int			 n;
+	int			 r = -1;
+
+	if (len != sh->rpt_in_len) {
+		fido_log_debug("%s: len=%zu", __func__, len);
+		return (-1);
+	}
+
+	if (ms >= 0 && fido_time_now(&t0) < 0)
+		return (-1);
+
+	mutex_lock(&sh->lock);
+
+	if (s->tx_left == 0 && s->tx_held > 0 &&
+	    send_held(sh, s, t0, ms) < 0) {
+		mutex_unlock(&sh->lock);
+		return (-1);
+	}
+
+	for (;;) {
+		if (s->q_lost) {
+			fido_log_debug("%s: cid=0x%x, frames lost", __func__,
+			    s->cid);
+			s->q_lost = false;
+			s->q_head = s->q_len = 0;
+			break;
+		}
+		if (s->q_len > 0) {
+			dequeue(s, buf);
+			reply_frame(sh, s, buf);
+			r = (int)len;
+			break;
+		}
+		if (ms >= 0) {
+			if (fido_time_elapsed_ms(t0, &elapsed) < 0 ||
+			    (remaining = ms - elapsed) <= 0)
+				break;
+		}
+		if (sh->reading) {
+			cond_wait(&sh->cond, &sh->lock, remaining);
+			continue;
+		}
+		/* become the reader */
+		sh->reading = true;
+		mutex_unlock(&sh->lock);
+		n = sh->io.read(sh->handle, frame, len, remaining);
+		mutex_lock(&sh->lock);
+		sh->reading = false;
+		if (n == (int)len)
+			dispatch(sh, frame);
+		cond_broadcast(&sh->cond);
+		if (n < 0) {
+			fido_log_debug("%s: read", __func__);
+			break;
+		}
+	}
+
+	/* the reply is incomplete; give up the transaction */
+	if (r < 0)
+		release(sh, s);
+
+	mutex_unlock(&sh->lock);
+
+	return (r);
+}
+
+/*
+ * Hold the frames of a request until the session reads the reply; see
+ * send_held(). CTAPHID_CANCEL has no reply, and is written at once.
+ */
+int
+fido_shared_write(void *handle, const unsigned char *buf, size_t len)
+{
+	struct shared_session	*s = handle;
+	fido_dev_shared_t	*sh = s->sh;
+	const uint8_t		 cancel = CTAP_FRAME_INIT | CTAP_CMD_CANCEL;
+	const unsigned char	*frame = buf + 1;
+	int			 n;
+
+	if (len != sh->rpt_out_len + 1) {
+		fido_log_debug("%s: len=%zu", __func__, len);
+		return (-1);
+	}
+
+	if (frame[4] == cancel) {
+		mutex_lock(&sh->wlock);
+		n = sh->io.write(sh->handle, buf, len);
+		mutex_unlock(&sh->wlock);
+		return (n);
+	}
+
+	/* an init frame starts a new request, whatever was held before */
+	if (frame[4] & CTAP_FRAME_INIT) {
+		if (msg_frames(frame, sh->rpt_out_len) > SHARED_MAX_FRAMES) {
+			fido_log_debug("%s: bcnt=%d", __func__,
+			    (frame[5] << 8) | frame[6]);
+			s->tx_held = s->tx_left = 0;
+			return (-1);
+		}
+		s->tx_held = 0;
+		s->tx_left = msg_frames(frame, sh->rpt_out_len);
+	} else if (s->tx_left == 0) {
+		fido_log_debug("%s: unexpected frame", __func__);
+		return (-1);
+	}
+
+	memcpy(s->tx + s->tx_held++ * len, buf, len);
+	s->tx_left--;
+
+	return ((int)len);
+}
+
+void *
+fido_shared_attach(fido_dev_shared_t *sh)
+{
+	struct shared_session *s;
+
+	if (sh->handle == NULL) {
+		fido_log_debug("%s: not open", __func__);
+		return (NULL);
+	}
+
+	if ((s = calloc(1, sizeof(*s))) == NULL ||
+	    (s->q = calloc(SHARED_QUEUE_LEN, sh->rpt_in_len)) == NULL ||
+	    (s->tx = calloc(SHARED_MAX_FRAMES, sh->rpt_out_len + 1)) == NULL) {
+		if (s != NULL)
+			free(s->q);
+		free(s);
+		return (NULL);
+	}
+
+	s->sh = sh;
+
+	mutex_lock(&sh->lock);
+	s->next = sh->sessions;
+	sh->sessions = s;
+	mutex_unlock(&sh->lock);
+
+	return (s);
+}
+
+const char *
+fido_shared_path(const fido_dev_shared_t *sh)
+{
+	return (sh->path);
+}
+
+fido_dev_shared_t *
+fido_dev_shared_new(void)
+{
+	fido_dev_shared_t *sh;
+
+	if ((sh = calloc(1, sizeof(*sh))) == NULL)
+		return (NULL);
+
+	sh->io.open = fido_hid_open;
+	sh->io.close = fido_hid_close;
+	sh->io.read = fido_hid_read;
+	sh->io.write = fido_hid_write;
+	sh->rpt_in_len = CTAP_RPT_SIZE;
+	sh->rpt_out_len = CTAP_RPT_SIZE;
+	sh->io_rpt_in_len = CTAP_RPT_SIZE;
+	sh->io_rpt_out_len = CTAP_RPT_SIZE;
+
+	mutex_init(&sh->wlock);
+	mutex_init(&sh->lock);
+	cond_init(&sh->cond);
+
+	return (sh);
+}
+
+void
+fido_dev_shared_free(fido_dev_shared_t **sh_p)
+{
+	fido_dev_shared_t *sh;
+
+	if (sh_p == NULL || (sh = *sh_p) == NULL)
+		return;
+
+	if (sh->handle != NULL)
+		sh->io.close(sh->handle);
+
+	cond_destroy(&sh->cond);
+	mutex_destroy(&sh->lock);
+	mutex_destroy(&sh->wlock);
+	free(sh->path);
+	free(sh);
+
+	*sh_p = NULL;
+}
+
+int
+fido_dev_shared_set_io_functions(fido_dev_shared_t *sh,
+    const fido_dev_io_t *io)
+{
+	if (sh->handle != NULL) {
+		fido_log_debug("%s: handle=%p", __func__, sh->handle);
+		return (FIDO_ERR_INVALID_ARGUMENT);
+	}
+
+	if (io == NULL || io->open == NULL || io->close == NULL ||
+	    io->read == NULL || io->write == NULL) {
+		fido_log_debug("%s: NULL function", __func__);
+		return (FIDO_ERR_INVALID_ARGUMENT);
+	}
+
+	sh->io = *io;
+
+	return (FIDO_OK);
+}
+
+int
+fido_dev_shared_set_report_len(fido_dev_shared_t *sh, size_t in_len,
+    size_t out_len)
+{
+	if (sh->handle != NULL) {
+		fido_log_debug("%s: handle=%p", __func__, sh->handle);
+		return (FIDO_ERR_INVALID_ARGUMENT);
+	}
+
+	if (in_len < CTAP_MIN_RPT_SIZE || in_len > CTAP_MAX_RPT_SIZE ||
+	    out_len < CTAP_MIN_RPT_SIZE || out_len > CTAP_MAX_RPT_SIZE) {
+		fido_log_debug("%s: in_len=%zu, out_len=%zu", __func__,
+		    in_len, out_len);
+		return (FIDO_ERR_INVALID_ARGUMENT);
+	}
+
+	sh->io_rpt_in_len = in_len;
+	sh->io_rpt_out_len = out_len;
+
+	return (FIDO_OK);
+}
+
+int
+fido_dev_shared_open(fido_dev_shared_t *sh, const char *path)
+{
+	size_t in_len;
+	size_t out_len;
+
+	if (sh->handle != NULL) {
+		fido_log_debug("%s: handle=%p", __func__, sh->handle);
+		return (FIDO_ERR_INVALID_ARGUMENT);
+	}
+
+	fido_io_select(&sh->io, path);
+
+	if ((sh->path = strdup(path)) == NULL)
+		return (FIDO_ERR_INTERNAL);
+
+	if ((sh->handle = sh->io.open(path)) == NULL) {
+		fido_log_debug("%s: sh->io.open", __func__);
+		free(sh->path);
+		sh->path = NULL;
+		return (FIDO_ERR_INTERNAL);
+	}
+
+	in_len = sh->io_rpt_in_len;
+	out_len = sh->io_rpt_out_len;
+	(void)fido_io_report_len(&sh->io, sh->handle, &in_len, &out_len);
+
+	if (in_len < CTAP_MIN_RPT_SIZE || in_len > CTAP_MAX_RPT_SIZE ||
+	    out_len < CTAP_MIN_RPT_SIZE || out_len > CTAP_MAX_RPT_SIZE) {
+		fido_log_debug("%s: in_len=%zu, out_len=%zu", __func__,
+		    in_len, out_len);
+		sh->io.close(sh->handle);
+		sh->handle = NULL;
+		free(sh->path);
+		sh->path = NULL;
+		return (FIDO_ERR_INTERNAL);
+	}
+
+	sh->rpt_in_len = in_len;
+	sh->rpt_out_len = out_len;
+
+	return (FIDO_OK);
+}
+
+int
+fido_dev_shared_close(fido_dev_shared_t *sh)
+{
+	bool busy;
+
+	mutex_lock(&sh->lock);
+	busy = sh->sessions != NULL;
+	mutex_unlock(&sh->lock);
+
+	if (sh->handle == NULL || busy) {
+		fido_log_debug("%s: handle=%p, busy=%d", __func__, sh->handle,
+		    busy);
+		return (FIDO_ERR_INVALID_ARGUMENT);
+	}
+
+	sh->io.close(sh->handle);
+	sh->handle = NULL;
+	free(sh->path);
+	sh->path = NULL;
+
+	return (FIDO_OK);
+}
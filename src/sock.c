@@ -0,0 +1,488 @@
+/*
+ * Copyright (c) 2020 Yubico AB. All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+#include <string.h>
+
+#include "fido.h"
+
+/*
+ * Device paths of the form "unix:<path>" and "tcp:<host>:<port>" reach an
+ * authenticator through a stream socket, typically served by
+ * fido2-forward(1). The stream starts with the input and output report
+ * lengths of the device, two bytes each, big-endian, sent by the server;
+ * then it carries bare CTAPHID frames of those lengths, without report
+ * ids. Outgoing frames are held back until the message they belong to is
+ * complete and then sent with a single call; incoming frames are read in
+ * bulk and handed out one at a time.
+ */
+
+#define SOCK_UNIX		"unix:"
+#define SOCK_TCP		"tcp:"
+#define SOCK_MAX_FRAMES		129	/* init frame + 128 continuation frames */
+#define SOCK_HELLO_LEN		4	/* report lengths sent by the server */
+#define SOCK_HELLO_MS		5000
+
+int
+fido_sock_is_path(const char *path)
+{
+	return (strncmp(path, SOCK_UNIX, strlen(SOCK_UNIX)) == 0 ||
+	    strncmp(path, SOCK_TCP, strlen(SOCK_TCP)) == 0);
+}
+
+#if defined(_WIN32)
+void *
+fido_sock_open(const char *path)
+{
+	fido_log_debug("%s: %s: not supported", __func__, path);
+
+	return (NULL);
+}
+
+void
+fido_sock_close(void *handle)
+{
+	(void)handle;
+}
+
+int
+fido_sock_read(void *handle, unsigned char *buf, size_t len, int ms)
+{
+	(void)handle;
+	(void)buf;
+	(void)len;
+	(void)ms;
+
+	return (-1);
+}
+
+int
+fido_sock_write(void *handle, const unsigned char *buf, size_t len)
+{
+	(void)handle;
+	(void)buf;
+	(void)len;
+
+	return (-1);
+}
+
+void
+fido_sock_report_len(void *handle, size_t *in_len, size_t *out_len)
+{
+	(void)handle;
+
+	*in_len = CTAP_RPT_SIZE;
+	*out_len = CTAP_RPT_SIZE;
+}
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS	MSG_NOSIGNAL
+#else
+#define SEND_FLAGS	0
+#endif
+
+struct sock {
+	int		 fd;
+	size_t		 in_len;  /* input report length */
+	size_t		 out_len; /* output report length */
+	unsigned char	*tx;      /* SOCK_MAX_FRAMES output reports */
+	size_t		 tx_len;  /* bytes queued */
+	size_t		 tx_want; /* bytes in the message being queued */
+	unsigned char	*rx;      /* SOCK_MAX_FRAMES input reports */
+	size_t		 rx_size;
+	size_t		 rx_off;  /* first unread byte */
+	size_t		 rx_len;  /* bytes received */
+};
+
+static int
+sock_setup(int fd)
+{
+	int on = 1;
+
+	if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+		fido_log_debug("%s: fcntl", __func__);
+		return (-1);
+	}
+
+#ifdef SO_NOSIGPIPE
+	if (setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on)) < 0) {
+		fido_log_debug("%s: SO_NOSIGPIPE", __func__);
+		return (-1);
+	}
+#endif
+	(void)on;
+
+	return (0);
+}
+
+static int
+connect_unix(const char *path)
+{
+	struct sockaddr_un	sun;
+	int			fd;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		fido_log_debug("%s: path too long", __func__);
+		return (-1);
+	}
+
+	memcpy(sun.sun_path, path, strlen(path));
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		fido_log_debug("%s: socket", __func__);
+		return (-1);
+	}
+
+	if (sock_setup(fd) < 0 ||
+	    connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		fido_log_debug("%s: connect %s", __func__, path);
+		close(fd);
+		return (-1);
+	}
+
+	return (fd);
+}
+
+/*
+ * Split "<host>:<port>" at its last colon; "[<host>]:<port>" is accepted
+ * for IPv6 addresses.
+ */
+static int
+split_host_port(const char *s, char *host, size_t host_len, const char **port)
+{
+	const char	*p;
+	size_t		 n;
+
+	if ((p = strrchr(s, ':')) == NULL || p[1] == '\0')
+		return (-1);
+
+	*port = p + 1;
+	n = (size_t)(p - s);
+
+	if (n >= 2 && s[0] == '[' && s[n - 1] == ']') {
+		s++;
+		n -= 2;
+	}
+
+	if (n == 0 || n >= host_len)
+		return (-1);
+
+	memcpy(host, s, n);
+	host[n] = '\0';
+
+	return (0);
+}
+
+static int
+connect_tcp(const char *hostport)
+{
+	struct addrinfo	 hints;
+	struct addrinfo	*res = NULL;
+	struct addrinfo	*ai;
+	char		 host[256];
+	const char	*port;
+	int		 fd = -1;
+	int		 on = 1;
+
+	if (split_host_port(hostport, host, sizeof(host), &port) < 0) {
+		fido_log_debug("%s: invalid address %s", __func__, hostport);
+		return (-1);
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if (getaddrinfo(host, port, &hints, &res) != 0) {
+		fido_log_debug("%s: getaddrinfo %s", __func__, hostport);
+		return (-1);
+	}
+
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype,
+		    ai->ai_protocol)) < 0)
+			continue;
+		if (sock_setup(fd) == 0 &&
+		    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on,
+		    sizeof(on)) == 0 &&
+		    connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(res);
+
+	if (fd < 0)
+		fido_log_debug("%s: connect %s", __func__, hostport);
+
+	return (fd);
+}
+
+/* read the report lengths the server starts the stream with */
+static int
+read_hello(struct sock *s)
+{
+	unsigned char	hello[SOCK_HELLO_LEN];
+	struct pollfd	pfd;
+	size_t		got = 0;
+	ssize_t		n;
+	int		r;
+
+	memset(&pfd, 0, sizeof(pfd));
+	pfd.fd = s->fd;
+	pfd.events = POLLIN;
+
+	while (got < sizeof(hello)) {
+		while ((r = poll(&pfd, 1, SOCK_HELLO_MS)) < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			fido_log_debug("%s: poll", __func__);
+			return (-1);
+		}
+		while ((n = recv(s->fd, hello + got, sizeof(hello) - got,
+		    0)) < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			fido_log_debug("%s: recv", __func__);
+			return (-1);
+		}
+		got += (size_t)n;
+	}
+
+	s->in_len = ((size_t)hello[0] << 8) | hello[1];
+	s->out_len = ((size_t)hello[2] << 8) | hello[3];
+
+	if (s->in_len < CTAP_MIN_RPT_SIZE || s->in_len > CTAP_MAX_RPT_SIZE ||
+	    s->out_len < CTAP_MIN_RPT_SIZE || s->out_len > CTAP_MAX_RPT_SIZE) {
+		fido_log_debug("%s: in_len=%zu, out_len=%zu", __func__,
+		    s->in_len, s->out_len);
+		return (-1);
+	}
+
+	return (0);
+}
+
+static void
+sock_free(struct sock *s)
+{
+	if (s->fd >= 0)
+		close(s->fd);
+
+	free(s->tx);
+	free(s->rx);
+	free(s);
+}
+
+void *
+fido_sock_open(const char *path)
+{
+	struct sock *s;
+
+	if ((s = calloc(1, sizeof(*s))) == NULL)
+		return (NULL);
+
+	if (strncmp(path, SOCK_UNIX, strlen(SOCK_UNIX)) == 0)
+		s->fd = connect_unix(path + strlen(SOCK_UNIX));
+	else if (strncmp(path, SOCK_TCP, strlen(SOCK_TCP)) == 0)
+		s->fd = connect_tcp(path + strlen(SOCK_TCP));
+	else
+		s->fd = -1;
+
+	if (s->fd < 0 || read_hello(s) < 0) {
+		sock_free(s);
+		return (NULL);
+	}
+
+	s->rx_size = SOCK_MAX_FRAMES * s->in_len;
+
+	if ((s->tx = calloc(SOCK_MAX_FRAMES, s->out_len)) == NULL ||
+	    (s->rx = calloc(SOCK_MAX_FRAMES, s->in_len)) == NULL) {
+		sock_free(s);
+		return (NULL);
+	}
+
+	return (s);
+}
+
+void
+fido_sock_close(void *handle)
+{
+	sock_free(handle);
+}
+
+void
+fido_sock_report_len(void *handle, size_t *in_len, size_t *out_len)
+{
+	struct sock *s = handle;
+
+	*in_len = s->in_len;
+	*out_len = s->out_len;
+}
+
+static int
+send_all(int fd, const unsigned char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = send(fd, buf, len, SEND_FLAGS)) < 0) {
+			if (errno == EINTR)
+				continue;
+			fido_log_debug("%s: send", __func__);
+			return (-1);
+		}
+		buf += n;
+		len -= (size_t)n;
+	}
+
+	return (0);
+}
+
+/*
+ * Number of bytes taken by the frames of the message starting with the
+ * given frame, sent in reports of rpt_len bytes.
+ */
+static size_t
+message_len(const unsigned char *frame, size_t rpt_len)
+{
+	size_t init_len = rpt_len - 7;
+	size_t cont_len = rpt_len - 5;
+	size_t bcnt;
+	size_t nframes = 1;
+
+	if ((frame[4] & CTAP_FRAME_INIT) == 0)
+		return (rpt_len); /* stray continuation frame */
+
+	bcnt = ((size_t)frame[5] << 8) | frame[6];
+	if (bcnt > init_len)
+		nframes += (bcnt - init_len + cont_len - 1) / cont_len;
+	if (nframes > SOCK_MAX_FRAMES)
+		nframes = SOCK_MAX_FRAMES;
+
+	return (nframes * rpt_len);
+}
+
+int
+fido_sock_write(void *handle, const unsigned char *buf, size_t len)
+{
+	struct sock *s = handle;
+
+	if (len != s->out_len + 1) {
+		fido_log_debug("%s: invalid len", __func__);
+		goto fail;
+	}
+
+	buf++; /* skip report id */
+
+	/* an init frame starts a new message, whatever was queued before */
+	if ((buf[4] & CTAP_FRAME_INIT) != 0)
+		s->tx_len = 0;
+
+	if (s->tx_len == 0)
+		s->tx_want = message_len(buf, s->out_len);
+
+	memcpy(s->tx + s->tx_len, buf, s->out_len);
+	s->tx_len += s->out_len;
+
+	if (s->tx_len == s->tx_want) {
+		s->tx_len = 0;
+		if (send_all(s->fd, s->tx, s->tx_want) < 0)
+			goto fail;
+	}
+
+	return ((int)len);
+fail:
+	s->tx_len = 0;
+
+	return (-1);
+}
+
+static int
+fill(struct sock *s, int ms)
+{
+	struct pollfd	pfd;
+	ssize_t		n;
+	int		r;
+
+	if (s->rx_off > 0) {
+		memmove(s->rx, s->rx + s->rx_off, s->rx_len - s->rx_off);
+		s->rx_len -= s->rx_off;
+		s->rx_off = 0;
+	}
+
+	memset(&pfd, 0, sizeof(pfd));
+	pfd.fd = s->fd;
+	pfd.events = POLLIN;
+
+	while ((r = poll(&pfd, 1, ms)) < 0 && errno == EINTR)
+		continue;
+	if (r <= 0) {
+		fido_log_debug("%s: poll", __func__);
+		return (-1);
+	}
+
+	while ((n = recv(s->fd, s->rx + s->rx_len, s->rx_size - s->rx_len,
+	    0)) < 0 && errno == EINTR)
+		continue;
+	if (n <= 0) {
+		fido_log_debug("%s: recv", __func__);
+		return (-1);
+	}
+
+	s->rx_len += (size_t)n;
+
+	return (0);
+}
+
+int
+fido_sock_read(void *handle, unsigned char *buf, size_t len, int ms)
+{
+	struct sock	*s = handle;
+	uint64_t	 t0;
+	int		 elapsed = 0;
+
+	if (len != s->in_len) {
+		fido_log_debug("%s: invalid len", __func__);
+		return (-1);
+	}
+
+	if (fido_time_now(&t0) < 0)
+		return (-1);
+
+	while (s->rx_len - s->rx_off < len) {
+		if (ms >= 0) {
+			if (fido_time_elapsed_ms(t0, &elapsed) < 0)
+				return (-1);
+			if (elapsed >= ms)
+				elapsed = ms; /* one last non-blocking poll */
+		}
+		if (fill(s, ms < 0 ? -1 : ms - elapsed) < 0)
+			return (-1);
+	}
+
+	memcpy(buf, s->rx + s->rx_off, len);
+	s->rx_off += len;
+
+	return ((int)len);
+}
+#endif /* _WIN32 */
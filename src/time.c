@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2020 Yubico AB. All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "fido.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+
+int
+fido_time_now(uint64_t *ns)
+{
+	*ns = (uint64_t)GetTickCount64() * 1000000;
+
+	return (0);
+}
+
+int
+fido_time_sleep(int ms)
+{
+	if (ms < 0)
+		return (-1);
+
+	Sleep((DWORD)ms);
+
+	return (0);
+}
+#else
+int
+fido_time_now(uint64_t *ns)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+		fido_log_debug("%s: clock_gettime", __func__);
+		return (-1);
+	}
+
+	*ns = (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+
+	return (0);
+}
+
+int
+fido_time_sleep(int ms)
+{
+	struct timespec ts;
+
+	if (ms < 0)
+		return (-1);
+
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (long)(ms % 1000) * 1000000;
+
+	while (nanosleep(&ts, &ts) != 0) {
+		if (errno != EINTR) {
+			fido_log_debug("%s: nanosleep", __func__);
+			return (-1);
+		}
+	}
+
+	return (0);
+}
+#endif /* _WIN32 */
+
+/*
+ * Milliseconds elapsed since t0, saturated at INT_MAX.
+ */
+int
+fido_time_elapsed_ms(uint64_t t0, int *ms)
+{
+	uint64_t now;
+
+	if (fido_time_now(&now) < 0 || now < t0)
+		return (-1);
+
+	if ((now - t0) / 1000000 > INT_MAX)
+		*ms = INT_MAX;
+	else
+		*ms = (int)((now - t0) / 1000000);
+
+	return (0);
+}
@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2020 Yubico AB. All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "fido.h"
+
+/*
+ * Tracing: a process-wide callback receiving frames, command boundaries
+ * and the time spent parsing replies and verifying signatures. Call
+ * sites test fido_trace_enabled() before doing any work; see extern.h.
+ *
+ * The callback and its argument are published together, as an immutable
+ * sink behind an atomic pointer, so that a thread emitting an event never
+ * sees one without the other. Sinks are never freed, since another thread
+ * may still be using one; they are reused when the same callback and
+ * argument are set again.
+ */
+
+#if defined(_MSC_VER)
+#include <windows.h>
+#define sink_load(p)		(struct trace_sink *) \
+				    InterlockedCompareExchangePointer( \
+				    (PVOID volatile *)(p), NULL, NULL)
+#define sink_store(p, v)	(void)InterlockedExchangePointer( \
+				    (PVOID volatile *)(p), (v))
+#define sink_cas(p, o, n)	(InterlockedCompareExchangePointer( \
+				    (PVOID volatile *)(p), (n), (o)) == (o))
+#else
+#define sink_load(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define sink_store(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define sink_cas(p, o, n)	__atomic_compare_exchange_n((p), &(o), (n), \
+				    false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#endif
+
+struct trace_sink {
+	fido_trace_cb_t		*cb;
+	void			*arg;
+	struct trace_sink	*next;
+};
+
+static struct trace_sink *sink;		/* current sink, or NULL */
+static struct trace_sink *sink_list;	/* every sink allocated */
+
+static struct trace_sink *
+sink_get(fido_trace_cb_t *cb, void *arg)
+{
+	struct trace_sink *s;
+
+	for (s = sink_load(&sink_list); s != NULL; s = s->next)
+		if (s->cb == cb && s->arg == arg)
+			return (s);
+
+	if ((s = calloc(1, sizeof(*s))) == NULL)
+		return (NULL);
+
+	s->cb = cb;
+	s->arg = arg;
+	s->next = sink_load(&sink_list);
+	while (!sink_cas(&sink_list, s->next, s))
+		continue;
+
+	return (s);
+}
+
+void
+fido_set_trace_callback(fido_trace_cb_t *cb, void *arg)
+{
+	struct trace_sink *s = NULL;
+
+	if (cb != NULL && (s = sink_get(cb, arg)) == NULL) {
+		fido_log_debug("%s: sink_get", __func__);
+		return;
+	}
+
+	sink_store(&sink, s);
+}
+
+bool
+fido_trace_enabled(void)
+{
+	return (sink_load(&sink) != NULL);
+}
+
+uint64_t
+fido_trace_now(void)
+{
+	uint64_t now;
+
+	if (fido_time_now(&now) < 0)
+		return (0);
+
+	return (now);
+}
+
+static void
+emit(fido_trace_event_t *ev)
+{
+	struct trace_sink *s;
+
+	if ((s = sink_load(&sink)) != NULL)
+		s->cb(ev, s->arg);
+}
+
+void
+fido_trace_frame(int type, const unsigned char *frame, size_t len)
+{
+	fido_trace_event_t ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = type;
+	ev.t = fido_trace_now();
+	memcpy(&ev.cid, frame, sizeof(ev.cid));
+	if (frame[4] & CTAP_FRAME_INIT) {
+		ev.cmd = frame[4] & 0x7f;
+		if (type == FIDO_TRACE_RX && ev.cmd == CTAP_KEEPALIVE) {
+			ev.type = FIDO_TRACE_KEEPALIVE;
+			ev.status = frame[7];
+		}
+	}
+	ev.ptr = frame;
+	ev.len = len;
+
+	emit(&ev);
+}
+
+void
+fido_trace_cmd_start(fido_dev_t *d, uint8_t cmd, size_t len)
+{
+	fido_trace_event_t ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = FIDO_TRACE_CMD_START;
+	ev.t = d->trace_t0 = fido_trace_now();
+	ev.cid = d->cid;
+	ev.cmd = cmd & 0x7f;
+	ev.len = len;
+
+	emit(&ev);
+}
+
+void
+fido_trace_cmd_end(fido_dev_t *d, uint8_t cmd, int n)
+{
+	fido_trace_event_t ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = FIDO_TRACE_CMD_END;
+	ev.t = fido_trace_now();
+	if (d->trace_t0 != 0 && ev.t > d->trace_t0)
+		ev.dur = ev.t - d->trace_t0;
+	ev.cid = d->cid;
+	ev.cmd = cmd & 0x7f;
+	ev.status = n < 0 ? -1 : 0;
+	ev.len = n < 0 ? 0 : (size_t)n;
+	d->trace_t0 = 0;
+
+	emit(&ev);
+}
+
+void
+fido_trace_span(int type, uint64_t t0, int status)
+{
+	fido_trace_event_t ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = type;
+	ev.t = fido_trace_now();
+	if (ev.t > t0)
+		ev.dur = ev.t - t0;
+	ev.status = status;
+
+	emit(&ev);
+}
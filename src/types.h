@@ -138,6 +138,8 @@ typedef struct fido_cbor_info {
 	fido_opt_array_t  options;    /* list of supported options */
 	uint64_t          maxmsgsiz;  /* maximum message size */
 	fido_byte_array_t protocols;  /* supported pin protocols */
+	uint64_t          maxcredcntlst; /* max number of credentials in list */
+	uint64_t          maxcredidlen;  /* max credential id length */
 } fido_cbor_info_t;
 
 typedef struct fido_dev_info {
@@ -160,12 +162,98 @@ struct fido_ctap_info {
 	uint8_t  flags;    /* capabilities flags; see FIDO_CAP_* */
 })
 
+typedef struct fido_poll {
+	int min_ms;     /* initial polling interval */
+	int max_ms;     /* maximum polling interval */
+	int timeout_ms; /* deadline; -1 waits indefinitely */
+} fido_poll_t;
+
+/* U2F key handles known to be present on a device */
+#define FIDO_U2F_CACHE_LEN	16
+
+typedef struct fido_u2f_cache {
+	unsigned char entry[FIDO_U2F_CACHE_LEN][32]; /* sha256(rp_id, kh) */
+	size_t        len;                           /* populated entries */
+	size_t        next;                          /* next slot to replace */
+} fido_u2f_cache_t;
+
+/* operational counters; see metrics.c */
+#define FIDO_METRIC_FRAMES_TX		0
+#define FIDO_METRIC_FRAMES_RX		1
+#define FIDO_METRIC_BYTES_TX		2
+#define FIDO_METRIC_BYTES_RX		3
+#define FIDO_METRIC_TX_ERRORS		4
+#define FIDO_METRIC_RX_ERRORS		5
+#define FIDO_METRIC_KEEPALIVES		6
+#define FIDO_METRIC_CID_MISMATCHES	7
+#define FIDO_METRIC_U2F_POLLS		8
+#define FIDO_METRIC_CBOR_ERRORS		9
+#define FIDO_METRIC_ECDH		10
+#define FIDO_METRIC_PIN_TOKENS		11
+#define FIDO_METRIC_VERIFY_ES256_OK	12
+#define FIDO_METRIC_VERIFY_ES256_FAIL	13
+#define FIDO_METRIC_VERIFY_RS256_OK	14
+#define FIDO_METRIC_VERIFY_RS256_FAIL	15
+#define FIDO_METRIC_VERIFY_EDDSA_OK	16
+#define FIDO_METRIC_VERIFY_EDDSA_FAIL	17
+#define FIDO_METRIC_STALE_FRAMES	18
+#define FIDO_METRIC_RESYNCS		19
+#define FIDO_METRIC_BUSY_RETRIES	20
+#define FIDO_METRIC_MAX			21
+
+#define FIDO_METRIC_LATENCY_MAX		14	/* commands */
+#define FIDO_METRIC_BUCKET_MAX		14	/* latency buckets */
+
+typedef struct fido_metrics {
+	uint64_t counter[FIDO_METRIC_MAX];
+	uint64_t latency[FIDO_METRIC_LATENCY_MAX][FIDO_METRIC_BUCKET_MAX];
+	uint64_t latency_sum[FIDO_METRIC_LATENCY_MAX]; /* us */
+} fido_metrics_t;
+
+typedef struct fido_ping {
+	size_t    len;   /* payload length */
+	uint64_t *rtt;   /* round trip times, ns; sorted */
+	size_t    count; /* completed round trips */
+	uint64_t  total; /* sum of rtt[] */
+	int       ms;    /* per round trip timeout */
+} fido_ping_t;
+
+/* defined in shared.c */
+typedef struct fido_dev_shared fido_dev_shared_t;
+
 typedef struct fido_dev {
 	uint64_t          nonce;     /* issued nonce */
 	fido_ctap_info_t  attr;      /* device attributes */
 	uint32_t          cid;       /* assigned channel id */
 	void		 *io_handle; /* abstract i/o handle */
 	fido_dev_io_t	  io;        /* i/o functions & data */
+	fido_dev_transport_t transport; /* message-level i/o, optional */
+	fido_poll_t       u2f_poll;  /* u2f user presence polling */
+	fido_u2f_cache_t  u2f_cache; /* u2f key handles found on device */
+	bool              preflight; /* split allow lists, probe silently */
+	char             *path;      /* path of the open device */
+	struct fido_affinity *affinity; /* credential affinity map */
+	char             *record_path; /* where to record traffic */
+	struct fido_record *record;  /* recording in progress */
+	double            replay_scale; /* replay delay multiplier */
+	uint64_t          trace_t0;  /* start of the traced command */
+	uint64_t          cmd_t0;    /* start of the current command */
+	int               cmd_idx;   /* its latency histogram */
+	fido_metrics_t    metrics;   /* counters for this device */
+	unsigned char    *rx_buf;    /* reassembled replies; see io.c */
+	size_t            rx_buf_len; /* payload capacity of rx_buf */
+	unsigned char    *tx_buf;    /* last request sent; see io.c */
+	size_t            tx_buf_len; /* capacity of tx_buf */
+	size_t            tx_len;    /* length of the last request */
+	uint8_t           tx_cmd;    /* its command, 0 if not kept */
+	uint64_t          maxmsgsiz; /* reported by the device, if known */
+	uint64_t          maxcredcntlst; /* ditto, if info_known */
+	uint64_t          maxcredidlen; /* ditto, if info_known */
+	bool              info_known; /* getInfo seen since open */
+	size_t            rpt_in_len; /* input report length in use */
+	size_t            rpt_out_len; /* output report length in use */
+	size_t            io_rpt_in_len; /* ... with the caller's i/o */
+	size_t            io_rpt_out_len;
 } fido_dev_t;
 
 #endif /* !_TYPES_H */
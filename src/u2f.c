@@ -8,23 +8,10 @@
 #include <openssl/x509.h>
 
 #include <string.h>
-#ifdef HAVE_UNISTD_H
-#include <unistd.h>
-#endif
 
 #include "fido.h"
 #include "fido/es256.h"
 
-#if defined(_MSC_VER)
-static int
-usleep(unsigned int usec)
-{
-	Sleep(usec / 1000);
-
-	return (0);
-}
-#endif
-
 static int
 sig_get(fido_blob_t *sig, const unsigned char **buf, size_t *len)
 {
@@ -122,14 +109,82 @@ authdata_fake(const char *rp_id, uint8_t flags, uint32_t sigcount,
 	return (0);
 }
 
+/*
+ * Transmit an APDU, retransmitting it for as long as the authenticator
+ * answers SW_CONDITIONS_NOT_SATISFIED (i.e., user presence is pending).
+ * The interval between attempts starts at dev->u2f_poll.min_ms and doubles
+ * up to dev->u2f_poll.max_ms; dev->u2f_poll.timeout_ms bounds the wait.
+ */
+static int
+u2f_poll(fido_dev_t *dev, const iso7816_apdu_t *apdu, unsigned char *reply,
+    size_t len, int *reply_len, int ms)
+{
+	const uint8_t	cmd = CTAP_FRAME_INIT | CTAP_CMD_MSG;
+	uint64_t	t0;
+	int		interval;
+	int		elapsed;
+	int		n;
+
+	interval = dev->u2f_poll.min_ms;
+
+#ifdef FIDO_FUZZ
+	interval = 0; /* XXX */
+#endif
+
+	if (fido_time_now(&t0) < 0) {
+		fido_log_debug("%s: fido_time_now", __func__);
+		return (FIDO_ERR_INTERNAL);
+	}
+
+	for (;;) {
+		fido_metrics_add(dev, FIDO_METRIC_U2F_POLLS, 1);
+		if (fido_tx(dev, cmd, iso7816_ptr(apdu),
+		    iso7816_len(apdu)) < 0) {
+			fido_log_debug("%s: fido_tx", __func__);
+			return (FIDO_ERR_TX);
+		}
+		if ((n = fido_rx(dev, cmd, reply, len, ms)) < 2) {
+			fido_log_debug("%s: fido_rx", __func__);
+			return (FIDO_ERR_RX);
+		}
+		if (((reply[0] << 8) | reply[1]) != SW_CONDITIONS_NOT_SATISFIED)
+			break;
+		if (dev->u2f_poll.timeout_ms != -1) {
+			if (fido_time_elapsed_ms(t0, &elapsed) < 0) {
+				fido_log_debug("%s: fido_time_elapsed_ms",
+				    __func__);
+				return (FIDO_ERR_INTERNAL);
+			}
+			if (elapsed >= dev->u2f_poll.timeout_ms) {
+				fido_log_debug("%s: timeout", __func__);
+				return (FIDO_ERR_USER_ACTION_TIMEOUT);
+			}
+			if (interval > dev->u2f_poll.timeout_ms - elapsed)
+				interval = dev->u2f_poll.timeout_ms - elapsed;
+		}
+		if (fido_time_sleep(interval) < 0) {
+			fido_log_debug("%s: fido_time_sleep", __func__);
+			return (FIDO_ERR_RX);
+		}
+		if (interval > dev->u2f_poll.max_ms / 2)
+			interval = dev->u2f_poll.max_ms;
+		else
+			interval *= 2;
+	}
+
+	*reply_len = n;
+
+	return (FIDO_OK);
+}
+
 static int
 send_dummy_register(fido_dev_t *dev, int ms)
 {
-	const uint8_t	 cmd = CTAP_FRAME_INIT | CTAP_CMD_MSG;
 	iso7816_apdu_t	*apdu = NULL;
 	unsigned char	 challenge[SHA256_DIGEST_LENGTH];
 	unsigned char	 application[SHA256_DIGEST_LENGTH];
 	unsigned char	 reply[2048];
+	int		 reply_len;
 	int		 r;
 
 #ifdef FIDO_FUZZ
@@ -149,24 +204,11 @@ send_dummy_register(fido_dev_t *dev, int ms)
 		goto fail;
 	}
 
-	do {
-		if (fido_tx(dev, cmd, iso7816_ptr(apdu),
-		    iso7816_len(apdu)) < 0) {
-			fido_log_debug("%s: fido_tx", __func__);
-			r = FIDO_ERR_TX;
-			goto fail;
-		}
-		if (fido_rx(dev, cmd, &reply, sizeof(reply), ms) < 2) {
-			fido_log_debug("%s: fido_rx", __func__);
-			r = FIDO_ERR_RX;
-			goto fail;
-		}
-		if (usleep((ms == -1 ? 100 : ms) * 1000) < 0) {
-			fido_log_debug("%s: usleep", __func__);
-			r = FIDO_ERR_RX;
-			goto fail;
-		}
-	} while (((reply[0] << 8) | reply[1]) == SW_CONDITIONS_NOT_SATISFIED);
+	if ((r = u2f_poll(dev, apdu, reply, sizeof(reply), &reply_len,
+	    ms)) != FIDO_OK) {
+		fido_log_debug("%s: u2f_poll", __func__);
+		goto fail;
+	}
 
 	r = FIDO_OK;
 fail:
@@ -248,6 +290,181 @@ fail:
 	return (r);
 }
 
+/*
+ * Digest identifying a key handle for a given rp_id in dev->u2f_cache.
+ */
+static int
+key_digest(const char *rp_id, const fido_blob_t *key_id, unsigned char *digest)
+{
+	unsigned char	buf[SHA256_DIGEST_LENGTH + 1 + UINT8_MAX];
+	size_t		len;
+
+	if (rp_id == NULL || key_id->len > UINT8_MAX)
+		return (-1);
+
+	if (SHA256((const void *)rp_id, strlen(rp_id), buf) != buf)
+		return (-1);
+
+	buf[SHA256_DIGEST_LENGTH] = (uint8_t)key_id->len;
+	if (key_id->len)
+		memcpy(&buf[SHA256_DIGEST_LENGTH + 1], key_id->ptr,
+		    key_id->len);
+	len = SHA256_DIGEST_LENGTH + 1 + key_id->len;
+
+	if (SHA256(buf, len, digest) != digest)
+		return (-1);
+
+	return (0);
+}
+
+static int
+key_cache_find(const fido_u2f_cache_t *c, const unsigned char *digest)
+{
+	for (size_t i = 0; i < c->len; i++)
+		if (memcmp(c->entry[i], digest, sizeof(c->entry[i])) == 0)
+			return ((int)i);
+
+	return (-1);
+}
+
+static void
+key_cache_add(fido_u2f_cache_t *c, const unsigned char *digest)
+{
+	if (key_cache_find(c, digest) >= 0)
+		return;
+
+	memcpy(c->entry[c->next], digest, sizeof(c->entry[c->next]));
+	c->next = (c->next + 1) % FIDO_U2F_CACHE_LEN;
+	if (c->len < FIDO_U2F_CACHE_LEN)
+		c->len++;
+}
+
+static void
+key_cache_del(fido_u2f_cache_t *c, const unsigned char *digest)
+{
+	int i;
+
+	if ((i = key_cache_find(c, digest)) < 0)
+		return;
+
+	memcpy(c->entry[i], c->entry[c->len - 1], sizeof(c->entry[i]));
+	explicit_bzero(c->entry[c->len - 1], sizeof(c->entry[c->len - 1]));
+	c->len--;
+	c->next = c->len;
+}
+
+static void
+key_remember(fido_dev_t *dev, const char *rp_id, const fido_blob_t *key_id)
+{
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+
+	if (key_digest(rp_id, key_id, digest) == 0)
+		key_cache_add(&dev->u2f_cache, digest);
+}
+
+static void
+key_forget(fido_dev_t *dev, const char *rp_id, const fido_blob_t *key_id)
+{
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+
+	if (key_digest(rp_id, key_id, digest) == 0)
+		key_cache_del(&dev->u2f_cache, digest);
+}
+
+/*
+ * Check whether a key handle exists on the device, consulting the cache of
+ * key handles previously found on dev before issuing a check-only APDU.
+ * Only positive answers are cached.
+ */
+static int
+key_probe(fido_dev_t *dev, const char *rp_id, const fido_blob_t *key_id,
+    int *found, int ms)
+{
+	unsigned char	digest[SHA256_DIGEST_LENGTH];
+	int		r;
+
+	if (key_digest(rp_id, key_id, digest) < 0) {
+		fido_log_debug("%s: key_digest", __func__);
+		return (FIDO_ERR_INVALID_ARGUMENT);
+	}
+
+	if (key_cache_find(&dev->u2f_cache, digest) >= 0) {
+		*found = 1;
+		return (FIDO_OK);
+	}
+
+	if ((r = key_lookup(dev, rp_id, key_id, found, ms)) != FIDO_OK) {
+		fido_log_debug("%s: key_lookup", __func__);
+		return (r);
+	}
+
+	if (*found)
+		key_cache_add(&dev->u2f_cache, digest);
+
+	return (FIDO_OK);
+}
+
+/*
+ * Called when signing with a key handle found on the device failed: the
+ * handle may have come from the cache and be gone since. Probe it again;
+ * FIDO_ERR_NO_CREDENTIALS tells the caller to skip it.
+ */
+static int
+key_recheck(fido_dev_t *dev, const char *rp_id, const fido_blob_t *key_id,
+    int r, int ms)
+{
+	int found;
+
+	key_forget(dev, rp_id, key_id);
+
+	if (key_lookup(dev, rp_id, key_id, &found, ms) != FIDO_OK) {
+		fido_log_debug("%s: key_lookup", __func__);
+		return (r);
+	}
+
+	if (!found)
+		return (FIDO_ERR_NO_CREDENTIALS);
+
+	key_remember(dev, rp_id, key_id);
+
+	return (r);
+}
+
+/*
+ * Find which key handles in a list exist on the device. Duplicates are
+ * probed once; found[i] is only set for their first occurrence.
+ */
+static int
+key_probe_list(fido_dev_t *dev, const char *rp_id,
+    const fido_blob_array_t *list, int *found, int ms)
+{
+	int r;
+
+	for (size_t i = 0; i < list->len; i++) {
+		const fido_blob_t *key_id = &list->ptr[i];
+		int dup = 0;
+
+		found[i] = 0;
+
+		for (size_t j = 0; j < i && !dup; j++)
+			if (list->ptr[j].len == key_id->len &&
+			    memcmp(list->ptr[j].ptr, key_id->ptr,
+			    key_id->len) == 0)
+				dup = 1;
+
+		if (dup)
+			continue;
+
+		if ((r = key_probe(dev, rp_id, key_id, &found[i],
+		    ms)) != FIDO_OK) {
+			fido_log_debug("%s: key_probe", __func__);
+			return (r);
+		}
+	}
+
+	return (FIDO_OK);
+}
+
 static int
 parse_auth_reply(fido_blob_t *sig, fido_blob_t *ad, const char *rp_id,
     const unsigned char *reply, size_t len)
@@ -285,7 +502,6 @@ static int
 do_auth(fido_dev_t *dev, const fido_blob_t *cdh, const char *rp_id,
     const fido_blob_t *key_id, fido_blob_t *sig, fido_blob_t *ad, int ms)
 {
-	const uint8_t	 cmd = CTAP_FRAME_INIT | CTAP_CMD_MSG;
 	iso7816_apdu_t	*apdu = NULL;
 	unsigned char	 rp_id_hash[SHA256_DIGEST_LENGTH];
 	unsigned char	 reply[128];
@@ -325,25 +541,11 @@ do_auth(fido_dev_t *dev, const fido_blob_t *cdh, const char *rp_id,
 		goto fail;
 	}
 
-	do {
-		if (fido_tx(dev, cmd, iso7816_ptr(apdu),
-		    iso7816_len(apdu)) < 0) {
-			fido_log_debug("%s: fido_tx", __func__);
-			r = FIDO_ERR_TX;
-			goto fail;
-		}
-		if ((reply_len = fido_rx(dev, cmd, &reply, sizeof(reply),
-		    ms)) < 2) {
-			fido_log_debug("%s: fido_rx", __func__);
-			r = FIDO_ERR_RX;
-			goto fail;
-		}
-		if (usleep((ms == -1 ? 100 : ms) * 1000) < 0) {
-			fido_log_debug("%s: usleep", __func__);
-			r = FIDO_ERR_RX;
-			goto fail;
-		}
-	} while (((reply[0] << 8) | reply[1]) == SW_CONDITIONS_NOT_SATISFIED);
+	if ((r = u2f_poll(dev, apdu, reply, sizeof(reply), &reply_len,
+	    ms)) != FIDO_OK) {
+		fido_log_debug("%s: u2f_poll", __func__);
+		goto fail;
+	}
 
 	if ((r = parse_auth_reply(sig, ad, rp_id, reply,
 	    (size_t)reply_len)) != FIDO_OK) {
@@ -575,7 +777,6 @@ fail:
 int
 u2f_register(fido_dev_t *dev, fido_cred_t *cred, int ms)
 {
-	const uint8_t	 cmd = CTAP_FRAME_INIT | CTAP_CMD_MSG;
 	iso7816_apdu_t	*apdu = NULL;
 	unsigned char	 rp_id_hash[SHA256_DIGEST_LENGTH];
 	unsigned char	 reply[2048];
@@ -600,20 +801,27 @@ u2f_register(fido_dev_t *dev, fido_cred_t *cred, int ms)
 		return (FIDO_ERR_INVALID_ARGUMENT);
 	}
 
+	/*
+	 * The cache is refreshed but not trusted here: a stale entry would
+	 * wrongly exclude the registration, and a hit costs a touch on the
+	 * dummy registration anyway.
+	 */
 	for (size_t i = 0; i < cred->excl.len; i++) {
 		if ((r = key_lookup(dev, cred->rp.id, &cred->excl.ptr[i],
 		    &found, ms)) != FIDO_OK) {
 			fido_log_debug("%s: key_lookup", __func__);
 			return (r);
 		}
-		if (found) {
-			if ((r = send_dummy_register(dev, ms)) != FIDO_OK) {
-				fido_log_debug("%s: send_dummy_register",
-				    __func__);
-				return (r);
-			}
-			return (FIDO_ERR_CREDENTIAL_EXCLUDED);
+		if (!found) {
+			key_forget(dev, cred->rp.id, &cred->excl.ptr[i]);
+			continue;
+		}
+		key_remember(dev, cred->rp.id, &cred->excl.ptr[i]);
+		if ((r = send_dummy_register(dev, ms)) != FIDO_OK) {
+			fido_log_debug("%s: send_dummy_register", __func__);
+			return (r);
 		}
+		return (FIDO_ERR_CREDENTIAL_EXCLUDED);
 	}
 
 	memset(&rp_id_hash, 0, sizeof(rp_id_hash));
@@ -633,31 +841,19 @@ u2f_register(fido_dev_t *dev, fido_cred_t *cred, int ms)
 		goto fail;
 	}
 
-	do {
-		if (fido_tx(dev, cmd, iso7816_ptr(apdu),
-		    iso7816_len(apdu)) < 0) {
-			fido_log_debug("%s: fido_tx", __func__);
-			r = FIDO_ERR_TX;
-			goto fail;
-		}
-		if ((reply_len = fido_rx(dev, cmd, &reply, sizeof(reply),
-		    ms)) < 2) {
-			fido_log_debug("%s: fido_rx", __func__);
-			r = FIDO_ERR_RX;
-			goto fail;
-		}
-		if (usleep((ms == -1 ? 100 : ms) * 1000) < 0) {
-			fido_log_debug("%s: usleep", __func__);
-			r = FIDO_ERR_RX;
-			goto fail;
-		}
-	} while (((reply[0] << 8) | reply[1]) == SW_CONDITIONS_NOT_SATISFIED);
+	if ((r = u2f_poll(dev, apdu, reply, sizeof(reply), &reply_len,
+	    ms)) != FIDO_OK) {
+		fido_log_debug("%s: u2f_poll", __func__);
+		goto fail;
+	}
 
 	if ((r = parse_register_reply(cred, reply,
 	    (size_t)reply_len)) != FIDO_OK) {
 		fido_log_debug("%s: parse_register_reply", __func__);
 		goto fail;
 	}
+
+	key_remember(dev, cred->rp.id, &cred->attcred.id);
 fail:
 	iso7816_free(&apdu);
 
@@ -670,23 +866,11 @@ u2f_authenticate_single(fido_dev_t *dev, const fido_blob_t *key_id,
 {
 	fido_blob_t	sig;
 	fido_blob_t	ad;
-	int		found;
 	int		r;
 
 	memset(&sig, 0, sizeof(sig));
 	memset(&ad, 0, sizeof(ad));
 
-	if ((r = key_lookup(dev, fa->rp_id, key_id, &found, ms)) != FIDO_OK) {
-		fido_log_debug("%s: key_lookup", __func__);
-		goto fail;
-	}
-
-	if (!found) {
-		fido_log_debug("%s: not found", __func__);
-		r = FIDO_ERR_CREDENTIAL_EXCLUDED;
-		goto fail;
-	}
-
 	if (fa->up == FIDO_OPT_FALSE) {
 		fido_log_debug("%s: checking for key existence only", __func__);
 		r = FIDO_ERR_USER_PRESENCE_REQUIRED;
@@ -696,6 +880,7 @@ u2f_authenticate_single(fido_dev_t *dev, const fido_blob_t *key_id,
 	if ((r = do_auth(dev, &fa->cdh, fa->rp_id, key_id, &sig, &ad,
 	    ms)) != FIDO_OK) {
 		fido_log_debug("%s: do_auth", __func__);
+		r = key_recheck(dev, fa->rp_id, key_id, r, ms);
 		goto fail;
 	}
 
@@ -724,8 +909,9 @@ fail:
 int
 u2f_authenticate(fido_dev_t *dev, fido_assert_t *fa, int ms)
 {
-	int	nauth_ok = 0;
-	int	r;
+	int	*found = NULL;
+	size_t	 nauth_ok = 0;
+	int	 r;
 
 	if (fa->uv == FIDO_OPT_TRUE || fa->allow_list.ptr == NULL) {
 		fido_log_debug("%s: uv=%d, allow_list=%p", __func__, fa->uv,
@@ -738,21 +924,37 @@ u2f_authenticate(fido_dev_t *dev, fido_assert_t *fa, int ms)
 		return (r);
 	}
 
+	if ((found = calloc(fa->allow_list.len, sizeof(*found))) == NULL)
+		return (FIDO_ERR_INTERNAL);
+
+	/* find the key handles present before asking for user presence */
+	if ((r = key_probe_list(dev, fa->rp_id, &fa->allow_list, found,
+	    ms)) != FIDO_OK) {
+		fido_log_debug("%s: key_probe_list", __func__);
+		goto fail;
+	}
+
 	for (size_t i = 0; i < fa->allow_list.len; i++) {
+		if (!found[i])
+			continue; /* ignore credentials that don't exist */
 		if ((r = u2f_authenticate_single(dev, &fa->allow_list.ptr[i],
-		    fa, nauth_ok, ms)) == FIDO_OK) {
-			nauth_ok++;
-		} else if (r != FIDO_ERR_CREDENTIAL_EXCLUDED) {
+		    fa, nauth_ok, ms)) == FIDO_ERR_NO_CREDENTIALS)
+			continue; /* gone since it was cached */
+		if (r != FIDO_OK) {
 			fido_log_debug("%s: u2f_authenticate_single", __func__);
-			return (r);
+			goto fail;
 		}
-		/* ignore credentials that don't exist */
+		nauth_ok++;
 	}
 
 	fa->stmt_len = nauth_ok;
 
 	if (nauth_ok == 0)
-		return (FIDO_ERR_NO_CREDENTIALS);
+		r = FIDO_ERR_NO_CREDENTIALS;
+	else
+		r = FIDO_OK;
+fail:
+	free(found);
 
-	return (FIDO_OK);
+	return (r);
 }
@@ -0,0 +1,607 @@
+/*
+ * Copyright (c) 2020 Yubico AB. All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+#include <string.h>
+
+#include "fido.h"
+
+#if defined(__linux__) && defined(HAVE_LINUX_IO_URING_H)
+#include <linux/io_uring.h>
+#endif
+
+/*
+ * Device paths of the form "uring:<path>" reach a Linux hidraw device
+ * through io_uring. Outgoing frames are held back until the message they
+ * belong to is complete and then submitted as a chain of linked writes,
+ * with a single system call. Reads are kept posted ahead of the caller as
+ * a chain of linked reads, which complete in order, so that the frames
+ * of a reply have usually arrived by the time they are asked for.
+ */
+
+#define URING_PREFIX	"uring:"
+
+int
+fido_uring_is_path(const char *path)
+{
+	return (strncmp(path, URING_PREFIX, strlen(URING_PREFIX)) == 0);
+}
+
+#if !defined(IORING_FEAT_EXT_ARG)
+void *
+fido_uring_open(const char *path)
+{
+	fido_log_debug("%s: %s: not supported", __func__, path);
+
+	return (NULL);
+}
+
+void
+fido_uring_close(void *handle)
+{
+	(void)handle;
+}
+
+int
+fido_uring_read(void *handle, unsigned char *buf, size_t len, int ms)
+{
+	(void)handle;
+	(void)buf;
+	(void)len;
+	(void)ms;
+
+	return (-1);
+}
+
+int
+fido_uring_write(void *handle, const unsigned char *buf, size_t len)
+{
+	(void)handle;
+	(void)buf;
+	(void)len;
+
+	return (-1);
+}
+
+void
+fido_uring_report_len(void *handle, size_t *in_len, size_t *out_len)
+{
+	(void)handle;
+
+	*in_len = CTAP_RPT_SIZE;
+	*out_len = CTAP_RPT_SIZE;
+}
+#else
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#define URING_ENTRIES	256	/* submission queue entries */
+#define URING_TX_FRAMES	129	/* init frame + 128 continuation frames */
+#define URING_RX_DEPTH	32	/* reads kept posted */
+#define URING_CLOSE_MS	1000	/* wait for cancelled reads */
+
+#define TAG_TX		(1ULL << 32)
+#define TAG_RX		(2ULL << 32)
+#define TAG_CANCEL	(3ULL << 32)
+#define TAG_MASK	(0xffffffffULL << 32)
+
+struct uring {
+	void			*hid;       /* hidraw handle */
+	int			 fd;        /* its descriptor */
+	size_t			 in_len;    /* input report length */
+	size_t			 out_len;   /* output report length */
+	int			 ring_fd;
+	unsigned char		*sq_ptr;    /* submission queue ring */
+	size_t			 sq_map_len;
+	unsigned char		*cq_ptr;    /* completion queue ring */
+	size_t			 cq_map_len;
+	struct io_uring_sqe	*sqes;
+	size_t			 sqes_map_len;
+	unsigned		*sq_head;
+	unsigned		*sq_tail;
+	unsigned		*sq_array;
+	unsigned		 sq_mask;
+	unsigned		 sq_entries;
+	unsigned		 sq_local;  /* tail, not yet published */
+	unsigned		 to_submit; /* entries not yet submitted */
+	unsigned		*cq_head;
+	unsigned		*cq_tail;
+	unsigned		 cq_mask;
+	struct io_uring_cqe	*cqes;
+	unsigned char		*tx;        /* frames of the message queued */
+	size_t			 tx_len;    /* bytes queued */
+	size_t			 tx_want;   /* bytes in the message */
+	unsigned		 tx_pending; /* writes not yet completed */
+	int			 tx_err;
+	unsigned char		*rx;        /* URING_RX_DEPTH input reports */
+	int			 rx_res[URING_RX_DEPTH];
+	uint64_t		 rx_posted; /* reads posted */
+	uint64_t		 rx_done;   /* reads completed */
+	uint64_t		 rx_consumed; /* reads handed out */
+};
+
+static int
+sys_setup(unsigned entries, struct io_uring_params *p)
+{
+	return ((int)syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int
+sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+    const void *arg, size_t argsz)
+{
+	return ((int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+	    flags, arg, argsz));
+}
+
+static int
+ring_map(struct uring *u)
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+
+	if ((u->ring_fd = sys_setup(URING_ENTRIES, &p)) < 0) {
+		fido_log_debug("%s: io_uring_setup", __func__);
+		return (-1);
+	}
+
+	if ((p.features & IORING_FEAT_EXT_ARG) == 0) {
+		fido_log_debug("%s: features=0x%x", __func__, p.features);
+		return (-1);
+	}
+
+	u->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_map_len = p.cq_off.cqes + p.cq_entries *
+	    sizeof(struct io_uring_cqe);
+	u->sqes_map_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_map_len > u->sq_map_len)
+			u->sq_map_len = u->cq_map_len;
+		u->cq_map_len = 0; /* shared with the submission queue */
+	}
+
+	if ((u->sq_ptr = mmap(NULL, u->sq_map_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, u->ring_fd,
+	    IORING_OFF_SQ_RING)) == MAP_FAILED) {
+		fido_log_debug("%s: mmap sq", __func__);
+		u->sq_ptr = NULL;
+		return (-1);
+	}
+
+	if (u->cq_map_len == 0)
+		u->cq_ptr = u->sq_ptr;
+	else if ((u->cq_ptr = mmap(NULL, u->cq_map_len, PROT_READ |
+	    PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->ring_fd,
+	    IORING_OFF_CQ_RING)) == MAP_FAILED) {
+		fido_log_debug("%s: mmap cq", __func__);
+		u->cq_ptr = NULL;
+		return (-1);
+	}
+
+	if ((u->sqes = mmap(NULL, u->sqes_map_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, u->ring_fd,
+	    IORING_OFF_SQES)) == MAP_FAILED) {
+		fido_log_debug("%s: mmap sqes", __func__);
+		u->sqes = NULL;
+		return (-1);
+	}
+
+	u->sq_head = (unsigned *)(u->sq_ptr + p.sq_off.head);
+	u->sq_tail = (unsigned *)(u->sq_ptr + p.sq_off.tail);
+	u->sq_array = (unsigned *)(u->sq_ptr + p.sq_off.array);
+	u->sq_mask = *(unsigned *)(u->sq_ptr + p.sq_off.ring_mask);
+	u->sq_entries = p.sq_entries;
+	u->sq_local = *u->sq_tail;
+	u->cq_head = (unsigned *)(u->cq_ptr + p.cq_off.head);
+	u->cq_tail = (unsigned *)(u->cq_ptr + p.cq_off.tail);
+	u->cq_mask = *(unsigned *)(u->cq_ptr + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(u->cq_ptr + p.cq_off.cqes);
+
+	return (0);
+}
+
+static void
+ring_unmap(struct uring *u)
+{
+	if (u->sqes != NULL)
+		munmap(u->sqes, u->sqes_map_len);
+	if (u->cq_ptr != NULL && u->cq_map_len != 0)
+		munmap(u->cq_ptr, u->cq_map_len);
+	if (u->sq_ptr != NULL)
+		munmap(u->sq_ptr, u->sq_map_len);
+	if (u->ring_fd >= 0)
+		close(u->ring_fd);
+}
+
+/* free submission queue entries */
+static unsigned
+ring_space(const struct uring *u)
+{
+	return (u->sq_entries - (u->sq_local -
+	    __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE)));
+}
+
+/* the next submission queue entry, published by ring_enter() */
+static struct io_uring_sqe *
+ring_sqe(struct uring *u, uint8_t opcode, uint64_t user_data)
+{
+	struct io_uring_sqe	*sqe;
+	unsigned		 idx;
+
+	if (ring_space(u) == 0) {
+		fido_log_debug("%s: submission queue full", __func__);
+		return (NULL);
+	}
+
+	idx = u->sq_local & u->sq_mask;
+	sqe = &u->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->user_data = user_data;
+	u->sq_array[idx] = idx;
+	u->sq_local++;
+	u->to_submit++;
+
+	return (sqe);
+}
+
+/*
+ * Submit the queued entries and, if min_complete is not zero, wait up to
+ * ms milliseconds (-1 meaning indefinitely) for a completion.
+ */
+static int
+ring_enter(struct uring *u, unsigned min_complete, int ms)
+{
+	struct io_uring_getevents_arg	 arg;
+	struct __kernel_timespec	 ts;
+	unsigned			 flags = 0;
+	int				 n;
+
+	__atomic_store_n(u->sq_tail, u->sq_local, __ATOMIC_RELEASE);
+
+	memset(&arg, 0, sizeof(arg));
+	if (min_complete) {
+		flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+		if (ms >= 0) {
+			ts.tv_sec = ms / 1000;
+			ts.tv_nsec = (ms % 1000) * 1000000LL;
+			arg.ts = (uint64_t)(uintptr_t)&ts;
+		}
+	}
+
+	while ((n = sys_enter(u->ring_fd, u->to_submit, min_complete, flags,
+	    flags ? &arg : NULL, flags ? sizeof(arg) : 0)) < 0 &&
+	    errno == EINTR)
+		continue;
+
+	if (n < 0) {
+		if (errno != ETIME)
+			fido_log_debug("%s: io_uring_enter", __func__);
+		return (-1);
+	}
+
+	u->to_submit -= (unsigned)n;
+
+	return (0);
+}
+
+static void
+ring_reap(struct uring *u)
+{
+	struct io_uring_cqe	*cqe;
+	unsigned		 head;
+	unsigned		 tail;
+
+	head = *u->cq_head;
+	tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; head++) {
+		cqe = &u->cqes[head & u->cq_mask];
+		switch (cqe->user_data & TAG_MASK) {
+		case TAG_TX:
+			if (cqe->res < 0 || (size_t)cqe->res != u->out_len + 1)
+				u->tx_err = 1;
+			if (u->tx_pending > 0)
+				u->tx_pending--;
+			break;
+		case TAG_RX:
+			u->rx_res[u->rx_done++ % URING_RX_DEPTH] = cqe->res;
+			break;
+		default:
+			break; /* cancellation */
+		}
+	}
+
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* post a chain of reads once the previous one has completed */
+static void
+rx_post(struct uring *u)
+{
+	struct io_uring_sqe	*sqe;
+	uint64_t		 n;
+
+	if (u->rx_done != u->rx_posted ||
+	    (n = u->rx_consumed + URING_RX_DEPTH - u->rx_posted) == 0 ||
+	    ring_space(u) < n)
+		return;
+
+	for (uint64_t i = 0; i < n; i++) {
+		size_t slot = (size_t)(u->rx_posted % URING_RX_DEPTH);
+
+		sqe = ring_sqe(u, IORING_OP_READ, TAG_RX |
+		    (u->rx_posted & 0xffffffff));
+		sqe->fd = u->fd;
+		sqe->addr = (uint64_t)(uintptr_t)(u->rx + slot * u->in_len);
+		sqe->len = (uint32_t)u->in_len;
+		sqe->off = 0;
+		if (i + 1 < n)
+			sqe->flags = IOSQE_IO_LINK;
+		u->rx_posted++;
+	}
+}
+
+/*
+ * Number of bytes taken by the frames of the message starting with the
+ * given frame, report ids included.
+ */
+static size_t
+message_len(const struct uring *u, const unsigned char *frame)
+{
+	const size_t	init_len = u->out_len - 7;
+	const size_t	cont_len = u->out_len - 5;
+	size_t		bcnt;
+	size_t		nframes = 1;
+
+	if ((frame[4] & CTAP_FRAME_INIT) != 0) {
+		bcnt = ((size_t)frame[5] << 8) | frame[6];
+		if (bcnt > init_len)
+			nframes += (bcnt - init_len + cont_len - 1) / cont_len;
+		if (nframes > URING_TX_FRAMES)
+			nframes = URING_TX_FRAMES;
+	}
+
+	return (nframes * (u->out_len + 1));
+}
+
+/* submit the queued message as a chain of writes and wait for it */
+static int
+tx_flush(struct uring *u)
+{
+	struct io_uring_sqe	*sqe;
+	const size_t		 frame_len = u->out_len + 1;
+	const size_t		 n = u->tx_want / frame_len;
+
+	u->tx_err = 0;
+
+	if (ring_space(u) < n) {
+		fido_log_debug("%s: n=%zu", __func__, n);
+		return (-1);
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		sqe = ring_sqe(u, IORING_OP_WRITE, TAG_TX | i);
+		sqe->fd = u->fd;
+		sqe->addr = (uint64_t)(uintptr_t)(u->tx + i * frame_len);
+		sqe->len = (uint32_t)frame_len;
+		sqe->off = 0;
+		if (i + 1 < n)
+			sqe->flags = IOSQE_IO_LINK;
+		u->tx_pending++;
+	}
+
+	/* the reply's frames are read as soon as they arrive */
+	rx_post(u);
+
+	while (u->tx_pending > 0) {
+		if (ring_enter(u, 1, -1) < 0)
+			return (-1);
+		ring_reap(u);
+	}
+
+	if (u->tx_err) {
+		fido_log_debug("%s: write", __func__);
+		return (-1);
+	}
+
+	return (0);
+}
+
+/* cancel the reads still posted, and wait for them to go */
+static int
+rx_cancel(struct uring *u)
+{
+	struct io_uring_sqe	*sqe;
+	uint64_t		 t0;
+	int			 elapsed;
+
+	for (uint64_t i = u->rx_done; i < u->rx_posted; i++) {
+		if ((sqe = ring_sqe(u, IORING_OP_ASYNC_CANCEL,
+		    TAG_CANCEL)) == NULL)
+			break;
+		sqe->addr = TAG_RX | (i & 0xffffffff);
+	}
+
+	if (fido_time_now(&t0) < 0)
+		return (-1);
+
+	while (u->rx_done != u->rx_posted) {
+		if (fido_time_elapsed_ms(t0, &elapsed) < 0 ||
+		    elapsed >= URING_CLOSE_MS ||
+		    ring_enter(u, 1, URING_CLOSE_MS - elapsed) < 0)
+			return (-1);
+		ring_reap(u);
+	}
+
+	return (0);
+}
+
+void *
+fido_uring_open(const char *path)
+{
+	struct uring *u;
+
+	if (fido_uring_is_path(path) == 0 ||
+	    (u = calloc(1, sizeof(*u))) == NULL)
+		return (NULL);
+
+	u->ring_fd = -1;
+
+	if ((u->hid = fido_hid_open(path + strlen(URING_PREFIX))) == NULL) {
+		fido_log_debug("%s: fido_hid_open", __func__);
+		goto fail;
+	}
+
+	u->fd = fido_hid_fd(u->hid);
+	fido_hid_report_len(u->hid, &u->in_len, &u->out_len);
+
+	if ((u->tx = calloc(URING_TX_FRAMES, u->out_len + 1)) == NULL ||
+	    (u->rx = calloc(URING_RX_DEPTH, u->in_len)) == NULL ||
+	    ring_map(u) < 0)
+		goto fail;
+
+	return (u);
+fail:
+	ring_unmap(u);
+	if (u->hid != NULL)
+		fido_hid_close(u->hid);
+	free(u->tx);
+	free(u->rx);
+	free(u);
+
+	return (NULL);
+}
+
+void
+fido_uring_close(void *handle)
+{
+	struct uring *u = handle;
+
+	if (rx_cancel(u) < 0) {
+		/* the kernel may still write to u->rx; leak it */
+		fido_log_debug("%s: rx_cancel", __func__);
+		u->rx = NULL;
+	}
+
+	ring_unmap(u);
+	fido_hid_close(u->hid);
+	free(u->tx);
+	free(u->rx);
+	free(u);
+}
+
+int
+fido_uring_read(void *handle, unsigned char *buf, size_t len, int ms)
+{
+	struct uring	*u = handle;
+	uint64_t	 t0;
+	int		 elapsed = 0;
+	int		 res;
+
+	if (len != u->in_len) {
+		fido_log_debug("%s: invalid len: got %zu, want %zu", __func__,
+		    len, u->in_len);
+		return (-1);
+	}
+
+	if (fido_time_now(&t0) < 0)
+		return (-1);
+
+	for (;;) {
+		while (u->rx_consumed < u->rx_done) {
+			size_t slot = (size_t)(u->rx_consumed++ %
+			    URING_RX_DEPTH);
+
+			if ((res = u->rx_res[slot]) == -ECANCELED)
+				continue; /* after a failed read */
+			if (res < 0 || (size_t)res != len) {
+				fido_log_debug("%s: read: %d", __func__, res);
+				return (-1);
+			}
+
+			memcpy(buf, u->rx + slot * len, len);
+
+			return ((int)len);
+		}
+
+		rx_post(u);
+
+		if (ms >= 0) {
+			if (fido_time_elapsed_ms(t0, &elapsed) < 0)
+				return (-1);
+			if (elapsed >= ms)
+				elapsed = ms; /* one last non-blocking wait */
+		}
+
+		if (ring_enter(u, 1, ms < 0 ? -1 : ms - elapsed) < 0) {
+			ring_reap(u);
+			if (u->rx_consumed < u->rx_done)
+				continue;
+			return (-1);
+		}
+
+		ring_reap(u);
+	}
+}
+
+int
+fido_uring_write(void *handle, const unsigned char *buf, size_t len)
+{
+	struct uring *u = handle;
+
+	if (len != u->out_len + 1) {
+		fido_log_debug("%s: invalid len: got %zu, want %zu", __func__,
+		    len, u->out_len + 1);
+		goto fail;
+	}
+
+	/* an init frame starts a new message, whatever was queued before */
+	if ((buf[5] & CTAP_FRAME_INIT) != 0)
+		u->tx_len = 0;
+
+	if (u->tx_len == 0) {
+		/* writes left over by a failed flush still use u->tx */
+		if (u->tx_pending > 0)
+			ring_reap(u);
+		if (u->tx_pending > 0) {
+			fido_log_debug("%s: tx_pending=%u", __func__,
+			    u->tx_pending);
+			goto fail;
+		}
+		u->tx_want = message_len(u, buf + 1);
+	}
+
+	memcpy(u->tx + u->tx_len, buf, len);
+	u->tx_len += len;
+
+	if (u->tx_len == u->tx_want) {
+		u->tx_len = 0;
+		if (tx_flush(u) < 0)
+			goto fail;
+	}
+
+	return ((int)len);
+fail:
+	u->tx_len = 0;
+
+	return (-1);
+}
+
+void
+fido_uring_report_len(void *handle, size_t *in_len, size_t *out_len)
+{
+	struct uring *u = handle;
+
+	*in_len = u->in_len;
+	*out_len = u->out_len;
+}
+#endif /* IORING_FEAT_EXT_ARG */
@@ -12,7 +12,7 @@ struct blob {
 	size_t len;
 };
 
-#define TOKEN_OPT	"CDILPRSVbcdei:k:n:r"
+#define TOKEN_OPT	"CDILPRSTVbcdei:k:l:n:rt:"
 
 #define FLAG_DEBUG	0x01
 #define FLAG_QUIET	0x02
@@ -49,6 +49,7 @@ int string_read(FILE *, char **);
 int token_delete(int, char **, char *);
 int token_info(int, char **, char *);
 int token_list(int, char **, char *);
+int token_ping(int, char **, char *);
 int token_reset(char *);
 int token_set(int, char **, char *);
 int write_ec_pubkey(FILE *, const void *, size_t);
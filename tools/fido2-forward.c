@@ -0,0 +1,511 @@
+/*
+ * Copyright (c) 2020 Yubico AB. All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+/*
+ * Expose a local hidraw authenticator on a unix or loopback tcp socket,
+ * for use with libfido2's "unix:" and "tcp:" device paths. Every client
+ * connection gets its own handle on the device, and is first sent the
+ * device's input and output report lengths, two bytes each, big-endian.
+ * Bare CTAPHID frames of those lengths are then forwarded in both
+ * directions; the frames of a reply are sent to the client in one go. Sockets are non-blocking: replies a client has not
+ * read yet are queued on its connection, and its device is not read
+ * from while the queue has no room for another reply.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fido.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../openbsd-compat/openbsd-compat.h"
+
+#define MAX_CONN	16
+#define MAX_DEVS	64
+#define MAX_FRAMES	129	/* init frame + 128 continuation frames */
+#define MAX_RPT_SIZE	1024	/* longest report libfido2 uses */
+#define HELLO_LEN	4	/* report lengths sent to a client */
+#define CMD_KEEPALIVE	(0x80 | 0x3b)
+
+struct conn {
+	int		 sock;
+	int		 hid;
+	unsigned char	*in;		/* from the client */
+	size_t		 in_len;
+	unsigned char	*reply;		/* from the device */
+	size_t		 reply_len;
+	size_t		 reply_want;
+	unsigned char	*out;		/* to the client */
+	size_t		 out_len;
+};
+
+static struct conn	*conn[MAX_CONN];
+static bool		 debug;
+static size_t		 rpt_in_len;	/* of the device */
+static size_t		 rpt_out_len;
+static size_t		 reply_max;	/* MAX_FRAMES input reports */
+static size_t		 out_max;	/* two replies */
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+"usage: fido2-forward [-d] unix:path | tcp:host:port [device]\n"
+	);
+
+	exit(1);
+}
+
+static void
+dbg(const char *fmt, ...)
+{
+	va_list ap;
+
+	if (debug == false)
+		return;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
+/* the first fido device found, if none was given */
+static char *
+default_device(void)
+{
+	fido_dev_info_t	*devlist;
+	size_t		 ndevs;
+	char		*path = NULL;
+
+	if ((devlist = fido_dev_info_new(MAX_DEVS)) == NULL)
+		errx(1, "fido_dev_info_new");
+	if (fido_dev_info_manifest(devlist, MAX_DEVS, &ndevs) != FIDO_OK)
+		errx(1, "fido_dev_info_manifest");
+	if (ndevs == 0)
+		errx(1, "no devices found");
+	if ((path = strdup(fido_dev_info_path(fido_dev_info_ptr(devlist,
+	    0)))) == NULL)
+		err(1, "strdup");
+
+	fido_dev_info_free(&devlist, MAX_DEVS);
+
+	return (path);
+}
+
+/* report lengths of the device, as libfido2 sees them */
+static void
+report_len(const char *path)
+{
+	fido_dev_t	*dev;
+	int		 r;
+
+	if ((dev = fido_dev_new()) == NULL)
+		errx(1, "fido_dev_new");
+	if ((r = fido_dev_open(dev, path)) != FIDO_OK)
+		errx(1, "fido_dev_open %s: %s", path, fido_strerr(r));
+
+	rpt_in_len = fido_dev_report_in_len(dev);
+	rpt_out_len = fido_dev_report_out_len(dev);
+	reply_max = MAX_FRAMES * rpt_in_len;
+	out_max = HELLO_LEN + 2 * reply_max;
+
+	fido_dev_close(dev);
+	fido_dev_free(&dev);
+}
+
+static int
+listen_unix(const char *path)
+{
+	struct sockaddr_un	sun;
+	struct stat		st;
+	int			fd;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, path, sizeof(sun.sun_path)) >=
+	    sizeof(sun.sun_path))
+		errx(1, "%s: path too long", path);
+
+	/* replace a stale socket, but nothing else */
+	if (lstat(path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode))
+			errx(1, "%s: exists and is not a socket", path);
+		if (unlink(path) < 0)
+			err(1, "unlink %s", path);
+	}
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		err(1, "socket");
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+		err(1, "bind %s", path);
+
+	return (fd);
+}
+
+static bool
+is_loopback(const struct sockaddr *sa)
+{
+	const struct sockaddr_in	*sin;
+	const struct sockaddr_in6	*sin6;
+
+	switch (sa->sa_family) {
+	case AF_INET:
+		sin = (const struct sockaddr_in *)sa;
+		return ((ntohl(sin->sin_addr.s_addr) >> 24) == 127);
+	case AF_INET6:
+		sin6 = (const struct sockaddr_in6 *)sa;
+		return (IN6_IS_ADDR_LOOPBACK(&sin6->sin6_addr));
+	default:
+		return (false);
+	}
+}
+
+static int
+listen_tcp(const char *hostport)
+{
+	struct addrinfo	 hints;
+	struct addrinfo	*res;
+	char		 host[256];
+	char		*port;
+	int		 fd;
+	int		 on = 1;
+	int		 r;
+
+	if (strlcpy(host, hostport, sizeof(host)) >= sizeof(host) ||
+	    (port = strrchr(host, ':')) == NULL || port[1] == '\0')
+		errx(1, "%s: invalid address", hostport);
+	*port++ = '\0';
+	if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+		host[strlen(host) - 1] = '\0';
+		memmove(host, host + 1, strlen(host));
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	if ((r = getaddrinfo(host, port, &hints, &res)) != 0)
+		errx(1, "%s: %s", hostport, gai_strerror(r));
+
+	/* the device must not be reachable from other hosts */
+	if (!is_loopback(res->ai_addr))
+		errx(1, "%s: not a loopback address", hostport);
+
+	if ((fd = socket(res->ai_family, res->ai_socktype,
+	    res->ai_protocol)) < 0)
+		err(1, "socket");
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0)
+		err(1, "setsockopt");
+	if (bind(fd, res->ai_addr, res->ai_addrlen) < 0)
+		err(1, "bind %s", hostport);
+
+	freeaddrinfo(res);
+
+	return (fd);
+}
+
+static int
+listen_addr(const char *addr)
+{
+	int fd = -1;
+
+	if (strncmp(addr, "unix:", 5) == 0)
+		fd = listen_unix(addr + 5);
+	else if (strncmp(addr, "tcp:", 4) == 0)
+		fd = listen_tcp(addr + 4);
+	else
+		usage();
+
+	if (listen(fd, MAX_CONN) < 0)
+		err(1, "listen");
+
+	return (fd);
+}
+
+static void
+conn_close(size_t i)
+{
+	dbg("conn %zu: closed", i);
+
+	close(conn[i]->sock);
+	close(conn[i]->hid);
+	free(conn[i]->in);
+	free(conn[i]->reply);
+	free(conn[i]->out);
+	free(conn[i]);
+	conn[i] = NULL;
+}
+
+/* send as much of the queued output as the socket takes */
+static int
+conn_flush(struct conn *c)
+{
+	ssize_t n;
+	size_t	off = 0;
+
+	while (off < c->out_len) {
+		if ((n = send(c->sock, c->out + off, c->out_len - off,
+		    MSG_NOSIGNAL)) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return (-1);
+		}
+		off += (size_t)n;
+	}
+
+	memmove(c->out, c->out + off, c->out_len - off);
+	c->out_len -= off;
+
+	return (0);
+}
+
+static void
+conn_accept(int lfd, const char *device)
+{
+	struct conn	*c;
+	int		 fd;
+	int		 flags;
+	int		 on = 1;
+	size_t		 i;
+
+	if ((fd = accept(lfd, NULL, NULL)) < 0) {
+		warn("accept");
+		return;
+	}
+
+	for (i = 0; i < MAX_CONN && conn[i] != NULL; i++)
+		continue;
+
+	if (i == MAX_CONN) {
+		warnx("too many connections");
+		close(fd);
+		return;
+	}
+
+	/* not a tcp socket in the unix: case; ignore failure */
+	(void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	if ((flags = fcntl(fd, F_GETFL)) < 0 ||
+	    fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		warn("fcntl");
+		close(fd);
+		return;
+	}
+
+	if ((c = calloc(1, sizeof(*c))) == NULL ||
+	    (c->in = calloc(MAX_FRAMES, rpt_out_len)) == NULL ||
+	    (c->reply = calloc(MAX_FRAMES, rpt_in_len)) == NULL ||
+	    (c->out = calloc(1, out_max)) == NULL) {
+		warn("calloc");
+		close(fd);
+		if (c != NULL) {
+			free(c->in);
+			free(c->reply);
+		}
+		free(c);
+		return;
+	}
+
+	c->sock = fd;
+	if ((c->hid = open(device, O_RDWR | O_CLOEXEC)) < 0) {
+		warn("open %s", device);
+		close(fd);
+		free(c->in);
+		free(c->reply);
+		free(c->out);
+		free(c);
+		return;
+	}
+
+	conn[i] = c;
+	dbg("conn %zu: opened %s", i, device);
+
+	/* the client learns the report lengths before any frame */
+	c->out[0] = (rpt_in_len >> 8) & 0xff;
+	c->out[1] = rpt_in_len & 0xff;
+	c->out[2] = (rpt_out_len >> 8) & 0xff;
+	c->out[3] = rpt_out_len & 0xff;
+	c->out_len = HELLO_LEN;
+
+	if (conn_flush(c) < 0)
+		conn_close(i);
+}
+
+/* whether a whole reply can be queued for the client */
+static bool
+conn_room(const struct conn *c)
+{
+	return (out_max - c->out_len >= reply_max);
+}
+
+/* client to device: write every complete frame as an output report */
+static int
+conn_in(struct conn *c)
+{
+	unsigned char	report[1 + MAX_RPT_SIZE];
+	size_t		len = rpt_out_len + 1;
+	ssize_t		n;
+	size_t		off;
+
+	if ((n = recv(c->sock, c->in + c->in_len, MAX_FRAMES * rpt_out_len -
+	    c->in_len, 0)) < 0 && (errno == EINTR || errno == EAGAIN ||
+	    errno == EWOULDBLOCK))
+		return (0);
+	if (n <= 0)
+		return (-1);
+
+	c->in_len += (size_t)n;
+
+	for (off = 0; c->in_len - off >= rpt_out_len; off += rpt_out_len) {
+		report[0] = 0; /* report id */
+		memcpy(report + 1, c->in + off, rpt_out_len);
+		if (write(c->hid, report, len) != (ssize_t)len)
+			return (-1);
+	}
+
+	memmove(c->in, c->in + off, c->in_len - off);
+	c->in_len -= off;
+
+	return (0);
+}
+
+/* bytes taken by the frames of the reply starting with frame */
+static size_t
+reply_len(const unsigned char *frame)
+{
+	size_t init_len = rpt_in_len - 7;
+	size_t cont_len = rpt_in_len - 5;
+	size_t bcnt;
+	size_t nframes = 1;
+
+	if ((frame[4] & 0x80) == 0 || frame[4] == CMD_KEEPALIVE)
+		return (rpt_in_len);
+
+	bcnt = ((size_t)frame[5] << 8) | frame[6];
+	if (bcnt > init_len)
+		nframes += (bcnt - init_len + cont_len - 1) / cont_len;
+
+	return ((nframes > MAX_FRAMES ? MAX_FRAMES : nframes) * rpt_in_len);
+}
+
+/* device to client: batch the frames of a reply, and queue it */
+static int
+conn_out(struct conn *c)
+{
+	unsigned char *frame = c->reply + c->reply_len;
+
+	if (read(c->hid, frame, rpt_in_len) != (ssize_t)rpt_in_len)
+		return (-1);
+
+	if (c->reply_len == 0)
+		c->reply_want = reply_len(frame);
+
+	if ((c->reply_len += rpt_in_len) < c->reply_want)
+		return (0);
+
+	/* only polled for when there is room; see conn_room() */
+	memcpy(c->out + c->out_len, c->reply, c->reply_want);
+	c->out_len += c->reply_want;
+	c->reply_len = 0;
+
+	return (conn_flush(c));
+}
+
+int
+main(int argc, char **argv)
+{
+	struct pollfd	 pfd[1 + 2 * MAX_CONN];
+	char		*device;
+	int		 lfd;
+	int		 ch;
+
+	while ((ch = getopt(argc, argv, "d")) != -1) {
+		switch (ch) {
+		case 'd':
+			debug = true;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 1 || argc > 2)
+		usage();
+
+	fido_init(0);
+	signal(SIGPIPE, SIG_IGN);
+
+	device = argc == 2 ? strdup(argv[1]) : default_device();
+	if (device == NULL)
+		err(1, "strdup");
+
+	report_len(device);
+	lfd = listen_addr(argv[0]);
+	dbg("forwarding %s to %s, reports of %zu/%zu bytes", device, argv[0],
+	    rpt_in_len, rpt_out_len);
+
+	for (;;) {
+		nfds_t n = 0;
+
+		pfd[n].fd = lfd;
+		pfd[n++].events = POLLIN;
+		for (size_t i = 0; i < MAX_CONN; i++) {
+			if (conn[i] == NULL)
+				continue;
+			pfd[n].fd = conn[i]->sock;
+			pfd[n++].events = POLLIN |
+			    (conn[i]->out_len > 0 ? POLLOUT : 0);
+			pfd[n].fd = conn[i]->hid;
+			pfd[n++].events = conn_room(conn[i]) ? POLLIN : 0;
+		}
+
+		if (poll(pfd, n, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
+		}
+
+		n = 1;
+		for (size_t i = 0; i < MAX_CONN; i++) {
+			if (conn[i] == NULL)
+				continue;
+			if (((pfd[n].revents & POLLOUT) &&
+			    conn_flush(conn[i]) < 0) ||
+			    ((pfd[n].revents & ~POLLOUT) &&
+			    conn_in(conn[i]) < 0) ||
+			    (pfd[n + 1].revents && conn_out(conn[i]) < 0))
+				conn_close(i);
+			n += 2;
+		}
+
+		if (pfd[0].revents & POLLIN)
+			conn_accept(lfd, device);
+	}
+
+	/* NOTREACHED */
+}
@@ -23,6 +23,7 @@ usage(void)
 "       fido2-token -I [-cd] [-k rp_id -i cred_id] device\n"
 "       fido2-token -L [-der] [-k rp_id] [device]\n" 
 "       fido2-token -S [-de] [-i template_id -n template_name] device\n"
+"       fido2-token -T [-d] [-l length] [-n count] [-t ms] [device]\n"
 "       fido2-token -V\n" 
 	);
 
@@ -51,8 +52,10 @@ main(int argc, char **argv)
 		case 'e':
 		case 'i':
 		case 'k':
+		case 'l':
 		case 'n':
 		case 'r':
+		case 't':
 			break; /* ignore */
 		case 'd':
 			flags = FIDO_DEBUG;
@@ -83,6 +86,8 @@ main(int argc, char **argv)
 		return (token_reset(device));
 	case 'S':
 		return (token_set(argc, argv, device));
+	case 'T':
+		return (token_ping(argc, argv, device));
 	case 'V':
 		fprintf(stderr, "%d.%d.%d\n", _FIDO_MAJOR, _FIDO_MINOR,
 		    _FIDO_PATCH);
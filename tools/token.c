@@ -4,8 +4,11 @@
  * license that can be found in the LICENSE file.
  */
 
+#include <errno.h>
 #include <fido.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -111,6 +114,18 @@ print_maxmsgsiz(uint64_t maxmsgsiz)
 	printf("maxmsgsiz: %d\n", (int)maxmsgsiz);
 }
 
+static void
+print_maxcredcntlst(uint64_t maxcredcntlst)
+{
+	printf("maxcredcntlst: %d\n", (int)maxcredcntlst);
+}
+
+static void
+print_maxcredidlen(uint64_t maxcredidlen)
+{
+	printf("maxcredidlen: %d\n", (int)maxcredidlen);
+}
+
 static void
 print_byte_array(const char *label, const uint8_t *ba, size_t len)
 {
@@ -196,6 +211,12 @@ token_info(int argc, char **argv, char *path)
 	/* print maximum message size */
 	print_maxmsgsiz(fido_cbor_info_maxmsgsiz(ci));
 
+	/* print maximum number of credentials in a list */
+	print_maxcredcntlst(fido_cbor_info_maxcredcntlst(ci));
+
+	/* print maximum credential id length */
+	print_maxcredidlen(fido_cbor_info_maxcredidlen(ci));
+
 	/* print supported pin protocols */
 	print_byte_array("pin protocols", fido_cbor_info_protocols_ptr(ci),
 	    fido_cbor_info_protocols_len(ci));
@@ -329,6 +350,111 @@ token_list(int argc, char **argv, char *path)
 	exit(0);
 }
 
+static size_t
+parse_size(const char *str)
+{
+	char		*ep;
+	unsigned long	 n;
+
+	errno = 0;
+	n = strtoul(str, &ep, 10);
+	if (str[0] < '0' || str[0] > '9' || *ep != '\0' || errno == ERANGE ||
+	    n > SIZE_MAX)
+		errx(1, "invalid number: %s", str);
+
+	return ((size_t)n);
+}
+
+static int
+ping_dev(const char *path, size_t len, size_t count, int ms)
+{
+	fido_dev_t	*dev;
+	fido_ping_t	*ping;
+	int		 r;
+
+	if ((dev = fido_dev_new()) == NULL)
+		errx(1, "fido_dev_new");
+	if ((ping = fido_ping_new()) == NULL)
+		errx(1, "fido_ping_new");
+	if (fido_ping_set_timeout(ping, ms) != FIDO_OK)
+		errx(1, "fido_ping_set_timeout");
+
+	if ((r = fido_dev_open(dev, path)) != FIDO_OK) {
+		warnx("fido_dev_open %s: %s", path, fido_strerr(r));
+		goto out;
+	}
+
+	if ((r = fido_dev_ping(dev, len, count, ping)) != FIDO_OK)
+		warnx("fido_dev_ping %s: %s (0x%x)", path, fido_strerr(r), r);
+
+	printf("%s: len=%zu, count=%zu, min=%llu, avg=%llu, p99=%llu, "
+	    "max=%llu us, %llu bytes/s\n", path, fido_ping_len(ping),
+	    fido_ping_count(ping),
+	    (unsigned long long)fido_ping_min_us(ping),
+	    (unsigned long long)fido_ping_avg_us(ping),
+	    (unsigned long long)fido_ping_p99_us(ping),
+	    (unsigned long long)fido_ping_max_us(ping),
+	    (unsigned long long)fido_ping_bytes_per_sec(ping));
+
+	fido_dev_close(dev);
+out:
+	fido_ping_free(&ping);
+	fido_dev_free(&dev);
+
+	return (r);
+}
+
+int
+token_ping(int argc, char **argv, char *path)
+{
+	fido_dev_info_t *devlist;
+	size_t ndevs;
+	size_t len = 64;
+	size_t count = 100;
+	size_t ms = 5000;
+	int failed = 0;
+	int ch;
+	int r;
+
+	optind = 1;
+
+	while ((ch = getopt(argc, argv, TOKEN_OPT)) != -1) {
+		switch (ch) {
+		case 'l':
+			len = parse_size(optarg);
+			break;
+		case 'n':
+			count = parse_size(optarg);
+			break;
+		case 't':
+			if ((ms = parse_size(optarg)) == 0 || ms > INT_MAX)
+				errx(1, "invalid timeout: %s", optarg);
+			break;
+		default:
+			break; /* ignore */
+		}
+	}
+
+	if (path != NULL)
+		exit(ping_dev(path, len, count, (int)ms) != FIDO_OK);
+
+	if ((devlist = fido_dev_info_new(64)) == NULL)
+		errx(1, "fido_dev_info_new");
+	if ((r = fido_dev_info_manifest(devlist, 64, &ndevs)) != FIDO_OK)
+		errx(1, "fido_dev_info_manifest: %s (0x%x)", fido_strerr(r), r);
+
+	for (size_t i = 0; i < ndevs; i++) {
+		const fido_dev_info_t *di = fido_dev_info_ptr(devlist, i);
+		if (ping_dev(fido_dev_info_path(di), len, count,
+		    (int)ms) != FIDO_OK)
+			failed = 1;
+	}
+
+	fido_dev_info_free(&devlist, ndevs);
+
+	exit(failed);
+}
+
 int
 token_delete(int argc, char **argv, char *path)
 {
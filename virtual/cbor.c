@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2020 Yubico AB. All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+#include <string.h>
+
+#include "extern.h"
+
+/*
+ * Build an integer using the shortest encoding, as required by the
+ * CTAP2 canonical CBOR encoding rules.
+ */
+cbor_item_t *
+vdev_cbor_int(int64_t v)
+{
+	uint64_t n;
+
+	if (v >= 0)
+		n = (uint64_t)v;
+	else
+		n = (uint64_t)(-(v + 1));
+
+	if (n <= UINT8_MAX)
+		return (v >= 0 ? cbor_build_uint8((uint8_t)n) :
+		    cbor_build_negint8((uint8_t)n));
+	if (n <= UINT16_MAX)
+		return (v >= 0 ? cbor_build_uint16((uint16_t)n) :
+		    cbor_build_negint16((uint16_t)n));
+	if (n <= UINT32_MAX)
+		return (v >= 0 ? cbor_build_uint32((uint32_t)n) :
+		    cbor_build_negint32((uint32_t)n));
+
+	return (v >= 0 ? cbor_build_uint64(n) : cbor_build_negint64(n));
+}
+
+const cbor_item_t *
+vdev_cbor_get(const cbor_item_t *map, int64_t key)
+{
+	struct cbor_pair	*v;
+	int64_t			 k;
+
+	if (map == NULL || cbor_isa_map(map) == false ||
+	    cbor_map_is_definite(map) == false ||
+	    (v = cbor_map_handle(map)) == NULL)
+		return (NULL);
+
+	for (size_t i = 0; i < cbor_map_size(map); i++)
+		if (vdev_cbor_sint(v[i].key, &k) == 0 && k == key)
+			return (v[i].value);
+
+	return (NULL);
+}
+
+const cbor_item_t *
+vdev_cbor_get_str(const cbor_item_t *map, const char *key)
+{
+	struct cbor_pair	*v;
+	size_t			 len = strlen(key);
+
+	if (map == NULL || cbor_isa_map(map) == false ||
+	    cbor_map_is_definite(map) == false ||
+	    (v = cbor_map_handle(map)) == NULL)
+		return (NULL);
+
+	for (size_t i = 0; i < cbor_map_size(map); i++)
+		if (cbor_isa_string(v[i].key) &&
+		    cbor_string_is_definite(v[i].key) &&
+		    cbor_string_length(v[i].key) == len &&
+		    memcmp(cbor_string_handle(v[i].key), key, len) == 0)
+			return (v[i].value);
+
+	return (NULL);
+}
+
+/*
+ * Add a key/value pair to a map, consuming the references to both. Keys
+ * must be added in canonical order.
+ */
+int
+vdev_cbor_add(cbor_item_t *map, cbor_item_t *key, cbor_item_t *val)
+{
+	struct cbor_pair	pair;
+	int			ok = -1;
+
+	if (key == NULL || val == NULL)
+		goto fail;
+
+	pair.key = key;
+	pair.value = val;
+
+	if (cbor_map_add(map, pair) == false)
+		goto fail;
+
+	ok = 0;
+fail:
+	if (key != NULL)
+		cbor_decref(&key);
+	if (val != NULL)
+		cbor_decref(&val);
+
+	return (ok);
+}
+
+int
+vdev_cbor_add_str(cbor_item_t *map, const char *key, cbor_item_t *val)
+{
+	return (vdev_cbor_add(map, cbor_build_string(key), val));
+}
+
+int
+vdev_cbor_bool(const cbor_item_t *item, bool *v)
+{
+	if (item == NULL || cbor_isa_float_ctrl(item) == false ||
+	    cbor_float_get_width(item) != CBOR_FLOAT_0 ||
+	    cbor_is_bool(item) == false)
+		return (-1);
+
+	*v = cbor_ctrl_value(item) == CBOR_CTRL_TRUE;
+
+	return (0);
+}
+
+int
+vdev_cbor_bytes(const cbor_item_t *item, const unsigned char **ptr,
+    size_t *len)
+{
+	if (item == NULL || cbor_isa_bytestring(item) == false ||
+	    cbor_bytestring_is_definite(item) == false)
+		return (-1);
+
+	*ptr = cbor_bytestring_handle(item);
+	*len = cbor_bytestring_length(item);
+
+	return (0);
+}
+
+int
+vdev_cbor_copy_bytes(const cbor_item_t *item, struct vdev_blob *b)
+{
+	const unsigned char	*ptr;
+	size_t			 len;
+
+	if (vdev_cbor_bytes(item, &ptr, &len) < 0 || len == 0 ||
+	    (b->ptr = malloc(len)) == NULL)
+		return (-1);
+
+	memcpy(b->ptr, ptr, len);
+	b->len = len;
+
+	return (0);
+}
+
+int
+vdev_cbor_copy_str(const cbor_item_t *item, char **str)
+{
+	size_t len;
+
+	if (item == NULL || cbor_isa_string(item) == false ||
+	    cbor_string_is_definite(item) == false)
+		return (-1);
+
+	len = cbor_string_length(item);
+	if (memchr(cbor_string_handle(item), 0, len) != NULL ||
+	    (*str = malloc(len + 1)) == NULL)
+		return (-1);
+
+	memcpy(*str, cbor_string_handle(item), len);
+	(*str)[len] = '\0';
+
+	return (0);
+}
+
+int
+vdev_cbor_uint(const cbor_item_t *item, uint64_t *v)
+{
+	if (item == NULL || cbor_isa_uint(item) == false)
+		return (-1);
+
+	*v = cbor_get_int(item);
+
+	return (0);
+}
+
+int
+vdev_cbor_sint(const cbor_item_t *item, int64_t *v)
+{
+	if (item == NULL)
+		return (-1);
+
+	if (cbor_isa_uint(item) && cbor_get_int(item) <= INT64_MAX)
+		*v = (int64_t)cbor_get_int(item);
+	else if (cbor_isa_negint(item) && cbor_get_int(item) <= INT64_MAX)
+		*v = -(int64_t)cbor_get_int(item) - 1;
+	else
+		return (-1);
+
+	return (0);
+}
@@ -0,0 +1,274 @@
+/*
+ * Copyright (c) 2020 Yubico AB. All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+#include <string.h>
+
+#include "extern.h"
+
+#define CMD_CRED_METADATA	0x01
+#define CMD_RP_BEGIN		0x02
+#define CMD_RP_NEXT		0x03
+#define CMD_RK_BEGIN		0x04
+#define CMD_RK_NEXT		0x05
+#define CMD_DELETE_CRED		0x06
+
+/*
+ * Verify the pinAuth of a credential management request, computed over
+ * subCommand || subCommandParams.
+ */
+static int
+check_auth(struct vdev *v, uint8_t cmd, const cbor_item_t *req)
+{
+	const cbor_item_t	*param;
+	unsigned char		*buf = NULL;
+	size_t			 buf_len = 0;
+	size_t			 alloc_len;
+	int			 r;
+
+	if (vdev_cbor_get(req, 4) == NULL)
+		return (v->pin_set ? FIDO_ERR_PIN_REQUIRED :
+		    FIDO_ERR_PIN_NOT_SET);
+
+	if ((param = vdev_cbor_get(req, 2)) != NULL &&
+	    (buf_len = cbor_serialize_alloc(param, &buf, &alloc_len)) == 0)
+		return (FIDO_ERR_ERR_OTHER);
+
+	r = vdev_pin_auth(v, vdev_cbor_get(req, 4), vdev_cbor_get(req, 3),
+	    &cmd, sizeof(cmd), buf, buf_len);
+
+	free(buf);
+
+	return (r);
+}
+
+static int
+get_metadata(const struct vdev *v, cbor_item_t **resp)
+{
+	size_t n = vdev_cred_rk_count(v);
+
+	if ((*resp = cbor_new_definite_map(2)) == NULL ||
+	    vdev_cbor_add(*resp, vdev_cbor_int(1),
+	    vdev_cbor_int((int64_t)n)) < 0 ||
+	    vdev_cbor_add(*resp, vdev_cbor_int(2),
+	    vdev_cbor_int((int64_t)(VDEV_MAX_RK - n))) < 0)
+		return (FIDO_ERR_ERR_OTHER);
+
+	return (FIDO_OK);
+}
+
+static cbor_item_t *
+encode_rp(const struct vdev_cred *c)
+{
+	cbor_item_t *item;
+
+	if ((item = cbor_new_definite_map(2)) == NULL)
+		return (NULL);
+
+	if (vdev_cbor_add_str(item, "id", cbor_build_string(c->rp_id)) < 0 ||
+	    (c->rp_name && vdev_cbor_add_str(item, "name",
+	    cbor_build_string(c->rp_name)) < 0))
+		cbor_decref(&item);
+
+	return (item);
+}
+
+static int
+encode_rp_reply(const struct vdev_cred *c, size_t total, cbor_item_t **resp)
+{
+	if ((*resp = cbor_new_definite_map(3)) == NULL ||
+	    vdev_cbor_add(*resp, vdev_cbor_int(3), encode_rp(c)) < 0 ||
+	    vdev_cbor_add(*resp, vdev_cbor_int(4),
+	    cbor_build_bytestring(c->rp_id_hash, sizeof(c->rp_id_hash))) < 0 ||
+	    (total && vdev_cbor_add(*resp, vdev_cbor_int(5),
+	    vdev_cbor_int((int64_t)total)) < 0))
+		return (FIDO_ERR_ERR_OTHER);
+
+	return (FIDO_OK);
+}
+
+static int
+encode_rk_reply(const struct vdev_cred *c, size_t total, cbor_item_t **resp)
+{
+	EVP_PKEY	*pkey;
+	int		 r = FIDO_ERR_ERR_OTHER;
+
+	if ((pkey = vdev_key_load(c->type, &c->key)) == NULL)
+		return (r);
+
+	if ((*resp = cbor_new_definite_map(4)) == NULL ||
+	    vdev_cbor_add(*resp, vdev_cbor_int(6),
+	    vdev_cred_user(c, true)) < 0 ||
+	    vdev_cbor_add(*resp, vdev_cbor_int(7),
+	    vdev_cred_descriptor(c)) < 0 ||
+	    vdev_cbor_add(*resp, vdev_cbor_int(8),
+	    vdev_key_cose(c->type, pkey)) < 0 ||
+	    (total && vdev_cbor_add(*resp, vdev_cbor_int(9),
+	    vdev_cbor_int((int64_t)total)) < 0))
+		goto fail;
+
+	r = FIDO_OK;
+fail:
+	EVP_PKEY_free(pkey);
+
+	return (r);
+}
+
+/* the first resident credential of each rp, in creation order */
+static int
+collect_rp(const struct vdev *v, struct vdev_iter *it)
+{
+	if ((it->serial = calloc(v->n_cred + 1, sizeof(*it->serial))) == NULL)
+		return (-1);
+
+	for (size_t i = 0; i < v->n_cred; i++) {
+		const struct vdev_cred *c = &v->cred[i];
+		bool seen = false;
+		if (c->rk == false)
+			continue;
+		for (size_t j = 0; seen == false && j < i; j++)
+			seen = v->cred[j].rk && memcmp(v->cred[j].rp_id_hash,
+			    c->rp_id_hash, sizeof(c->rp_id_hash)) == 0;
+		if (seen == false)
+			it->serial[it->n++] = c->serial;
+	}
+
+	return (0);
+}
+
+/* resident credentials of an rp, in creation order */
+static int
+collect_rk(const struct vdev *v, const unsigned char *rp_id_hash,
+    struct vdev_iter *it)
+{
+	if ((it->serial = calloc(v->n_cred + 1, sizeof(*it->serial))) == NULL)
+		return (-1);
+
+	for (size_t i = 0; i < v->n_cred; i++)
+		if (v->cred[i].rk && memcmp(v->cred[i].rp_id_hash, rp_id_hash,
+		    sizeof(v->cred[i].rp_id_hash)) == 0)
+			it->serial[it->n++] = v->cred[i].serial;
+
+	return (0);
+}
+
+static int
+enumerate_begin(struct vdev *v, struct vdev_port *p, uint8_t cmd,
+    const cbor_item_t *req, cbor_item_t **resp)
+{
+	struct vdev_iter	*it = &p->iter;
+	const unsigned char	*rp_id_hash;
+	size_t			 len;
+	int			 r;
+
+	if (cmd == CMD_RP_BEGIN)
+		r = collect_rp(v, it);
+	else if (vdev_cbor_bytes(vdev_cbor_get(vdev_cbor_get(req, 2), 1),
+	    &rp_id_hash, &len) < 0 || len != 32)
+		return (FIDO_ERR_MISSING_PARAMETER);
+	else
+		r = collect_rk(v, rp_id_hash, it);
+
+	if (r < 0)
+		return (FIDO_ERR_ERR_OTHER);
+	if (it->n == 0) {
+		vdev_iter_reset(it);
+		return (FIDO_ERR_NO_CREDENTIALS);
+	}
+
+	if (cmd == CMD_RP_BEGIN)
+		r = encode_rp_reply(vdev_cred_by_serial(v, it->serial[0]),
+		    it->n, resp);
+	else
+		r = encode_rk_reply(vdev_cred_by_serial(v, it->serial[0]),
+		    it->n, resp);
+
+	if (r != FIDO_OK || it->n == 1) {
+		vdev_iter_reset(it);
+		return (r);
+	}
+
+	it->cmd = cmd;
+	it->pos = 1;
+
+	return (FIDO_OK);
+}
+
+static int
+enumerate_next(struct vdev *v, struct vdev_port *p, uint8_t cmd,
+    cbor_item_t **resp)
+{
+	struct vdev_iter	*it = &p->iter;
+	struct vdev_cred	*c;
+	int			 r;
+
+	if (it->cmd != cmd - 1 || it->pos >= it->n ||
+	    (c = vdev_cred_by_serial(v, it->serial[it->pos++])) == NULL) {
+		vdev_iter_reset(it);
+		return (FIDO_ERR_NOT_ALLOWED);
+	}
+
+	if (cmd == CMD_RP_NEXT)
+		r = encode_rp_reply(c, 0, resp);
+	else
+		r = encode_rk_reply(c, 0, resp);
+
+	if (r != FIDO_OK || it->pos == it->n)
+		vdev_iter_reset(it);
+
+	return (r);
+}
+
+static int
+delete_cred(struct vdev *v, const cbor_item_t *req)
+{
+	const unsigned char	*id;
+	size_t			 id_len;
+	struct vdev_cred	*c;
+
+	if (vdev_cbor_bytes(vdev_cbor_get_str(vdev_cbor_get(vdev_cbor_get(req,
+	    2), 2), "id"), &id, &id_len) < 0)
+		return (FIDO_ERR_MISSING_PARAMETER);
+
+	if ((c = vdev_cred_by_id(v, id, id_len)) == NULL || c->rk == false)
+		return (FIDO_ERR_NO_CREDENTIALS);
+
+	vdev_cred_del(v, c);
+
+	return (FIDO_OK);
+}
+
+int
+vdev_cmd_cred_mgmt(struct vdev *v, struct vdev_port *p, const cbor_item_t *req,
+    cbor_item_t **resp)
+{
+	uint64_t	cmd;
+	int		r;
+
+	if (vdev_cbor_uint(vdev_cbor_get(req, 1), &cmd) < 0) {
+		vdev_iter_reset(&p->iter);
+		return (FIDO_ERR_MISSING_PARAMETER);
+	}
+
+	if (cmd == CMD_RP_NEXT || cmd == CMD_RK_NEXT)
+		return (enumerate_next(v, p, (uint8_t)cmd, resp));
+
+	vdev_iter_reset(&p->iter);
+
+	if (cmd < CMD_CRED_METADATA || cmd > CMD_DELETE_CRED)
+		return (FIDO_ERR_INVALID_PARAMETER);
+	if ((r = check_auth(v, (uint8_t)cmd, req)) != FIDO_OK)
+		return (r);
+
+	switch (cmd) {
+	case CMD_CRED_METADATA:
+		return (get_metadata(v, resp));
+	case CMD_RP_BEGIN:
+	case CMD_RK_BEGIN:
+		return (enumerate_begin(v, p, (uint8_t)cmd, req, resp));
+	default:
+		return (delete_cred(v, req));
+	}
+}
@@ -0,0 +1,915 @@
+/*
+ * Copyright (c) 2020 Yubico AB. All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+
+#include <string.h>
+
+#include "extern.h"
+
+#define STORED_ID_LEN	32
+
+void
+vdev_cred_reset(struct vdev_cred *c)
+{
+	if (c->key.ptr != NULL)
+		explicit_bzero(c->key.ptr, c->key.len);
+
+	free(c->id.ptr);
+	free(c->key.ptr);
+	free(c->rp_id);
+	free(c->rp_name);
+	free(c->user_id.ptr);
+	free(c->user_name);
+	free(c->user_display_name);
+	free(c->user_icon);
+
+	memset(c, 0, sizeof(*c));
+}
+
+/*
+ * Move a credential into the authenticator's store.
+ */
+int
+vdev_cred_add(struct vdev *v, struct vdev_cred *c)
+{
+	struct vdev_cred	*ptr;
+	size_t			 n;
+
+	if (v->n_cred == v->n_alloc) {
+		if (v->n_alloc >= VDEV_MAX_CRED)
+			return (-1);
+		n = v->n_alloc ? v->n_alloc * 2 : 16;
+		if (n > VDEV_MAX_CRED)
+			n = VDEV_MAX_CRED;
+		if ((ptr = recallocarray(v->cred, v->n_alloc, n,
+		    sizeof(*ptr))) == NULL)
+			return (-1);
+		v->cred = ptr;
+		v->n_alloc = n;
+	}
+
+	c->serial = ++v->serial;
+	v->cred[v->n_cred++] = *c;
+	memset(c, 0, sizeof(*c));
+
+	return (0);
+}
+
+struct vdev_cred *
+vdev_cred_by_id(struct vdev *v, const unsigned char *id, size_t id_len)
+{
+	for (size_t i = 0; i < v->n_cred; i++)
+		if (v->cred[i].id.len == id_len &&
+		    memcmp(v->cred[i].id.ptr, id, id_len) == 0)
+			return (&v->cred[i]);
+
+	return (NULL);
+}
+
+struct vdev_cred *
+vdev_cred_by_serial(struct vdev *v, uint64_t serial)
+{
+	for (size_t i = 0; i < v->n_cred; i++)
+		if (v->cred[i].serial == serial)
+			return (&v->cred[i]);
+
+	return (NULL);
+}
+
+size_t
+vdev_cred_rk_count(const struct vdev *v)
+{
+	size_t n = 0;
+
+	for (size_t i = 0; i < v->n_cred; i++)
+		if (v->cred[i].rk)
+			n++;
+
+	return (n);
+}
+
+void
+vdev_cred_del(struct vdev *v, struct vdev_cred *c)
+{
+	size_t i = (size_t)(c - v->cred);
+
+	vdev_cred_reset(c);
+	memmove(&v->cred[i], &v->cred[i + 1],
+	    (v->n_cred - i - 1) * sizeof(*c));
+	memset(&v->cred[--v->n_cred], 0, sizeof(*c));
+}
+
+cbor_item_t *
+vdev_cred_descriptor(const struct vdev_cred *c)
+{
+	cbor_item_t *item;
+
+	if ((item = cbor_new_definite_map(2)) == NULL)
+		return (NULL);
+
+	if (vdev_cbor_add_str(item, "id", cbor_build_bytestring(c->id.ptr,
+	    c->id.len)) < 0 ||
+	    vdev_cbor_add_str(item, "type",
+	    cbor_build_string("public-key")) < 0)
+		cbor_decref(&item);
+
+	return (item);
+}
+
+/*
+ * Encode a credential's user entity. User-identifiable information is
+ * only included if the user was verified.
+ */
+cbor_item_t *
+vdev_cred_user(const struct vdev_cred *c, bool full)
+{
+	cbor_item_t *item;
+
+	if ((item = cbor_new_definite_map(4)) == NULL)
+		return (NULL);
+
+	if (vdev_cbor_add_str(item, "id", cbor_build_bytestring(c->user_id.ptr,
+	    c->user_id.len)) < 0)
+		goto fail;
+
+	if (full == false)
+		return (item);
+
+	if ((c->user_icon && vdev_cbor_add_str(item, "icon",
+	    cbor_build_string(c->user_icon)) < 0) ||
+	    (c->user_name && vdev_cbor_add_str(item, "name",
+	    cbor_build_string(c->user_name)) < 0) ||
+	    (c->user_display_name && vdev_cbor_add_str(item, "displayName",
+	    cbor_build_string(c->user_display_name)) < 0))
+		goto fail;
+
+	return (item);
+fail:
+	cbor_decref(&item);
+
+	return (NULL);
+}
+
+void
+vdev_iter_reset(struct vdev_iter *it)
+{
+	free(it->serial);
+	memset(it, 0, sizeof(*it));
+}
+
+/*
+ * Resolve a credential id for a relying party. Wrapped credentials are
+ * unwrapped into tmp, which the caller must reset.
+ */
+static struct vdev_cred *
+cred_lookup(struct vdev *v, const unsigned char *id, size_t id_len,
+    const unsigned char *rp_id_hash, struct vdev_cred *tmp)
+{
+	struct vdev_cred *c;
+
+	if (vdev_unwrap(v, id, id_len, rp_id_hash, tmp) == 0)
+		return (tmp);
+
+	if ((c = vdev_cred_by_id(v, id, id_len)) != NULL &&
+	    memcmp(c->rp_id_hash, rp_id_hash, sizeof(c->rp_id_hash)) == 0)
+		return (c);
+
+	return (NULL);
+}
+
+static int
+cred_id(const cbor_item_t *item, const unsigned char **id, size_t *id_len)
+{
+	return (vdev_cbor_bytes(vdev_cbor_get_str(item, "id"), id, id_len));
+}
+
+static void
+put_be16(unsigned char *p, uint16_t v)
+{
+	p[0] = (v >> 8) & 0xff;
+	p[1] = v & 0xff;
+}
+
+static void
+put_be32(unsigned char *p, uint32_t v)
+{
+	p[0] = (v >> 24) & 0xff;
+	p[1] = (v >> 16) & 0xff;
+	p[2] = (v >> 8) & 0xff;
+	p[3] = v & 0xff;
+}
+
+static int
+cmd_get_info(const struct vdev *v, cbor_item_t **resp)
+{
+	cbor_item_t	*versions = NULL;
+	cbor_item_t	*options = NULL;
+	cbor_item_t	*protocols = NULL;
+	int		 r = FIDO_ERR_ERR_OTHER;
+
+	if ((*resp = cbor_new_definite_map(7)) == NULL ||
+	    (versions = cbor_new_definite_array(2)) == NULL ||
+	    (options = cbor_new_definite_map(5)) == NULL ||
+	    (protocols = cbor_new_definite_array(1)) == NULL)
+		goto fail;
+
+	if (cbor_array_push(versions, cbor_move(cbor_build_string(
+	    "FIDO_2_0"))) == false ||
+	    cbor_array_push(versions, cbor_move(cbor_build_string(
+	    "FIDO_2_1_PRE"))) == false ||
+	    cbor_array_push(protocols, cbor_move(vdev_cbor_int(1))) == false)
+		goto fail;
+
+	if (vdev_cbor_add_str(options, "rk", cbor_build_bool(true)) < 0 ||
+	    vdev_cbor_add_str(options, "up", cbor_build_bool(true)) < 0 ||
+	    vdev_cbor_add_str(options, "plat", cbor_build_bool(false)) < 0 ||
+	    vdev_cbor_add_str(options, "clientPin",
+	    cbor_build_bool(v->pin_set)) < 0 ||
+	    vdev_cbor_add_str(options, "credentialMgmtPreview",
+	    cbor_build_bool(true)) < 0)
+		goto fail;
+
+	if (vdev_cbor_add(*resp, vdev_cbor_int(1), versions) < 0 ||
+	    vdev_cbor_add(*resp, vdev_cbor_int(3),
+	    cbor_build_bytestring(v->aaguid, sizeof(v->aaguid))) < 0 ||
+	    vdev_cbor_add(*resp, vdev_cbor_int(4), options) < 0 ||
+	    vdev_cbor_add(*resp, vdev_cbor_int(5),
+	    vdev_cbor_int(VDEV_MAX_MSG)) < 0 ||
+	    vdev_cbor_add(*resp, vdev_cbor_int(6), protocols) < 0 ||
+	    vdev_cbor_add(*resp, vdev_cbor_int(7),
+	    vdev_cbor_int(VDEV_MAX_ALLOW)) < 0 ||
+	    vdev_cbor_add(*resp, vdev_cbor_int(8),
+	    vdev_cbor_int(VDEV_MAX_ID)) < 0) {
+		/* references consumed */
+		versions = options = protocols = NULL;
+		goto fail;
+	}
+
+	return (FIDO_OK);
+fail:
+	if (versions != NULL)
+		cbor_decref(&versions);
+	if (options != NULL)
+		cbor_decref(&options);
+	if (protocols != NULL)
+		cbor_decref(&protocols);
+
+	return (r);
+}
+
+static int
+select_alg(const cbor_item_t *params, int *type)
+{
+	cbor_item_t	**v;
+	char		 *t = NULL;
+	int64_t		  alg;
+
+	if (cbor_isa_array(params) == false ||
+	    cbor_array_is_definite(params) == false ||
+	    (v = cbor_array_handle(params)) == NULL)
+		return (FIDO_ERR_CBOR_UNEXPECTED_TYPE);
+
+	for (size_t i = 0; i < cbor_array_size(params); i++) {
+		if (vdev_cbor_copy_str(vdev_cbor_get_str(v[i], "type"),
+		    &t) < 0 ||
+		    vdev_cbor_sint(vdev_cbor_get_str(v[i], "alg"), &alg) < 0) {
+			free(t);
+			return (FIDO_ERR_MISSING_PARAMETER);
+		}
+		if (strcmp(t, "public-key") == 0 && alg >= INT16_MIN &&
+		    alg < 0 && vdev_key_supported((int)alg)) {
+			free(t);
+			*type = (int)alg;
+			return (FIDO_OK);
+		}
+		free(t);
+		t = NULL;
+	}
+
+	return (FIDO_ERR_UNSUPPORTED_ALGORITHM);
+}
+
+/*
+ * Parse the options map of a makeCredential or getAssertion request.
+ */
+static int
+parse_options(const cbor_item_t *opt, bool *rk, bool *up, bool *uv)
+{
+	const cbor_item_t *item;
+
+	if (opt == NULL)
+		return (FIDO_OK);
+	if (cbor_isa_map(opt) == false)
+		return (FIDO_ERR_CBOR_UNEXPECTED_TYPE);
+
+	if ((item = vdev_cbor_get_str(opt, "rk")) != NULL) {
+		if (rk == NULL)
+			return (FIDO_ERR_INVALID_OPTION);
+		if (vdev_cbor_bool(item, rk) < 0)
+			return (FIDO_ERR_CBOR_UNEXPECTED_TYPE);
+	}
+	if ((item = vdev_cbor_get_str(opt, "up")) != NULL) {
+		if (up == NULL)
+			return (FIDO_ERR_INVALID_OPTION);
+		if (vdev_cbor_bool(item, up) < 0)
+			return (FIDO_ERR_CBOR_UNEXPECTED_TYPE);
+	}
+	if ((item = vdev_cbor_get_str(opt, "uv")) != NULL) {
+		if (vdev_cbor_bool(item, uv) < 0)
+			return (FIDO_ERR_CBOR_UNEXPECTED_TYPE);
+		/* no built-in user verification */
+		if (*uv)
+			return (FIDO_ERR_UNSUPPORTED_OPTION);
+	}
+
+	return (FIDO_OK);
+}
+
+static int
+parse_rp(const cbor_item_t *rp, struct vdev_cred *c)
+{
+	const cbor_item_t *name;
+
+	if (cbor_isa_map(rp) == false)
+		return (FIDO_ERR_CBOR_UNEXPECTED_TYPE);
+	if (vdev_cbor_copy_str(vdev_cbor_get_str(rp, "id"), &c->rp_id) < 0)
+		return (FIDO_ERR_MISSING_PARAMETER);
+	if ((name = vdev_cbor_get_str(rp, "name")) != NULL &&
+	    vdev_cbor_copy_str(name, &c->rp_name) < 0)
+		return (FIDO_ERR_CBOR_UNEXPECTED_TYPE);
+	if (SHA256((const unsigned char *)c->rp_id, strlen(c->rp_id),
+	    c->rp_id_hash) != c->rp_id_hash)
+		return (FIDO_ERR_ERR_OTHER);
+
+	return (FIDO_OK);
+}
+
+static int
+parse_user(const cbor_item_t *user, struct vdev_cred *c)
+{
+	const cbor_item_t *item;
+
+	if (cbor_isa_map(user) == false)
+		return (FIDO_ERR_CBOR_UNEXPECTED_TYPE);
+	if (vdev_cbor_copy_bytes(vdev_cbor_get_str(user, "id"),
+	    &c->user_id) < 0)
+		return (FIDO_ERR_MISSING_PARAMETER);
+	if (c->user_id.len > 64)
+		return (FIDO_ERR_INVALID_LENGTH);
+	if (((item = vdev_cbor_get_str(user, "name")) != NULL &&
+	    vdev_cbor_copy_str(item, &c->user_name) < 0) ||
+	    ((item = vdev_cbor_get_str(user, "displayName")) != NULL &&
+	    vdev_cbor_copy_str(item, &c->user_display_name) < 0) ||
+	    ((item = vdev_cbor_get_str(user, "icon")) != NULL &&
+	    vdev_cbor_copy_str(item, &c->user_icon) < 0))
+		return (FIDO_ERR_CBOR_UNEXPECTED_TYPE);
+
+	return (FIDO_OK);
+}
+
+static int
+check_exclude_list(struct vdev *v, const cbor_item_t *excl,
+    const unsigned char *rp_id_hash)
+{
+	struct vdev_cred	  tmp;
+	cbor_item_t		**ids;
+	const unsigned char	 *id;
+	size_t			  id_len;
+
+	if (excl == NULL)
+		return (FIDO_OK);
+	if (cbor_isa_array(excl) == false ||
+	    cbor_array_is_definite(excl) == false ||
+	    (ids = cbor_array_handle(excl)) == NULL)
+		return (FIDO_ERR_CBOR_UNEXPECTED_TYPE);
+
+	for (size_t i = 0; i < cbor_array_size(excl); i++) {
+		if (cred_id(ids[i], &id, &id_len) < 0)
+			return (FIDO_ERR_MISSING_PARAMETER);
+		memset(&tmp, 0, sizeof(tmp));
+		if (cred_lookup(v, id, id_len, rp_id_hash, &tmp) != NULL) {
+			vdev_cred_reset(&tmp);
+			return (FIDO_ERR_CREDENTIAL_EXCLUDED);
+		}
+	}
+
+	return (FIDO_OK);
+}
+
+static cbor_item_t *
+encode_attstmt(const struct vdev *v, const struct vdev_blob *sig)
+{
+	cbor_item_t *item = NULL;
+	cbor_item_t *x5c = NULL;
+
+	if ((item = cbor_new_definite_map(3)) == NULL ||
+	    (x5c = cbor_new_definite_array(1)) == NULL ||
+	    cbor_array_push(x5c, cbor_move(cbor_build_bytestring(
+	    v->att_cert.ptr, v->att_cert.len))) == false)
+		goto fail;
+
+	if (vdev_cbor_add_str(item, "alg", vdev_cbor_int(COSE_ES256)) < 0 ||
+	    vdev_cbor_add_str(item, "sig", cbor_build_bytestring(sig->ptr,
+	    sig->len)) < 0)
+		goto fail;
+
+	if (vdev_cbor_add_str(item, "x5c", x5c) < 0) {
+		x5c = NULL; /* consumed */
+		goto fail;
+	}
+
+	return (item);
+fail:
+	if (item != NULL)
+		cbor_decref(&item);
+	if (x5c != NULL)
+		cbor_decref(&x5c);
+
+	return (NULL);
+}
+
+/*
+ * Build the authenticator data of a new credential:
+ * rp_id_hash || flags || sigcount || aaguid || id_len || id || pubkey.
+ */
+static int
+encode_cred_authdata(struct vdev *v, const struct vdev_cred *c, uint8_t flags,
+    const cbor_item_t *pk, struct vdev_blob *authdata)
+{
+	unsigned char	*cose = NULL;
+	size_t		 cose_len;
+	size_t		 alloc_len;
+	unsigned char	*p;
+	int		 ok = -1;
+
+	memset(authdata, 0, sizeof(*authdata));
+
+	if ((cose_len = cbor_serialize_alloc(pk, &cose, &alloc_len)) == 0 ||
+	    c->id.len > UINT16_MAX)
+		goto fail;
+
+	authdata->len = 37 + 16 + 2 + c->id.len + cose_len;
+	if ((authdata->ptr = calloc(1, authdata->len)) == NULL)
+		goto fail;
+
+	p = authdata->ptr;
+	memcpy(p, c->rp_id_hash, 32);
+	p[32] = flags;
+	put_be32(p + 33, ++v->sigcount);
+	memcpy(p + 37, v->aaguid, 16);
+	put_be16(p + 53, (uint16_t)c->id.len);
+	memcpy(p + 55, c->id.ptr, c->id.len);
+	memcpy(p + 55 + c->id.len, cose, cose_len);
+
+	ok = 0;
+fail:
+	free(cose);
+
+	return (ok);
+}
+
+/*
+ * Give a new credential an id: credentials that are neither resident
+ * nor RS256 are wrapped, others get a random handle into the store.
+ */
+static int
+assign_cred_id(struct vdev *v, struct vdev_cred *c)
+{
+	if (c->rk == false && c->type != COSE_RS256)
+		return (vdev_wrap(v, c, &c->id));
+
+	do {
+		free(c->id.ptr);
+		if ((c->id.ptr = calloc(1, STORED_ID_LEN)) == NULL ||
+		    RAND_bytes(c->id.ptr, STORED_ID_LEN) != 1)
+			return (-1);
+		c->id.len = STORED_ID_LEN;
+		c->id.ptr[0] = 0x02; /* never a valid wrapped id */
+	} while (vdev_cred_by_id(v, c->id.ptr, c->id.len) != NULL);
+
+	return (0);
+}
+
+/* replace any resident credential for the same rp and user */
+static void
+drop_rk(struct vdev *v, const struct vdev_cred *c)
+{
+	for (size_t i = 0; i < v->n_cred; i++) {
+		struct vdev_cred *o = &v->cred[i];
+		if (o->rk && memcmp(o->rp_id_hash, c->rp_id_hash,
+		    sizeof(c->rp_id_hash)) == 0 &&
+		    o->user_id.len == c->user_id.len &&
+		    memcmp(o->user_id.ptr, c->user_id.ptr,
+		    c->user_id.len) == 0) {
+			vdev_cred_del(v, o);
+			return;
+		}
+	}
+}
+
+static int
+cmd_make_cred(struct vdev *v, const cbor_item_t *req, cbor_item_t **resp)
+{
+	struct vdev_cred	 c;
+	struct vdev_blob	 authdata;
+	struct vdev_blob	 sig;
+	const cbor_item_t	*auth;
+	const unsigned char	*cdh;
+	size_t			 cdh_len;
+	EVP_PKEY		*pkey = NULL;
+	cbor_item_t		*pk = NULL;
+	uint8_t			 flags;
+	bool			 rk = false;
+	bool			 uv = false;
+	int			 r;
+
+	memset(&c, 0, sizeof(c));
+	memset(&authdata, 0, sizeof(authdata));
+	memset(&sig, 0, sizeof(sig));
+
+	if (vdev_cbor_get(req, 1) == NULL || vdev_cbor_get(req, 2) == NULL ||
+	    vdev_cbor_get(req, 3) == NULL || vdev_cbor_get(req, 4) == NULL) {
+		r = FIDO_ERR_MISSING_PARAMETER;
+		goto fail;
+	}
+
+	if (vdev_cbor_bytes(vdev_cbor_get(req, 1), &cdh, &cdh_len) < 0 ||
+	    cdh_len != 32) {
+		r = FIDO_ERR_CBOR_UNEXPECTED_TYPE;
+		goto fail;
+	}
+
+	if ((r = parse_rp(vdev_cbor_get(req, 2), &c)) != FIDO_OK ||
+	    (r = parse_user(vdev_cbor_get(req, 3), &c)) != FIDO_OK ||
+	    (r = select_alg(vdev_cbor_get(req, 4), &c.type)) != FIDO_OK ||
+	    (r = parse_options(vdev_cbor_get(req, 7), &rk, NULL,
+	    &uv)) != FIDO_OK)
+		goto fail;
+
+	flags = CTAP_AUTHDATA_USER_PRESENT | CTAP_AUTHDATA_ATT_CRED;
+
+	if ((auth = vdev_cbor_get(req, 8)) != NULL) {
+		if ((r = vdev_pin_auth(v, auth, vdev_cbor_get(req, 9), cdh,
+		    cdh_len, NULL, 0)) != FIDO_OK)
+			goto fail;
+		flags |= CTAP_AUTHDATA_USER_VERIFIED;
+	} else if (v->pin_set) {
+		r = FIDO_ERR_PIN_REQUIRED;
+		goto fail;
+	}
+
+	if ((r = check_exclude_list(v, vdev_cbor_get(req, 5),
+	    c.rp_id_hash)) != FIDO_OK)
+		goto fail;
+
+	c.rk = rk;
+	if (rk) {
+		drop_rk(v, &c);
+		if (vdev_cred_rk_count(v) >= VDEV_MAX_RK) {
+			r = FIDO_ERR_KEY_STORE_FULL;
+			goto fail;
+		}
+	}
+
+	if ((rk || c.type == COSE_RS256) && v->n_cred >= VDEV_MAX_CRED) {
+		r = FIDO_ERR_KEY_STORE_FULL;
+		goto fail;
+	}
+
+	r = FIDO_ERR_ERR_OTHER;
+
+	if (vdev_key_create(c.type, &c.key) < 0 ||
+	    (pkey = vdev_key_load(c.type, &c.key)) == NULL ||
+	    (pk = vdev_key_cose(c.type, pkey)) == NULL ||
+	    assign_cred_id(v, &c) < 0 ||
+	    encode_cred_authdata(v, &c, flags, pk, &authdata) < 0 ||
+	    vdev_key_sign(COSE_ES256, v->att_pkey, authdata.ptr, authdata.len,
+	    cdh, cdh_len, &sig) < 0)
+		goto fail;
+
+	if ((*resp = cbor_new_definite_map(3)) == NULL ||
+	    vdev_cbor_add(*resp, vdev_cbor_int(1),
+	    cbor_build_string("packed")) < 0 ||
+	    vdev_cbor_add(*resp, vdev_cbor_int(2),
+	    cbor_build_bytestring(authdata.ptr, authdata.len)) < 0 ||
+	    vdev_cbor_add(*resp, vdev_cbor_int(3),
+	    encode_attstmt(v, &sig)) < 0)
+		goto fail;
+
+	if ((rk || c.type == COSE_RS256) && vdev_cred_add(v, &c) < 0)
+		goto fail;
+
+	r = FIDO_OK;
+fail:
+	if (pkey != NULL)
+		EVP_PKEY_free(pkey);
+	if (pk != NULL)
+		cbor_decref(&pk);
+
+	vdev_cred_reset(&c);
+	free(authdata.ptr);
+	free(sig.ptr);
+
+	return (r);
+}
+
+/*
+ * Sign an assertion and encode the reply.
+ */
+static int
+encode_assert(struct vdev *v, const struct vdev_cred *c,
+    const unsigned char *cdh, uint8_t flags, size_t count, cbor_item_t **resp)
+{
+	unsigned char		 authdata[37];
+	struct vdev_blob	 sig;
+	EVP_PKEY		*pkey = NULL;
+	int			 ok = -1;
+
+	memset(&sig, 0, sizeof(sig));
+
+	memcpy(authdata, c->rp_id_hash, 32);
+	authdata[32] = flags;
+	put_be32(authdata + 33, ++v->sigcount);
+
+	if ((pkey = vdev_key_load(c->type, &c->key)) == NULL ||
+	    vdev_key_sign(c->type, pkey, authdata, sizeof(authdata), cdh, 32,
+	    &sig) < 0)
+		goto fail;
+
+	if ((*resp = cbor_new_definite_map(5)) == NULL ||
+	    vdev_cbor_add(*resp, vdev_cbor_int(1),
+	    vdev_cred_descriptor(c)) < 0 ||
+	    vdev_cbor_add(*resp, vdev_cbor_int(2),
+	    cbor_build_bytestring(authdata, sizeof(authdata))) < 0 ||
+	    vdev_cbor_add(*resp, vdev_cbor_int(3),
+	    cbor_build_bytestring(sig.ptr, sig.len)) < 0)
+		goto fail;
+
+	if (c->rk && vdev_cbor_add(*resp, vdev_cbor_int(4), vdev_cred_user(c,
+	    (flags & CTAP_AUTHDATA_USER_VERIFIED) != 0)) < 0)
+		goto fail;
+
+	if (count > 1 && vdev_cbor_add(*resp, vdev_cbor_int(5),
+	    vdev_cbor_int((int64_t)count)) < 0)
+		goto fail;
+
+	ok = 0;
+fail:
+	if (pkey != NULL)
+		EVP_PKEY_free(pkey);
+
+	free(sig.ptr);
+
+	return (ok);
+}
+
+/* resident credentials for an rp, most recent first */
+static int
+collect_rk(struct vdev *v, const unsigned char *rp_id_hash,
+    struct vdev_iter *it)
+{
+	it->n = 0;
+
+	if ((it->serial = calloc(v->n_cred + 1, sizeof(*it->serial))) == NULL)
+		return (-1);
+
+	for (size_t i = v->n_cred; i > 0; i--) {
+		const struct vdev_cred *c = &v->cred[i - 1];
+		if (c->rk && memcmp(c->rp_id_hash, rp_id_hash,
+		    sizeof(c->rp_id_hash)) == 0)
+			it->serial[it->n++] = c->serial;
+	}
+
+	return (0);
+}
+
+static int
+cmd_get_assert(struct vdev *v, struct vdev_port *p, const cbor_item_t *req,
+    cbor_item_t **resp)
+{
+	struct vdev_cred	  tmp;
+	struct vdev_cred	 *c = NULL;
+	struct vdev_iter	 *it = &p->iter;
+	const cbor_item_t	 *allow;
+	const cbor_item_t	 *auth;
+	const unsigned char	 *cdh;
+	const unsigned char	 *id;
+	size_t			  cdh_len;
+	size_t			  id_len;
+	unsigned char		  rp_id_hash[32];
+	char			 *rp_id = NULL;
+	cbor_item_t		**ids;
+	uint8_t			  flags = 0;
+	bool			  up = true;
+	bool			  uv = false;
+	int			  r;
+
+	memset(&tmp, 0, sizeof(tmp));
+
+	if (vdev_cbor_get(req, 1) == NULL || vdev_cbor_get(req, 2) == NULL) {
+		r = FIDO_ERR_MISSING_PARAMETER;
+		goto fail;
+	}
+
+	if (vdev_cbor_copy_str(vdev_cbor_get(req, 1), &rp_id) < 0 ||
+	    vdev_cbor_bytes(vdev_cbor_get(req, 2), &cdh, &cdh_len) < 0 ||
+	    cdh_len != 32) {
+		r = FIDO_ERR_CBOR_UNEXPECTED_TYPE;
+		goto fail;
+	}
+
+	if ((r = parse_options(vdev_cbor_get(req, 5), NULL, &up,
+	    &uv)) != FIDO_OK)
+		goto fail;
+
+	if (up)
+		flags |= CTAP_AUTHDATA_USER_PRESENT;
+
+	if ((auth = vdev_cbor_get(req, 6)) != NULL) {
+		if ((r = vdev_pin_auth(v, auth, vdev_cbor_get(req, 7), cdh,
+		    cdh_len, NULL, 0)) != FIDO_OK)
+			goto fail;
+		flags |= CTAP_AUTHDATA_USER_VERIFIED;
+	}
+
+	if (SHA256((const unsigned char *)rp_id, strlen(rp_id),
+	    rp_id_hash) != rp_id_hash) {
+		r = FIDO_ERR_ERR_OTHER;
+		goto fail;
+	}
+
+	if ((allow = vdev_cbor_get(req, 3)) != NULL) {
+		if (cbor_isa_array(allow) == false ||
+		    cbor_array_is_definite(allow) == false ||
+		    (ids = cbor_array_handle(allow)) == NULL) {
+			r = FIDO_ERR_CBOR_UNEXPECTED_TYPE;
+			goto fail;
+		}
+		for (size_t i = 0; c == NULL && i < cbor_array_size(allow);
+		    i++) {
+			if (cred_id(ids[i], &id, &id_len) < 0) {
+				r = FIDO_ERR_MISSING_PARAMETER;
+				goto fail;
+			}
+			c = cred_lookup(v, id, id_len, rp_id_hash, &tmp);
+		}
+		if (c == NULL) {
+			r = FIDO_ERR_NO_CREDENTIALS;
+			goto fail;
+		}
+	} else {
+		if (collect_rk(v, rp_id_hash, it) < 0) {
+			r = FIDO_ERR_ERR_OTHER;
+			goto fail;
+		}
+		if (it->n == 0) {
+			r = FIDO_ERR_NO_CREDENTIALS;
+			goto fail;
+		}
+		c = vdev_cred_by_serial(v, it->serial[0]);
+	}
+
+	if (encode_assert(v, c, cdh, flags, it->n, resp) < 0) {
+		r = FIDO_ERR_ERR_OTHER;
+		goto fail;
+	}
+
+	if (it->n > 1) {
+		it->cmd = CTAP_CBOR_ASSERT;
+		it->pos = 1;
+		it->flags = flags;
+		memcpy(it->cdh, cdh, sizeof(it->cdh));
+	}
+
+	r = FIDO_OK;
+fail:
+	if (r != FIDO_OK || it->cmd == 0)
+		vdev_iter_reset(it);
+
+	vdev_cred_reset(&tmp);
+	free(rp_id);
+
+	return (r);
+}
+
+static int
+cmd_get_next_assert(struct vdev *v, struct vdev_port *p, cbor_item_t **resp)
+{
+	struct vdev_iter	*it = &p->iter;
+	struct vdev_cred	*c;
+
+	if (it->cmd != CTAP_CBOR_ASSERT || it->pos >= it->n) {
+		vdev_iter_reset(it);
+		return (FIDO_ERR_NOT_ALLOWED);
+	}
+
+	if ((c = vdev_cred_by_serial(v, it->serial[it->pos++])) == NULL ||
+	    encode_assert(v, c, it->cdh, it->flags, 0, resp) < 0) {
+		vdev_iter_reset(it);
+		return (c == NULL ? FIDO_ERR_NOT_ALLOWED : FIDO_ERR_ERR_OTHER);
+	}
+
+	return (FIDO_OK);
+}
+
+/*
+ * Process a CTAPHID_CBOR message. The reply is a status byte optionally
+ * followed by a CBOR map.
+ */
+int
+vdev_cbor(struct vdev_port *p, const unsigned char *req, size_t req_len,
+    unsigned char *reply, size_t *reply_len)
+{
+	struct vdev		*v = p->vdev;
+	struct cbor_load_result	 cbor;
+	cbor_item_t		*item = NULL;
+	cbor_item_t		*resp = NULL;
+	unsigned char		*buf = NULL;
+	size_t			 buf_len = 0;
+	size_t			 alloc_len;
+	int			 r;
+
+	if (req_len < 1) {
+		r = FIDO_ERR_INVALID_LENGTH;
+		goto out;
+	}
+
+	if (req_len > VDEV_MAX_MSG) {
+		r = FIDO_ERR_REQUEST_TOO_LARGE;
+		goto out;
+	}
+
+	if (req_len > 1 && ((item = cbor_load(req + 1, req_len - 1,
+	    &cbor)) == NULL || cbor.read != req_len - 1 ||
+	    cbor_isa_map(item) == false ||
+	    cbor_map_is_definite(item) == false)) {
+		r = FIDO_ERR_INVALID_CBOR;
+		goto out;
+	}
+
+	if (req[0] != CTAP_CBOR_NEXT_ASSERT &&
+	    req[0] != CTAP_CBOR_CRED_MGMT_PRE)
+		vdev_iter_reset(&p->iter);
+
+	switch (req[0]) {
+	case CTAP_CBOR_GETINFO:
+		r = cmd_get_info(v, &resp);
+		break;
+	case CTAP_CBOR_MAKECRED:
+		r = item ? cmd_make_cred(v, item, &resp) :
+		    FIDO_ERR_MISSING_PARAMETER;
+		break;
+	case CTAP_CBOR_ASSERT:
+		r = item ? cmd_get_assert(v, p, item, &resp) :
+		    FIDO_ERR_MISSING_PARAMETER;
+		break;
+	case CTAP_CBOR_NEXT_ASSERT:
+		r = cmd_get_next_assert(v, p, &resp);
+		break;
+	case CTAP_CBOR_CLIENT_PIN:
+		r = item ? vdev_cmd_client_pin(v, item, &resp) :
+		    FIDO_ERR_MISSING_PARAMETER;
+		break;
+	case CTAP_CBOR_RESET:
+		vdev_state_reset(v);
+		r = FIDO_OK;
+		break;
+	case CTAP_CBOR_CRED_MGMT_PRE:
+		r = item ? vdev_cmd_cred_mgmt(v, p, item, &resp) :
+		    FIDO_ERR_MISSING_PARAMETER;
+		break;
+	default:
+		r = FIDO_ERR_INVALID_COMMAND;
+		break;
+	}
+
+	if (r == FIDO_OK && resp != NULL) {
+		buf_len = cbor_serialize_alloc(resp, &buf, &alloc_len);
+		if (buf_len == 0 || buf_len > VDEV_MAX_PAYLOAD - 1) {
+			r = FIDO_ERR_ERR_OTHER;
+			buf_len = 0;
+		}
+	}
+out:
+	reply[0] = (uint8_t)r;
+	*reply_len = 1;
+
+	if (r == FIDO_OK && buf_len > 0) {
+		memcpy(reply + 1, buf, buf_len);
+		*reply_len += buf_len;
+	}
+
+	if (item != NULL)
+		cbor_decref(&item);
+	if (resp != NULL)
+		cbor_decref(&resp);
+
+	free(buf);
+
+	return (r);
+}
@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2020 Yubico AB. All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+#ifndef _VDEV_EXTERN_H
+#define _VDEV_EXTERN_H
+
+#include <openssl/evp.h>
+
+#include <cbor.h>
+#include <pthread.h>
+
+#include "vdev.h"
+#include "../openbsd-compat/openbsd-compat.h"
+
+#define VDEV_RPT_SIZE		64	/* default hid report size */
+#define VDEV_MAX_RPT_SIZE	1024	/* largest hid report size */
+#define VDEV_MAX_FRAMES		129	/* frames in a ctaphid message */
+#define VDEV_MAX_PAYLOAD	7609	/* bytes in a ctaphid message */
+#define VDEV_MAX_MSG		1200	/* advertised maxMsgSize */
+#define VDEV_MAX_ALLOW		8	/* advertised maxCredentialCount */
+#define VDEV_MAX_ID		128	/* advertised maxCredentialIdLength */
+#define VDEV_MAX_RK		256	/* resident credentials */
+#define VDEV_MAX_CRED		4096	/* stored credentials */
+#define VDEV_PIN_RETRIES	8
+#define VDEV_CMD_ERROR		0x3f
+
+struct vdev_blob {
+	unsigned char	*ptr;
+	size_t		 len;
+};
+
+/*
+ * A credential stored by the authenticator. Resident credentials and
+ * RS256 credentials are always stored; other credentials are wrapped
+ * into their credential id instead.
+ */
+struct vdev_cred {
+	struct vdev_blob  id;             /* credential id */
+	int               type;           /* cose algorithm */
+	struct vdev_blob  key;            /* private key */
+	unsigned char     rp_id_hash[32]; /* sha256 of rp_id */
+	char             *rp_id;
+	char             *rp_name;
+	struct vdev_blob  user_id;
+	char             *user_name;
+	char             *user_display_name;
+	char             *user_icon;
+	bool              rk;             /* resident */
+	uint64_t          serial;         /* creation order */
+};
+
+/* state of a getNextAssertion or credential management enumeration */
+struct vdev_iter {
+	uint8_t		 cmd;         /* command being iterated */
+	uint64_t	*serial;      /* credentials to be returned */
+	size_t		 n;           /* number of credentials */
+	size_t		 pos;         /* next credential */
+	unsigned char	 cdh[32];     /* client data hash */
+	uint8_t		 flags;       /* authenticator data flags */
+};
+
+/* an open handle on a virtual authenticator */
+struct vdev_port {
+	struct vdev	*vdev;
+	uint32_t	 cid;                   /* channel being received */
+	uint8_t		 cmd;                   /* command being received */
+	size_t		 len;                   /* expected payload length */
+	size_t		 got;                   /* received payload length */
+	uint8_t		 seq;                   /* next sequence number */
+	unsigned char	 msg[VDEV_MAX_PAYLOAD]; /* payload being received */
+	size_t		 rpt_len;               /* hid report size */
+	unsigned char	 rx[VDEV_MAX_FRAMES][VDEV_MAX_RPT_SIZE];
+	size_t		 rx_head;               /* next frame to be read */
+	size_t		 rx_len;                /* frames to be read */
+	bool		 unframed;              /* message-level transport */
+	bool		 reply_ready;           /* unframed reply pending */
+	uint8_t		 reply_cmd;
+	size_t		 reply_len;
+	unsigned char	 reply[VDEV_MAX_PAYLOAD];
+	struct vdev_iter iter;
+};
+
+struct vdev {
+	pthread_mutex_t	  lock;
+	char		  path[32];
+	struct vdev	 *next;          /* registered authenticators */
+	size_t		  rpt_len;       /* hid report size */
+	uint32_t	  next_cid;      /* next channel to be allocated */
+	unsigned char	  aaguid[16];
+	uint32_t	  sigcount;      /* signature counter */
+	unsigned char	  wrap_key[32];  /* protects wrapped credentials */
+	struct vdev_blob  att_key;       /* attestation key (der) */
+	struct vdev_blob  att_cert;      /* attestation certificate (der) */
+	EVP_PKEY	 *att_pkey;
+	bool		  pin_set;
+	unsigned char	  pin_hash[16];  /* left(sha256(pin), 16) */
+	int		  pin_retries;
+	EVP_PKEY	 *ka_pkey;       /* pin key agreement key */
+	unsigned char	  pin_token[32];
+	struct vdev_cred *cred;          /* stored credentials */
+	size_t		  n_alloc;
+	size_t		  n_cred;
+	uint64_t	  serial;        /* last credential serial */
+};
+
+/* cbor */
+cbor_item_t *vdev_cbor_int(int64_t);
+const cbor_item_t *vdev_cbor_get(const cbor_item_t *, int64_t);
+const cbor_item_t *vdev_cbor_get_str(const cbor_item_t *, const char *);
+int vdev_cbor_add(cbor_item_t *, cbor_item_t *, cbor_item_t *);
+int vdev_cbor_add_str(cbor_item_t *, const char *, cbor_item_t *);
+int vdev_cbor_bool(const cbor_item_t *, bool *);
+int vdev_cbor_bytes(const cbor_item_t *, const unsigned char **, size_t *);
+int vdev_cbor_copy_bytes(const cbor_item_t *, struct vdev_blob *);
+int vdev_cbor_copy_str(const cbor_item_t *, char **);
+int vdev_cbor_sint(const cbor_item_t *, int64_t *);
+int vdev_cbor_uint(const cbor_item_t *, uint64_t *);
+
+/* keys */
+EVP_PKEY *vdev_key_load(int, const struct vdev_blob *);
+cbor_item_t *vdev_key_cose(int, EVP_PKEY *);
+int vdev_key_create(int, struct vdev_blob *);
+bool vdev_key_supported(int);
+int vdev_key_sign(int, EVP_PKEY *, const unsigned char *, size_t,
+    const unsigned char *, size_t, struct vdev_blob *);
+int vdev_att_create(struct vdev *);
+int vdev_ka_create(struct vdev *);
+int vdev_ka_derive(const struct vdev *, const cbor_item_t *, unsigned char *);
+int vdev_aes256_cbc(bool, const unsigned char *, const unsigned char *,
+    size_t, unsigned char *);
+int vdev_hmac(const unsigned char *, size_t, const unsigned char *, size_t,
+    const unsigned char *, size_t, unsigned char *);
+int vdev_wrap(const struct vdev *, const struct vdev_cred *,
+    struct vdev_blob *);
+int vdev_unwrap(const struct vdev *, const unsigned char *, size_t,
+    const unsigned char *, struct vdev_cred *);
+
+/* credentials */
+int vdev_cred_add(struct vdev *, struct vdev_cred *);
+struct vdev_cred *vdev_cred_by_id(struct vdev *, const unsigned char *, size_t);
+struct vdev_cred *vdev_cred_by_serial(struct vdev *, uint64_t);
+size_t vdev_cred_rk_count(const struct vdev *);
+void vdev_cred_del(struct vdev *, struct vdev_cred *);
+void vdev_cred_reset(struct vdev_cred *);
+cbor_item_t *vdev_cred_descriptor(const struct vdev_cred *);
+cbor_item_t *vdev_cred_user(const struct vdev_cred *, bool);
+
+/* commands */
+int vdev_cbor(struct vdev_port *, const unsigned char *, size_t,
+    unsigned char *, size_t *);
+int vdev_cmd_client_pin(struct vdev *, const cbor_item_t *, cbor_item_t **);
+int vdev_cmd_cred_mgmt(struct vdev *, struct vdev_port *, const cbor_item_t *,
+    cbor_item_t **);
+int vdev_pin_auth(struct vdev *, const cbor_item_t *, const cbor_item_t *,
+    const unsigned char *, size_t, const unsigned char *, size_t);
+int vdev_state_init(struct vdev *);
+void vdev_state_reset(struct vdev *);
+void vdev_iter_reset(struct vdev_iter *);
+
+#endif /* !_VDEV_EXTERN_H */
@@ -0,0 +1,419 @@
+/*
+ * Copyright (c) 2020 Yubico AB. All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "extern.h"
+
+/*
+ * Fault injection: a set of i/o functions wrapping those of another
+ * device, adding delays to reads and writes, dropping or corrupting
+ * reply frames, prepending keepalive frames to replies, leaving frames
+ * of an earlier session to be read after open, and turning requests
+ * away as a device busy with another channel would.
+ */
+
+#define CMD_KEEPALIVE		(0x80 | 0x3b)
+#define CMD_ERROR		(0x80 | 0x3f)
+#define KEEPALIVE_PROCESSING	1
+#define ERR_CHANNEL_BUSY	0x06
+#define STALE_CID		0x7ffffffe /* a channel of someone else's */
+#define MAX_QUEUE		32	/* frames injected ahead of replies */
+
+struct vdev_fault {
+	fido_dev_io_t		 io;         /* wrapped functions */
+	char			*inner_path; /* wrapped device */
+	char			 path[32];
+	pthread_mutex_t		 lock;       /* protects the fields below */
+	vdev_fault_cfg_t	 cfg;
+	uint32_t		 rng;
+	uint64_t		 n_drop;
+	uint64_t		 n_corrupt;
+	uint64_t		 n_keepalive;
+	unsigned int		 busy_left;
+	unsigned int		 desync_left;
+	struct vdev_fault	*next;
+};
+
+struct fault_port {
+	struct vdev_fault	*f;
+	void			*handle;   /* wrapped handle */
+	unsigned char		 held[VDEV_RPT_SIZE]; /* reply behind keepalives */
+	bool			 have_held;
+	unsigned int		 n_ka;     /* keepalives left */
+	unsigned char		 queue[MAX_QUEUE][VDEV_RPT_SIZE]; /* injected */
+	unsigned int		 q_head;
+	unsigned int		 q_len;
+	uint32_t		 busy_cid; /* request being turned away */
+	size_t			 busy_len; /* bytes of it still to come */
+};
+
+static pthread_mutex_t	 registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct vdev_fault *registry;
+static unsigned int	 registry_seq;
+
+static void
+fault_sleep(int ms)
+{
+	struct timespec ts;
+
+	if (ms <= 0)
+		return;
+
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000L;
+
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		continue;
+}
+
+/* xorshift32; deterministic for a given seed */
+static bool
+roll(struct vdev_fault *f, unsigned int pct)
+{
+	uint32_t x;
+
+	if (pct == 0)
+		return (false);
+
+	x = f->rng;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	f->rng = x;
+
+	return (x % 100 < pct);
+}
+
+vdev_fault_t *
+vdev_fault_new(const fido_dev_io_t *io, const char *inner_path)
+{
+	struct vdev_fault *f;
+
+	if ((f = calloc(1, sizeof(*f))) == NULL)
+		return (NULL);
+
+	if ((f->inner_path = strdup(inner_path)) == NULL ||
+	    pthread_mutex_init(&f->lock, NULL) != 0) {
+		free(f->inner_path);
+		free(f);
+		return (NULL);
+	}
+
+	f->io = *io;
+	f->rng = 1;
+
+	pthread_mutex_lock(&registry_lock);
+	snprintf(f->path, sizeof(f->path), "fault:%u", registry_seq++);
+	f->next = registry;
+	registry = f;
+	pthread_mutex_unlock(&registry_lock);
+
+	return (f);
+}
+
+void
+vdev_fault_free(vdev_fault_t **f_p)
+{
+	struct vdev_fault	 *f;
+	struct vdev_fault	**p;
+
+	if (f_p == NULL || (f = *f_p) == NULL)
+		return;
+
+	pthread_mutex_lock(&registry_lock);
+	for (p = &registry; *p != NULL; p = &(*p)->next)
+		if (*p == f) {
+			*p = f->next;
+			break;
+		}
+	pthread_mutex_unlock(&registry_lock);
+
+	pthread_mutex_destroy(&f->lock);
+	free(f->inner_path);
+	free(f);
+
+	*f_p = NULL;
+}
+
+const char *
+vdev_fault_path(const vdev_fault_t *f)
+{
+	return (f->path);
+}
+
+void
+vdev_fault_set(vdev_fault_t *f, const vdev_fault_cfg_t *cfg)
+{
+	pthread_mutex_lock(&f->lock);
+	f->cfg = *cfg;
+	f->rng = cfg->seed ? cfg->seed : 1;
+	f->busy_left = cfg->busy;
+	f->desync_left = cfg->desync;
+	pthread_mutex_unlock(&f->lock);
+}
+
+void
+vdev_fault_stats(vdev_fault_t *f, uint64_t *n_drop, uint64_t *n_corrupt,
+    uint64_t *n_keepalive)
+{
+	pthread_mutex_lock(&f->lock);
+	*n_drop = f->n_drop;
+	*n_corrupt = f->n_corrupt;
+	*n_keepalive = f->n_keepalive;
+	pthread_mutex_unlock(&f->lock);
+}
+
+static unsigned char *
+enqueue(struct fault_port *p)
+{
+	unsigned char *frame;
+
+	if (p->q_len == MAX_QUEUE)
+		return (NULL);
+
+	frame = p->queue[(p->q_head + p->q_len++) % MAX_QUEUE];
+	memset(frame, 0, VDEV_RPT_SIZE);
+
+	return (frame);
+}
+
+/*
+ * Frames of an earlier session: a reply to another CTAPHID_INIT, a reply
+ * on another channel, and the tail of an abandoned reply.
+ */
+static void
+make_stale(unsigned char *frame, unsigned int i)
+{
+	const uint32_t cid = STALE_CID;
+
+	switch (i % 3) {
+	case 0:
+		memset(frame, 0xff, 4);
+		frame[4] = CTAP_FRAME_INIT | CTAP_CMD_INIT;
+		frame[6] = 17;
+		memset(frame + 7, 0xee, 8); /* nonce */
+		memcpy(frame + 15, &cid, 4);
+		break;
+	case 1:
+		memcpy(frame, &cid, 4);
+		frame[4] = CTAP_FRAME_INIT | CTAP_CMD_CBOR;
+		frame[6] = 1;
+		break;
+	default:
+		memset(frame, 0xff, 4);
+		frame[4] = (unsigned char)(i & 0x7f); /* seq */
+		break;
+	}
+}
+
+static void *
+fault_open(const char *path)
+{
+	struct fault_port	*p;
+	struct vdev_fault	*f;
+
+	if ((p = calloc(1, sizeof(*p))) == NULL)
+		return (NULL);
+
+	pthread_mutex_lock(&registry_lock);
+	for (f = registry; f != NULL; f = f->next)
+		if (strcmp(f->path, path) == 0)
+			break;
+	pthread_mutex_unlock(&registry_lock);
+
+	if (f == NULL || (p->handle = f->io.open(f->inner_path)) == NULL) {
+		free(p);
+		return (NULL);
+	}
+
+	p->f = f;
+
+	pthread_mutex_lock(&f->lock);
+	for (unsigned int i = 0; i < f->cfg.stale && i < MAX_QUEUE; i++)
+		make_stale(enqueue(p), i);
+	pthread_mutex_unlock(&f->lock);
+
+	return (p);
+}
+
+static void
+fault_close(void *handle)
+{
+	struct fault_port *p = handle;
+
+	p->f->io.close(p->handle);
+	free(p);
+}
+
+static void
+make_keepalive(unsigned char *frame, const unsigned char *reply)
+{
+	memset(frame, 0, VDEV_RPT_SIZE);
+	memcpy(frame, reply, 4); /* cid */
+	frame[4] = CMD_KEEPALIVE;
+	frame[6] = 1;
+	frame[7] = KEEPALIVE_PROCESSING;
+}
+
+static int
+fault_read(void *handle, unsigned char *buf, size_t len, int ms)
+{
+	struct fault_port	*p = handle;
+	struct vdev_fault	*f = p->f;
+	vdev_fault_cfg_t	 cfg;
+	bool			 drop;
+	bool			 corrupt;
+	size_t			 off = 0;
+	int			 n;
+
+	if (len != VDEV_RPT_SIZE)
+		return (-1);
+
+	pthread_mutex_lock(&f->lock);
+	cfg = f->cfg;
+	pthread_mutex_unlock(&f->lock);
+
+	fault_sleep(cfg.read_delay_ms);
+
+	if (p->q_len > 0) {
+		memcpy(buf, p->queue[p->q_head], VDEV_RPT_SIZE);
+		p->q_head = (p->q_head + 1) % MAX_QUEUE;
+		p->q_len--;
+		return (VDEV_RPT_SIZE);
+	}
+
+	if (p->n_ka > 0) {
+		p->n_ka--;
+		make_keepalive(buf, p->held);
+		return (VDEV_RPT_SIZE);
+	}
+
+	if (p->have_held) {
+		p->have_held = false;
+		memcpy(buf, p->held, VDEV_RPT_SIZE);
+		return (VDEV_RPT_SIZE);
+	}
+
+	for (;;) {
+		n = f->io.read(p->handle, buf, len, ms);
+		if (n != VDEV_RPT_SIZE) {
+			/* emulate a timeout; a blocking read cannot block */
+			if (ms > 0)
+				fault_sleep(ms);
+			return (-1);
+		}
+		pthread_mutex_lock(&f->lock);
+		/* the first continuation frame of a reply */
+		if ((drop = buf[4] == 0 && f->desync_left > 0))
+			f->desync_left--;
+		else
+			drop = roll(f, cfg.drop_pct);
+		corrupt = drop == false && roll(f, cfg.corrupt_pct);
+		f->n_drop += drop;
+		f->n_corrupt += corrupt;
+		off = (f->rng >> 8) % VDEV_RPT_SIZE;
+		pthread_mutex_unlock(&f->lock);
+		if (drop == false)
+			break;
+	}
+
+	if (corrupt)
+		buf[off] ^= 0xff;
+
+	/* hold the first frame of a reply behind keepalives */
+	if (cfg.keepalives > 0 && (buf[4] & 0x80) && buf[4] != CMD_KEEPALIVE) {
+		memcpy(p->held, buf, VDEV_RPT_SIZE);
+		p->have_held = true;
+		p->n_ka = cfg.keepalives - 1;
+		make_keepalive(buf, p->held);
+		pthread_mutex_lock(&f->lock);
+		f->n_keepalive += cfg.keepalives;
+		pthread_mutex_unlock(&f->lock);
+	}
+
+	return (VDEV_RPT_SIZE);
+}
+
+/*
+ * Turn a request away with ERR_CHANNEL_BUSY, as a device busy with
+ * another channel would, dropping its frames.
+ */
+static bool
+fault_busy(struct fault_port *p, const unsigned char *frame)
+{
+	struct vdev_fault	*f = p->f;
+	unsigned char		*reply;
+	uint32_t		 cid;
+	size_t			 n;
+
+	memcpy(&cid, frame, 4);
+
+	if ((frame[4] & CTAP_FRAME_INIT) == 0) {
+		if (p->busy_len == 0 || cid != p->busy_cid)
+			return (false);
+		n = VDEV_RPT_SIZE - 5;
+		p->busy_len -= p->busy_len < n ? p->busy_len : n;
+		return (true);
+	}
+
+	if (cid == CTAP_CID_BROADCAST ||
+	    frame[4] == (CTAP_FRAME_INIT | CTAP_CMD_INIT) ||
+	    frame[4] == (CTAP_FRAME_INIT | CTAP_CMD_CANCEL))
+		return (false);
+
+	pthread_mutex_lock(&f->lock);
+	if (f->busy_left == 0) {
+		pthread_mutex_unlock(&f->lock);
+		return (false);
+	}
+	f->busy_left--;
+	pthread_mutex_unlock(&f->lock);
+
+	n = (size_t)((frame[5] << 8) | frame[6]);
+	p->busy_cid = cid;
+	p->busy_len = n > VDEV_RPT_SIZE - 7 ? n - (VDEV_RPT_SIZE - 7) : 0;
+
+	if ((reply = enqueue(p)) != NULL) {
+		memcpy(reply, &cid, 4);
+		reply[4] = CMD_ERROR;
+		reply[6] = 1;
+		reply[7] = ERR_CHANNEL_BUSY;
+	}
+
+	return (true);
+}
+
+static int
+fault_write(void *handle, const unsigned char *buf, size_t len)
+{
+	struct fault_port	*p = handle;
+	int			 delay_ms;
+
+	pthread_mutex_lock(&p->f->lock);
+	delay_ms = p->f->cfg.write_delay_ms;
+	pthread_mutex_unlock(&p->f->lock);
+
+	fault_sleep(delay_ms);
+
+	/* report id followed by a ctaphid frame */
+	if (len == VDEV_RPT_SIZE + 1 && fault_busy(p, buf + 1))
+		return ((int)len);
+
+	return (p->f->io.write(p->handle, buf, len));
+}
+
+void
+vdev_fault_io(fido_dev_io_t *io)
+{
+	io->open = fault_open;
+	io->close = fault_close;
+	io->read = fault_read;
+	io->write = fault_write;
+}
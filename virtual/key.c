@@ -0,0 +1,787 @@
+/*
+ * Copyright (c) 2020 Yubico AB. All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/obj_mac.h>
+#include <openssl/rand.h>
+#include <openssl/rsa.h>
+#include <openssl/sha.h>
+#include <openssl/x509.h>
+
+#include <string.h>
+
+#include "extern.h"
+
+#if !defined(LIBRESSL_VERSION_NUMBER) && OPENSSL_VERSION_NUMBER >= 0x10101000L
+#define HAVE_ED25519
+#endif
+
+#define WRAP_VERSION	0x01
+#define WRAP_IV_LEN	12
+#define WRAP_KEY_LEN	32
+#define WRAP_TAG_LEN	16
+#define WRAP_LEN	(2 + WRAP_IV_LEN + WRAP_KEY_LEN + WRAP_TAG_LEN)
+
+bool
+vdev_key_supported(int type)
+{
+	switch (type) {
+	case COSE_ES256:
+	case COSE_RS256:
+		return (true);
+#ifdef HAVE_ED25519
+	case COSE_EDDSA:
+		return (true);
+#endif
+	default:
+		return (false);
+	}
+}
+
+static int
+es256_create(struct vdev_blob *key)
+{
+	EC_KEY		*ec = NULL;
+	const BIGNUM	*d;
+	int		 ok = -1;
+
+	if ((ec = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1)) == NULL ||
+	    EC_KEY_generate_key(ec) == 0 ||
+	    (d = EC_KEY_get0_private_key(ec)) == NULL ||
+	    (key->ptr = calloc(1, 32)) == NULL)
+		goto fail;
+
+	key->len = 32;
+	if (BN_bn2binpad(d, key->ptr, (int)key->len) != (int)key->len)
+		goto fail;
+
+	ok = 0;
+fail:
+	if (ec != NULL)
+		EC_KEY_free(ec);
+
+	return (ok);
+}
+
+static int
+rs256_create(struct vdev_blob *key)
+{
+	EVP_PKEY	*pkey = NULL;
+	RSA		*rsa = NULL;
+	BIGNUM		*e = NULL;
+	unsigned char	*p;
+	int		 len;
+	int		 ok = -1;
+
+	if ((e = BN_new()) == NULL || BN_set_word(e, RSA_F4) == 0 ||
+	    (rsa = RSA_new()) == NULL ||
+	    RSA_generate_key_ex(rsa, 2048, e, NULL) == 0 ||
+	    (pkey = EVP_PKEY_new()) == NULL ||
+	    EVP_PKEY_assign_RSA(pkey, rsa) == 0)
+		goto fail;
+
+	rsa = NULL; /* owned by pkey */
+
+	if ((len = i2d_PrivateKey(pkey, NULL)) <= 0 ||
+	    (key->ptr = calloc(1, (size_t)len)) == NULL)
+		goto fail;
+
+	p = key->ptr;
+	if (i2d_PrivateKey(pkey, &p) != len)
+		goto fail;
+
+	key->len = (size_t)len;
+
+	ok = 0;
+fail:
+	if (e != NULL)
+		BN_free(e);
+	if (rsa != NULL)
+		RSA_free(rsa);
+	if (pkey != NULL)
+		EVP_PKEY_free(pkey);
+
+	return (ok);
+}
+
+#ifdef HAVE_ED25519
+static int
+eddsa_create(struct vdev_blob *key)
+{
+	EVP_PKEY_CTX	*ctx = NULL;
+	EVP_PKEY	*pkey = NULL;
+	int		 ok = -1;
+
+	if ((ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_ED25519, NULL)) == NULL ||
+	    EVP_PKEY_keygen_init(ctx) <= 0 ||
+	    EVP_PKEY_keygen(ctx, &pkey) <= 0 ||
+	    (key->ptr = calloc(1, 32)) == NULL)
+		goto fail;
+
+	key->len = 32;
+	if (EVP_PKEY_get_raw_private_key(pkey, key->ptr, &key->len) != 1 ||
+	    key->len != 32)
+		goto fail;
+
+	ok = 0;
+fail:
+	if (ctx != NULL)
+		EVP_PKEY_CTX_free(ctx);
+	if (pkey != NULL)
+		EVP_PKEY_free(pkey);
+
+	return (ok);
+}
+#endif
+
+/*
+ * Create a private key of the given type. ES256 and EdDSA keys are
+ * stored as raw 32-byte secrets; RS256 keys are DER-encoded.
+ */
+int
+vdev_key_create(int type, struct vdev_blob *key)
+{
+	int ok = -1;
+
+	memset(key, 0, sizeof(*key));
+
+	switch (type) {
+	case COSE_ES256:
+		ok = es256_create(key);
+		break;
+	case COSE_RS256:
+		ok = rs256_create(key);
+		break;
+#ifdef HAVE_ED25519
+	case COSE_EDDSA:
+		ok = eddsa_create(key);
+		break;
+#endif
+	}
+
+	if (ok < 0) {
+		if (key->ptr != NULL)
+			explicit_bzero(key->ptr, key->len);
+		free(key->ptr);
+		memset(key, 0, sizeof(*key));
+	}
+
+	return (ok);
+}
+
+static EVP_PKEY *
+es256_load(const struct vdev_blob *key)
+{
+	EC_KEY		*ec = NULL;
+	EC_POINT	*q = NULL;
+	BIGNUM		*d = NULL;
+	EVP_PKEY	*pkey = NULL;
+	const EC_GROUP	*g;
+	int		 ok = -1;
+
+	if (key->len != 32 ||
+	    (d = BN_bin2bn(key->ptr, (int)key->len, NULL)) == NULL ||
+	    (ec = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1)) == NULL ||
+	    (g = EC_KEY_get0_group(ec)) == NULL ||
+	    (q = EC_POINT_new(g)) == NULL ||
+	    EC_POINT_mul(g, q, d, NULL, NULL, NULL) == 0 ||
+	    EC_KEY_set_private_key(ec, d) == 0 ||
+	    EC_KEY_set_public_key(ec, q) == 0 ||
+	    (pkey = EVP_PKEY_new()) == NULL ||
+	    EVP_PKEY_assign_EC_KEY(pkey, ec) == 0)
+		goto fail;
+
+	ec = NULL; /* owned by pkey */
+
+	ok = 0;
+fail:
+	if (d != NULL)
+		BN_clear_free(d);
+	if (q != NULL)
+		EC_POINT_free(q);
+	if (ec != NULL)
+		EC_KEY_free(ec);
+	if (ok < 0 && pkey != NULL) {
+		EVP_PKEY_free(pkey);
+		pkey = NULL;
+	}
+
+	return (pkey);
+}
+
+EVP_PKEY *
+vdev_key_load(int type, const struct vdev_blob *key)
+{
+	const unsigned char *p = key->ptr;
+
+	switch (type) {
+	case COSE_ES256:
+		return (es256_load(key));
+	case COSE_RS256:
+		if (key->len > LONG_MAX)
+			return (NULL);
+		return (d2i_PrivateKey(EVP_PKEY_RSA, NULL, &p,
+		    (long)key->len));
+#ifdef HAVE_ED25519
+	case COSE_EDDSA:
+		return (EVP_PKEY_new_raw_private_key(EVP_PKEY_ED25519, NULL,
+		    key->ptr, key->len));
+#endif
+	default:
+		return (NULL);
+	}
+}
+
+static cbor_item_t *
+cose_bytes(const BIGNUM *bn, size_t len)
+{
+	unsigned char	buf[256];
+	cbor_item_t	*item;
+
+	if (len > sizeof(buf) || BN_bn2binpad(bn, buf, (int)len) != (int)len)
+		return (NULL);
+
+	item = cbor_build_bytestring(buf, len);
+	explicit_bzero(buf, sizeof(buf));
+
+	return (item);
+}
+
+static int
+es256_cose(cbor_item_t *item, int alg, EVP_PKEY *pkey)
+{
+	const EC_KEY	*ec;
+	const EC_POINT	*q;
+	BIGNUM		*x = NULL;
+	BIGNUM		*y = NULL;
+	int		 ok = -1;
+
+	if ((ec = EVP_PKEY_get0_EC_KEY(pkey)) == NULL ||
+	    (q = EC_KEY_get0_public_key(ec)) == NULL ||
+	    (x = BN_new()) == NULL || (y = BN_new()) == NULL ||
+	    EC_POINT_get_affine_coordinates_GFp(EC_KEY_get0_group(ec), q, x,
+	    y, NULL) == 0)
+		goto fail;
+
+	if (vdev_cbor_add(item, vdev_cbor_int(1),
+	    vdev_cbor_int(COSE_KTY_EC2)) < 0 ||
+	    vdev_cbor_add(item, vdev_cbor_int(3), vdev_cbor_int(alg)) < 0 ||
+	    vdev_cbor_add(item, vdev_cbor_int(-1),
+	    vdev_cbor_int(COSE_P256)) < 0 ||
+	    vdev_cbor_add(item, vdev_cbor_int(-2), cose_bytes(x, 32)) < 0 ||
+	    vdev_cbor_add(item, vdev_cbor_int(-3), cose_bytes(y, 32)) < 0)
+		goto fail;
+
+	ok = 0;
+fail:
+	if (x != NULL)
+		BN_free(x);
+	if (y != NULL)
+		BN_free(y);
+
+	return (ok);
+}
+
+static int
+rs256_cose(cbor_item_t *item, EVP_PKEY *pkey)
+{
+	const RSA	*rsa;
+	const BIGNUM	*n = NULL;
+	const BIGNUM	*e = NULL;
+
+	if ((rsa = EVP_PKEY_get0_RSA(pkey)) == NULL)
+		return (-1);
+
+	RSA_get0_key(rsa, &n, &e, NULL);
+
+	if (n == NULL || e == NULL || BN_num_bytes(n) != 256 ||
+	    BN_num_bytes(e) != 3)
+		return (-1);
+
+	if (vdev_cbor_add(item, vdev_cbor_int(1),
+	    vdev_cbor_int(COSE_KTY_RSA)) < 0 ||
+	    vdev_cbor_add(item, vdev_cbor_int(3),
+	    vdev_cbor_int(COSE_RS256)) < 0 ||
+	    vdev_cbor_add(item, vdev_cbor_int(-1), cose_bytes(n, 256)) < 0 ||
+	    vdev_cbor_add(item, vdev_cbor_int(-2), cose_bytes(e, 3)) < 0)
+		return (-1);
+
+	return (0);
+}
+
+#ifdef HAVE_ED25519
+static int
+eddsa_cose(cbor_item_t *item, const EVP_PKEY *pkey)
+{
+	unsigned char	x[32];
+	size_t		len = sizeof(x);
+
+	if (EVP_PKEY_get_raw_public_key(pkey, x, &len) != 1 ||
+	    len != sizeof(x))
+		return (-1);
+
+	if (vdev_cbor_add(item, vdev_cbor_int(1),
+	    vdev_cbor_int(COSE_KTY_OKP)) < 0 ||
+	    vdev_cbor_add(item, vdev_cbor_int(3),
+	    vdev_cbor_int(COSE_EDDSA)) < 0 ||
+	    vdev_cbor_add(item, vdev_cbor_int(-1),
+	    vdev_cbor_int(COSE_ED25519)) < 0 ||
+	    vdev_cbor_add(item, vdev_cbor_int(-2),
+	    cbor_build_bytestring(x, len)) < 0)
+		return (-1);
+
+	return (0);
+}
+#endif
+
+/*
+ * Encode the public part of a key as a COSE_Key. COSE_ECDH_ES256 is
+ * used for the PIN key agreement key.
+ */
+cbor_item_t *
+vdev_key_cose(int type, EVP_PKEY *pkey)
+{
+	cbor_item_t	*item;
+	int		 ok = -1;
+
+	if ((item = cbor_new_definite_map(5)) == NULL)
+		return (NULL);
+
+	switch (type) {
+	case COSE_ES256:
+	case COSE_ECDH_ES256:
+		ok = es256_cose(item, type, pkey);
+		break;
+	case COSE_RS256:
+		ok = rs256_cose(item, pkey);
+		break;
+#ifdef HAVE_ED25519
+	case COSE_EDDSA:
+		ok = eddsa_cose(item, pkey);
+		break;
+#endif
+	}
+
+	if (ok < 0)
+		cbor_decref(&item);
+
+	return (item);
+}
+
+/*
+ * Sign the concatenation of a and b, which for makeCredential and
+ * getAssertion are the authenticator data and the client data hash.
+ */
+int
+vdev_key_sign(int type, EVP_PKEY *pkey, const unsigned char *a, size_t a_len,
+    const unsigned char *b, size_t b_len, struct vdev_blob *sig)
+{
+	EVP_MD_CTX	*ctx = NULL;
+	unsigned char	*tbs = NULL;
+	int		 ok = -1;
+
+	memset(sig, 0, sizeof(*sig));
+
+	if ((ctx = EVP_MD_CTX_new()) == NULL)
+		goto fail;
+
+	switch (type) {
+	case COSE_ES256:
+	case COSE_RS256:
+		if (EVP_DigestSignInit(ctx, NULL, EVP_sha256(), NULL,
+		    pkey) != 1 || EVP_DigestSignUpdate(ctx, a, a_len) != 1 ||
+		    EVP_DigestSignUpdate(ctx, b, b_len) != 1 ||
+		    EVP_DigestSignFinal(ctx, NULL, &sig->len) != 1 ||
+		    (sig->ptr = calloc(1, sig->len)) == NULL ||
+		    EVP_DigestSignFinal(ctx, sig->ptr, &sig->len) != 1)
+			goto fail;
+		break;
+#ifdef HAVE_ED25519
+	case COSE_EDDSA:
+		/* ed25519 is a one-shot signature scheme */
+		if ((tbs = malloc(a_len + b_len)) == NULL)
+			goto fail;
+		memcpy(tbs, a, a_len);
+		memcpy(tbs + a_len, b, b_len);
+		if (EVP_DigestSignInit(ctx, NULL, NULL, NULL, pkey) != 1 ||
+		    EVP_DigestSign(ctx, NULL, &sig->len, tbs,
+		    a_len + b_len) != 1 ||
+		    (sig->ptr = calloc(1, sig->len)) == NULL ||
+		    EVP_DigestSign(ctx, sig->ptr, &sig->len, tbs,
+		    a_len + b_len) != 1)
+			goto fail;
+		break;
+#endif
+	default:
+		goto fail;
+	}
+
+	ok = 0;
+fail:
+	if (ctx != NULL)
+		EVP_MD_CTX_free(ctx);
+	free(tbs);
+
+	if (ok < 0) {
+		free(sig->ptr);
+		memset(sig, 0, sizeof(*sig));
+	}
+
+	return (ok);
+}
+
+/*
+ * Create a self-signed ES256 attestation certificate.
+ */
+int
+vdev_att_create(struct vdev *v)
+{
+	X509		*x509 = NULL;
+	X509_NAME	*name;
+	unsigned char	*p;
+	int		 len;
+	int		 ok = -1;
+
+	if (vdev_key_create(COSE_ES256, &v->att_key) < 0 ||
+	    (v->att_pkey = vdev_key_load(COSE_ES256, &v->att_key)) == NULL ||
+	    (x509 = X509_new()) == NULL ||
+	    X509_set_version(x509, 2) == 0 ||
+	    ASN1_INTEGER_set(X509_get_serialNumber(x509), 1) == 0 ||
+	    X509_gmtime_adj(X509_get_notBefore(x509), 0) == NULL ||
+	    X509_gmtime_adj(X509_get_notAfter(x509),
+	    20L * 365 * 86400) == NULL ||
+	    (name = X509_get_subject_name(x509)) == NULL ||
+	    X509_NAME_add_entry_by_txt(name, "O", MBSTRING_ASC,
+	    (const unsigned char *)"libfido2", -1, -1, 0) == 0 ||
+	    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+	    (const unsigned char *)"Virtual Authenticator", -1, -1, 0) == 0 ||
+	    X509_set_issuer_name(x509, name) == 0 ||
+	    X509_set_pubkey(x509, v->att_pkey) == 0 ||
+	    X509_sign(x509, v->att_pkey, EVP_sha256()) == 0)
+		goto fail;
+
+	if ((len = i2d_X509(x509, NULL)) <= 0 ||
+	    (v->att_cert.ptr = calloc(1, (size_t)len)) == NULL)
+		goto fail;
+
+	p = v->att_cert.ptr;
+	if (i2d_X509(x509, &p) != len)
+		goto fail;
+
+	v->att_cert.len = (size_t)len;
+
+	ok = 0;
+fail:
+	if (x509 != NULL)
+		X509_free(x509);
+
+	return (ok);
+}
+
+/*
+ * (Re)generate the authenticator's PIN key agreement key.
+ */
+int
+vdev_ka_create(struct vdev *v)
+{
+	struct vdev_blob	key;
+	EVP_PKEY		*pkey;
+
+	if (vdev_key_create(COSE_ES256, &key) < 0)
+		return (-1);
+
+	pkey = vdev_key_load(COSE_ES256, &key);
+	explicit_bzero(key.ptr, key.len);
+	free(key.ptr);
+
+	if (pkey == NULL)
+		return (-1);
+
+	if (v->ka_pkey != NULL)
+		EVP_PKEY_free(v->ka_pkey);
+
+	v->ka_pkey = pkey;
+
+	return (0);
+}
+
+static EVP_PKEY *
+ka_peer(const cbor_item_t *cose)
+{
+	const unsigned char	*x;
+	const unsigned char	*y;
+	size_t			 x_len;
+	size_t			 y_len;
+	int64_t			 kty;
+	int64_t			 crv;
+	EC_KEY			*ec = NULL;
+	BIGNUM			*bx = NULL;
+	BIGNUM			*by = NULL;
+	EVP_PKEY		*pkey = NULL;
+	int			 ok = -1;
+
+	if (vdev_cbor_sint(vdev_cbor_get(cose, 1), &kty) < 0 ||
+	    kty != COSE_KTY_EC2 ||
+	    vdev_cbor_sint(vdev_cbor_get(cose, -1), &crv) < 0 ||
+	    crv != COSE_P256 ||
+	    vdev_cbor_bytes(vdev_cbor_get(cose, -2), &x, &x_len) < 0 ||
+	    vdev_cbor_bytes(vdev_cbor_get(cose, -3), &y, &y_len) < 0 ||
+	    x_len != 32 || y_len != 32)
+		return (NULL);
+
+	if ((bx = BN_bin2bn(x, (int)x_len, NULL)) == NULL ||
+	    (by = BN_bin2bn(y, (int)y_len, NULL)) == NULL ||
+	    (ec = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1)) == NULL ||
+	    EC_KEY_set_public_key_affine_coordinates(ec, bx, by) == 0 ||
+	    (pkey = EVP_PKEY_new()) == NULL ||
+	    EVP_PKEY_assign_EC_KEY(pkey, ec) == 0)
+		goto fail;
+
+	ec = NULL; /* owned by pkey */
+
+	ok = 0;
+fail:
+	if (bx != NULL)
+		BN_free(bx);
+	if (by != NULL)
+		BN_free(by);
+	if (ec != NULL)
+		EC_KEY_free(ec);
+	if (ok < 0 && pkey != NULL) {
+		EVP_PKEY_free(pkey);
+		pkey = NULL;
+	}
+
+	return (pkey);
+}
+
+/*
+ * Compute the PIN protocol 1 shared secret, sha256((ka * peer).x).
+ */
+int
+vdev_ka_derive(const struct vdev *v, const cbor_item_t *cose,
+    unsigned char *shared)
+{
+	EVP_PKEY	*peer = NULL;
+	EVP_PKEY_CTX	*ctx = NULL;
+	unsigned char	 z[32];
+	size_t		 z_len = sizeof(z);
+	int		 ok = -1;
+
+	if ((peer = ka_peer(cose)) == NULL ||
+	    (ctx = EVP_PKEY_CTX_new(v->ka_pkey, NULL)) == NULL ||
+	    EVP_PKEY_derive_init(ctx) <= 0 ||
+	    EVP_PKEY_derive_set_peer(ctx, peer) <= 0 ||
+	    EVP_PKEY_derive(ctx, z, &z_len) <= 0 || z_len != sizeof(z) ||
+	    SHA256(z, z_len, shared) != shared)
+		goto fail;
+
+	ok = 0;
+fail:
+	if (peer != NULL)
+		EVP_PKEY_free(peer);
+	if (ctx != NULL)
+		EVP_PKEY_CTX_free(ctx);
+
+	explicit_bzero(z, sizeof(z));
+
+	return (ok);
+}
+
+/*
+ * AES-256-CBC with a zero IV and no padding, as used by PIN protocol 1.
+ */
+int
+vdev_aes256_cbc(bool enc, const unsigned char *key, const unsigned char *in,
+    size_t len, unsigned char *out)
+{
+	EVP_CIPHER_CTX	*ctx = NULL;
+	unsigned char	 iv[16];
+	int		 n;
+	int		 ok = -1;
+
+	memset(iv, 0, sizeof(iv));
+
+	if (len == 0 || len % 16 != 0 || len > INT_MAX)
+		return (-1);
+
+	if ((ctx = EVP_CIPHER_CTX_new()) == NULL ||
+	    EVP_CipherInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv,
+	    enc ? 1 : 0) == 0 ||
+	    EVP_CIPHER_CTX_set_padding(ctx, 0) == 0 ||
+	    EVP_CipherUpdate(ctx, out, &n, in, (int)len) == 0 ||
+	    n < 0 || (size_t)n != len)
+		goto fail;
+
+	ok = 0;
+fail:
+	if (ctx != NULL)
+		EVP_CIPHER_CTX_free(ctx);
+
+	return (ok);
+}
+
+/*
+ * HMAC-SHA-256 over the concatenation of a and b.
+ */
+int
+vdev_hmac(const unsigned char *key, size_t key_len, const unsigned char *a,
+    size_t a_len, const unsigned char *b, size_t b_len, unsigned char *out)
+{
+	HMAC_CTX	*ctx = NULL;
+	unsigned int	 len;
+	int		 ok = -1;
+
+	if (key_len > INT_MAX)
+		return (-1);
+
+	if ((ctx = HMAC_CTX_new()) == NULL ||
+	    HMAC_Init_ex(ctx, key, (int)key_len, EVP_sha256(), NULL) == 0 ||
+	    HMAC_Update(ctx, a, a_len) == 0 ||
+	    (b != NULL && HMAC_Update(ctx, b, b_len) == 0) ||
+	    HMAC_Final(ctx, out, &len) == 0 || len != SHA256_DIGEST_LENGTH)
+		goto fail;
+
+	ok = 0;
+fail:
+	if (ctx != NULL)
+		HMAC_CTX_free(ctx);
+
+	return (ok);
+}
+
+static uint8_t
+wrap_type(int type)
+{
+	switch (type) {
+	case COSE_ES256:
+		return (1);
+	case COSE_EDDSA:
+		return (2);
+	default:
+		return (0);
+	}
+}
+
+/*
+ * Wrap a credential's private key into its credential id:
+ * version || type || iv || aes256-gcm(key) || tag, authenticating the
+ * rp id hash as additional data.
+ */
+int
+vdev_wrap(const struct vdev *v, const struct vdev_cred *cred,
+    struct vdev_blob *id)
+{
+	EVP_CIPHER_CTX	*ctx = NULL;
+	unsigned char	*iv;
+	unsigned char	*ct;
+	int		 n;
+	int		 ok = -1;
+
+	memset(id, 0, sizeof(*id));
+
+	if (cred->key.len != WRAP_KEY_LEN || wrap_type(cred->type) == 0 ||
+	    (id->ptr = calloc(1, WRAP_LEN)) == NULL)
+		goto fail;
+
+	id->len = WRAP_LEN;
+	id->ptr[0] = WRAP_VERSION;
+	id->ptr[1] = wrap_type(cred->type);
+	iv = id->ptr + 2;
+	ct = iv + WRAP_IV_LEN;
+
+	if (RAND_bytes(iv, WRAP_IV_LEN) != 1 ||
+	    (ctx = EVP_CIPHER_CTX_new()) == NULL ||
+	    EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, v->wrap_key,
+	    iv) == 0 ||
+	    EVP_EncryptUpdate(ctx, NULL, &n, id->ptr, 2) == 0 ||
+	    EVP_EncryptUpdate(ctx, NULL, &n, cred->rp_id_hash,
+	    sizeof(cred->rp_id_hash)) == 0 ||
+	    EVP_EncryptUpdate(ctx, ct, &n, cred->key.ptr, WRAP_KEY_LEN) == 0 ||
+	    n != WRAP_KEY_LEN ||
+	    EVP_EncryptFinal_ex(ctx, ct + n, &n) == 0 ||
+	    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, WRAP_TAG_LEN,
+	    ct + WRAP_KEY_LEN) == 0)
+		goto fail;
+
+	ok = 0;
+fail:
+	if (ctx != NULL)
+		EVP_CIPHER_CTX_free(ctx);
+
+	if (ok < 0) {
+		free(id->ptr);
+		memset(id, 0, sizeof(*id));
+	}
+
+	return (ok);
+}
+
+int
+vdev_unwrap(const struct vdev *v, const unsigned char *ptr, size_t len,
+    const unsigned char *rp_id_hash, struct vdev_cred *cred)
+{
+	EVP_CIPHER_CTX	*ctx = NULL;
+	unsigned char	 tag[WRAP_TAG_LEN];
+	const unsigned char *iv;
+	const unsigned char *ct;
+	int		 n;
+	int		 ok = -1;
+
+	memset(cred, 0, sizeof(*cred));
+
+	if (len != WRAP_LEN || ptr[0] != WRAP_VERSION)
+		return (-1);
+
+	switch (ptr[1]) {
+	case 1:
+		cred->type = COSE_ES256;
+		break;
+	case 2:
+		cred->type = COSE_EDDSA;
+		break;
+	default:
+		return (-1);
+	}
+
+	iv = ptr + 2;
+	ct = iv + WRAP_IV_LEN;
+	memcpy(tag, ct + WRAP_KEY_LEN, sizeof(tag));
+
+	if ((cred->key.ptr = calloc(1, WRAP_KEY_LEN)) == NULL ||
+	    (cred->id.ptr = malloc(len)) == NULL)
+		goto fail;
+
+	cred->key.len = WRAP_KEY_LEN;
+	cred->id.len = len;
+	memcpy(cred->id.ptr, ptr, len);
+	memcpy(cred->rp_id_hash, rp_id_hash, sizeof(cred->rp_id_hash));
+
+	if ((ctx = EVP_CIPHER_CTX_new()) == NULL ||
+	    EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, v->wrap_key,
+	    iv) == 0 ||
+	    EVP_DecryptUpdate(ctx, NULL, &n, ptr, 2) == 0 ||
+	    EVP_DecryptUpdate(ctx, NULL, &n, rp_id_hash, 32) == 0 ||
+	    EVP_DecryptUpdate(ctx, cred->key.ptr, &n, ct, WRAP_KEY_LEN) == 0 ||
+	    n != WRAP_KEY_LEN ||
+	    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, WRAP_TAG_LEN,
+	    tag) == 0 ||
+	    EVP_DecryptFinal_ex(ctx, cred->key.ptr + n, &n) <= 0)
+		goto fail;
+
+	ok = 0;
+fail:
+	if (ctx != NULL)
+		EVP_CIPHER_CTX_free(ctx);
+
+	if (ok < 0)
+		vdev_cred_reset(cred);
+
+	return (ok);
+}
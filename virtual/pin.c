@@ -0,0 +1,288 @@
+/*
+ * Copyright (c) 2020 Yubico AB. All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+
+#include <string.h>
+
+#include "extern.h"
+
+#define CMD_GET_RETRIES		1
+#define CMD_GET_KEY_AGREEMENT	2
+#define CMD_SET_PIN		3
+#define CMD_CHANGE_PIN		4
+#define CMD_GET_PIN_TOKEN	5
+
+#define PIN_MIN_LEN		4
+#define PIN_MAX_LEN		63
+#define PIN_ENC_MAX		256
+
+static int
+check_protocol(const cbor_item_t *item)
+{
+	uint64_t protocol;
+
+	if (item == NULL)
+		return (FIDO_ERR_MISSING_PARAMETER);
+	if (vdev_cbor_uint(item, &protocol) < 0 || protocol != 1)
+		return (FIDO_ERR_INVALID_PARAMETER);
+
+	return (FIDO_OK);
+}
+
+/*
+ * Verify a pinAuth parameter: left(hmac(pin_token, a || b), 16).
+ */
+int
+vdev_pin_auth(struct vdev *v, const cbor_item_t *auth,
+    const cbor_item_t *protocol, const unsigned char *a, size_t a_len,
+    const unsigned char *b, size_t b_len)
+{
+	const unsigned char	*ptr;
+	size_t			 len;
+	unsigned char		 mac[SHA256_DIGEST_LENGTH];
+	int			 r;
+
+	if ((r = check_protocol(protocol)) != FIDO_OK)
+		return (r);
+	if (v->pin_set == false)
+		return (FIDO_ERR_PIN_NOT_SET);
+	if (vdev_cbor_bytes(auth, &ptr, &len) < 0 || len != 16)
+		return (FIDO_ERR_PIN_AUTH_INVALID);
+	if (vdev_hmac(v->pin_token, sizeof(v->pin_token), a, a_len, b, b_len,
+	    mac) < 0)
+		return (FIDO_ERR_ERR_OTHER);
+	if (timingsafe_bcmp(mac, ptr, len) != 0)
+		return (FIDO_ERR_PIN_AUTH_INVALID);
+
+	return (FIDO_OK);
+}
+
+/*
+ * Verify the authentication of a setPIN or changePIN request, keyed with
+ * the shared secret.
+ */
+static int
+check_shared_auth(const unsigned char *shared, const cbor_item_t *auth,
+    const cbor_item_t *a, const cbor_item_t *b)
+{
+	const unsigned char	*auth_ptr;
+	const unsigned char	*a_ptr;
+	const unsigned char	*b_ptr = NULL;
+	size_t			 auth_len;
+	size_t			 a_len;
+	size_t			 b_len = 0;
+	unsigned char		 mac[SHA256_DIGEST_LENGTH];
+
+	if (vdev_cbor_bytes(auth, &auth_ptr, &auth_len) < 0 ||
+	    vdev_cbor_bytes(a, &a_ptr, &a_len) < 0 ||
+	    (b != NULL && vdev_cbor_bytes(b, &b_ptr, &b_len) < 0))
+		return (FIDO_ERR_CBOR_UNEXPECTED_TYPE);
+	if (auth_len != 16)
+		return (FIDO_ERR_PIN_AUTH_INVALID);
+	if (vdev_hmac(shared, 32, a_ptr, a_len, b_ptr, b_len, mac) < 0)
+		return (FIDO_ERR_ERR_OTHER);
+	if (timingsafe_bcmp(mac, auth_ptr, auth_len) != 0)
+		return (FIDO_ERR_PIN_AUTH_INVALID);
+
+	return (FIDO_OK);
+}
+
+/*
+ * Compare an encrypted PIN hash against the stored PIN. Each mismatch
+ * consumes a retry and invalidates the key agreement key.
+ */
+static int
+check_pin_hash(struct vdev *v, const unsigned char *shared,
+    const cbor_item_t *item)
+{
+	const unsigned char	*ptr;
+	size_t			 len;
+	unsigned char		 pin_hash[16];
+	int			 r;
+
+	if (vdev_cbor_bytes(item, &ptr, &len) < 0 || len != sizeof(pin_hash))
+		return (FIDO_ERR_CBOR_UNEXPECTED_TYPE);
+	if (vdev_aes256_cbc(false, shared, ptr, len, pin_hash) < 0)
+		return (FIDO_ERR_ERR_OTHER);
+
+	v->pin_retries--;
+
+	if (timingsafe_bcmp(pin_hash, v->pin_hash, sizeof(pin_hash)) != 0) {
+		r = v->pin_retries > 0 ? FIDO_ERR_PIN_INVALID :
+		    FIDO_ERR_PIN_BLOCKED;
+		if (vdev_ka_create(v) < 0)
+			r = FIDO_ERR_ERR_OTHER;
+		explicit_bzero(pin_hash, sizeof(pin_hash));
+		return (r);
+	}
+
+	v->pin_retries = VDEV_PIN_RETRIES;
+	explicit_bzero(pin_hash, sizeof(pin_hash));
+
+	return (FIDO_OK);
+}
+
+static int
+set_pin(struct vdev *v, const unsigned char *shared, const cbor_item_t *item)
+{
+	const unsigned char	*ptr;
+	size_t			 len;
+	size_t			 pin_len;
+	unsigned char		 pin[PIN_ENC_MAX];
+	unsigned char		 md[SHA256_DIGEST_LENGTH];
+	int			 r = FIDO_ERR_ERR_OTHER;
+
+	if (vdev_cbor_bytes(item, &ptr, &len) < 0)
+		return (FIDO_ERR_CBOR_UNEXPECTED_TYPE);
+	if (len < 64 || len > sizeof(pin) || len % 16 != 0)
+		return (FIDO_ERR_PIN_POLICY_VIOLATION);
+
+	if (vdev_aes256_cbc(false, shared, ptr, len, pin) < 0)
+		goto fail;
+
+	pin_len = strnlen((const char *)pin, len);
+	if (pin_len < PIN_MIN_LEN || pin_len > PIN_MAX_LEN) {
+		r = FIDO_ERR_PIN_POLICY_VIOLATION;
+		goto fail;
+	}
+
+	if (SHA256(pin, pin_len, md) != md ||
+	    RAND_bytes(v->pin_token, sizeof(v->pin_token)) != 1)
+		goto fail;
+
+	memcpy(v->pin_hash, md, sizeof(v->pin_hash));
+	v->pin_set = true;
+	v->pin_retries = VDEV_PIN_RETRIES;
+
+	r = FIDO_OK;
+fail:
+	explicit_bzero(pin, sizeof(pin));
+	explicit_bzero(md, sizeof(md));
+
+	return (r);
+}
+
+static int
+get_key_agreement(const struct vdev *v, cbor_item_t **resp)
+{
+	if ((*resp = cbor_new_definite_map(1)) == NULL ||
+	    vdev_cbor_add(*resp, vdev_cbor_int(1),
+	    vdev_key_cose(COSE_ECDH_ES256, v->ka_pkey)) < 0)
+		return (FIDO_ERR_ERR_OTHER);
+
+	return (FIDO_OK);
+}
+
+static int
+get_retries(const struct vdev *v, cbor_item_t **resp)
+{
+	if ((*resp = cbor_new_definite_map(1)) == NULL ||
+	    vdev_cbor_add(*resp, vdev_cbor_int(3),
+	    vdev_cbor_int(v->pin_retries)) < 0)
+		return (FIDO_ERR_ERR_OTHER);
+
+	return (FIDO_OK);
+}
+
+static int
+get_pin_token(struct vdev *v, const unsigned char *shared,
+    const cbor_item_t *req, cbor_item_t **resp)
+{
+	unsigned char	token[sizeof(v->pin_token)];
+	int		r;
+
+	if (vdev_cbor_get(req, 6) == NULL)
+		return (FIDO_ERR_MISSING_PARAMETER);
+	if ((r = check_pin_hash(v, shared, vdev_cbor_get(req, 6))) != FIDO_OK)
+		return (r);
+	if (vdev_aes256_cbc(true, shared, v->pin_token, sizeof(token),
+	    token) < 0)
+		return (FIDO_ERR_ERR_OTHER);
+
+	if ((*resp = cbor_new_definite_map(1)) == NULL ||
+	    vdev_cbor_add(*resp, vdev_cbor_int(2),
+	    cbor_build_bytestring(token, sizeof(token))) < 0)
+		r = FIDO_ERR_ERR_OTHER;
+
+	explicit_bzero(token, sizeof(token));
+
+	return (r);
+}
+
+int
+vdev_cmd_client_pin(struct vdev *v, const cbor_item_t *req,
+    cbor_item_t **resp)
+{
+	const cbor_item_t	*auth;
+	const cbor_item_t	*pin_enc;
+	unsigned char		 shared[32];
+	uint64_t		 cmd;
+	int			 r;
+
+	if ((r = check_protocol(vdev_cbor_get(req, 1))) != FIDO_OK)
+		return (r);
+	if (vdev_cbor_uint(vdev_cbor_get(req, 2), &cmd) < 0)
+		return (FIDO_ERR_MISSING_PARAMETER);
+
+	switch (cmd) {
+	case CMD_GET_RETRIES:
+		return (get_retries(v, resp));
+	case CMD_GET_KEY_AGREEMENT:
+		return (get_key_agreement(v, resp));
+	case CMD_SET_PIN:
+		if (v->pin_set)
+			return (FIDO_ERR_NOT_ALLOWED);
+		break;
+	case CMD_CHANGE_PIN:
+	case CMD_GET_PIN_TOKEN:
+		if (v->pin_set == false)
+			return (FIDO_ERR_PIN_NOT_SET);
+		if (v->pin_retries <= 0)
+			return (FIDO_ERR_PIN_BLOCKED);
+		break;
+	default:
+		return (FIDO_ERR_INVALID_PARAMETER);
+	}
+
+	if (vdev_cbor_get(req, 3) == NULL)
+		return (FIDO_ERR_MISSING_PARAMETER);
+	if (vdev_ka_derive(v, vdev_cbor_get(req, 3), shared) < 0)
+		return (FIDO_ERR_INVALID_PARAMETER);
+
+	if (cmd == CMD_GET_PIN_TOKEN) {
+		r = get_pin_token(v, shared, req, resp);
+		goto out;
+	}
+
+	auth = vdev_cbor_get(req, 4);
+	pin_enc = vdev_cbor_get(req, 5);
+
+	if (auth == NULL || pin_enc == NULL ||
+	    (cmd == CMD_CHANGE_PIN && vdev_cbor_get(req, 6) == NULL)) {
+		r = FIDO_ERR_MISSING_PARAMETER;
+		goto out;
+	}
+
+	if (cmd == CMD_SET_PIN)
+		r = check_shared_auth(shared, auth, pin_enc, NULL);
+	else
+		r = check_shared_auth(shared, auth, pin_enc,
+		    vdev_cbor_get(req, 6));
+	if (r != FIDO_OK)
+		goto out;
+
+	if (cmd == CMD_CHANGE_PIN && (r = check_pin_hash(v, shared,
+	    vdev_cbor_get(req, 6))) != FIDO_OK)
+		goto out;
+
+	r = set_pin(v, shared, pin_enc);
+out:
+	explicit_bzero(shared, sizeof(shared));
+
+	return (r);
+}
@@ -0,0 +1,407 @@
+/*
+ * Copyright (c) 2020 Yubico AB. All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "extern.h"
+
+/*
+ * The state of a virtual authenticator is saved as a CBOR map. PIN tokens
+ * and key agreement keys are per power cycle and are not saved.
+ */
+
+#define STORE_VERSION	1
+#define STORE_MAX_LEN	(64 * 1024 * 1024)
+
+static int
+add_blob(cbor_item_t *map, const char *key, const struct vdev_blob *b)
+{
+	return (vdev_cbor_add_str(map, key, cbor_build_bytestring(b->ptr,
+	    b->len)));
+}
+
+static int
+add_opt_str(cbor_item_t *map, const char *key, const char *str)
+{
+	if (str == NULL)
+		return (0);
+
+	return (vdev_cbor_add_str(map, key, cbor_build_string(str)));
+}
+
+static cbor_item_t *
+encode_cred(const struct vdev_cred *c)
+{
+	cbor_item_t *item;
+
+	if ((item = cbor_new_definite_map(11)) == NULL)
+		return (NULL);
+
+	if (add_blob(item, "id", &c->id) < 0 ||
+	    vdev_cbor_add_str(item, "type", vdev_cbor_int(c->type)) < 0 ||
+	    add_blob(item, "key", &c->key) < 0 ||
+	    vdev_cbor_add_str(item, "rp_id_hash",
+	    cbor_build_bytestring(c->rp_id_hash, sizeof(c->rp_id_hash))) < 0 ||
+	    add_opt_str(item, "rp_id", c->rp_id) < 0 ||
+	    add_opt_str(item, "rp_name", c->rp_name) < 0 ||
+	    add_blob(item, "user_id", &c->user_id) < 0 ||
+	    add_opt_str(item, "user_name", c->user_name) < 0 ||
+	    add_opt_str(item, "user_display_name", c->user_display_name) < 0 ||
+	    add_opt_str(item, "user_icon", c->user_icon) < 0 ||
+	    vdev_cbor_add_str(item, "rk", cbor_build_bool(c->rk)) < 0)
+		cbor_decref(&item);
+
+	return (item);
+}
+
+static cbor_item_t *
+encode_state(const struct vdev *v)
+{
+	cbor_item_t	*item = NULL;
+	cbor_item_t	*creds = NULL;
+
+	if ((item = cbor_new_definite_map(10)) == NULL ||
+	    (creds = cbor_new_definite_array(v->n_cred)) == NULL)
+		goto fail;
+
+	for (size_t i = 0; i < v->n_cred; i++) {
+		cbor_item_t *c;
+		if ((c = encode_cred(&v->cred[i])) == NULL)
+			goto fail;
+		if (cbor_array_push(creds, c) == false) {
+			cbor_decref(&c);
+			goto fail;
+		}
+		cbor_decref(&c);
+	}
+
+	if (vdev_cbor_add_str(item, "version",
+	    vdev_cbor_int(STORE_VERSION)) < 0 ||
+	    vdev_cbor_add_str(item, "aaguid", cbor_build_bytestring(v->aaguid,
+	    sizeof(v->aaguid))) < 0 ||
+	    vdev_cbor_add_str(item, "counter",
+	    vdev_cbor_int(v->sigcount)) < 0 ||
+	    (v->pin_set && vdev_cbor_add_str(item, "pin",
+	    cbor_build_bytestring(v->pin_hash, sizeof(v->pin_hash))) < 0) ||
+	    vdev_cbor_add_str(item, "retries",
+	    vdev_cbor_int(v->pin_retries)) < 0 ||
+	    vdev_cbor_add_str(item, "wrap", cbor_build_bytestring(v->wrap_key,
+	    sizeof(v->wrap_key))) < 0 ||
+	    add_blob(item, "att_key", &v->att_key) < 0 ||
+	    add_blob(item, "att_cert", &v->att_cert) < 0)
+		goto fail;
+
+	if (vdev_cbor_add_str(item, "creds", creds) < 0) {
+		creds = NULL; /* consumed */
+		goto fail;
+	}
+
+	return (item);
+fail:
+	if (item != NULL)
+		cbor_decref(&item);
+	if (creds != NULL)
+		cbor_decref(&creds);
+
+	return (NULL);
+}
+
+int
+vdev_save(vdev_t *v, const char *path)
+{
+	cbor_item_t	*item = NULL;
+	unsigned char	*buf = NULL;
+	size_t		 buf_len = 0;
+	size_t		 alloc_len;
+	FILE		*f = NULL;
+	int		 fd;
+	int		 r = FIDO_ERR_INTERNAL;
+
+	if (v == NULL || path == NULL)
+		return (FIDO_ERR_INVALID_ARGUMENT);
+
+	pthread_mutex_lock(&v->lock);
+	if ((item = encode_state(v)) != NULL)
+		buf_len = cbor_serialize_alloc(item, &buf, &alloc_len);
+	pthread_mutex_unlock(&v->lock);
+
+	if (buf_len == 0)
+		goto fail;
+
+	/* the file holds private keys */
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0 ||
+	    (f = fdopen(fd, "wb")) == NULL) {
+		if (fd >= 0)
+			close(fd);
+		r = FIDO_ERR_INVALID_ARGUMENT;
+		goto fail;
+	}
+
+	if (fwrite(buf, 1, buf_len, f) != buf_len)
+		goto fail;
+
+	r = FIDO_OK;
+fail:
+	if (f != NULL && fclose(f) != 0)
+		r = FIDO_ERR_INTERNAL;
+	if (item != NULL)
+		cbor_decref(&item);
+	if (buf != NULL)
+		explicit_bzero(buf, buf_len);
+
+	free(buf);
+
+	return (r);
+}
+
+static int
+get_fixed(const cbor_item_t *map, const char *key, unsigned char *ptr,
+    size_t len)
+{
+	const unsigned char	*p;
+	size_t			 n;
+
+	if (vdev_cbor_bytes(vdev_cbor_get_str(map, key), &p, &n) < 0 ||
+	    n != len)
+		return (-1);
+
+	memcpy(ptr, p, len);
+
+	return (0);
+}
+
+static int
+get_opt_str(const cbor_item_t *map, const char *key, char **str)
+{
+	const cbor_item_t *item;
+
+	if ((item = vdev_cbor_get_str(map, key)) == NULL)
+		return (0);
+
+	return (vdev_cbor_copy_str(item, str));
+}
+
+static int
+decode_cred(const cbor_item_t *item, struct vdev_cred *c)
+{
+	int64_t		 type;
+	EVP_PKEY	*pkey;
+
+	if (vdev_cbor_copy_bytes(vdev_cbor_get_str(item, "id"), &c->id) < 0 ||
+	    vdev_cbor_sint(vdev_cbor_get_str(item, "type"), &type) < 0 ||
+	    type < INT16_MIN || type > 0 ||
+	    vdev_cbor_copy_bytes(vdev_cbor_get_str(item, "key"), &c->key) < 0 ||
+	    get_fixed(item, "rp_id_hash", c->rp_id_hash,
+	    sizeof(c->rp_id_hash)) < 0 ||
+	    get_opt_str(item, "rp_id", &c->rp_id) < 0 ||
+	    get_opt_str(item, "rp_name", &c->rp_name) < 0 ||
+	    vdev_cbor_copy_bytes(vdev_cbor_get_str(item, "user_id"),
+	    &c->user_id) < 0 ||
+	    get_opt_str(item, "user_name", &c->user_name) < 0 ||
+	    get_opt_str(item, "user_display_name", &c->user_display_name) < 0 ||
+	    get_opt_str(item, "user_icon", &c->user_icon) < 0 ||
+	    vdev_cbor_bool(vdev_cbor_get_str(item, "rk"), &c->rk) < 0)
+		return (-1);
+
+	c->type = (int)type;
+
+	/* make sure the key is usable */
+	if (vdev_key_supported(c->type) == false ||
+	    (pkey = vdev_key_load(c->type, &c->key)) == NULL)
+		return (-1);
+
+	EVP_PKEY_free(pkey);
+
+	return (0);
+}
+
+/*
+ * Decode a saved state into a scratch authenticator, which is only
+ * swapped in once the whole file has been validated.
+ */
+static int
+decode_state(const cbor_item_t *item, struct vdev *tmp)
+{
+	const cbor_item_t	 *creds;
+	cbor_item_t		**v;
+	struct vdev_cred	  c;
+	uint64_t		  version;
+	uint64_t		  counter;
+	uint64_t		  retries;
+
+	if (vdev_cbor_uint(vdev_cbor_get_str(item, "version"), &version) < 0 ||
+	    version != STORE_VERSION ||
+	    get_fixed(item, "aaguid", tmp->aaguid, sizeof(tmp->aaguid)) < 0 ||
+	    vdev_cbor_uint(vdev_cbor_get_str(item, "counter"), &counter) < 0 ||
+	    counter > UINT32_MAX ||
+	    vdev_cbor_uint(vdev_cbor_get_str(item, "retries"), &retries) < 0 ||
+	    retries > VDEV_PIN_RETRIES ||
+	    get_fixed(item, "wrap", tmp->wrap_key, sizeof(tmp->wrap_key)) < 0 ||
+	    vdev_cbor_copy_bytes(vdev_cbor_get_str(item, "att_key"),
+	    &tmp->att_key) < 0 ||
+	    vdev_cbor_copy_bytes(vdev_cbor_get_str(item, "att_cert"),
+	    &tmp->att_cert) < 0 ||
+	    (tmp->att_pkey = vdev_key_load(COSE_ES256, &tmp->att_key)) == NULL)
+		return (-1);
+
+	tmp->sigcount = (uint32_t)counter;
+	tmp->pin_retries = (int)retries;
+
+	if (vdev_cbor_get_str(item, "pin") != NULL) {
+		if (get_fixed(item, "pin", tmp->pin_hash,
+		    sizeof(tmp->pin_hash)) < 0)
+			return (-1);
+		tmp->pin_set = true;
+	}
+
+	if ((creds = vdev_cbor_get_str(item, "creds")) == NULL ||
+	    cbor_isa_array(creds) == false ||
+	    cbor_array_is_definite(creds) == false ||
+	    cbor_array_size(creds) > VDEV_MAX_CRED ||
+	    (cbor_array_size(creds) > 0 &&
+	    (v = cbor_array_handle(creds)) == NULL))
+		return (-1);
+
+	for (size_t i = 0; i < cbor_array_size(creds); i++) {
+		memset(&c, 0, sizeof(c));
+		if (decode_cred(v[i], &c) < 0 ||
+		    vdev_cred_by_id(tmp, c.id.ptr, c.id.len) != NULL ||
+		    vdev_cred_add(tmp, &c) < 0) {
+			vdev_cred_reset(&c);
+			return (-1);
+		}
+	}
+
+	if (vdev_cred_rk_count(tmp) > VDEV_MAX_RK)
+		return (-1);
+
+	return (0);
+}
+
+static void
+free_state(struct vdev *v)
+{
+	for (size_t i = 0; i < v->n_cred; i++)
+		vdev_cred_reset(&v->cred[i]);
+
+	free(v->cred);
+
+	if (v->att_key.ptr != NULL)
+		explicit_bzero(v->att_key.ptr, v->att_key.len);
+	free(v->att_key.ptr);
+	free(v->att_cert.ptr);
+
+	if (v->att_pkey != NULL)
+		EVP_PKEY_free(v->att_pkey);
+
+	explicit_bzero(v->wrap_key, sizeof(v->wrap_key));
+	explicit_bzero(v->pin_hash, sizeof(v->pin_hash));
+}
+
+static int
+read_file(const char *path, unsigned char **ptr, size_t *len)
+{
+	struct stat	 st;
+	int		 fd;
+	ssize_t		 n;
+	int		 ok = -1;
+
+	*ptr = NULL;
+	*len = 0;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return (-1);
+
+	if (fstat(fd, &st) < 0 || st.st_size <= 0 ||
+	    st.st_size > STORE_MAX_LEN ||
+	    (*ptr = malloc((size_t)st.st_size)) == NULL)
+		goto fail;
+
+	if ((n = read(fd, *ptr, (size_t)st.st_size)) < 0 ||
+	    (size_t)n != (size_t)st.st_size)
+		goto fail;
+
+	*len = (size_t)n;
+	ok = 0;
+fail:
+	close(fd);
+
+	if (ok < 0) {
+		free(*ptr);
+		*ptr = NULL;
+	}
+
+	return (ok);
+}
+
+int
+vdev_load(vdev_t *v, const char *path)
+{
+	struct vdev		 tmp;
+	struct vdev		 old;
+	struct cbor_load_result	 cbor;
+	cbor_item_t		*item = NULL;
+	unsigned char		*buf = NULL;
+	size_t			 buf_len;
+	int			 r = FIDO_ERR_INVALID_ARGUMENT;
+
+	memset(&tmp, 0, sizeof(tmp));
+	memset(&old, 0, sizeof(old));
+
+	if (v == NULL || path == NULL)
+		return (FIDO_ERR_INVALID_ARGUMENT);
+
+	if (read_file(path, &buf, &buf_len) < 0 ||
+	    (item = cbor_load(buf, buf_len, &cbor)) == NULL ||
+	    cbor.read != buf_len || cbor_isa_map(item) == false ||
+	    decode_state(item, &tmp) < 0) {
+		free_state(&tmp);
+		goto fail;
+	}
+
+	pthread_mutex_lock(&v->lock);
+
+	old.cred = v->cred;
+	old.n_cred = v->n_cred;
+	old.att_key = v->att_key;
+	old.att_cert = v->att_cert;
+	old.att_pkey = v->att_pkey;
+
+	memcpy(v->aaguid, tmp.aaguid, sizeof(v->aaguid));
+	memcpy(v->wrap_key, tmp.wrap_key, sizeof(v->wrap_key));
+	memcpy(v->pin_hash, tmp.pin_hash, sizeof(v->pin_hash));
+	v->sigcount = tmp.sigcount;
+	v->pin_set = tmp.pin_set;
+	v->pin_retries = tmp.pin_retries;
+	v->att_key = tmp.att_key;
+	v->att_cert = tmp.att_cert;
+	v->att_pkey = tmp.att_pkey;
+	v->cred = tmp.cred;
+	v->n_alloc = tmp.n_alloc;
+	v->n_cred = tmp.n_cred;
+	v->serial = tmp.serial;
+
+	pthread_mutex_unlock(&v->lock);
+
+	free_state(&old);
+	explicit_bzero(&tmp, sizeof(tmp));
+
+	r = FIDO_OK;
+fail:
+	if (item != NULL)
+		cbor_decref(&item);
+	if (buf != NULL)
+		explicit_bzero(buf, buf_len);
+
+	free(buf);
+
+	return (r);
+}
@@ -0,0 +1,308 @@
+/*
+ * Copyright (c) 2020 Yubico AB. All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+#include <linux/input.h>
+#include <linux/uhid.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "extern.h"
+
+/*
+ * Expose a virtual authenticator to the kernel through /dev/uhid, so
+ * that it shows up as a hidraw device and is reached through the
+ * library's regular hid backend.
+ */
+
+#define UHID_PATH	"/dev/uhid"
+#define UHID_VENDOR	0x1209	/* pid.codes */
+#define UHID_PRODUCT	0x0001	/* test pid */
+#define UHID_POLL_MS	100
+
+struct vdev_uhid {
+	pthread_t	 thread;
+	pthread_mutex_t	 lock;
+	int		 fd;
+	bool		 stop;
+	int		 latency_ms;   /* delay before each reply */
+	fido_dev_io_t	 io;
+	void		*port;         /* handle on the authenticator */
+	size_t		 rpt_len;      /* hid report size */
+	uint64_t	 n_out;        /* output reports received */
+	uint64_t	 n_in;         /* input reports sent */
+};
+
+/*
+ * fido usage page, input and output reports of vdev_report_len() bytes,
+ * filled in at the offsets below
+ */
+#define RD_IN_COUNT	17
+#define RD_OUT_COUNT	31
+
+static const unsigned char report_descriptor[] = {
+	0x06, 0xd0, 0xf1,	/* usage page (fido) */
+	0x09, 0x01,		/* usage (ctaphid) */
+	0xa1, 0x01,		/* collection (application) */
+	0x09, 0x20,		/*   usage (data in) */
+	0x15, 0x00,		/*   logical minimum (0) */
+	0x26, 0xff, 0x00,	/*   logical maximum (255) */
+	0x75, 0x08,		/*   report size (8) */
+	0x96, 0x00, 0x00,	/*   report count (set at RD_IN_COUNT) */
+	0x81, 0x02,		/*   input (data, var, abs) */
+	0x09, 0x21,		/*   usage (data out) */
+	0x15, 0x00,		/*   logical minimum (0) */
+	0x26, 0xff, 0x00,	/*   logical maximum (255) */
+	0x75, 0x08,		/*   report size (8) */
+	0x96, 0x00, 0x00,	/*   report count (set at RD_OUT_COUNT) */
+	0x91, 0x02,		/*   output (data, var, abs) */
+	0xc0,			/* end collection */
+};
+
+static int
+uhid_send(int fd, const struct uhid_event *ev)
+{
+	ssize_t n;
+
+	do {
+		n = write(fd, ev, sizeof(*ev));
+	} while (n < 0 && errno == EINTR);
+
+	return (n == (ssize_t)sizeof(*ev) ? 0 : -1);
+}
+
+static void
+uhid_sleep(int ms)
+{
+	struct timespec ts;
+
+	if (ms <= 0)
+		return;
+
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000L;
+
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		continue;
+}
+
+/*
+ * Feed an output report to the authenticator and forward its reply
+ * frames as input reports.
+ */
+static void
+uhid_output(struct vdev_uhid *u, const unsigned char *ptr, size_t len)
+{
+	struct uhid_event	ev;
+	unsigned char		frame[VDEV_MAX_RPT_SIZE + 1];
+	bool			first = true;
+	int			latency_ms;
+
+	/* unnumbered reports come with a zero report id */
+	if (len == u->rpt_len + 1)
+		ptr++;
+	else if (len != u->rpt_len)
+		return;
+
+	frame[0] = 0;
+	memcpy(frame + 1, ptr, u->rpt_len);
+
+	pthread_mutex_lock(&u->lock);
+	u->n_out++;
+	latency_ms = u->latency_ms;
+	pthread_mutex_unlock(&u->lock);
+
+	if (u->io.write(u->port, frame, u->rpt_len + 1) < 0)
+		return;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_INPUT2;
+	ev.u.input2.size = (uint16_t)u->rpt_len;
+
+	while (u->io.read(u->port, ev.u.input2.data, u->rpt_len,
+	    0) == (int)u->rpt_len) {
+		if (first) {
+			uhid_sleep(latency_ms);
+			first = false;
+		}
+		if (uhid_send(u->fd, &ev) < 0)
+			break;
+		pthread_mutex_lock(&u->lock);
+		u->n_in++;
+		pthread_mutex_unlock(&u->lock);
+	}
+}
+
+/* reject feature report requests; ctaphid does not use them */
+static void
+uhid_report_reply(int fd, const struct uhid_event *req)
+{
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+
+	if (req->type == UHID_GET_REPORT) {
+		ev.type = UHID_GET_REPORT_REPLY;
+		ev.u.get_report_reply.id = req->u.get_report.id;
+		ev.u.get_report_reply.err = EIO;
+	} else {
+		ev.type = UHID_SET_REPORT_REPLY;
+		ev.u.set_report_reply.id = req->u.set_report.id;
+		ev.u.set_report_reply.err = EIO;
+	}
+
+	uhid_send(fd, &ev);
+}
+
+static void *
+uhid_loop(void *arg)
+{
+	struct vdev_uhid	*u = arg;
+	struct uhid_event	 ev;
+	struct pollfd		 pfd;
+	ssize_t			 n;
+	bool			 stop = false;
+
+	pfd.fd = u->fd;
+	pfd.events = POLLIN;
+
+	while (stop == false) {
+		pfd.revents = 0;
+		if (poll(&pfd, 1, UHID_POLL_MS) > 0 &&
+		    (n = read(u->fd, &ev, sizeof(ev))) > 0 &&
+		    (size_t)n >= sizeof(ev.type)) {
+			switch (ev.type) {
+			case UHID_OUTPUT:
+				uhid_output(u, ev.u.output.data,
+				    ev.u.output.size);
+				break;
+			case UHID_GET_REPORT:
+			case UHID_SET_REPORT:
+				uhid_report_reply(u->fd, &ev);
+				break;
+			default:
+				break; /* start, stop, open, close */
+			}
+		}
+		pthread_mutex_lock(&u->lock);
+		stop = u->stop;
+		pthread_mutex_unlock(&u->lock);
+	}
+
+	return (NULL);
+}
+
+static int
+uhid_create(int fd, const vdev_t *v)
+{
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_CREATE2;
+	snprintf((char *)ev.u.create2.name, sizeof(ev.u.create2.name),
+	    "Virtual Authenticator");
+	snprintf((char *)ev.u.create2.phys, sizeof(ev.u.create2.phys),
+	    "libfido2/%s", vdev_path(v));
+	snprintf((char *)ev.u.create2.uniq, sizeof(ev.u.create2.uniq),
+	    "%s", vdev_path(v));
+	ev.u.create2.rd_size = sizeof(report_descriptor);
+	ev.u.create2.bus = BUS_USB;
+	ev.u.create2.vendor = UHID_VENDOR;
+	ev.u.create2.product = UHID_PRODUCT;
+	memcpy(ev.u.create2.rd_data, report_descriptor,
+	    sizeof(report_descriptor));
+	ev.u.create2.rd_data[RD_IN_COUNT] = vdev_report_len(v) & 0xff;
+	ev.u.create2.rd_data[RD_IN_COUNT + 1] = vdev_report_len(v) >> 8;
+	ev.u.create2.rd_data[RD_OUT_COUNT] = vdev_report_len(v) & 0xff;
+	ev.u.create2.rd_data[RD_OUT_COUNT + 1] = vdev_report_len(v) >> 8;
+
+	return (uhid_send(fd, &ev));
+}
+
+vdev_uhid_t *
+vdev_uhid_new(vdev_t *v)
+{
+	struct vdev_uhid *u;
+
+	if ((u = calloc(1, sizeof(*u))) == NULL)
+		return (NULL);
+
+	u->fd = -1;
+	u->rpt_len = vdev_report_len(v);
+	vdev_io(&u->io);
+
+	if (pthread_mutex_init(&u->lock, NULL) != 0) {
+		free(u);
+		return (NULL);
+	}
+
+	if ((u->port = u->io.open(vdev_path(v))) == NULL ||
+	    (u->fd = open(UHID_PATH, O_RDWR | O_CLOEXEC)) < 0 ||
+	    uhid_create(u->fd, v) < 0 ||
+	    pthread_create(&u->thread, NULL, uhid_loop, u) != 0)
+		goto fail;
+
+	return (u);
+fail:
+	if (u->fd >= 0)
+		close(u->fd); /* destroys the device */
+	if (u->port != NULL)
+		u->io.close(u->port);
+
+	pthread_mutex_destroy(&u->lock);
+	free(u);
+
+	return (NULL);
+}
+
+void
+vdev_uhid_free(vdev_uhid_t **u_p)
+{
+	struct vdev_uhid	*u;
+	struct uhid_event	 ev;
+
+	if (u_p == NULL || (u = *u_p) == NULL)
+		return;
+
+	pthread_mutex_lock(&u->lock);
+	u->stop = true;
+	pthread_mutex_unlock(&u->lock);
+	pthread_join(u->thread, NULL);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_DESTROY;
+	uhid_send(u->fd, &ev);
+	close(u->fd);
+
+	u->io.close(u->port);
+	pthread_mutex_destroy(&u->lock);
+	free(u);
+
+	*u_p = NULL;
+}
+
+void
+vdev_uhid_set_latency(vdev_uhid_t *u, int ms)
+{
+	pthread_mutex_lock(&u->lock);
+	u->latency_ms = ms < 0 ? 0 : ms;
+	pthread_mutex_unlock(&u->lock);
+}
+
+void
+vdev_uhid_stats(vdev_uhid_t *u, uint64_t *n_out, uint64_t *n_in)
+{
+	pthread_mutex_lock(&u->lock);
+	*n_out = u->n_out;
+	*n_in = u->n_in;
+	pthread_mutex_unlock(&u->lock);
+}
@@ -0,0 +1,493 @@
+/*
+ * Copyright (c) 2020 Yubico AB. All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+#include <openssl/rand.h>
+
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "extern.h"
+
+#define INIT_NONCE_LEN	8
+#define INIT_REPLY_LEN	17
+
+#define ERR_INVALID_CMD	0x01
+#define ERR_INVALID_LEN	0x03
+#define ERR_INVALID_SEQ	0x04
+#define ERR_INVALID_CID	0x0b
+
+/*
+ * Virtual authenticators are registered in a process-wide list, where
+ * vdev_io's open callback finds them by path.
+ */
+static pthread_mutex_t	 registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct vdev	*registry;
+static unsigned int	 registry_seq;
+
+int
+vdev_state_init(struct vdev *v)
+{
+	v->pin_retries = VDEV_PIN_RETRIES;
+
+	if (RAND_bytes(v->aaguid, sizeof(v->aaguid)) != 1 ||
+	    RAND_bytes(v->wrap_key, sizeof(v->wrap_key)) != 1 ||
+	    RAND_bytes(v->pin_token, sizeof(v->pin_token)) != 1 ||
+	    vdev_att_create(v) < 0 || vdev_ka_create(v) < 0)
+		return (-1);
+
+	return (0);
+}
+
+/*
+ * authenticatorReset: forget all credentials and the PIN. Credentials
+ * wrapped with the old key become unusable.
+ */
+void
+vdev_state_reset(struct vdev *v)
+{
+	for (size_t i = 0; i < v->n_cred; i++)
+		vdev_cred_reset(&v->cred[i]);
+
+	v->n_cred = 0;
+	v->pin_set = false;
+	v->pin_retries = VDEV_PIN_RETRIES;
+	explicit_bzero(v->pin_hash, sizeof(v->pin_hash));
+
+	if (RAND_bytes(v->wrap_key, sizeof(v->wrap_key)) != 1 ||
+	    RAND_bytes(v->pin_token, sizeof(v->pin_token)) != 1 ||
+	    vdev_ka_create(v) < 0)
+		abort(); /* no sane way to keep going */
+}
+
+vdev_t *
+vdev_new(void)
+{
+	struct vdev *v;
+
+	if ((v = calloc(1, sizeof(*v))) == NULL)
+		return (NULL);
+
+	if (pthread_mutex_init(&v->lock, NULL) != 0) {
+		free(v);
+		return (NULL);
+	}
+
+	v->next_cid = 1;
+	v->rpt_len = VDEV_RPT_SIZE;
+
+	if (vdev_state_init(v) < 0) {
+		vdev_free(&v);
+		return (NULL);
+	}
+
+	pthread_mutex_lock(&registry_lock);
+	snprintf(v->path, sizeof(v->path), "vdev:%u", registry_seq++);
+	v->next = registry;
+	registry = v;
+	pthread_mutex_unlock(&registry_lock);
+
+	return (v);
+}
+
+void
+vdev_free(vdev_t **v_p)
+{
+	struct vdev	 *v;
+	struct vdev	**p;
+
+	if (v_p == NULL || (v = *v_p) == NULL)
+		return;
+
+	pthread_mutex_lock(&registry_lock);
+	for (p = &registry; *p != NULL; p = &(*p)->next)
+		if (*p == v) {
+			*p = v->next;
+			break;
+		}
+	pthread_mutex_unlock(&registry_lock);
+
+	for (size_t i = 0; i < v->n_cred; i++)
+		vdev_cred_reset(&v->cred[i]);
+
+	free(v->cred);
+
+	if (v->att_key.ptr != NULL)
+		explicit_bzero(v->att_key.ptr, v->att_key.len);
+
+	free(v->att_key.ptr);
+	free(v->att_cert.ptr);
+
+	if (v->att_pkey != NULL)
+		EVP_PKEY_free(v->att_pkey);
+	if (v->ka_pkey != NULL)
+		EVP_PKEY_free(v->ka_pkey);
+
+	pthread_mutex_destroy(&v->lock);
+	explicit_bzero(v, sizeof(*v));
+	free(v);
+
+	*v_p = NULL;
+}
+
+const char *
+vdev_path(const vdev_t *v)
+{
+	return (v->path);
+}
+
+size_t
+vdev_cred_count(vdev_t *v)
+{
+	size_t n;
+
+	pthread_mutex_lock(&v->lock);
+	n = v->n_cred;
+	pthread_mutex_unlock(&v->lock);
+
+	return (n);
+}
+
+size_t
+vdev_report_len(const vdev_t *v)
+{
+	return (v->rpt_len);
+}
+
+/* report size of ports opened from now on */
+int
+vdev_set_report_len(vdev_t *v, size_t len)
+{
+	if (len < VDEV_RPT_SIZE || len > VDEV_MAX_RPT_SIZE)
+		return (-1);
+
+	v->rpt_len = len;
+
+	return (0);
+}
+
+/*
+ * Queue a reply, splitting it into an initialisation frame followed by
+ * continuation frames. Unframed replies are kept whole.
+ */
+static void
+hid_reply(struct vdev_port *p, uint32_t cid, uint8_t cmd,
+    const unsigned char *ptr, size_t len)
+{
+	unsigned char	*frame;
+	size_t		 init_len = p->rpt_len - 7;
+	size_t		 cont_len = p->rpt_len - 5;
+	size_t		 n;
+	size_t		 count;
+	uint8_t		 seq = 0;
+
+	if (p->unframed) {
+		p->reply_ready = true;
+		p->reply_cmd = cmd;
+		p->reply_len = len;
+		if (len)
+			memcpy(p->reply, ptr, len);
+		return;
+	}
+
+	count = 1 + (len > init_len ?
+	    (len - init_len + cont_len - 1) / cont_len : 0);
+
+	if (p->rx_len == 0)
+		p->rx_head = 0;
+	if (p->rx_head + p->rx_len + count > VDEV_MAX_FRAMES) {
+		memmove(p->rx[0], p->rx[p->rx_head],
+		    p->rx_len * sizeof(p->rx[0]));
+		p->rx_head = 0;
+	}
+	if (p->rx_len + count > VDEV_MAX_FRAMES)
+		p->rx_len = 0; /* overrun; drop unread frames */
+
+	frame = p->rx[p->rx_head + p->rx_len++];
+	memset(frame, 0, p->rpt_len);
+	memcpy(frame, &cid, 4);
+	frame[4] = CTAP_FRAME_INIT | cmd;
+	frame[5] = (len >> 8) & 0xff;
+	frame[6] = len & 0xff;
+	n = len < init_len ? len : init_len;
+	if (n)
+		memcpy(frame + 7, ptr, n);
+	ptr += n;
+	len -= n;
+
+	while (len > 0) {
+		frame = p->rx[p->rx_head + p->rx_len++];
+		memset(frame, 0, p->rpt_len);
+		memcpy(frame, &cid, 4);
+		frame[4] = seq++;
+		n = len < cont_len ? len : cont_len;
+		memcpy(frame + 5, ptr, n);
+		ptr += n;
+		len -= n;
+	}
+}
+
+static void
+hid_error(struct vdev_port *p, uint32_t cid, uint8_t code)
+{
+	hid_reply(p, cid, VDEV_CMD_ERROR, &code, sizeof(code));
+}
+
+static void
+hid_init(struct vdev_port *p)
+{
+	struct vdev	*v = p->vdev;
+	unsigned char	 reply[INIT_REPLY_LEN];
+	uint32_t	 cid;
+
+	if (p->len != INIT_NONCE_LEN) {
+		hid_error(p, p->cid, ERR_INVALID_LEN);
+		return;
+	}
+
+	if (p->cid == CTAP_CID_BROADCAST) {
+		if (v->next_cid == CTAP_CID_BROADCAST)
+			v->next_cid = 1;
+		cid = v->next_cid++;
+	} else
+		cid = p->cid;
+
+	memcpy(reply, p->msg, INIT_NONCE_LEN);
+	memcpy(reply + 8, &cid, 4);
+	reply[12] = 2;		/* ctaphid protocol version */
+	reply[13] = _FIDO_MAJOR;
+	reply[14] = _FIDO_MINOR;
+	reply[15] = _FIDO_PATCH;
+	reply[16] = FIDO_CAP_WINK | FIDO_CAP_CBOR | FIDO_CAP_NMSG;
+
+	hid_reply(p, p->cid, CTAP_CMD_INIT, reply, sizeof(reply));
+}
+
+static void
+hid_dispatch(struct vdev_port *p)
+{
+	unsigned char	reply[VDEV_MAX_PAYLOAD];
+	size_t		reply_len;
+
+	switch (p->cmd) {
+	case CTAP_CMD_INIT:
+		hid_init(p);
+		break;
+	case CTAP_CMD_PING:
+		hid_reply(p, p->cid, CTAP_CMD_PING, p->msg, p->len);
+		break;
+	case CTAP_CMD_WINK:
+		hid_reply(p, p->cid, CTAP_CMD_WINK, NULL, 0);
+		break;
+	case CTAP_CMD_CANCEL:
+		break;
+	case CTAP_CMD_CBOR:
+		vdev_cbor(p, p->msg, p->len, reply, &reply_len);
+		hid_reply(p, p->cid, CTAP_CMD_CBOR, reply, reply_len);
+		explicit_bzero(reply, reply_len);
+		break;
+	default:
+		hid_error(p, p->cid, ERR_INVALID_CMD);
+		break;
+	}
+}
+
+static bool
+hid_valid_cid(const struct vdev *v, uint32_t cid, uint8_t cmd)
+{
+	if (cid == CTAP_CID_BROADCAST)
+		return (cmd == CTAP_CMD_INIT);
+
+	return (cid != 0 && cid < v->next_cid);
+}
+
+/*
+ * Reassemble a CTAPHID message; dispatch it once complete.
+ */
+static void
+hid_frame(struct vdev_port *p, const unsigned char *frame)
+{
+	uint32_t	cid;
+	size_t		n;
+
+	memcpy(&cid, frame, 4);
+
+	if (frame[4] & CTAP_FRAME_INIT) {
+		if (hid_valid_cid(p->vdev, cid, frame[4] & 0x7f) == false) {
+			hid_error(p, cid, ERR_INVALID_CID);
+			return;
+		}
+		p->cid = cid;
+		p->cmd = frame[4] & 0x7f;
+		p->len = (size_t)((frame[5] << 8) | frame[6]);
+		p->seq = 0;
+		if (p->len > VDEV_MAX_PAYLOAD) {
+			hid_error(p, cid, ERR_INVALID_LEN);
+			p->cmd = 0;
+			return;
+		}
+		n = p->len < p->rpt_len - 7 ? p->len : p->rpt_len - 7;
+		memcpy(p->msg, frame + 7, n);
+		p->got = n;
+	} else {
+		if (p->cmd == 0 || cid != p->cid)
+			return; /* spurious */
+		if (frame[4] != p->seq++) {
+			hid_error(p, cid, ERR_INVALID_SEQ);
+			p->cmd = 0;
+			return;
+		}
+		n = p->len - p->got < p->rpt_len - 5 ? p->len - p->got :
+		    p->rpt_len - 5;
+		memcpy(p->msg + p->got, frame + 5, n);
+		p->got += n;
+	}
+
+	if (p->got == p->len) {
+		hid_dispatch(p);
+		explicit_bzero(p->msg, p->len);
+		p->cmd = 0;
+	}
+}
+
+static void *
+vdev_open(const char *path)
+{
+	struct vdev_port	*p;
+	struct vdev		*v;
+
+	if ((p = calloc(1, sizeof(*p))) == NULL)
+		return (NULL);
+
+	pthread_mutex_lock(&registry_lock);
+	for (v = registry; v != NULL; v = v->next)
+		if (strcmp(v->path, path) == 0)
+			break;
+	pthread_mutex_unlock(&registry_lock);
+
+	if (v == NULL) {
+		free(p);
+		return (NULL);
+	}
+
+	p->vdev = v;
+	p->rpt_len = v->rpt_len;
+
+	return (p);
+}
+
+static void
+vdev_close(void *handle)
+{
+	struct vdev_port *p = handle;
+
+	vdev_iter_reset(&p->iter);
+	explicit_bzero(p, sizeof(*p));
+	free(p);
+}
+
+/*
+ * Replies are produced synchronously by vdev_write, so a read either
+ * returns a queued frame or fails immediately.
+ */
+static int
+vdev_read(void *handle, unsigned char *buf, size_t len, int ms)
+{
+	struct vdev_port *p = handle;
+
+	(void)ms;
+
+	if (len != p->rpt_len || p->rx_len == 0)
+		return (-1);
+
+	memcpy(buf, p->rx[p->rx_head], p->rpt_len);
+	p->rx_head++;
+	p->rx_len--;
+
+	return ((int)p->rpt_len);
+}
+
+static int
+vdev_write(void *handle, const unsigned char *buf, size_t len)
+{
+	struct vdev_port *p = handle;
+
+	/* report id followed by a ctaphid frame */
+	if (len != p->rpt_len + 1)
+		return (-1);
+
+	pthread_mutex_lock(&p->vdev->lock);
+	hid_frame(p, buf + 1);
+	pthread_mutex_unlock(&p->vdev->lock);
+
+	return ((int)len);
+}
+
+/*
+ * Message-level transport: requests are dispatched whole, and the reply
+ * is kept for the following vdev_rx() call.
+ */
+static int
+vdev_tx(void *handle, uint8_t cmd, const unsigned char *buf, size_t len)
+{
+	struct vdev_port *p = handle;
+
+	if (len > VDEV_MAX_PAYLOAD || len > INT_MAX)
+		return (-1);
+
+	pthread_mutex_lock(&p->vdev->lock);
+	p->unframed = true;
+	p->reply_ready = false;
+	p->cid = cmd == CTAP_CMD_INIT ? CTAP_CID_BROADCAST : 1;
+	p->cmd = cmd;
+	p->len = len;
+	if (len)
+		memcpy(p->msg, buf, len);
+	hid_dispatch(p);
+	explicit_bzero(p->msg, len);
+	p->cmd = 0;
+	pthread_mutex_unlock(&p->vdev->lock);
+
+	return ((int)len);
+}
+
+static int
+vdev_rx(void *handle, uint8_t cmd, unsigned char *buf, size_t len, int ms)
+{
+	struct vdev_port	*p = handle;
+	int			 n;
+
+	(void)ms;
+
+	if (p->reply_ready == false || p->reply_cmd != cmd ||
+	    p->reply_len > len)
+		n = -1;
+	else {
+		memcpy(buf, p->reply, p->reply_len);
+		n = (int)p->reply_len;
+	}
+
+	p->reply_ready = false;
+	explicit_bzero(p->reply, p->reply_len);
+
+	return (n);
+}
+
+void
+vdev_transport(fido_dev_transport_t *t)
+{
+	t->rx = vdev_rx;
+	t->tx = vdev_tx;
+}
+
+void
+vdev_io(fido_dev_io_t *io)
+{
+	io->open = vdev_open;
+	io->close = vdev_close;
+	io->read = vdev_read;
+	io->write = vdev_write;
+}
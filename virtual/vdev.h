@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2020 Yubico AB. All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+#ifndef _VDEV_H
+#define _VDEV_H
+
+#include <fido.h>
+
+typedef struct vdev vdev_t;
+
+vdev_t *vdev_new(void);
+void vdev_free(vdev_t **);
+
+const char *vdev_path(const vdev_t *);
+size_t vdev_cred_count(vdev_t *);
+size_t vdev_report_len(const vdev_t *);
+int vdev_set_report_len(vdev_t *, size_t);
+
+int vdev_load(vdev_t *, const char *);
+int vdev_save(vdev_t *, const char *);
+
+void vdev_io(fido_dev_io_t *);
+void vdev_transport(fido_dev_transport_t *);
+
+typedef struct vdev_fault vdev_fault_t;
+
+typedef struct vdev_fault_cfg {
+	int		read_delay_ms;  /* before every frame read */
+	int		write_delay_ms; /* before every frame written */
+	unsigned int	drop_pct;       /* reply frames dropped, in percent */
+	unsigned int	corrupt_pct;    /* reply frames with a byte flipped */
+	unsigned int	keepalives;     /* keepalive frames before each reply */
+	uint32_t	seed;           /* drop and corruption decisions */
+	unsigned int	stale;          /* stale frames read after open */
+	unsigned int	busy;           /* requests answered "channel busy" */
+	unsigned int	desync;         /* replies losing a continuation */
+} vdev_fault_cfg_t;
+
+vdev_fault_t *vdev_fault_new(const fido_dev_io_t *, const char *);
+void vdev_fault_free(vdev_fault_t **);
+const char *vdev_fault_path(const vdev_fault_t *);
+void vdev_fault_set(vdev_fault_t *, const vdev_fault_cfg_t *);
+void vdev_fault_stats(vdev_fault_t *, uint64_t *, uint64_t *, uint64_t *);
+void vdev_fault_io(fido_dev_io_t *);
+
+#ifdef __linux__
+typedef struct vdev_uhid vdev_uhid_t;
+
+vdev_uhid_t *vdev_uhid_new(vdev_t *);
+void vdev_uhid_free(vdev_uhid_t **);
+void vdev_uhid_set_latency(vdev_uhid_t *, int);
+void vdev_uhid_stats(vdev_uhid_t *, uint64_t *, uint64_t *);
+#endif
+
+#endif /* !_VDEV_H */